@@ -0,0 +1,221 @@
+// Find files with the same audio by hashing everything but their tags
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// Reads are large so each one is a long sequential transfer
+#define AUDIO_READ_SIZE (1 << 20)
+// Several reads stay outstanding even on few CPUs, as hashing is faster
+// than the disk
+#define AUDIO_MIN_WORKERS 4
+#define ID3V1_SIZE 128
+#define ID3V1_IDENTIFIER "TAG"
+
+struct audio_file {
+    const char *path;
+    uint64_t hash;
+    off_t len;
+    int index;
+    int ok;
+};
+
+struct audio_hasher {
+    struct audio_file *files;
+    struct work_queue queue;
+};
+
+// Find the audio between any tags at the start and end of the file
+// Return 1 and set start and end on success, 0 otherwise
+static int find_audio(int fd, off_t size, off_t *start, off_t *end) {
+    uint8_t data[ID3V2_HEADER_SIZE];
+    size_t extent;
+
+    // Tags may be stacked at the start of the file
+    *start = 0;
+    while (size - *start >= ID3V2_HEADER_SIZE) {
+        if (pread(fd, data, sizeof(data), *start) != sizeof(data)) {
+            debug("pread failed: %m");
+            return 0;
+        }
+        extent = get_id3v2_tag_extent(data);
+        if (extent == 0 || extent > size - *start) {
+            break;
+        }
+        *start += extent;
+    }
+
+    // Then an ID3v1 tag, then a 2.4 tag with a footer, at the end
+    *end = size;
+    if (*end - *start >= ID3V1_SIZE) {
+        if (pread(fd, data, strlen(ID3V1_IDENTIFIER), *end - ID3V1_SIZE) !=
+                strlen(ID3V1_IDENTIFIER)) {
+            debug("pread failed: %m");
+            return 0;
+        }
+        if (!memcmp(data, ID3V1_IDENTIFIER, strlen(ID3V1_IDENTIFIER))) {
+            *end -= ID3V1_SIZE;
+        }
+    }
+    if (*end - *start >= ID3V2_FOOTER_SIZE) {
+        if (pread(fd, data, sizeof(data), *end - ID3V2_FOOTER_SIZE) !=
+                sizeof(data)) {
+            debug("pread failed: %m");
+            return 0;
+        }
+        extent = 0;
+        if (!memcmp(data, ID3V2_FOOTER_IDENTIFIER, ID3V2_FOOTER_ID_SIZE)) {
+            extent = get_id3v2_tag_extent(data);
+        }
+        if (extent && extent <= *end - *start) {
+            *end -= extent;
+        }
+    }
+    return 1;
+}
+
+// Hash the audio of one file, reading into buffer
+// Return 1 on success, 0 otherwise
+static int hash_file(struct audio_file *file, uint8_t *buffer) {
+    struct hash64_state state;
+    struct stat st;
+    off_t start, end, offset;
+    ssize_t count;
+    int fd, ret = 0;
+
+    fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        debug("open %s failed: %m", file->path);
+        return 0;
+    }
+    if (fstat(fd, &st) == -1) {
+        debug("fstat %s failed: %m", file->path);
+        goto out;
+    }
+    if (!find_audio(fd, st.st_size, &start, &end)) {
+        goto out;
+    }
+    posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+
+    hash64_init(&state, 0);
+    for (offset = start; offset < end; offset += count) {
+        count = end - offset < AUDIO_READ_SIZE ? end - offset :
+                AUDIO_READ_SIZE;
+        count = pread(fd, buffer, count, offset);
+        if (count <= 0) {
+            debug("pread %s failed: %m", file->path);
+            goto out;
+        }
+        hash64_update(&state, buffer, count);
+    }
+    file->hash = hash64_final(&state);
+    file->len = end - start;
+    ret = 1;
+out:
+    close(fd);
+    return ret;
+}
+
+static void *hash_worker(void *arg) {
+    struct audio_hasher *hasher = arg;
+    uint8_t *buffer;
+    int i;
+
+    buffer = malloc(AUDIO_READ_SIZE);
+    if (buffer == NULL) {
+        debug("malloc %d failed: %m", AUDIO_READ_SIZE);
+        return NULL;
+    }
+    while ((i = next_work(&hasher->queue)) >= 0) {
+        hasher->files[i].ok = hash_file(&hasher->files[i], buffer);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Order by hash then length, keeping files that failed last
+static int compare_files(const void *a, const void *b) {
+    const struct audio_file *x = a, *y = b;
+
+    if (x->ok != y->ok) {
+        return y->ok - x->ok;
+    } else if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    } else if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    // Keep command line order within a group
+    return x->index - y->index;
+}
+
+static int same_audio(const struct audio_file *x, const struct audio_file *y) {
+    return x->ok && y->ok && x->hash == y->hash && x->len == y->len;
+}
+
+// Groups are separated by blank lines. With verbosity the hash and audio
+// length of every file is printed first.
+int hash_audio(char * const files[], int nfiles, unsigned int workers,
+        int verbosity, FILE *fp) {
+    struct audio_hasher hasher;
+    unsigned int nthreads;
+    int i, j, groups = 0, ret = 1;
+
+    assert(files);
+    assert(fp);
+
+    hasher.files = calloc(nfiles ? nfiles : 1, sizeof(*hasher.files));
+    if (hasher.files == NULL) {
+        debug("calloc failed: %m");
+        return 0;
+    }
+    for (i = 0; i < nfiles; i++) {
+        hasher.files[i].path = files[i];
+        hasher.files[i].index = i;
+    }
+
+    init_work_queue(&hasher.queue, nfiles);
+    nthreads = pool_size(workers, AUDIO_MIN_WORKERS, nfiles);
+    if (!run_pool(hash_worker, &hasher, 0, nthreads)) {
+        free(hasher.files);
+        return 0;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        if (!hasher.files[i].ok) {
+            fprintf(stderr, "Couldn't hash %s\n", files[i]);
+            ret = 0;
+        } else if (verbosity > 0) {
+            fprintf(fp, "%016"PRIx64" %12jd %s\n", hasher.files[i].hash,
+                    (intmax_t)hasher.files[i].len, files[i]);
+        }
+    }
+    if (verbosity > 0 && nfiles > 0) {
+        groups++;
+    }
+
+    qsort(hasher.files, nfiles, sizeof(*hasher.files), compare_files);
+    for (i = 0; i < nfiles; i = j) {
+        for (j = i + 1; j < nfiles &&
+                same_audio(&hasher.files[i], &hasher.files[j]); j++);
+        if (j - i < 2) {
+            continue;
+        }
+        if (groups++) {
+            fputc('\n', fp);
+        }
+        for (; i < j; i++) {
+            fprintf(fp, "%016"PRIx64" %s\n", hasher.files[i].hash,
+                    hasher.files[i].path);
+        }
+    }
+    free(hasher.files);
+    return ret;
+}
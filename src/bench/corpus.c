@@ -0,0 +1,888 @@
+// Write a reproducible corpus of tagged files for benchmarks
+// Copyright 2015 David Gloe.
+//
+// Every byte written depends only on the options and the seed, except
+// compressed frames, which depend on the zlib version.
+//
+// id3al reads only 2.3 and 2.4 frames. 2.2 tags are written for timing
+// how fast unreadable tags are turned away, and every one fails as a bad
+// frame.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "../id3v2.h"
+
+#define DEFAULT_FILES 100
+#define DEFAULT_FRAMES 10
+#define DEFAULT_APIC_SIZE (32 << 10)
+#define DEFAULT_AUDIO_SIZE (256 << 10)
+#define DEFAULT_HUGE_SIZE (16 << 20)
+// Bytes of audio between false "ID3" identifiers
+#define FALSE_POSITIVE_INTERVAL (64 << 10)
+#define MPEG_FRAME_SIZE 417
+
+// ID3v2.3 flags, where they differ from 2.4
+#define ID3V23_FRAME_HEADER_COMPRESSION_BIT 0x80
+// ID3v2.2 frame headers are a 3 byte ID and a 3 byte size
+#define ID3V22_FRAME_ID_SIZE 3
+#define ID3V22_FRAME_HEADER_SIZE 6
+
+enum frame_kind {
+    KIND_TEXT,
+    KIND_TXXX,
+    KIND_COMM,
+    KIND_APIC,
+    KIND_PRIV,
+    KINDS
+};
+
+enum encoding_choice {
+    CHOOSE_LATIN1 = ID3V2_ENCODING_ISO_8859_1,
+    CHOOSE_UTF16 = ID3V2_ENCODING_UTF_16,
+    CHOOSE_UTF16BE = ID3V2_ENCODING_UTF_16BE,
+    CHOOSE_UTF8 = ID3V2_ENCODING_UTF_8,
+    CHOOSE_MIXED
+};
+
+enum unsync_choice {
+    UNSYNC_NONE,
+    UNSYNC_TAG,
+    UNSYNC_FRAME
+};
+
+enum corpus_case {
+    CASE_NORMAL,
+    CASE_NO_TAG,
+    CASE_FALSE_POSITIVE,
+    CASE_HUGE_FRAME
+};
+
+struct corpus_options {
+    uint64_t seed;
+    unsigned int files;
+    int version;
+    unsigned int frames;
+    unsigned int mix[KINDS];
+    enum encoding_choice encoding;
+    size_t apic_size;
+    enum unsync_choice unsync;
+    int compress;
+    int extheader;
+    int crc;
+    int restrictions;
+    int footer;
+    size_t padding;
+    size_t audio_size;
+    size_t huge_size;
+    enum corpus_case corpus_case;
+    const char *dir;
+};
+
+struct buffer {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+static const char *kind_names[KINDS] = {
+    [KIND_TEXT] = "text",
+    [KIND_TXXX] = "txxx",
+    [KIND_COMM] = "comm",
+    [KIND_APIC] = "apic",
+    [KIND_PRIV] = "priv",
+};
+
+// Text frame IDs in versions 2.2, 2.3 and 2.4
+static const char *text_ids[][3] = {
+    { "TT2", "TIT2", "TIT2" },
+    { "TP1", "TPE1", "TPE1" },
+    { "TAL", "TALB", "TALB" },
+    { "TCO", "TCON", "TCON" },
+    { "TRK", "TRCK", "TRCK" },
+    { "TYE", "TYER", "TDRC" },
+    { "TEN", "TENC", "TENC" },
+};
+
+static const char *other_ids[KINDS][3] = {
+    [KIND_TXXX] = { "TXX", "TXXX", "TXXX" },
+    [KIND_COMM] = { "COM", "COMM", "COMM" },
+    [KIND_APIC] = { "PIC", "APIC", "APIC" },
+    [KIND_PRIV] = { NULL, "PRIV", "PRIV" },
+};
+
+static const char *words[] = {
+    "the", "night", "river", "blue", "song", "of", "electric", "dream",
+    "caf\xc3\xa9", "\xc3\xbc" "ber", "se\xc3\xb1" "or", "live", "remix",
+    "part", "2", "1999",
+    "\xe3\x81\x82\xe3\x81\x8a", "\xd0\xbc\xd0\xb8\xd1\x80"
+};
+// Words from here on aren't representable in ISO 8859-1
+#define LATIN1_WORDS 16
+
+// splitmix64, so each file gets an independent stream from the seed
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static size_t random_below(uint64_t *state, size_t n) {
+    return next_random(state) % n;
+}
+
+// Make room for len more bytes
+// Return 1 on success, 0 otherwise
+static int reserve(struct buffer *buf, size_t len) {
+    size_t size = buf->size ? buf->size : 4096;
+    void *p;
+
+    while (size - buf->len < len) {
+        size *= 2;
+    }
+    if (size != buf->size) {
+        p = realloc(buf->data, size);
+        if (p == NULL) {
+            perror("realloc");
+            return 0;
+        }
+        buf->data = p;
+        buf->size = size;
+    }
+    return 1;
+}
+
+static int put(struct buffer *buf, const void *data, size_t len) {
+    if (!reserve(buf, len)) {
+        return 0;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 1;
+}
+
+static int put_byte(struct buffer *buf, uint8_t byte) {
+    return put(buf, &byte, 1);
+}
+
+static int put_be32(struct buffer *buf, uint32_t val) {
+    val = byte_swap_32(val);
+    return put(buf, &val, sizeof(val));
+}
+
+static int put_random(struct buffer *buf, uint64_t *state, size_t len) {
+    uint64_t r = 0;
+    size_t i;
+
+    if (!reserve(buf, len)) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        if (i % sizeof(r) == 0) {
+            r = next_random(state);
+        }
+        buf->data[buf->len++] = r;
+        r >>= 8;
+    }
+    return 1;
+}
+
+// Decode one UTF-8 character, returning its code point
+static uint32_t next_code_point(const char **str) {
+    const uint8_t *s = (const uint8_t *)*str;
+    uint32_t cp;
+    int extra;
+
+    if (s[0] < 0x80) {
+        cp = s[0];
+        extra = 0;
+    } else if (s[0] < 0xE0) {
+        cp = s[0] & 0x1F;
+        extra = 1;
+    } else {
+        cp = s[0] & 0x0F;
+        extra = 2;
+    }
+    *str += 1;
+    while (extra--) {
+        cp = (cp << 6) | (**(const uint8_t **)str & 0x3F);
+        *str += 1;
+    }
+    return cp;
+}
+
+// Write the UTF-8 string str in enc, with a terminator
+static int put_text(struct buffer *buf, const char *str,
+        enum id3v2_encoding enc) {
+    uint32_t cp;
+    int ret = 1;
+
+    if (enc == ID3V2_ENCODING_UTF_8) {
+        return put(buf, str, strlen(str) + 1);
+    }
+    if (enc == ID3V2_ENCODING_UTF_16) {
+        ret = put_byte(buf, 0xFF) && put_byte(buf, 0xFE);
+    }
+    while (ret && *str) {
+        cp = next_code_point(&str);
+        if (enc == ID3V2_ENCODING_ISO_8859_1) {
+            ret = put_byte(buf, cp);
+        } else if (enc == ID3V2_ENCODING_UTF_16) {
+            ret = put_byte(buf, cp) && put_byte(buf, cp >> 8);
+        } else {
+            ret = put_byte(buf, cp >> 8) && put_byte(buf, cp);
+        }
+    }
+    if (enc == ID3V2_ENCODING_ISO_8859_1) {
+        return ret && put_byte(buf, 0);
+    }
+    return ret && put_byte(buf, 0) && put_byte(buf, 0);
+}
+
+// Make up a phrase of a few words that can be written in enc
+static void make_phrase(char *phrase, size_t size, uint64_t *state,
+        enum id3v2_encoding enc) {
+    size_t nwords = sizeof(words) / sizeof(words[0]), count, i;
+    size_t limit = enc == ID3V2_ENCODING_ISO_8859_1 ? LATIN1_WORDS : nwords;
+    const char *word;
+
+    phrase[0] = 0;
+    count = 1 + random_below(state, 4);
+    for (i = 0; i < count; i++) {
+        word = words[random_below(state, limit)];
+        if (strlen(phrase) + strlen(word) + 2 > size) {
+            break;
+        }
+        if (i) {
+            strcat(phrase, " ");
+        }
+        strcat(phrase, word);
+    }
+}
+
+static enum id3v2_encoding choose_encoding(const struct corpus_options *opts,
+        uint64_t *state) {
+    if (opts->encoding != CHOOSE_MIXED) {
+        return opts->encoding;
+    }
+    // Encodings new in 2.4 only appear in 2.4 tags
+    return random_below(state, opts->version >= 4 ? 4 : 2);
+}
+
+static enum frame_kind choose_kind(const struct corpus_options *opts,
+        uint64_t *state) {
+    unsigned int total = 0, pick;
+    int i;
+
+    for (i = 0; i < KINDS; i++) {
+        total += opts->mix[i];
+    }
+    pick = random_below(state, total);
+    for (i = 0; i < KINDS - 1 && pick >= opts->mix[i]; i++) {
+        pick -= opts->mix[i];
+    }
+    return i;
+}
+
+// Write the body of a frame of the given kind
+static int put_frame_body(struct buffer *body, enum frame_kind kind,
+        const struct corpus_options *opts, uint64_t *state, size_t apic_size,
+        const char **id) {
+    enum id3v2_encoding enc = choose_encoding(opts, state);
+    int v = opts->version - 2;
+    char phrase[128];
+    int ret;
+
+    body->len = 0;
+    if (kind == KIND_TEXT) {
+        *id = text_ids[random_below(state,
+                sizeof(text_ids) / sizeof(text_ids[0]))][v];
+    } else {
+        *id = other_ids[kind][v];
+    }
+    if (kind != KIND_PRIV && !put_byte(body, enc)) {
+        return 0;
+    }
+    make_phrase(phrase, sizeof(phrase), state, enc);
+    switch (kind) {
+        case KIND_TEXT:
+            return put_text(body, phrase, enc);
+        case KIND_TXXX:
+            return put_text(body, "BENCHMARK", enc) &&
+                put_text(body, phrase, enc);
+        case KIND_COMM:
+            return put(body, "eng", 3) && put_text(body, "", enc) &&
+                put_text(body, phrase, enc);
+        case KIND_APIC:
+            if (v == 0) {
+                ret = put(body, "JPG", 3);
+            } else {
+                ret = put(body, "image/jpeg", strlen("image/jpeg") + 1);
+            }
+            // A front cover, holding something like a JPEG, which has
+            // plenty of bytes that need unsynchronising
+            return ret && put_byte(body, 3) && put_text(body, phrase, enc) &&
+                put(body, "\xFF\xD8\xFF\xE0", 4) &&
+                put_random(body, state, apic_size) &&
+                put(body, "\xFF\xD9", 2);
+        case KIND_PRIV:
+            return put(body, "bench.example", strlen("bench.example") + 1) &&
+                put_random(body, state, 16 + random_below(state, 64));
+        default:
+            return 0;
+    }
+}
+
+// Unsynchronise the len bytes at the end of buf
+static int unsynchronize_tail(struct buffer *buf, size_t len) {
+    size_t start = buf->len - len, out_len;
+    uint8_t *copy;
+
+    out_len = len ? unsync_len(buf->data + start, len) : 0;
+    if (out_len == len) {
+        return 1;
+    }
+    copy = malloc(len);
+    if (copy == NULL || !reserve(buf, out_len - len)) {
+        perror("malloc");
+        free(copy);
+        return 0;
+    }
+    memcpy(copy, buf->data + start, len);
+    unsynchronize(copy, len, buf->data + start);
+    buf->len = start + out_len;
+    free(copy);
+    return 1;
+}
+
+// Append a frame with the given body to the tag
+static int put_frame(struct buffer *tag, const char *id, struct buffer *body,
+        const struct corpus_options *opts) {
+    uint8_t flags = 0, *data = body->data;
+    size_t len = body->len, start;
+    uLongf zlen = 0;
+    uint8_t *zdata = NULL;
+    int unsync = opts->unsync != UNSYNC_NONE && opts->version >= 4;
+    int ret;
+
+    if (opts->compress) {
+        zlen = compressBound(len);
+        zdata = malloc(zlen);
+        if (zdata == NULL) {
+            perror("malloc");
+            return 0;
+        }
+        if (compress2(zdata, &zlen, data, len, Z_DEFAULT_COMPRESSION) !=
+                Z_OK) {
+            fprintf(stderr, "Couldn't compress frame %s\n", id);
+            free(zdata);
+            return 0;
+        }
+        data = zdata;
+    }
+
+    if (opts->version == 2) {
+        uint8_t header[ID3V22_FRAME_HEADER_SIZE] = {
+            id[0], id[1], id[2], len >> 16, len >> 8, len
+        };
+        return put(tag, header, sizeof(header)) && put(tag, data, len);
+    }
+
+    if (opts->version == 3) {
+        // The decompressed size precedes compressed data
+        ret = put(tag, id, ID3V2_FRAME_ID_SIZE) &&
+            put_be32(tag, opts->compress ? zlen + 4 : len) &&
+            put_byte(tag, 0) &&
+            put_byte(tag, opts->compress ?
+                    ID3V23_FRAME_HEADER_COMPRESSION_BIT : 0) &&
+            (!opts->compress || put_be32(tag, len)) &&
+            put(tag, data, opts->compress ? zlen : len);
+        free(zdata);
+        return ret;
+    }
+
+    // In 2.4 the data length is that with every flag undone, and the
+    // frame size is only known once the data is unsynchronised
+    if (opts->compress) {
+        flags |= ID3V2_FRAME_HEADER_COMPRESSION_BIT |
+            ID3V2_FRAME_HEADER_DATA_LENGTH_BIT;
+    }
+    if (unsync) {
+        flags |= ID3V2_FRAME_HEADER_UNSYNCHRONIZATION_BIT;
+    }
+    start = tag->len;
+    ret = put(tag, id, ID3V2_FRAME_ID_SIZE) && put_be32(tag, 0) &&
+        put_byte(tag, 0) && put_byte(tag, flags) &&
+        (!opts->compress || put_be32(tag, to_synchsafe(len))) &&
+        put(tag, data, opts->compress ? zlen : len) &&
+        (!unsync || unsynchronize_tail(tag, opts->compress ? zlen : len));
+    free(zdata);
+    if (ret) {
+        len = byte_swap_32(to_synchsafe(tag->len - start -
+                    ID3V2_FRAME_HEADER_SIZE));
+        memcpy(tag->data + start + ID3V2_FRAME_ID_SIZE, &len,
+                sizeof(uint32_t));
+    }
+    return ret;
+}
+
+// Append the extended header, with a CRC of crc_len bytes of frames,
+// which is followed by the padding
+static int put_extheader(struct buffer *tag, const uint8_t *frames,
+        size_t crc_len, const struct corpus_options *opts) {
+    uint32_t crc = crc32(crc32(0L, Z_NULL, 0), frames, crc_len);
+    uint8_t flags = 0, size = 6;
+
+    if (opts->version == 3) {
+        return put_be32(tag, opts->crc ? 10 : 6) &&
+            put_byte(tag, opts->crc ? ID3V23_EXTENDED_HEADER_CRC_BIT : 0) &&
+            put_byte(tag, 0) && put_be32(tag, opts->padding) &&
+            (!opts->crc || put_be32(tag, crc));
+    }
+
+    // The 2.4 CRC is 35 bits, synchsafe
+    if (opts->crc) {
+        flags |= ID3V2_EXTENDED_HEADER_CRC_BIT;
+        size += 6;
+    }
+    if (opts->restrictions >= 0) {
+        flags |= ID3V2_EXTENDED_HEADER_TAG_RESTRICTIONS_BIT;
+        size += 2;
+    }
+    if (!put_be32(tag, to_synchsafe(size)) || !put_byte(tag, 1) ||
+            !put_byte(tag, flags)) {
+        return 0;
+    }
+    if (opts->crc) {
+        uint8_t data[6] = { 5, crc >> 28, (crc >> 21) & 0x7F,
+            (crc >> 14) & 0x7F, (crc >> 7) & 0x7F, crc & 0x7F };
+        if (!put(tag, data, sizeof(data))) {
+            return 0;
+        }
+    }
+    return opts->restrictions < 0 ||
+        (put_byte(tag, 1) && put_byte(tag, opts->restrictions));
+}
+
+// Build a whole tag in tag
+// Return 1 on success, 0 otherwise
+static int build_tag(struct buffer *tag, const struct corpus_options *opts,
+        uint64_t *state) {
+    struct buffer frames = { 0 }, body = { 0 };
+    enum frame_kind kind;
+    size_t crc_len, tag_size;
+    uint8_t flags = 0;
+    const char *id;
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < opts->frames; i++) {
+        if (opts->corpus_case == CASE_HUGE_FRAME && i == 0) {
+            kind = KIND_APIC;
+        } else {
+            kind = choose_kind(opts, state);
+        }
+        if (!put_frame_body(&body, kind, opts, state,
+                    kind == KIND_APIC && opts->corpus_case ==
+                    CASE_HUGE_FRAME && i == 0 ? opts->huge_size :
+                    opts->apic_size, &id) ||
+                !put_frame(&frames, id, &body, opts)) {
+            goto out;
+        }
+    }
+    crc_len = frames.len;
+    if (!reserve(&frames, opts->padding)) {
+        goto out;
+    }
+    memset(frames.data + frames.len, 0, opts->padding);
+    frames.len += opts->padding;
+    if (opts->version >= 4) {
+        crc_len = frames.len;
+    }
+
+    tag->len = 0;
+    if (!put(tag, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE) ||
+            !put_byte(tag, opts->version) || !put_byte(tag, 0) ||
+            !put_byte(tag, 0) || !put_be32(tag, 0)) {
+        goto out;
+    }
+    if (opts->extheader && !put_extheader(tag, frames.data, crc_len, opts)) {
+        goto out;
+    }
+    if (!put(tag, frames.data, frames.len)) {
+        goto out;
+    }
+    // Before 2.4, unsynchronisation covers everything after the header
+    if (opts->unsync == UNSYNC_TAG && opts->version < 4 &&
+            !unsynchronize_tail(tag, tag->len - ID3V2_HEADER_SIZE)) {
+        goto out;
+    }
+
+    if (opts->unsync == UNSYNC_TAG) {
+        flags |= ID3V2_HEADER_UNSYNCHRONIZATION_BIT;
+    }
+    if (opts->extheader) {
+        flags |= ID3V2_HEADER_EXTENDED_HEADER_BIT;
+    }
+    if (opts->footer) {
+        flags |= ID3V2_HEADER_FOOTER_BIT;
+    }
+    tag_size = byte_swap_32(to_synchsafe(tag->len - ID3V2_HEADER_SIZE));
+    tag->data[5] = flags;
+    memcpy(tag->data + 6, &tag_size, sizeof(uint32_t));
+    if (opts->footer) {
+        if (!put(tag, tag->data, ID3V2_HEADER_SIZE)) {
+            goto out;
+        }
+        memcpy(tag->data + tag->len - ID3V2_HEADER_SIZE,
+                ID3V2_FOOTER_IDENTIFIER, ID3V2_FOOTER_ID_SIZE);
+    }
+    ret = 1;
+out:
+    free(frames.data);
+    free(body.data);
+    return ret;
+}
+
+// Append len bytes of something like MPEG audio, with a false "ID3"
+// every FALSE_POSITIVE_INTERVAL bytes if asked
+static int put_audio(struct buffer *buf, size_t len, int false_positives,
+        uint64_t *state) {
+    size_t start = buf->len, i;
+
+    if (!put_random(buf, state, len)) {
+        return 0;
+    }
+    for (i = 0; i + 4 <= len; i += MPEG_FRAME_SIZE) {
+        memcpy(buf->data + start + i, "\xFF\xFB\x90\x64", 4);
+    }
+    // Each looks like a header until its size, which isn't synchsafe
+    for (i = FALSE_POSITIVE_INTERVAL; false_positives &&
+            i + ID3V2_HEADER_SIZE <= len; i += FALSE_POSITIVE_INTERVAL) {
+        memcpy(buf->data + start + i, "ID3\x04\x00\x00\x80\x80\x80\x80",
+                ID3V2_HEADER_SIZE);
+    }
+    return 1;
+}
+
+// Write the index'th file of the corpus
+// Return 1 on success, 0 otherwise
+static int write_file(const struct corpus_options *opts, unsigned int index,
+        struct buffer *buf) {
+    uint64_t state = opts->seed ^ (0xD1B54A32D192ED03ULL * (index + 1));
+    char *path;
+    FILE *fp;
+    int ret = 1;
+
+    buf->len = 0;
+    if (opts->corpus_case != CASE_NO_TAG &&
+            opts->corpus_case != CASE_FALSE_POSITIVE &&
+            !build_tag(buf, opts, &state)) {
+        return 0;
+    }
+    if (!put_audio(buf, opts->audio_size,
+                opts->corpus_case == CASE_FALSE_POSITIVE, &state)) {
+        return 0;
+    }
+
+    if (asprintf(&path, "%s/%06u.mp3", opts->dir, index) == -1) {
+        perror("asprintf");
+        return 0;
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Couldn't open %s: %m\n", path);
+        free(path);
+        return 0;
+    }
+    if (fwrite(buf->data, 1, buf->len, fp) != buf->len) {
+        fprintf(stderr, "Couldn't write %s: %m\n", path);
+        ret = 0;
+    }
+    if (fclose(fp)) {
+        fprintf(stderr, "Couldn't close %s: %m\n", path);
+        ret = 0;
+    }
+    free(path);
+    return ret;
+}
+
+static void print_usage(const char *name, FILE *fp) {
+    fprintf(fp, "Usage: %s [OPTION]... DIR\n"
+            "Write a reproducible corpus of tagged files into DIR\n"
+            "    --seed=N          Seed for all content (1)\n"
+            "    --files=N         Number of files (%d)\n"
+            "    --version=2|3|4   ID3v2 minor version (4). id3al can't\n"
+            "                      read 2.2 frames, so 2.2 files are\n"
+            "                      negative input\n"
+            "    --frames=N        Frames per tag (%d)\n"
+            "    --mix=KIND:W,...  Weights of frame kinds text, txxx,\n"
+            "                      comm, apic and priv (text:8,txxx:1,\n"
+            "                      comm:1)\n"
+            "    --encoding=ENC    latin1, utf16, utf16be, utf8 or mixed\n"
+            "                      (latin1)\n"
+            "    --apic-size=N     Bytes of picture data in APIC frames "
+            "(%d)\n"
+            "    --unsync=WHERE    none, tag or frame (none)\n"
+            "    --compress        Compress every frame\n"
+            "    --extended-header Write an extended header\n"
+            "    --crc             Put a CRC in the extended header\n"
+            "    --restrictions=N  Put restrictions byte N in the extended\n"
+            "                      header\n"
+            "    --footer          Write a footer\n"
+            "    --padding=N       Bytes of padding (0)\n"
+            "    --audio-size=N    Bytes of audio after the tag (%d)\n"
+            "    --case=CASE       normal, no-tag, false-positive, with a\n"
+            "                      false \"ID3\" every %d bytes of audio and\n"
+            "                      no tag, or huge-frame (normal)\n"
+            "    --huge-size=N     Bytes in the huge frame (%d)\n",
+            name, DEFAULT_FILES, DEFAULT_FRAMES, DEFAULT_APIC_SIZE,
+            DEFAULT_AUDIO_SIZE, FALSE_POSITIVE_INTERVAL, DEFAULT_HUGE_SIZE);
+}
+
+// Parse a size or count, returning 1 on success and 0 otherwise
+static int parse_number(const char *arg, unsigned long long max,
+        unsigned long long *val) {
+    char *end;
+
+    errno = 0;
+    *val = strtoull(arg, &end, 0);
+    return *arg && !*end && !errno && *val <= max;
+}
+
+// Parse a list like text:8,apic:1
+// Return 1 on success, 0 otherwise
+static int parse_mix(const char *arg, struct corpus_options *opts) {
+    char *copy, *item, *save = NULL, *weight;
+    unsigned long long val;
+    unsigned int total = 0;
+    int i, ret = 1;
+
+    copy = strdup(arg);
+    if (copy == NULL) {
+        return 0;
+    }
+    memset(opts->mix, 0, sizeof(opts->mix));
+    for (item = strtok_r(copy, ",", &save); item && ret;
+            item = strtok_r(NULL, ",", &save)) {
+        weight = strchr(item, ':');
+        if (weight == NULL) {
+            ret = 0;
+            break;
+        }
+        *weight++ = 0;
+        for (i = 0; i < KINDS && strcmp(kind_names[i], item); i++);
+        if (i == KINDS || !parse_number(weight, 1000, &val)) {
+            ret = 0;
+            break;
+        }
+        opts->mix[i] = val;
+        total += val;
+    }
+    free(copy);
+    return ret && total > 0;
+}
+
+// Return the index of arg in names, or -1 if it isn't there
+static int parse_choice(const char *arg, const char * const names[],
+        int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcmp(arg, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Check the options make a valid tag
+// Return 1 if they do, 0 otherwise
+static int check_options(const struct corpus_options *opts) {
+    if (opts->version == 2 && opts->compress) {
+        fprintf(stderr, "2.2 tags can't be compressed\n");
+    } else if (opts->version < 4 && opts->unsync == UNSYNC_FRAME) {
+        fprintf(stderr, "Frames are only unsynchronised in 2.4 tags\n");
+    } else if (opts->version < 4 && (opts->encoding == CHOOSE_UTF16BE ||
+                opts->encoding == CHOOSE_UTF8)) {
+        fprintf(stderr, "That encoding needs a 2.4 tag\n");
+    } else if (opts->version == 2 && opts->mix[KIND_PRIV]) {
+        fprintf(stderr, "2.2 tags have no PRIV frames\n");
+    } else if (opts->version == 2 && opts->extheader) {
+        fprintf(stderr, "2.2 tags have no extended header\n");
+    } else if ((opts->crc || opts->restrictions >= 0) && !opts->extheader) {
+        fprintf(stderr, "CRC and restrictions need --extended-header\n");
+    } else if (opts->version < 4 && opts->restrictions >= 0) {
+        fprintf(stderr, "Restrictions need a 2.4 tag\n");
+    } else if (opts->footer && (opts->version < 4 || opts->padding)) {
+        fprintf(stderr, "Footers need a 2.4 tag without padding\n");
+    } else if (opts->version == 2 && opts->corpus_case == CASE_HUGE_FRAME &&
+            opts->huge_size >= (1 << 24) - 64) {
+        fprintf(stderr, "2.2 frames must be under 16 MiB\n");
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+static void parse_args(int argc, char * const argv[],
+        struct corpus_options *opts) {
+    static const char *encodings[] = { "latin1", "utf16", "utf16be", "utf8",
+        "mixed" };
+    static const char *unsyncs[] = { "none", "tag", "frame" };
+    static const char *cases[] = { "normal", "no-tag", "false-positive",
+        "huge-frame" };
+    static const struct option longopts[] = {
+        { "seed", required_argument, NULL, 's' },
+        { "files", required_argument, NULL, 'n' },
+        { "version", required_argument, NULL, 'V' },
+        { "frames", required_argument, NULL, 'f' },
+        { "mix", required_argument, NULL, 'm' },
+        { "encoding", required_argument, NULL, 'e' },
+        { "apic-size", required_argument, NULL, 'a' },
+        { "unsync", required_argument, NULL, 'u' },
+        { "compress", no_argument, NULL, 'z' },
+        { "extended-header", no_argument, NULL, 'x' },
+        { "crc", no_argument, NULL, 'c' },
+        { "restrictions", required_argument, NULL, 'r' },
+        { "footer", no_argument, NULL, 'F' },
+        { "padding", required_argument, NULL, 'p' },
+        { "audio-size", required_argument, NULL, 'A' },
+        { "case", required_argument, NULL, 'C' },
+        { "huge-size", required_argument, NULL, 'H' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned long long val;
+    int opt, choice, ok;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->seed = 1;
+    opts->files = DEFAULT_FILES;
+    opts->version = 4;
+    opts->frames = DEFAULT_FRAMES;
+    opts->mix[KIND_TEXT] = 8;
+    opts->mix[KIND_TXXX] = 1;
+    opts->mix[KIND_COMM] = 1;
+    opts->encoding = CHOOSE_LATIN1;
+    opts->apic_size = DEFAULT_APIC_SIZE;
+    opts->restrictions = -1;
+    opts->audio_size = DEFAULT_AUDIO_SIZE;
+    opts->huge_size = DEFAULT_HUGE_SIZE;
+
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        ok = 1;
+        choice = 0;
+        switch (opt) {
+            case 's':
+                ok = parse_number(optarg, UINT64_MAX, &val);
+                opts->seed = val;
+                break;
+            case 'n':
+                ok = parse_number(optarg, 1000000, &val);
+                opts->files = val;
+                break;
+            case 'V':
+                ok = parse_number(optarg, 4, &val) && val >= 2;
+                opts->version = val;
+                break;
+            case 'f':
+                ok = parse_number(optarg, 100000, &val);
+                opts->frames = val;
+                break;
+            case 'm':
+                ok = parse_mix(optarg, opts);
+                break;
+            case 'e':
+                choice = parse_choice(optarg, encodings, 5);
+                opts->encoding = choice;
+                break;
+            case 'a':
+                ok = parse_number(optarg, 1 << 26, &val);
+                opts->apic_size = val;
+                break;
+            case 'u':
+                choice = parse_choice(optarg, unsyncs, 3);
+                opts->unsync = choice;
+                break;
+            case 'z':
+                opts->compress = 1;
+                break;
+            case 'x':
+                opts->extheader = 1;
+                break;
+            case 'c':
+                opts->crc = 1;
+                break;
+            case 'r':
+                ok = parse_number(optarg, 0xFF, &val);
+                opts->restrictions = val;
+                break;
+            case 'F':
+                opts->footer = 1;
+                break;
+            case 'p':
+                ok = parse_number(optarg, 1 << 26, &val);
+                opts->padding = val;
+                break;
+            case 'A':
+                ok = parse_number(optarg, 1ULL << 32, &val);
+                opts->audio_size = val;
+                break;
+            case 'C':
+                choice = parse_choice(optarg, cases, 4);
+                opts->corpus_case = choice;
+                break;
+            case 'H':
+                ok = parse_number(optarg, 1 << 28, &val);
+                opts->huge_size = val;
+                break;
+            case 'h':
+                print_usage(argv[0], stdout);
+                exit(0);
+            default:
+                print_usage(argv[0], stderr);
+                exit(1);
+        }
+        if (!ok || choice < 0) {
+            fprintf(stderr, "Invalid argument %s\n", optarg);
+            print_usage(argv[0], stderr);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || !check_options(opts)) {
+        print_usage(argv[0], stderr);
+        exit(1);
+    }
+    opts->dir = argv[optind];
+}
+
+int main(int argc, char *argv[]) {
+    struct corpus_options opts;
+    struct buffer buf = { 0 };
+    unsigned int i;
+    int ret = 0;
+
+    parse_args(argc, argv, &opts);
+    if (mkdir(opts.dir, 0777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Couldn't make %s: %m\n", opts.dir);
+        return 1;
+    }
+    for (i = 0; i < opts.files; i++) {
+        if (!write_file(&opts, i, &buf)) {
+            ret = 1;
+            break;
+        }
+    }
+    free(buf.data);
+    return ret;
+}
@@ -0,0 +1,361 @@
+// Measure the speed of the core decoding and printing functions
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../id3v2.h"
+
+#define WARMUP_RUNS 3
+#define DEFAULT_RUNS 31
+// Each run repeats the operation for at least this long
+#define MIN_RUN_NS 2000000LL
+
+#define VALUES 1024
+#define SYNC_SIZE (64 << 10)
+#define SCAN_SIZE (1 << 20)
+#define TAG_FRAMES 64
+
+struct kernel {
+    const char *name;
+    // Bytes processed by one operation for throughput, or 0 if that
+    // isn't meaningful
+    size_t bytes;
+    void (*run)(long long ops);
+};
+
+// Results are summed here so the work can't be optimised away
+static volatile uint64_t sink;
+
+static uint32_t values[VALUES];
+static uint8_t *plain, *unsynced;
+static size_t unsynced_len;
+static uint8_t *scan_data;
+static struct id3v2_header tag;
+static struct id3v2_frame_header title_frames[VALUES];
+static FILE *null_fp;
+static char latin1_text[64], utf16_text[128];
+
+static void run_from_synchsafe(long long ops) {
+    uint64_t total = 0;
+
+    while (ops--) {
+        total += from_synchsafe(values[ops % VALUES]);
+    }
+    sink += total;
+}
+
+static void run_to_synchsafe(long long ops) {
+    uint64_t total = 0;
+
+    while (ops--) {
+        total += to_synchsafe(values[ops % VALUES] & 0x0FFFFFFF);
+    }
+    sink += total;
+}
+
+static void run_byte_swap_32(long long ops) {
+    uint64_t total = 0;
+
+    while (ops--) {
+        total += byte_swap_32(values[ops % VALUES]);
+    }
+    sink += total;
+}
+
+static void run_unsynchronize(long long ops) {
+    static uint8_t out[SYNC_SIZE * 2];
+
+    while (ops--) {
+        unsynchronize(plain, SYNC_SIZE, out);
+    }
+    sink += out[0];
+}
+
+static void run_resynchronize(long long ops) {
+    static uint8_t out[SYNC_SIZE];
+
+    while (ops--) {
+        resynchronize(unsynced, unsynced_len, out);
+    }
+    sink += out[0];
+}
+
+static void run_scan(long long ops) {
+    struct id3v2_header header;
+
+    while (ops--) {
+        sink += find_id3v2_header(scan_data, SCAN_SIZE, &header);
+    }
+}
+
+static void run_frames(long long ops) {
+    struct id3v2_frame_header fheader;
+
+    while (ops--) {
+        tag.i = 0;
+        tag.frames = 0;
+        while (get_id3v2_frame(&tag, &fheader)) {
+            sink += fheader.data_len;
+            free_id3v2_frame_data(&tag, &fheader);
+        }
+    }
+}
+
+static void run_frame_title(long long ops) {
+    while (ops--) {
+        sink += (uintptr_t)frame_title(&title_frames[ops % VALUES]);
+    }
+}
+
+static void run_print_latin1(long long ops) {
+    while (ops--) {
+        sink += print_enc(null_fp, latin1_text, -1,
+                ID3V2_ENCODING_ISO_8859_1);
+    }
+}
+
+static void run_print_utf16(long long ops) {
+    while (ops--) {
+        sink += print_enc(null_fp, utf16_text, -1, ID3V2_ENCODING_UTF_16);
+    }
+}
+
+static struct kernel kernels[] = {
+    { "from_synchsafe", sizeof(uint32_t), run_from_synchsafe },
+    { "to_synchsafe", sizeof(uint32_t), run_to_synchsafe },
+    { "byte_swap_32", sizeof(uint32_t), run_byte_swap_32 },
+    { "unsynchronize", SYNC_SIZE, run_unsynchronize },
+    { "resynchronize", SYNC_SIZE, run_resynchronize },
+    { "id3_scan", SCAN_SIZE, run_scan },
+    { "frame_iteration", 0, run_frames },
+    { "frame_title", 0, run_frame_title },
+    { "print_enc_latin1", 0, run_print_latin1 },
+    { "print_enc_utf16", 0, run_print_utf16 },
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static void set_bytes(const char *name, size_t bytes) {
+    int i;
+
+    for (i = 0; i < KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name)) {
+            kernels[i].bytes = bytes;
+        }
+    }
+}
+
+// A simple generator, so every run sees the same data
+static uint32_t next_random(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Write a tag of TAG_FRAMES text frames to a file and read it back
+// Return 1 on success, 0 otherwise
+static int setup_tag(void) {
+    static const char *ids[] = { "TIT2", "TPE1", "TALB", "TCON" };
+    char file[] = "/tmp/id3al-kernels-XXXXXX";
+    uint8_t data[ID3V2_HEADER_SIZE + TAG_FRAMES * 42];
+    size_t i = ID3V2_HEADER_SIZE;
+    uint32_t size;
+    int fd, j;
+
+    for (j = 0; j < TAG_FRAMES; j++) {
+        memcpy(data + i, ids[j % 4], ID3V2_FRAME_ID_SIZE);
+        size = byte_swap_32(to_synchsafe(32));
+        memcpy(data + i + 4, &size, sizeof(size));
+        data[i + 8] = data[i + 9] = 0;
+        data[i + 10] = ID3V2_ENCODING_ISO_8859_1;
+        memset(data + i + 11, 'a' + j % 26, 31);
+        i += 42;
+    }
+    memcpy(data, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE);
+    data[3] = 4;
+    data[4] = data[5] = 0;
+    size = byte_swap_32(to_synchsafe(i - ID3V2_HEADER_SIZE));
+    memcpy(data + 6, &size, sizeof(size));
+    set_bytes("frame_iteration", i);
+
+    fd = mkstemp(file);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 0;
+    }
+    unlink(file);
+    if (write(fd, data, i) != i || !get_id3v2_tag(fd, &tag)) {
+        fprintf(stderr, "Couldn't write and read back a tag\n");
+        close(fd);
+        return 0;
+    }
+    // The mapping keeps the tag readable
+    close(fd);
+    return 1;
+}
+
+// Return 1 on success, 0 otherwise
+static int setup(void) {
+    static const char *ids[] = { "TIT2", "TPE1", "APIC", "COMM", "TXXX",
+        "TDRC", "WXXX", "XYZW" };
+    uint32_t state = 0x1D3A1;
+    size_t i;
+
+    for (i = 0; i < VALUES; i++) {
+        values[i] = next_random(&state);
+        memcpy(title_frames[i].id, ids[i % 8], sizeof(title_frames[i].id));
+    }
+
+    // Audio-like data, where 0xFF is common and false syncs occur
+    plain = malloc(SYNC_SIZE);
+    unsynced = malloc(SYNC_SIZE * 2);
+    scan_data = calloc(1, SCAN_SIZE);
+    if (plain == NULL || unsynced == NULL || scan_data == NULL) {
+        perror("malloc");
+        return 0;
+    }
+    for (i = 0; i < SYNC_SIZE; i++) {
+        plain[i] = next_random(&state) % 4 ? next_random(&state) : 0xFF;
+    }
+    unsynced_len = unsync_len(plain, SYNC_SIZE);
+    unsynchronize(plain, SYNC_SIZE, unsynced);
+
+    // No header until the last few bytes. Stray invalid headers are left
+    // out, as debug builds would report each one.
+    for (i = 0; i + ID3V2_HEADER_SIZE < SCAN_SIZE; i++) {
+        scan_data[i] = next_random(&state);
+        if (scan_data[i] == 'I') {
+            scan_data[i]++;
+        }
+    }
+    memcpy(scan_data + SCAN_SIZE - ID3V2_HEADER_SIZE,
+            "ID3\x04\x00\x00\x00\x00\x00\x00", ID3V2_HEADER_SIZE);
+
+    if (!setup_tag()) {
+        return 0;
+    }
+
+    memset(latin1_text, 'x', sizeof(latin1_text) - 1);
+    set_bytes("print_enc_latin1", sizeof(latin1_text) - 1);
+    utf16_text[0] = 0xFF;
+    utf16_text[1] = 0xFE;
+    for (i = 2; i + 2 < sizeof(utf16_text); i += 2) {
+        utf16_text[i] = 'a' + i % 26;
+        utf16_text[i + 1] = i % 8 ? 0 : 0x03;
+    }
+    set_bytes("print_enc_utf16", sizeof(utf16_text) - 2);
+
+    null_fp = fopen("/dev/null", "w");
+    if (null_fp == NULL) {
+        perror("fopen");
+        return 0;
+    }
+    return 1;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time runs of the kernel, returning the ns per operation of each, sorted
+static void measure(struct kernel *kernel, double *times, int runs) {
+    long long ops = 1, start, elapsed;
+    int i;
+
+    // Find how many operations fill a run
+    for (;;) {
+        start = now_ns();
+        kernel->run(ops);
+        elapsed = now_ns() - start;
+        if (elapsed >= MIN_RUN_NS) {
+            break;
+        }
+        ops *= elapsed > 0 && MIN_RUN_NS / elapsed < 10 ?
+            MIN_RUN_NS / elapsed + 1 : 10;
+    }
+    for (i = 0; i < WARMUP_RUNS; i++) {
+        kernel->run(ops);
+    }
+    for (i = 0; i < runs; i++) {
+        start = now_ns();
+        kernel->run(ops);
+        times[i] = (double)(now_ns() - start) / ops;
+    }
+    qsort(times, runs, sizeof(*times), compare_double);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    double *times, median, p99;
+    int runs = DEFAULT_RUNS, json = 0, first = 1, i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json")) {
+            json = 1;
+        } else if (!strncmp(argv[i], "--runs=", 7) && atoi(argv[i] + 7) > 0) {
+            runs = atoi(argv[i] + 7);
+        } else if (argv[i][0] != '-' && filter == NULL) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--json] [--runs=RUNS] [NAME]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    times = calloc(runs, sizeof(*times));
+    if (times == NULL || !setup()) {
+        return 1;
+    }
+
+    if (json) {
+        printf("{\"runs\": %d, \"kernels\": [", runs);
+    } else {
+        printf("%-18s %12s %12s %10s\n", "Kernel", "Median ns", "p99 ns",
+                "GB/s");
+    }
+    for (i = 0; i < KERNELS; i++) {
+        if (filter && !strstr(kernels[i].name, filter)) {
+            continue;
+        }
+        measure(&kernels[i], times, runs);
+        median = times[runs / 2];
+        p99 = times[(runs * 99) / 100];
+        // Bytes per nanosecond are GB/s
+        if (json) {
+            printf("%s\n  {\"name\": \"%s\", \"bytes\": %zu, "
+                    "\"median_ns\": %.3f, \"p99_ns\": %.3f, "
+                    "\"min_ns\": %.3f, \"gb_per_s\": %.3f}",
+                    first ? "" : ",", kernels[i].name, kernels[i].bytes,
+                    median, p99, times[0], kernels[i].bytes / median);
+        } else if (kernels[i].bytes) {
+            printf("%-18s %12.1f %12.1f %10.3f\n", kernels[i].name, median,
+                    p99, kernels[i].bytes / median);
+        } else {
+            printf("%-18s %12.1f %12.1f %10s\n", kernels[i].name, median,
+                    p99, "-");
+        }
+        fflush(stdout);
+        first = 0;
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+    free(times);
+    return 0;
+}
@@ -0,0 +1,274 @@
+// Measure request latency and throughput of id3al --serve
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "smallfile.h"
+
+#define DEFAULT_REQUESTS 20000
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_DEPTH 8
+#define CONNECT_TRIES 500
+#define BUFFER_SIZE 65536
+
+extern char **environ;
+
+struct conn {
+    int fd;
+    int outstanding;
+    char out[BUFFER_SIZE];
+    size_t out_len;
+    char in[BUFFER_SIZE];
+    size_t in_len;
+};
+
+static int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Connect to the server, waiting for it to start listening
+// Returns the socket, or -1 on failure
+static int connect_server(const char *path) {
+    struct sockaddr_un addr;
+    int fd, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    for (i = 0; i < CONNECT_TRIES; i++) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    fprintf(stderr, "Couldn't connect to %s\n", path);
+    return -1;
+}
+
+static void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n REQUESTS] [-c CONNECTIONS] [-d DEPTH]\n"
+            "        (-s SOCKET | ID3AL) [FILE...]\n"
+            "    Send REQUESTS tag queries for FILEs over CONNECTIONS\n"
+            "    connections with up to DEPTH outstanding on each, to a\n"
+            "    server at SOCKET or to one started from ID3AL\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    posix_spawn_file_actions_t actions;
+    struct pollfd *fds = NULL;
+    struct conn *conns = NULL;
+    char *socket_path = NULL, *server_arg = NULL, *tmp_file = NULL;
+    char **files, *args[3], *nl, *p;
+    long long *start = NULL, *latency = NULL, begin, elapsed;
+    int requests = DEFAULT_REQUESTS, nconns = DEFAULT_CONNECTIONS;
+    int depth = DEFAULT_DEPTH, nfiles, opt, i, ret = 1;
+    int sent = 0, received = 0, errors = 0, len;
+    pid_t pid = -1;
+    ssize_t count;
+    long id;
+
+    while ((opt = getopt(argc, argv, "n:c:d:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 's':
+                socket_path = strdup(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (requests <= 0 || nconns <= 0 || depth <= 0 ||
+            (!socket_path && optind >= argc)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Start a server unless one was given
+    if (!socket_path) {
+        if (asprintf(&socket_path, "/tmp/id3al-loadgen-%d.sock",
+                    getpid()) == -1 ||
+                asprintf(&server_arg, "--serve=%s", socket_path) == -1) {
+            return 1;
+        }
+        args[0] = argv[optind++];
+        args[1] = server_arg;
+        args[2] = NULL;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                "/dev/null", O_WRONLY, 0);
+        if (posix_spawn(&pid, args[0], &actions, NULL, args, environ)) {
+            perror("posix_spawn");
+            return 1;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if (optind < argc) {
+        files = argv + optind;
+        nfiles = argc - optind;
+    } else {
+        tmp_file = write_small_file("/tmp/id3al-loadgen-XXXXXX", 0);
+        if (tmp_file == NULL) {
+            goto out;
+        }
+        files = &tmp_file;
+        nfiles = 1;
+    }
+
+    conns = calloc(nconns, sizeof(*conns));
+    fds = calloc(nconns, sizeof(*fds));
+    start = calloc(requests, sizeof(*start));
+    latency = calloc(requests, sizeof(*latency));
+    if (!conns || !fds || !start || !latency) {
+        perror("calloc");
+        goto out;
+    }
+    for (i = 0; i < nconns; i++) {
+        conns[i].fd = connect_server(socket_path);
+        if (conns[i].fd == -1) {
+            goto out;
+        }
+        fds[i].fd = conns[i].fd;
+    }
+
+    begin = now_ns();
+    while (received < requests) {
+        for (i = 0; i < nconns; i++) {
+            // Keep every connection's pipeline full
+            while (conns[i].outstanding < depth && sent < requests &&
+                    BUFFER_SIZE - conns[i].out_len > PATH_MAX + 64) {
+                len = snprintf(conns[i].out + conns[i].out_len,
+                        BUFFER_SIZE - conns[i].out_len,
+                        "{\"id\": %d, \"path\": \"%s\"}\n", sent,
+                        files[sent % nfiles]);
+                conns[i].out_len += len;
+                start[sent++] = now_ns();
+                conns[i].outstanding++;
+            }
+            if (conns[i].out_len) {
+                count = send(conns[i].fd, conns[i].out, conns[i].out_len,
+                        MSG_NOSIGNAL);
+                if (count == -1 && errno != EAGAIN) {
+                    perror("send");
+                    goto out;
+                } else if (count > 0) {
+                    memmove(conns[i].out, conns[i].out + count,
+                            conns[i].out_len - count);
+                    conns[i].out_len -= count;
+                }
+            }
+            fds[i].events = POLLIN | (conns[i].out_len ? POLLOUT : 0);
+        }
+        if (poll(fds, nconns, -1) == -1) {
+            perror("poll");
+            goto out;
+        }
+        for (i = 0; i < nconns; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            } else if (conns[i].in_len == BUFFER_SIZE) {
+                fprintf(stderr, "Reply longer than %d bytes\n", BUFFER_SIZE);
+                goto out;
+            }
+            count = read(conns[i].fd, conns[i].in + conns[i].in_len,
+                    BUFFER_SIZE - conns[i].in_len);
+            if (count <= 0) {
+                fprintf(stderr, "Server closed the connection\n");
+                goto out;
+            }
+            conns[i].in_len += count;
+            p = conns[i].in;
+            while ((nl = memchr(p, '\n', conns[i].in + conns[i].in_len - p))) {
+                *nl = 0;
+                if (strstr(p, "\"error\"")) {
+                    errors++;
+                }
+                id = -1;
+                if (!strncmp(p, "{\"id\": ", 7)) {
+                    id = strtol(p + 7, NULL, 10);
+                }
+                if (id < 0 || id >= requests) {
+                    fprintf(stderr, "Unexpected reply %s\n", p);
+                    goto out;
+                }
+                latency[received++] = now_ns() - start[id];
+                conns[i].outstanding--;
+                p = nl + 1;
+            }
+            conns[i].in_len -= p - conns[i].in;
+            memmove(conns[i].in, p, conns[i].in_len);
+        }
+    }
+    elapsed = now_ns() - begin;
+    qsort(latency, requests, sizeof(*latency), compare_ns);
+
+    printf("%d requests over %d connections, %d deep, to %s\n", requests,
+            nconns, depth, socket_path);
+    printf("    p50: %8.1f us\n", latency[requests / 2] / 1000.0);
+    printf("    p99: %8.1f us\n", latency[(requests * 99LL) / 100] / 1000.0);
+    printf("    max: %8.1f us\n", latency[requests - 1] / 1000.0);
+    printf("   rate: %8.0f requests/s\n", requests * 1e9 / elapsed);
+    if (errors) {
+        printf(" errors: %d\n", errors);
+    }
+    ret = errors != 0;
+
+out:
+    if (pid != -1) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    for (i = 0; conns && i < nconns; i++) {
+        if (conns[i].fd > 0) {
+            close(conns[i].fd);
+        }
+    }
+    if (tmp_file) {
+        unlink(tmp_file);
+    }
+    free(conns);
+    free(fds);
+    free(start);
+    free(latency);
+    free(tmp_file);
+    free(socket_path);
+    free(server_arg);
+    return ret;
+}
@@ -0,0 +1,420 @@
+// Compare benchmark results against a checked-in baseline, failing when
+// any metric is worse than its tolerance allows or has no baseline value
+// Copyright 2015 David Gloe.
+//
+// Run from the top of the tree after building id3al and the benchmarks.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ID3AL "./src/id3al"
+#define CORPUS "./src/bench/corpus"
+#define KERNELS "./src/bench/kernels"
+#define PIPELINE "./src/bench/pipeline"
+#define DEFAULT_BASELINE "src/bench/baseline.txt"
+#define DEFAULT_WORKDIR "/tmp/id3al-perf-check"
+
+// Options for the two corpora. Nothing is compressed, so every count
+// is the same whatever the zlib version.
+#define PLAIN_CORPUS "--files=200 --encoding=mixed " \
+    "--mix=text:8,txxx:1,comm:1,apic:1,priv:1 --apic-size=8192 " \
+    "--padding=512 --audio-size=16384"
+#define UNSYNC_CORPUS "--seed=2 --files=100 --unsync=frame " \
+    "--mix=text:4,apic:1 --apic-size=100000 --audio-size=16384"
+
+enum better {
+    LOWER,
+    HIGHER
+};
+
+struct metric {
+    const char *name;
+    enum better better;
+    // Percent change allowed in the worse direction, or NAN if the
+    // metric is only reported
+    double tolerance;
+    double baseline;
+    double current;
+};
+
+// Counts are exact, while times vary too much between runs and machines
+// to fail on, so they're only reported
+static struct metric metrics[] = {
+    { "plain.allocations_per_file", LOWER, 1 },
+    { "plain.bytes_allocated_per_file", LOWER, 1 },
+    { "plain.bytes_scanned_per_file", LOWER, 1 },
+    { "plain.frames_per_file", HIGHER, 0 },
+    { "unsync.allocations_per_file", LOWER, 1 },
+    { "unsync.bytes_allocated_per_file", LOWER, 1 },
+    { "plain.peak_live_bytes", LOWER, 1 },
+    { "unsync.peak_live_bytes", LOWER, 1 },
+    { "plain.instructions_per_file", LOWER, 3 },
+    { "stats.instructions_per_file", LOWER, 3 },
+    { "plain.files_per_s", HIGHER, NAN },
+    { "stats.files_per_s", HIGHER, NAN },
+    { "kernel.unsynchronize.gb_per_s", HIGHER, NAN },
+    { "kernel.resynchronize.gb_per_s", HIGHER, NAN },
+    { "kernel.id3_scan.gb_per_s", HIGHER, NAN },
+    { "kernel.frame_iteration.gb_per_s", HIGHER, NAN },
+    { "kernel.print_enc_utf16.gb_per_s", HIGHER, NAN },
+};
+#define METRICS (sizeof(metrics) / sizeof(metrics[0]))
+
+static struct metric *find_metric(const char *name) {
+    int i;
+
+    for (i = 0; i < METRICS; i++) {
+        if (!strcmp(metrics[i].name, name)) {
+            return &metrics[i];
+        }
+    }
+    return NULL;
+}
+
+static void set_current(const char *name, double val) {
+    struct metric *metric = find_metric(name);
+
+    if (metric) {
+        metric->current = val;
+    }
+}
+
+// Run a shell command and return everything it prints, or NULL on
+// failure. The result must be freed.
+static char *run_command(const char *command) {
+    char *out = NULL;
+    size_t len = 0, count;
+    char buf[4096];
+    FILE *in, *fp;
+    int status;
+
+    fp = open_memstream(&out, &len);
+    in = popen(command, "r");
+    if (fp == NULL || in == NULL) {
+        fprintf(stderr, "Couldn't run %s: %m\n", command);
+        if (fp) {
+            fclose(fp);
+            free(out);
+        }
+        return NULL;
+    }
+    while ((count = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, count, fp);
+    }
+    status = pclose(in);
+    fclose(fp);
+    if (status != 0) {
+        fprintf(stderr, "%s failed\n", command);
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Find "key": NUMBER in text, after the first occurrence of within if it
+// isn't NULL
+// Return the number, or NAN if it isn't there or is null
+static double json_number(const char *text, const char *within,
+        const char *key) {
+    char pattern[128];
+    const char *p = text;
+    char *end;
+    double val;
+
+    if (within) {
+        p = strstr(p, within);
+        if (p == NULL) {
+            return NAN;
+        }
+    }
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(p, pattern);
+    if (p == NULL) {
+        return NAN;
+    }
+    p += strlen(pattern);
+    val = strtod(p, &end);
+    return end == p ? NAN : val;
+}
+
+// Write a corpus and get the counts from listing it with --profile
+// Return 1 on success, 0 otherwise
+static int measure_profile(const char *name, const char *options,
+        const char *workdir) {
+    char *command, *out, metric[64];
+    static const char *counts[] = { "allocations", "bytes_allocated",
+        "bytes_scanned", "frames" };
+    double files;
+    int i;
+
+    if (asprintf(&command, CORPUS " %s %s/%s && " ID3AL
+                " --profile=json %s/%s/* 2>&1 >/dev/null", options, workdir,
+                name, workdir, name) == -1) {
+        return 0;
+    }
+    out = run_command(command);
+    free(command);
+    if (out == NULL) {
+        return 0;
+    }
+    files = json_number(out, "\"counters\"", "files");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        snprintf(metric, sizeof(metric), "%s.%s_per_file", name, counts[i]);
+        set_current(metric, json_number(out, "\"counters\"", counts[i]) /
+                files);
+    }
+    snprintf(metric, sizeof(metric), "%s.peak_live_bytes", name);
+    set_current(metric, json_number(out, NULL, "peak_live_bytes"));
+    free(out);
+    return 1;
+}
+
+// Get whole run numbers from the pipeline benchmark
+// Return 1 on success, 0 otherwise
+static int measure_pipeline(const char *name, const char *args,
+        const char *workdir) {
+    char *command, *out, metric[64];
+
+    if (asprintf(&command, PIPELINE " --json --runs=5 " ID3AL " %s/plain %s",
+                workdir, args) == -1) {
+        return 0;
+    }
+    out = run_command(command);
+    free(command);
+    if (out == NULL) {
+        return 0;
+    }
+    snprintf(metric, sizeof(metric), "%s.instructions_per_file", name);
+    set_current(metric, json_number(out, NULL, "instructions_per_file"));
+    snprintf(metric, sizeof(metric), "%s.files_per_s", name);
+    set_current(metric, json_number(out, NULL, "files_per_s"));
+    free(out);
+    return 1;
+}
+
+// Get throughput from the microbenchmarks
+// Return 1 on success, 0 otherwise
+static int measure_kernels(void) {
+    char *out, name[64], metric[64];
+    const char *kernel, *end;
+    int i;
+
+    out = run_command(KERNELS " --json --runs=11");
+    if (out == NULL) {
+        return 0;
+    }
+    for (i = 0; i < METRICS; i++) {
+        if (strncmp(metrics[i].name, "kernel.", 7)) {
+            continue;
+        }
+        kernel = metrics[i].name + 7;
+        end = strchr(kernel, '.');
+        snprintf(name, sizeof(name), "\"name\": \"%.*s\"",
+                (int)(end - kernel), kernel);
+        snprintf(metric, sizeof(metric), "%s", end + 1);
+        metrics[i].current = json_number(out, name, metric);
+    }
+    free(out);
+    return 1;
+}
+
+// Read baseline values and tolerances, one "NAME TOLERANCE VALUE" per
+// line, where a TOLERANCE of - only reports the metric. Missing metrics
+// are left without a baseline.
+// Return 1 on success, 0 otherwise
+static int read_baseline(const char *path) {
+    char line[256], name[128], tolerance[64], value[64];
+    struct metric *metric;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Couldn't open %s: %m\n", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' ||
+                sscanf(line, "%127s %63s %63s", name, tolerance,
+                    value) != 3) {
+            continue;
+        }
+        metric = find_metric(name);
+        if (metric == NULL) {
+            fprintf(stderr, "Ignoring unknown metric %s\n", name);
+            continue;
+        }
+        metric->tolerance = strcmp(tolerance, "-") ? atof(tolerance) : NAN;
+        metric->baseline = strcmp(value, "n/a") ? atof(value) : NAN;
+    }
+    fclose(fp);
+    return 1;
+}
+
+// Return 1 on success, 0 otherwise
+static int write_baseline(const char *path) {
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Couldn't open %s: %m\n", path);
+        return 0;
+    }
+    fprintf(fp, "# Baseline for make perf-check. Values are rewritten by\n"
+            "# make perf-baseline; tolerances, the percentage a metric may\n"
+            "# worsen by, are kept. A tolerance of - only reports the\n"
+            "# metric, and a value of n/a couldn't be measured.\n"
+            "# METRIC TOLERANCE VALUE\n");
+    for (i = 0; i < METRICS; i++) {
+        fprintf(fp, "%s ", metrics[i].name);
+        if (isnan(metrics[i].tolerance)) {
+            fprintf(fp, "- ");
+        } else {
+            fprintf(fp, "%g ", metrics[i].tolerance);
+        }
+        if (isnan(metrics[i].current)) {
+            fprintf(fp, "n/a\n");
+        } else {
+            fprintf(fp, "%.10g\n", metrics[i].current);
+        }
+    }
+    if (fclose(fp)) {
+        fprintf(stderr, "Couldn't write %s: %m\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Print each metric against its baseline, counting in missing those
+// measured here without a baseline value to compare with
+// Return the number that regressed
+static int compare(int *missing) {
+    double change, worse;
+    const char *status;
+    char limit[16];
+    int i, failed = 0;
+
+    *missing = 0;
+    printf("%-34s %12s %12s %8s %6s\n", "Metric", "Baseline", "Current",
+            "Change", "Limit");
+    for (i = 0; i < METRICS; i++) {
+        if (isnan(metrics[i].tolerance)) {
+            snprintf(limit, sizeof(limit), "-");
+        } else {
+            snprintf(limit, sizeof(limit), "%g%%", metrics[i].tolerance);
+        }
+        if (isnan(metrics[i].current)) {
+            printf("%-34s %12s %12s %8s %6s  skipped\n", metrics[i].name,
+                    "", "n/a", "", limit);
+            continue;
+        } else if (isnan(metrics[i].baseline)) {
+            printf("%-34s %12s %12.6g %8s %6s  NO BASELINE\n",
+                    metrics[i].name, "n/a", metrics[i].current, "", limit);
+            (*missing)++;
+            continue;
+        }
+        if (metrics[i].baseline == 0) {
+            change = metrics[i].current == 0 ? 0 : INFINITY;
+        } else {
+            change = (metrics[i].current - metrics[i].baseline) * 100 /
+                metrics[i].baseline;
+        }
+        worse = metrics[i].better == LOWER ? change : -change;
+        if (isnan(metrics[i].tolerance)) {
+            status = "reported";
+        } else if (worse > metrics[i].tolerance) {
+            status = "REGRESSED";
+            failed++;
+        } else {
+            status = "ok";
+        }
+        printf("%-34s %12.6g %12.6g %+7.1f%% %6s  %s\n", metrics[i].name,
+                metrics[i].baseline, metrics[i].current, change, limit,
+                status);
+    }
+    return failed;
+}
+
+static void print_usage(const char *name, FILE *fp) {
+    fprintf(fp, "Usage: %s [--update] [--baseline=FILE] [--workdir=DIR]\n"
+            "Measure id3al on a generated corpus and compare against the\n"
+            "baseline in FILE (%s), or rewrite it with --update\n",
+            name, DEFAULT_BASELINE);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+        { "update", no_argument, NULL, 'u' },
+        { "baseline", required_argument, NULL, 'b' },
+        { "workdir", required_argument, NULL, 'w' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *baseline = DEFAULT_BASELINE, *workdir = DEFAULT_WORKDIR;
+    int update = 0, opt, failed, missing, i;
+
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'u':
+                update = 1;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 'w':
+                workdir = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0], stdout);
+                return 0;
+            default:
+                print_usage(argv[0], stderr);
+                return 2;
+        }
+    }
+    for (i = 0; i < METRICS; i++) {
+        metrics[i].baseline = metrics[i].current = NAN;
+    }
+    // Keep tolerances chosen in an existing baseline when updating it
+    if (!(update && access(baseline, F_OK)) && !read_baseline(baseline)) {
+        return 2;
+    }
+    if (mkdir(workdir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "Couldn't make %s: %m\n", workdir);
+        return 2;
+    }
+
+    if (!measure_profile("plain", PLAIN_CORPUS, workdir) ||
+            !measure_profile("unsync", UNSYNC_CORPUS, workdir) ||
+            !measure_pipeline("plain", "", workdir) ||
+            !measure_pipeline("stats", "--stats", workdir) ||
+            !measure_kernels()) {
+        return 2;
+    }
+
+    if (update) {
+        return !write_baseline(baseline);
+    }
+    failed = compare(&missing);
+    if (missing) {
+        fprintf(stderr, "\nMetrics measured here without a baseline "
+                "value to check against: %d\nRun make perf-baseline on "
+                "this machine and commit %s.\n", missing, baseline);
+    }
+    if (failed) {
+        printf("\n%d of %zu metrics regressed beyond their tolerance.\n"
+                "If this is expected, run make perf-baseline and commit "
+                "%s.\n", failed, METRICS, baseline);
+    } else if (!missing) {
+        printf("\nNo metric regressed.\n");
+    }
+    return failed || missing;
+}
@@ -0,0 +1,451 @@
+// Measure whole runs of id3al over a directory of files, with hardware
+// performance counters where the kernel allows them
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_RUNS 5
+#define MAX_JOBS 16
+
+enum cache_choice {
+    CACHE_WARM = 1,
+    CACHE_COLD = 2,
+    CACHE_BOTH = 3
+};
+
+struct counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const struct counter counters[] = {
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+#define COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+struct run {
+    long long wall_ns;
+    // -1 where a counter couldn't be opened
+    long long counts[COUNTERS];
+    struct rusage usage;
+};
+
+struct pipeline_options {
+    int json;
+    int runs;
+    enum cache_choice cache;
+    unsigned int jobs[MAX_JOBS];
+    int njobs;
+    const char *id3al;
+    const char *dir;
+    char **args;
+    int nargs;
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int open_counter(const struct counter *counter, pid_t pid) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->type;
+    attr.config = counter->config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    // Counting user space alone is allowed at perf_event_paranoid 2
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+            PERF_FLAG_FD_CLOEXEC);
+}
+
+// Find the regular files in dir, sorted by name
+// Return the number found, or -1 on failure
+static int list_files(const char *dir, char ***files, long long *bytes) {
+    struct dirent **entries;
+    struct stat st;
+    char *path;
+    int n, i, count = 0;
+
+    n = scandir(dir, &entries, NULL, alphasort);
+    if (n == -1) {
+        fprintf(stderr, "Couldn't read %s: %m\n", dir);
+        return -1;
+    }
+    *files = calloc(n ? n : 1, sizeof(**files));
+    *bytes = 0;
+    for (i = 0; i < n; i++) {
+        if (*files && asprintf(&path, "%s/%s", dir, entries[i]->d_name) !=
+                -1) {
+            if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+                (*files)[count++] = path;
+                *bytes += st.st_size;
+            } else {
+                free(path);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    if (*files == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    return count;
+}
+
+// Push the files out of the page cache so the next run reads the disk.
+// Dirty pages can't be dropped, so they are written back first.
+static void evict_files(char * const files[], int nfiles) {
+    int fd, i;
+
+    for (i = 0; i < nfiles; i++) {
+        fd = open(files[i], O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Run argv once with its output discarded, counting what it does
+// Return 1 on success, 0 otherwise
+static int run_once(char * const argv[], struct run *run) {
+    int fds[COUNTERS], go[2], status, null_fd, i, ret = 1;
+    long long start;
+    pid_t pid;
+    char c = 0;
+
+    if (pipe2(go, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return 0;
+    }
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        // Wait for the counters to be attached before starting
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1) {
+            _exit(127);
+        }
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(go[0]);
+
+    // Counters start at the exec, so the fork isn't counted
+    for (i = 0; i < COUNTERS; i++) {
+        fds[i] = open_counter(&counters[i], pid);
+    }
+    start = now_ns();
+    if (write(go[1], &c, 1) != 1) {
+        perror("write");
+        ret = 0;
+    }
+    close(go[1]);
+    if (wait4(pid, &status, 0, &run->usage) == -1) {
+        perror("wait4");
+        ret = 0;
+    }
+    run->wall_ns = now_ns() - start;
+    if (ret && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+        fprintf(stderr, "%s exited abnormally\n", argv[0]);
+        ret = 0;
+    }
+
+    for (i = 0; i < COUNTERS; i++) {
+        run->counts[i] = -1;
+        if (fds[i] != -1) {
+            if (read(fds[i], &run->counts[i], sizeof(run->counts[i])) !=
+                    sizeof(run->counts[i])) {
+                run->counts[i] = -1;
+            }
+            close(fds[i]);
+        }
+    }
+    return ret;
+}
+
+static int compare_runs(const void *a, const void *b) {
+    const struct run *x = a, *y = b;
+    return (x->wall_ns > y->wall_ns) - (x->wall_ns < y->wall_ns);
+}
+
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Print the median run of one configuration
+static void print_result(const struct pipeline_options *opts,
+        unsigned int jobs, int cold, int nfiles, long long bytes,
+        const struct run *run, int first) {
+    double wall = run->wall_ns / 1e9;
+    double cpu = seconds(run->usage.ru_utime) + seconds(run->usage.ru_stime);
+    long faults = run->usage.ru_minflt + run->usage.ru_majflt;
+    int i;
+
+    if (opts->json) {
+        printf("%s\n  {\"jobs\": %u, \"cache\": \"%s\", \"files\": %d, "
+                "\"bytes\": %lld, \"wall_s\": %.6f, \"files_per_s\": %.1f, "
+                "\"mb_per_s\": %.3f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+                "\"cpu_utilisation\": %.3f, \"major_faults\": %ld, "
+                "\"faults_per_file\": %.3f", first ? "" : ",", jobs,
+                cold ? "cold" : "warm", nfiles, bytes, wall, nfiles / wall,
+                bytes / 1e6 / wall, seconds(run->usage.ru_utime),
+                seconds(run->usage.ru_stime), cpu / wall,
+                run->usage.ru_majflt, (double)faults / nfiles);
+        for (i = 0; i < COUNTERS; i++) {
+            if (run->counts[i] == -1) {
+                printf(", \"%s_per_file\": null", counters[i].name);
+            } else {
+                printf(", \"%s_per_file\": %.1f", counters[i].name,
+                        (double)run->counts[i] / nfiles);
+            }
+        }
+        printf("}");
+        return;
+    }
+
+    if (jobs) {
+        printf("\n-j %u, ", jobs);
+    } else {
+        printf("\nDefault jobs, ");
+    }
+    printf("%s cache: %d files, %.1f MB\n", cold ? "cold" : "warm", nfiles,
+            bytes / 1e6);
+    printf("%24s: %12.3f ms\n", "wall", wall * 1e3);
+    printf("%24s: %12.1f\n", "files/s", nfiles / wall);
+    printf("%24s: %12.3f\n", "MB/s", bytes / 1e6 / wall);
+    printf("%24s: %12.3f ms user, %.3f ms sys\n", "cpu",
+            seconds(run->usage.ru_utime) * 1e3,
+            seconds(run->usage.ru_stime) * 1e3);
+    // Well under 1 per thread means the run was waiting on I/O
+    printf("%24s: %12.3f\n", "cpu utilisation", cpu / wall);
+    printf("%24s: %12.3f (%ld major in all)\n", "page faults/file",
+            (double)faults / nfiles, run->usage.ru_majflt);
+    for (i = 0; i < COUNTERS; i++) {
+        if (run->counts[i] == -1) {
+            printf("%20s/file: %12s\n", counters[i].name, "n/a");
+        } else {
+            printf("%20s/file: %12.1f\n", counters[i].name,
+                    (double)run->counts[i] / nfiles);
+        }
+    }
+}
+
+static void print_usage(const char *name, FILE *fp) {
+    fprintf(fp, "Usage: %s [--json] [--runs=RUNS] [--jobs=J[,J]...]\n"
+            "        [--cache=warm|cold|both] ID3AL DIR [ARG]...\n"
+            "Run ID3AL ARG... over every file in DIR, RUNS times for each\n"
+            "of the job counts given to -j and each cache state, and\n"
+            "report the median run. A cold cache is made by evicting the\n"
+            "files with posix_fadvise before each run.\n", name);
+}
+
+// Parse a list of job counts like 1,2,4
+// Return 1 on success, 0 otherwise
+static int parse_jobs(const char *arg, struct pipeline_options *opts) {
+    const char *p = arg;
+    char *end;
+    long val;
+
+    opts->njobs = 0;
+    while (*p && opts->njobs < MAX_JOBS) {
+        val = strtol(p, &end, 10);
+        if (end == p || val <= 0 || (*end && *end != ',')) {
+            return 0;
+        }
+        opts->jobs[opts->njobs++] = val;
+        p = *end ? end + 1 : end;
+    }
+    return *p == 0 && opts->njobs > 0;
+}
+
+static void parse_args(int argc, char *argv[],
+        struct pipeline_options *opts) {
+    static const struct option longopts[] = {
+        { "json", no_argument, NULL, 'J' },
+        { "runs", required_argument, NULL, 'r' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "cache", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->runs = DEFAULT_RUNS;
+    opts->cache = CACHE_WARM;
+    // Stop at ID3AL, so its own options are passed through
+    while ((opt = getopt_long(argc, argv, "+h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'J':
+                opts->json = 1;
+                break;
+            case 'r':
+                opts->runs = atoi(optarg);
+                if (opts->runs <= 0) {
+                    fprintf(stderr, "Invalid runs %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                if (!parse_jobs(optarg, opts)) {
+                    fprintf(stderr, "Invalid jobs %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                if (!strcmp(optarg, "warm")) {
+                    opts->cache = CACHE_WARM;
+                } else if (!strcmp(optarg, "cold")) {
+                    opts->cache = CACHE_COLD;
+                } else if (!strcmp(optarg, "both")) {
+                    opts->cache = CACHE_BOTH;
+                } else {
+                    fprintf(stderr, "Invalid cache %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_usage(argv[0], stdout);
+                exit(0);
+            default:
+                print_usage(argv[0], stderr);
+                exit(1);
+        }
+    }
+    if (argc - optind < 2) {
+        print_usage(argv[0], stderr);
+        exit(1);
+    }
+    opts->id3al = argv[optind];
+    opts->dir = argv[optind + 1];
+    opts->args = argv + optind + 2;
+    opts->nargs = argc - optind - 2;
+}
+
+int main(int argc, char *argv[]) {
+    struct pipeline_options opts;
+    struct run *runs;
+    char **files, **args, jobs_arg[16];
+    long long bytes;
+    int nfiles, nargs, cold, j, i, first = 1, ret = 0;
+
+    parse_args(argc, argv, &opts);
+    nfiles = list_files(opts.dir, &files, &bytes);
+    if (nfiles <= 0) {
+        fprintf(stderr, "No files in %s\n", opts.dir);
+        return 1;
+    }
+    // ID3AL [-j JOBS] ARG... FILE...
+    args = calloc(nfiles + opts.nargs + 4, sizeof(*args));
+    runs = calloc(opts.runs, sizeof(*runs));
+    if (args == NULL || runs == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    if (opts.njobs == 0) {
+        opts.jobs[opts.njobs++] = 0;
+    }
+
+    if (opts.json) {
+        printf("{\"command\": \"%s", opts.id3al);
+        for (i = 0; i < opts.nargs; i++) {
+            printf(" %s", opts.args[i]);
+        }
+        printf("\", \"runs\": %d, \"results\": [", opts.runs);
+    } else {
+        printf("%s", opts.id3al);
+        for (i = 0; i < opts.nargs; i++) {
+            printf(" %s", opts.args[i]);
+        }
+        printf(" over %s, median of %d runs\n", opts.dir, opts.runs);
+    }
+    for (j = 0; j < opts.njobs; j++) {
+        nargs = 0;
+        args[nargs++] = (char *)opts.id3al;
+        if (opts.jobs[j]) {
+            snprintf(jobs_arg, sizeof(jobs_arg), "-j%u", opts.jobs[j]);
+            args[nargs++] = jobs_arg;
+        }
+        memcpy(args + nargs, opts.args, opts.nargs * sizeof(*args));
+        nargs += opts.nargs;
+        memcpy(args + nargs, files, nfiles * sizeof(*args));
+        args[nargs + nfiles] = NULL;
+
+        for (cold = 0; cold < 2; cold++) {
+            if (!(opts.cache & (cold ? CACHE_COLD : CACHE_WARM))) {
+                continue;
+            }
+            // A warm run starts with every file already read once
+            if (!cold && !run_once(args, &runs[0])) {
+                ret = 1;
+                goto out;
+            }
+            for (i = 0; i < opts.runs; i++) {
+                if (cold) {
+                    evict_files(files, nfiles);
+                }
+                if (!run_once(args, &runs[i])) {
+                    ret = 1;
+                    goto out;
+                }
+            }
+            qsort(runs, opts.runs, sizeof(*runs), compare_runs);
+            print_result(&opts, opts.jobs[j], cold, nfiles, bytes,
+                    &runs[opts.runs / 2], first);
+            first = 0;
+            fflush(stdout);
+        }
+    }
+    if (opts.json) {
+        printf("\n]}\n");
+    }
+
+out:
+    for (i = 0; i < nfiles; i++) {
+        free(files[i]);
+    }
+    free(files);
+    free(args);
+    free(runs);
+    return ret;
+}
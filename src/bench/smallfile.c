@@ -0,0 +1,50 @@
+// Small tagged files for the benchmarks that run id3al itself
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "smallfile.h"
+
+// A tag with two ASCII text frames and a little padding
+static const uint8_t small_tag[] = {
+    'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x2B,
+    'T', 'I', 'T', '2', 0, 0, 0, 6, 0, 0, 0, 'T', 'i', 't', 'l', 'e',
+    'T', 'P', 'E', '1', 0, 0, 0, 7, 0, 0, 0, 'A', 'r', 't', 'i', 's', 't',
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Write the small tag followed by frames MPEG frame headers to a file
+// made unique from template, ending in XXXXXX
+// Returns its name, which must be freed, or NULL on failure
+char *write_small_file(const char *template, int frames) {
+    char *path;
+    uint8_t frame[4] = { 0xFF, 0xFB, 0x90, 0x00 };
+    int fd, i;
+
+    path = strdup(template);
+    if (path == NULL) {
+        return NULL;
+    }
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        free(path);
+        return NULL;
+    }
+    if (write(fd, small_tag, sizeof(small_tag)) != sizeof(small_tag)) {
+        perror("write");
+    }
+    for (i = 0; i < frames; i++) {
+        if (write(fd, frame, sizeof(frame)) != sizeof(frame)) {
+            perror("write");
+            break;
+        }
+    }
+    close(fd);
+    return path;
+}
@@ -0,0 +1,9 @@
+// Small tagged files for the benchmarks that run id3al itself
+// Copyright 2015 David Gloe.
+
+#ifndef _SMALLFILE_H
+#define _SMALLFILE_H
+
+char *write_small_file(const char *template, int frames);
+
+#endif
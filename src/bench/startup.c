@@ -0,0 +1,121 @@
+// Measure exec-to-exit latency of id3al on a single small file
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "smallfile.h"
+
+#define WARMUP_RUNS 10
+#define DEFAULT_RUNS 200
+
+extern char **environ;
+
+static int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Run the command once and return the elapsed time in nanoseconds,
+// or -1 on failure
+static long long run_once(char * const argv[],
+        posix_spawn_file_actions_t *actions) {
+    struct timespec start, end;
+    pid_t pid;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (posix_spawn(&pid, argv[0], actions, NULL, argv, environ)) {
+        perror("posix_spawn");
+        return -1;
+    }
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s exited abnormally\n", argv[0]);
+        return -1;
+    }
+    return (end.tv_sec - start.tv_sec) * 1000000000LL +
+        (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    posix_spawn_file_actions_t actions;
+    char *file = NULL, *args[3];
+    long long *times, total = 0;
+    int runs = DEFAULT_RUNS, i, ret = 0;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s ID3AL [FILE] [RUNS]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        file = strdup(argv[2]);
+    } else {
+        file = write_small_file("/tmp/id3al-startup-XXXXXX", 256);
+    }
+    if (file == NULL) {
+        return 1;
+    }
+    if (argc > 3) {
+        runs = atoi(argv[3]);
+        if (runs <= 0) {
+            fprintf(stderr, "Invalid run count %s\n", argv[3]);
+            return 1;
+        }
+    }
+    times = calloc(runs, sizeof(*times));
+    if (times == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    args[0] = argv[1];
+    args[1] = file;
+    args[2] = NULL;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+            O_WRONLY, 0);
+
+    for (i = 0; i < WARMUP_RUNS; i++) {
+        if (run_once(args, &actions) == -1) {
+            ret = 1;
+            goto out;
+        }
+    }
+    for (i = 0; i < runs; i++) {
+        times[i] = run_once(args, &actions);
+        if (times[i] == -1) {
+            ret = 1;
+            goto out;
+        }
+        total += times[i];
+    }
+    qsort(times, runs, sizeof(*times), compare_ns);
+
+    printf("startup latency over %d runs of %s %s\n", runs, args[0], file);
+    printf("    min: %8.1f us\n", times[0] / 1000.0);
+    printf(" median: %8.1f us\n", times[runs / 2] / 1000.0);
+    printf("    p99: %8.1f us\n", times[(runs * 99) / 100] / 1000.0);
+    printf("   mean: %8.1f us\n", total / 1000.0 / runs);
+
+out:
+    posix_spawn_file_actions_destroy(&actions);
+    if (argc == 2) {
+        unlink(file);
+    }
+    free(file);
+    free(times);
+    return ret;
+}
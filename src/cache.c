@@ -0,0 +1,490 @@
+// Implementation of the persistent metadata cache
+// Copyright 2015 David Gloe.
+//
+// The cache file is a header followed by records, each holding the
+// identity of a file when it was read and the output rendered for it.
+// Records are only ever appended, so a file that changes leaves a dead
+// record behind; the file is rewritten without them once they take up
+// more space than the live records.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+#define CACHE_MAGIC "ID3ALCCH"
+#define CACHE_MAGIC_SIZE 8
+// Bump whenever the rendered output changes so stale entries are dropped
+#define CACHE_VERSION 1
+#define CACHE_ALIGN 8
+#define CACHE_EMPTY ((size_t)-1)
+// Set in a slot whose record was superseded by one appended since
+#define CACHE_STALE 1
+
+struct cache_header {
+    char magic[CACHE_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t options;
+    uint64_t len;
+};
+
+struct metadata_cache {
+    char *path;
+    int fd;
+    uint64_t options;
+    uint8_t *map;
+    size_t map_len;
+    size_t *slots;      // Offsets of the newest records, or CACHE_EMPTY
+    size_t mask;
+    size_t live_bytes;
+    size_t dead_bytes;
+};
+
+static size_t record_size(uint64_t len) {
+    return sizeof(struct cache_record) +
+        (len + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+static uint64_t stat_mtime_ns(const struct stat *st) {
+    return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+static size_t key_slot(struct metadata_cache *cache, uint64_t dev,
+        uint64_t ino, uint64_t options) {
+    uint64_t key[3] = { dev, ino, options };
+
+    return hash64(key, sizeof(key), 0) & cache->mask;
+}
+
+// Find the slot for a file and options, which may be empty
+static size_t *find_slot(struct metadata_cache *cache, uint64_t dev,
+        uint64_t ino, uint64_t options) {
+    struct cache_record *rec;
+    size_t i;
+
+    i = key_slot(cache, dev, ino, options);
+    while (cache->slots[i] != CACHE_EMPTY) {
+        rec = (struct cache_record *)(cache->map +
+                (cache->slots[i] & ~CACHE_STALE));
+        if (rec->dev == dev && rec->ino == ino && rec->options == options) {
+            break;
+        }
+        i = (i + 1) & cache->mask;
+    }
+    return &cache->slots[i];
+}
+
+// Walk the records in the mapped file, calling fn on each complete one
+// Returns the offset just past the last complete record
+static size_t walk_records(uint8_t *map, size_t len,
+        void (*fn)(void *arg, size_t offset), void *arg) {
+    struct cache_record *rec;
+    size_t offset = sizeof(struct cache_header);
+
+    while (len - offset >= sizeof(*rec)) {
+        rec = (struct cache_record *)(map + offset);
+        if (rec->len > len - offset - sizeof(*rec) ||
+                record_size(rec->len) > len - offset) {
+            break;
+        }
+        if (fn) {
+            fn(arg, offset);
+        }
+        offset += record_size(rec->len);
+    }
+    return offset;
+}
+
+// Index a record, superseding any earlier one for the same file
+static void index_record(void *arg, size_t offset) {
+    struct metadata_cache *cache = arg;
+    struct cache_record *rec;
+    size_t *slot, size;
+
+    rec = (struct cache_record *)(cache->map + offset);
+    size = record_size(rec->len);
+    slot = find_slot(cache, rec->dev, rec->ino, rec->options);
+    if (*slot != CACHE_EMPTY) {
+        rec = (struct cache_record *)(cache->map + *slot);
+        cache->dead_bytes += record_size(rec->len);
+        cache->live_bytes -= record_size(rec->len);
+    }
+    *slot = offset;
+    cache->live_bytes += size;
+}
+
+static void count_record(void *arg, size_t offset) {
+    (*(size_t *)arg)++;
+}
+
+// Write a header to an empty or outdated cache file
+// Returns 1 on success, 0 otherwise
+static int init_cache_file(int fd) {
+    struct cache_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+    header.version = CACHE_VERSION;
+    if (ftruncate(fd, 0)) {
+        debug("ftruncate failed: %m");
+        return 0;
+    }
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        debug("pwrite failed: %m");
+        return 0;
+    }
+    return 1;
+}
+
+// Check that fd is still the file at path, and not one replaced since
+static int is_current(int fd, const char *path) {
+    struct stat fst, pst;
+
+    return fstat(fd, &fst) == 0 && stat(path, &pst) == 0 &&
+        fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino;
+}
+
+// Open the cache file and lock it shared. A file replaced by compaction
+// in another process between the open and the lock is opened again.
+// Returns the descriptor, or -1 on failure
+static int open_locked(const char *path) {
+    int fd;
+
+    while (1) {
+        fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            debug("Opening %s failed: %m", path);
+            return -1;
+        }
+        if (flock(fd, LOCK_SH)) {
+            debug("flock failed: %m");
+            close(fd);
+            return -1;
+        }
+        if (is_current(fd, path)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+// Map the cache file and index its records. Under an exclusive lock, a
+// file with an unknown format is discarded and any record left
+// incomplete by a crash cut off. Under a shared lock either one fails
+// the load, except that with in_use set an incomplete record is skipped,
+// as another process may still be appending it.
+// Returns 1 on success, -1 if the exclusive lock is needed, 0 otherwise
+static int load_cache(struct metadata_cache *cache, int exclusive,
+        int in_use) {
+    struct cache_header *header;
+    struct stat st;
+    size_t count = 0, size = 64, end, i;
+
+    if (fstat(cache->fd, &st)) {
+        debug("fstat failed: %m");
+        return 0;
+    }
+    if (st.st_size >= sizeof(*header)) {
+        cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                cache->fd, 0);
+        if (cache->map == MAP_FAILED) {
+            debug("mmap %zu bytes failed: %m", (size_t)st.st_size);
+            cache->map = NULL;
+            return 0;
+        }
+        cache->map_len = st.st_size;
+        header = (struct cache_header *)cache->map;
+        if (memcmp(header->magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) ||
+                header->version != CACHE_VERSION) {
+            debug("Discarding cache with unknown format");
+            munmap(cache->map, cache->map_len);
+            cache->map = NULL;
+            cache->map_len = 0;
+        }
+    }
+    if (cache->map == NULL && (!exclusive || !init_cache_file(cache->fd))) {
+        return exclusive ? 0 : -1;
+    }
+
+    end = sizeof(*header);
+    if (cache->map) {
+        end = walk_records(cache->map, cache->map_len, count_record, &count);
+    }
+    if (end < cache->map_len && !exclusive && !in_use) {
+        return -1;
+    }
+    while (size / 2 < count) {
+        size *= 2;
+    }
+    cache->slots = malloc(size * sizeof(*cache->slots));
+    if (cache->slots == NULL) {
+        debug("malloc %zu failed: %m", size * sizeof(*cache->slots));
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        cache->slots[i] = CACHE_EMPTY;
+    }
+    cache->mask = size - 1;
+    if (cache->map) {
+        walk_records(cache->map, cache->map_len, index_record, cache);
+        if (end < cache->map_len && exclusive &&
+                ftruncate(cache->fd, end)) {
+            debug("ftruncate failed: %m");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Drop what load_cache read, so the file can be loaded again
+static void unload_cache(struct metadata_cache *cache) {
+    if (cache->map) {
+        munmap(cache->map, cache->map_len);
+    }
+    free(cache->slots);
+    cache->map = NULL;
+    cache->map_len = 0;
+    cache->slots = NULL;
+    cache->live_bytes = 0;
+    cache->dead_bytes = 0;
+}
+
+// Open a cache of rendered output
+// Returns the cache, or NULL on failure
+struct metadata_cache *open_metadata_cache(const char *path,
+        uint64_t options) {
+    struct metadata_cache *cache;
+    int ret, in_use = 0;
+
+    assert(path);
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        debug("calloc %zu failed: %m", sizeof(*cache));
+        return NULL;
+    }
+    cache->options = options;
+    cache->path = strdup(path);
+    if (cache->path == NULL) {
+        debug("strdup failed: %m");
+        free(cache);
+        return NULL;
+    }
+    // Every process using the cache holds the lock shared, and appends
+    // whole records, so they can all run at once. Only setting up the
+    // file and cutting off a record left incomplete by a crash need it
+    // exclusively, and that isn't waited for, as the other holders may
+    // run for a long time. Compaction likewise only happens when no
+    // other process has the file open.
+    while (1) {
+        cache->fd = open_locked(path);
+        if (cache->fd == -1) {
+            free(cache->path);
+            free(cache);
+            return NULL;
+        }
+        ret = load_cache(cache, 0, in_use);
+        if (ret != -1) {
+            break;
+        }
+        unload_cache(cache);
+        if (!flock(cache->fd, LOCK_EX | LOCK_NB)) {
+            // Changing the lock drops the shared one first, so the file
+            // may have been replaced in between
+            if (is_current(cache->fd, path)) {
+                ret = load_cache(cache, 1, 0) && !flock(cache->fd, LOCK_SH);
+                break;
+            }
+        } else if (errno == EWOULDBLOCK) {
+            // Another process has the file, and is either setting it up
+            // or appending the incomplete record
+            in_use = 1;
+        } else {
+            debug("flock failed: %m");
+            ret = 0;
+            break;
+        }
+        close(cache->fd);
+    }
+    if (!ret) {
+        close_metadata_cache(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Find the output cached for a file
+// Return 1 and set data and len if found, 0 otherwise
+int metadata_cache_lookup(struct metadata_cache *cache, const struct stat *st,
+        const uint8_t **data, size_t *len) {
+    struct cache_record *rec;
+    size_t *slot;
+
+    assert(cache);
+    assert(st);
+    assert(data);
+    assert(len);
+
+    slot = find_slot(cache, st->st_dev, st->st_ino, cache->options);
+    if (*slot == CACHE_EMPTY || (*slot & CACHE_STALE)) {
+        return 0;
+    }
+    rec = (struct cache_record *)(cache->map + *slot);
+    if (rec->size != st->st_size || rec->mtime_ns != stat_mtime_ns(st)) {
+        return 0;
+    }
+    *data = (uint8_t *)(rec + 1);
+    *len = rec->len;
+    return 1;
+}
+
+// Append the output rendered for a file with a single write, so records
+// from processes sharing the cache don't interleave
+// Return 1 on success, 0 otherwise
+int metadata_cache_store(struct metadata_cache *cache, const struct stat *st,
+        const uint8_t *data, size_t len) {
+    struct cache_record rec, *old;
+    uint8_t pad[CACHE_ALIGN] = { 0 };
+    struct iovec iov[3];
+    size_t *slot, size;
+    ssize_t written;
+
+    assert(cache);
+    assert(st);
+    assert(data || len == 0);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.dev = st->st_dev;
+    rec.ino = st->st_ino;
+    rec.size = st->st_size;
+    rec.mtime_ns = stat_mtime_ns(st);
+    rec.options = cache->options;
+    rec.len = len;
+    size = record_size(len);
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = pad;
+    iov[2].iov_len = size - sizeof(rec) - len;
+    written = writev(cache->fd, iov, 3);
+    if (written != size) {
+        debug("writev failed: %m");
+        return 0;
+    }
+
+    // The new record isn't mapped, so it can't replace an old one in
+    // the table, but the old one is dead from now on
+    slot = find_slot(cache, rec.dev, rec.ino, rec.options);
+    if (*slot != CACHE_EMPTY && !(*slot & CACHE_STALE)) {
+        old = (struct cache_record *)(cache->map + *slot);
+        cache->dead_bytes += record_size(old->len);
+        cache->live_bytes -= record_size(old->len);
+        *slot |= CACHE_STALE;
+    }
+    cache->live_bytes += size;
+    return 1;
+}
+
+struct compact_state {
+    struct metadata_cache *cache;
+    FILE *fp;
+    int ok;
+};
+
+// Copy a record to the compacted file if it is the newest for its file
+static void compact_record(void *arg, size_t offset) {
+    struct compact_state *state = arg;
+    struct cache_record *rec;
+
+    rec = (struct cache_record *)(state->cache->map + offset);
+    if (state->ok && *find_slot(state->cache, rec->dev, rec->ino,
+                rec->options) == offset) {
+        state->ok = fwrite(rec, record_size(rec->len), 1, state->fp) == 1;
+    }
+}
+
+// Rewrite the cache file without dead records. Skipped if another
+// process is using the cache.
+// Returns 1 on success, 0 otherwise
+static int compact_cache(struct metadata_cache *cache) {
+    struct compact_state state;
+    struct cache_header header;
+    char *tmp_path;
+    int fd;
+
+    if (flock(cache->fd, LOCK_EX | LOCK_NB)) {
+        return 1;
+    }
+    // Pick up records appended by other processes
+    unload_cache(cache);
+    if (load_cache(cache, 1, 0) != 1 || cache->map == NULL) {
+        return 0;
+    }
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", cache->path) == -1) {
+        debug("asprintf failed");
+        return 0;
+    }
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd == -1) {
+        debug("mkstemp %s failed: %m", tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    state.cache = cache;
+    state.fp = fdopen(fd, "w");
+    state.ok = state.fp != NULL;
+    if (state.fp == NULL) {
+        debug("fdopen failed: %m");
+        close(fd);
+    } else {
+        memcpy(&header, cache->map, sizeof(header));
+        state.ok = fwrite(&header, sizeof(header), 1, state.fp) == 1;
+        walk_records(cache->map, cache->map_len, compact_record, &state);
+        state.ok = !fchmod(fd, 0644) && !fclose(state.fp) && state.ok;
+    }
+    if (!state.ok || rename(tmp_path, cache->path)) {
+        debug("Writing %s failed: %m", tmp_path);
+        unlink(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    free(tmp_path);
+    return 1;
+}
+
+void close_metadata_cache(struct metadata_cache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->map && cache->dead_bytes > cache->live_bytes) {
+        compact_cache(cache);
+    }
+    if (cache->map) {
+        munmap(cache->map, cache->map_len);
+    }
+    free(cache->slots);
+    close(cache->fd);
+    free(cache->path);
+    free(cache);
+}
@@ -0,0 +1,181 @@
+// Structural validation of tags, without decoding or printing them
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+struct check_scan {
+    char * const *files;
+    struct work_queue queue;
+    enum id3v2_check_status *results;
+};
+
+const char *check_status_str(enum id3v2_check_status status) {
+    switch (status) {
+        case ID3V2_CHECK_OK:
+            return "OK";
+        case ID3V2_CHECK_FAILED:
+            return "Check failed";
+        case ID3V2_CHECK_UNREADABLE:
+            return "Unreadable";
+        case ID3V2_CHECK_NO_TAG:
+            return "No tag";
+        case ID3V2_CHECK_BAD_HEADER:
+            return "Bad tag header";
+        case ID3V2_CHECK_BAD_FRAME:
+            return "Bad frame";
+        case ID3V2_CHECK_BAD_CRC:
+            return "CRC mismatch";
+        case ID3V2_CHECK_RESTRICTED:
+            return "Breaks tag restrictions";
+    }
+    return "Unknown";
+}
+
+// Check a frame against the tag's restrictions. Only transformed frames
+// are decoded, and only when there are restrictions to check.
+static enum id3v2_check_status check_frame(struct id3v2_header *header,
+        struct id3v2_frame_header *fheader) {
+    int ret;
+
+    if (!verify_id3v2_frame_id(fheader->id)) {
+        return ID3V2_CHECK_BAD_FRAME;
+    }
+    if (!header->extheader_present || !header->extheader.restrictions ||
+            !frame_has_encoding(fheader->id) || fheader->encrypted) {
+        return ID3V2_CHECK_OK;
+    }
+    if (fheader->data_offset != -1) {
+        ret = verify_id3v2_frame_restrictions(header, fheader, fheader->data,
+                fheader->raw_len);
+    } else {
+        if (!get_id3v2_frame_data(header, fheader)) {
+            return ID3V2_CHECK_BAD_FRAME;
+        }
+        ret = verify_id3v2_frame_restrictions(header, fheader, fheader->data,
+                fheader->data_len);
+        free_id3v2_frame_data(header, fheader);
+    }
+    return ret ? ID3V2_CHECK_OK : ID3V2_CHECK_RESTRICTED;
+}
+
+// Walk the frame headers of a tag, which stops early at a frame that
+// doesn't fit, and check that only zeros follow the last frame
+static enum id3v2_check_status check_frames(struct id3v2_header *header) {
+    struct id3v2_frame_header fheader;
+    enum id3v2_check_status status;
+    size_t i;
+
+    while (get_id3v2_frame_header(header, &fheader)) {
+        status = check_frame(header, &fheader);
+        if (status != ID3V2_CHECK_OK) {
+            return status;
+        }
+    }
+    if (header->i + header->padding != header->frame_data_len) {
+        return ID3V2_CHECK_BAD_FRAME;
+    }
+    for (i = header->i; i < header->frame_data_len; i++) {
+        if (header->frame_data[i]) {
+            debug("Padding byte %zu is %#x, not 0", i, header->frame_data[i]);
+            return ID3V2_CHECK_BAD_FRAME;
+        }
+    }
+    return ID3V2_CHECK_OK;
+}
+
+// Check that the tag of a file is sound and keeps to the spec
+enum id3v2_check_status check_id3v2_file(const char *path) {
+    struct id3v2_header header;
+    enum id3v2_check_status status;
+    char id[ID3V2_HEADER_ID_SIZE];
+    uint64_t timer;
+    int fd;
+
+    assert(path);
+
+    timer = PROFILE_START();
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    PROFILE_END(PROFILE_OPEN, timer);
+    if (fd == -1) {
+        debug("open %s failed: %m", path);
+        return ID3V2_CHECK_UNREADABLE;
+    }
+    // The ID is only filled in once a valid header is found, so failing
+    // without one means there is no tag, unless the file starts with
+    // one too damaged to be found
+    header.id[0] = 0;
+    if (!get_id3v2_tag(fd, &header)) {
+        if (!header.id[0] && pread(fd, id, ID3V2_HEADER_ID_SIZE, 0) ==
+                ID3V2_HEADER_ID_SIZE &&
+                !memcmp(id, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
+            header.id[0] = id[0];
+        }
+        close(fd);
+        return header.id[0] ? ID3V2_CHECK_BAD_HEADER : ID3V2_CHECK_NO_TAG;
+    }
+    header.verify_crc = 1;
+    status = check_frames(&header);
+    if (status == ID3V2_CHECK_OK && !verify_id3v2_crc(&header)) {
+        status = ID3V2_CHECK_BAD_CRC;
+    } else if (status == ID3V2_CHECK_OK &&
+            !verify_id3v2_tag_restrictions(&header)) {
+        status = ID3V2_CHECK_RESTRICTED;
+    }
+    free_id3v2_tag(&header);
+    close(fd);
+    return status;
+}
+
+static void *check_worker(void *arg) {
+    struct check_scan *scan = arg;
+    int i;
+
+    while ((i = next_work(&scan->queue)) >= 0) {
+        scan->results[i] = check_id3v2_file(scan->files[i]);
+    }
+    return NULL;
+}
+
+// Check files with workers threads, or one per CPU if workers is 0.
+// Nothing is printed for files that pass. Each that fails is printed to
+// fp with the reason, in the order given.
+// Returns the status of the first file that failed, or ID3V2_CHECK_OK
+int check_files(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp) {
+    struct check_scan scan;
+    int ret = ID3V2_CHECK_OK, j;
+
+    assert(files);
+    assert(fp);
+
+    scan.files = files;
+    init_work_queue(&scan.queue, nfiles);
+    scan.results = calloc(nfiles ? nfiles : 1, sizeof(*scan.results));
+    if (scan.results == NULL) {
+        debug("calloc failed: %m");
+        return ID3V2_CHECK_FAILED;
+    }
+    if (!run_pool(check_worker, &scan, 0, pool_size(workers, 1, nfiles))) {
+        free(scan.results);
+        return ID3V2_CHECK_FAILED;
+    }
+
+    for (j = 0; j < nfiles; j++) {
+        if (scan.results[j] != ID3V2_CHECK_OK) {
+            fprintf(fp, "%s: %s\n", files[j],
+                    check_status_str(scan.results[j]));
+            if (ret == ID3V2_CHECK_OK) {
+                ret = scan.results[j];
+            }
+        }
+    }
+    free(scan.results);
+    return ret;
+}
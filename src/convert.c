@@ -2,6 +2,7 @@
 // Copyright 2015 David Gloe.
 
 #include <string.h>
+#include <strings.h>
 #include "id3v2.h"
 
 // Convert a boolean value to a string
@@ -12,6 +13,26 @@ const char *boolstr(int b) {
     return "False";
 }
 
+// Check whether the data of a frame starts with a text encoding byte
+int frame_has_encoding(const char *id) {
+    static const char *frames[] = {
+        ID3V2_FRAME_ID_APIC, ID3V2_FRAME_ID_COMM, ID3V2_FRAME_ID_COMR,
+        ID3V2_FRAME_ID_GEOB, ID3V2_FRAME_ID_OWNE, ID3V2_FRAME_ID_SYLT,
+        ID3V2_FRAME_ID_USER, ID3V2_FRAME_ID_USLT, ID3V2_FRAME_ID_WXXX, NULL
+    };
+    int i;
+
+    if (id[0] == 'T') {
+        return 1;
+    }
+    for (i = 0; frames[i]; i++) {
+        if (!strcmp(id, frames[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Get a descriptive title for a frame
 const char *frame_title(struct id3v2_frame_header *fheader) {
     static const char *frames[] = {
@@ -423,3 +444,23 @@ const char *pic_type_str(enum id3v2_APIC_picture_type pic_type) {
     }
     return "Unknown";
 }
+
+// Get a file name extension for a MIME type
+const char *mime_ext(const char *mime_type) {
+    static const char *types[] = {
+        "image/jpeg", "image/jpg", "image/png", "image/gif", "image/bmp",
+        "image/tiff", "image/webp", "JPG", "PNG", "GIF", "BMP"
+    };
+    static const char *exts[] = {
+        "jpg", "jpg", "png", "gif", "bmp",
+        "tiff", "webp", "jpg", "png", "gif", "bmp"
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(const char *); i++) {
+        if (!strcasecmp(mime_type, types[i])) {
+            return exts[i];
+        }
+    }
+    return "bin";
+}
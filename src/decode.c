@@ -10,6 +10,7 @@
 #include "unicode/ustring.h"
 #include "zlib.h"
 #include "id3v2.h"
+#include "probes.h"
 
 // Get the length of a terminated encoded string in bytes,
 // including the terminator.
@@ -24,15 +25,36 @@ size_t strlen_enc(const char *str, enum id3v2_encoding enc) {
     return strlen(str) + 1;
 }
 
+// Get the length of an encoded string terminated within max bytes,
+// including the terminator, or 0 if it isn't
+size_t strnlen_enc(const char *str, size_t max, enum id3v2_encoding enc) {
+    const uint8_t *data = (const uint8_t *)str;
+    size_t i;
+
+    switch (enc) {
+        case ID3V2_ENCODING_UTF_16:
+        case ID3V2_ENCODING_UTF_16BE:
+            for (i = 0; i + 1 < max; i += sizeof(UChar)) {
+                if (data[i] == 0 && data[i + 1] == 0) {
+                    return i + sizeof(UChar);
+                }
+            }
+            return 0;
+        default:
+            break;
+    }
+    i = strnlen(str, max);
+    return i < max ? i + 1 : 0;
+}
+
 
 // Parse raw data into a header
 // Return 1 on success, 0 otherwise
 static int parse_id3v2_header(const uint8_t *fdata, size_t *i,
         struct id3v2_header *header) {
+    const uint8_t *id = fdata + *i;
     uint8_t flags;
 
-    memcpy(header->id, fdata, ID3V2_HEADER_ID_SIZE);
-    header->id[ID3V2_HEADER_ID_SIZE] = 0;
     *i += ID3V2_HEADER_ID_SIZE;
     header->version = fdata[*i];
     (*i)++;
@@ -48,21 +70,52 @@ static int parse_id3v2_header(const uint8_t *fdata, size_t *i,
     (*i)++;
     header->tag_size = byte_swap_32(*(uint32_t *)(fdata + *i));
     *i += sizeof(uint32_t);
-    if (header->version >= 4) {
-        if (!is_synchsafe(header->tag_size)) {
-            debug("Tag size %"PRIx32" not synchsafe",
-                    header->tag_size);
-            return 0;
-        }
-        header->tag_size = from_synchsafe(header->tag_size);
+    // Unlike frame sizes, the tag size is synchsafe in every version
+    if (!is_synchsafe(header->tag_size)) {
+        debug("Tag size %"PRIx32" not synchsafe", header->tag_size);
+        return 0;
     }
+    header->tag_size = from_synchsafe(header->tag_size);
     header->i = 0;
+    // The ID is only filled in for a valid header, so callers can tell a
+    // damaged tag from stray "ID3" bytes
+    memcpy(header->id, id, ID3V2_HEADER_ID_SIZE);
+    header->id[ID3V2_HEADER_ID_SIZE] = 0;
+    return 1;
+}
+
+// Parse the rest of a 2.3 extended header, after its size: 2 flag bytes,
+// the padding size, and the CRC if its flag is set
+// Return 1 if successful, 0 otherwise
+static int parse_id3v23_extended_header(const uint8_t *fdata, size_t *i,
+        struct id3v2_extended_header *extheader) {
+    uint32_t min = ID3V23_EXTENDED_FLAGS_SIZE + sizeof(uint32_t);
+
+    extheader->flag_size = 0;
+    extheader->update = 0;
+    extheader->restrictions = 0;
+    extheader->crc_present = fdata[*i] & ID3V23_EXTENDED_HEADER_CRC_BIT;
+    *i += ID3V23_EXTENDED_FLAGS_SIZE;
+    if (extheader->crc_present) {
+        min += sizeof(uint32_t);
+    }
+    if (extheader->size < min) {
+        debug("Extended header size %"PRIu32" < %"PRIu32,
+                extheader->size, min);
+        return 0;
+    }
+    extheader->padding_size = byte_swap_32(*(uint32_t *)(fdata + *i));
+    *i += sizeof(uint32_t);
+    if (extheader->crc_present) {
+        extheader->crc = byte_swap_32(*(uint32_t *)(fdata + *i));
+        *i += sizeof(uint32_t);
+    }
     return 1;
 }
 
 // Parse raw data into an extended header
 // Return 1 on success, 0 otherwise
-static int parse_id3v2_extended_header(uint8_t *fdata, size_t *i,
+static int parse_id3v2_extended_header(const uint8_t *fdata, size_t *i,
         struct id3v2_header *header) {
     uint8_t flags;
     struct id3v2_extended_header *extheader = &header->extheader;
@@ -77,6 +130,10 @@ static int parse_id3v2_extended_header(uint8_t *fdata, size_t *i,
         extheader->size = from_synchsafe(extheader->size);
     }
     *i += sizeof(uint32_t);
+    if (header->version < 4) {
+        return parse_id3v23_extended_header(fdata, i, extheader);
+    }
+    extheader->padding_size = 0;
     extheader->flag_size = fdata[*i];
     (*i)++;
     flags = fdata[*i];
@@ -93,31 +150,20 @@ static int parse_id3v2_extended_header(uint8_t *fdata, size_t *i,
         (*i)++;
     }
     if (extheader->crc_present) {
-        if (header->version >= 4) {
-            if (fdata[*i] != 5) {
-                debug("CRC flag data length %"PRIu8" not 5", fdata[*i]);
-                return 0;
-            }
-            (*i)++;
-            extheader->crc = byte_swap_32(*(uint32_t *)(fdata + *i));
-            if (!is_synchsafe(extheader->crc)) {
-                debug("Extended header crc %"PRIx32" not synchsafe",
-                        extheader->crc);
-                return 0;
-            }
-            extheader->crc = from_synchsafe(extheader->crc);
-            *i += sizeof(uint32_t);
-            extheader->crc += fdata[*i] << 29;
-            (*i)++;
-        } else {
-            if (fdata[*i] != 4) {
-                debug("CRC flag data length %"PRIu8" not 4", fdata[*i]);
-                return 0;
-            }
-            (*i)++;
-            extheader->crc = byte_swap_32(*(uint32_t *)(fdata + *i));
-            *i += sizeof(uint32_t);
+        if (fdata[*i] != 5) {
+            debug("CRC flag data length %"PRIu8" not 5", fdata[*i]);
+            return 0;
         }
+        (*i)++;
+        // 35 synchsafe bits, the first byte holding the top 4
+        if (fdata[*i] & 0xF0 || !is_synchsafe(byte_swap_32(
+                        *(uint32_t *)(fdata + *i + 1)))) {
+            debug("Extended header crc not synchsafe");
+            return 0;
+        }
+        extheader->crc = (uint32_t)fdata[*i] << 28 |
+            from_synchsafe(byte_swap_32(*(uint32_t *)(fdata + *i + 1)));
+        *i += 5;
     }
     if (extheader->restrictions) {
         if (fdata[*i] != 1) {
@@ -160,30 +206,156 @@ static int parse_id3v2_footer(uint8_t *fdata, size_t *i,
     footer->footer_present = flags & ID3V2_HEADER_FOOTER_BIT;
     (*i)++;
     footer->tag_size = byte_swap_32(*(uint32_t *)(fdata + *i));
-    if (header->version >= 4) {
-        if (!is_synchsafe(footer->tag_size)) {
-            debug("Footer tag size %"PRIx32" not synchsafe",
-                    footer->tag_size);
+    if (!is_synchsafe(footer->tag_size)) {
+        debug("Footer tag size %"PRIx32" not synchsafe", footer->tag_size);
+        return 0;
+    }
+    footer->tag_size = from_synchsafe(footer->tag_size);
+    return 1;
+}
+
+// Get the length of the extended header of a tag, or 0 if it has none
+static size_t get_extheader_len(const struct id3v2_header *header) {
+    if (!header->extheader_present) {
+        return 0;
+    }
+    // The 2.4 size counts the size field itself, earlier ones don't
+    if (header->version < 4) {
+        return header->extheader.size + sizeof(uint32_t);
+    }
+    return header->extheader.size;
+}
+
+// Get the length of the frames and padding of a tag from its headers.
+// The tag size leaves out the header and footer.
+static ssize_t get_frame_data_len(const struct id3v2_header *header) {
+    return (ssize_t)header->tag_size - (ssize_t)get_extheader_len(header);
+}
+
+// Parse the header and any extended header of a tag at the start of the
+// len bytes at data, without reading its frames. frame_data is left NULL
+// with frame_data_offset counted from data.
+// Return 1 if successful, 0 otherwise
+int parse_id3v2_tag_header(const uint8_t *data, size_t len,
+        struct id3v2_header *header) {
+    ssize_t frames_len;
+    size_t i = 0;
+
+    assert(data);
+    assert(header);
+
+    if (len < ID3V2_HEADER_SIZE ||
+            memcmp(data, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
+        debug("No tag at start of data");
+        return 0;
+    }
+    if (!parse_id3v2_header(data, &i, header)) {
+        return 0;
+    } else if (header->version > ID3V2_SUPPORTED_VERSION) {
+        debug("Tag version %"PRIu8" higher than supported version %d",
+                header->version, ID3V2_SUPPORTED_VERSION);
+        return 0;
+    }
+    if (header->extheader_present) {
+        if (len < ID3V2_HEADER_SIZE + ID3V2_EXTENDED_HEADER_MAX_SIZE) {
+            debug("Extended header truncated");
+            return 0;
+        }
+        if (!parse_id3v2_extended_header(data, &i, header)) {
             return 0;
         }
-        footer->tag_size = from_synchsafe(footer->tag_size);
+        i = ID3V2_HEADER_SIZE + get_extheader_len(header);
     }
+    frames_len = get_frame_data_len(header);
+    if (frames_len <= 0) {
+        debug("Frame data length %zd invalid", frames_len);
+        return 0;
+    }
+    header->frame_data = NULL;
+    header->frame_data_len = frames_len;
+    header->frame_data_offset = i;
+    header->offset = 0;
+    header->resync_data = NULL;
+    header->fd = -1;
+    header->frames = 0;
+    header->padding = 0;
+    header->map = NULL;
+    header->budget = ID3V2_DEFAULT_BUDGET;
+    header->verify_crc = 0;
+    header->frames_crc = 0;
+    header->frames_crc_done = 0;
     return 1;
 }
 
+// Search the len bytes at data for the first valid tag header, which is
+// parsed into header
+// Return the offset just past the header, or 0 if there is none
+size_t find_id3v2_header(const uint8_t *data, size_t len,
+        struct id3v2_header *header) {
+    size_t i, end;
+
+    assert(data);
+    assert(header);
+
+    for (i = 0; i + ID3V2_HEADER_SIZE <= len; i++) {
+        if (!memcmp(data + i, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
+            end = i;
+            if (parse_id3v2_header(data, &end, header)) {
+                return end;
+            }
+        }
+    }
+    return 0;
+}
+
+// Before 2.4, unsynchronisation covers the whole tag after its header,
+// frame headers and sizes included, so it's undone before anything else
+// is read. The len bytes of the tag at data are copied, resynchronized,
+// into header->resync_data against the tag's memory budget.
+// Return the resynchronized length, or 0 on failure
+static size_t resync_tag(struct id3v2_header *header, const uint8_t *data,
+        size_t len) {
+    size_t sync_len;
+
+    if (header->tag_size > len) {
+        debug("Unexpected eof in tag");
+        return 0;
+    } else if (header->tag_size == 0) {
+        debug("Tag size 0 invalid");
+        return 0;
+    }
+    sync_len = resync_len(data, header->tag_size);
+    if (sync_len > header->budget) {
+        debug("Tag needs %zu bytes, over the %zu budget", sync_len,
+                header->budget);
+        return 0;
+    }
+    header->resync_data = profile_malloc(sync_len);
+    if (header->resync_data == NULL) {
+        debug("malloc %zu failed: %m", sync_len);
+        return 0;
+    }
+    resynchronize(data, header->tag_size, header->resync_data);
+    header->budget -= sync_len;
+    return sync_len;
+}
+
 // Find and decode the next ID3v2 tag in the file
-// Caller must free the frame data
+// Caller must release the tag with free_id3v2_tag
 // Return 1 if successful, 0 otherwise
 int get_id3v2_tag(int fd, struct id3v2_header *header) {
     struct stat st;
     void *fmap;
-    size_t i;
+    uint8_t *tag;
+    size_t i, start, tag_len, base = 0;
     ssize_t len;
-    int found_header, ret;
+    uint64_t timer;
+    int ret;
 
     assert(header);
 
     // Map the fd for easy parsing
+    timer = PROFILE_START();
     ret = fstat(fd, &st);
     if (ret == -1) {
         debug("fstat failed: %m");
@@ -194,116 +366,202 @@ int get_id3v2_tag(int fd, struct id3v2_header *header) {
         debug("mmap %zu bytes failed: %m", st.st_size);
         return 0;
     }
+    PROFILE_END(PROFILE_MAP, timer);
+    ID3AL_PROBE2(tag__open, fd, st.st_size);
+    PROFILE_COUNT(PROFILE_FILES, 1);
+    PROFILE_COUNT(PROFILE_BYTES_MAPPED, st.st_size);
 
     // Search for the header
-    for (i = 0; i < st.st_size - ID3V2_HEADER_ID_SIZE; i++) {
-        if (!strncmp(fmap + i, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
-            // We've found a header, read it in and check it
-            if (parse_id3v2_header(fmap, &i, header)) {
-                found_header = 1;
-                break;
-            } else {
-                continue;
-            }
-        }
-    }
-    if (!found_header) {
+    timer = PROFILE_START();
+    i = find_id3v2_header(fmap, st.st_size, header);
+    PROFILE_END(PROFILE_SCAN, timer);
+    PROFILE_COUNT(PROFILE_BYTES_SCANNED, i ? i : st.st_size);
+    if (i == 0) {
         debug("No tag found in file");
         munmap(fmap, st.st_size);
         return 0;
     }
+    ID3AL_PROBE4(tag__header, header->version, header->revision,
+            header->tag_size, ID3AL_TAG_FLAGS(header));
+    header->offset = i - ID3V2_HEADER_SIZE;
+    header->budget = ID3V2_DEFAULT_BUDGET;
+    header->resync_data = NULL;
 
-    // Read the extended header if it exists
-    if (header->extheader_present) {
-        if (!parse_id3v2_extended_header(fmap, &i, header)) {
+    // The rest of the tag is read from the map, or its resynchronized copy
+    tag = fmap;
+    tag_len = st.st_size;
+    if (header->unsynchronization && header->version < 4) {
+        tag_len = resync_tag(header, tag + i, st.st_size - i);
+        if (tag_len == 0) {
             munmap(fmap, st.st_size);
             return 0;
         }
+        tag = header->resync_data;
+        base = i;
+        i = 0;
     }
 
-    // Next read the frame data
-    len = header->tag_size;
+    // Read the extended header if it exists
     if (header->extheader_present) {
-        len -= from_synchsafe(header->extheader.size);
-    }
-    if (header->footer_present) {
-        len -= ID3V2_FOOTER_SIZE;
+        if (tag_len - i < ID3V2_EXTENDED_HEADER_MAX_SIZE) {
+            debug("Extended header truncated");
+            goto fail;
+        }
+        start = i;
+        if (!parse_id3v2_extended_header(tag, &i, header)) {
+            goto fail;
+        }
+        i = start + get_extheader_len(header);
     }
+
+    // Next read the frame data
+    len = header->resync_data ? (ssize_t)tag_len - (ssize_t)i :
+        get_frame_data_len(header);
     if (len <= 0) {
         debug("Frame data length %zd invalid", len);
-        munmap(fmap, st.st_size);
-        return 0;
+        goto fail;
     }
-    if (i > st.st_size - len) {
+    if (i > tag_len - len) {
         debug("Unexpected eof in frame data");
-        munmap(fmap, st.st_size);
-        return 0;
-    }
-    header->frame_data = malloc(len);
-    if (header->frame_data == NULL) {
-        debug("malloc %zd failed: %m", len);
-        munmap(fmap, st.st_size);
-        return 0;
+        goto fail;
     }
+    // Frames are read in place, so the mapping lives as long as the tag
+    header->frame_data = tag + i;
     header->frame_data_len = len;
-    memcpy(header->frame_data, fmap + i, len);
-    i += len;
+    header->frame_data_offset = base + i;
+    header->fd = fd;
+    header->frames = 0;
+    header->padding = 0;
+    header->verify_crc = 0;
+    header->frames_crc = 0;
+    header->frames_crc_done = 0;
+    i = header->resync_data ? base + header->tag_size : i + len;
 
     // Finally read the footer
     if (header->footer_present) {
         if (i > st.st_size - ID3V2_FOOTER_SIZE) {
             debug("Unexpected eof in footer");
-            munmap(fmap, st.st_size);
-            return 0;
+            goto fail;
         }
         if (strncmp(fmap + i, ID3V2_FOOTER_IDENTIFIER, ID3V2_FOOTER_ID_SIZE)) {
             debug("Expected footer not found");
-            munmap(fmap, st.st_size);
-            return 0;
+            goto fail;
         }
         if (!parse_id3v2_footer(fmap, &i, header)) {
-            munmap(fmap, st.st_size);
-            return 0;
+            goto fail;
         }
     }
 
-    return verify_id3v2_header(header);
+    header->map = fmap;
+    header->map_len = st.st_size;
+    if (!verify_id3v2_header(header)) {
+        free_id3v2_tag(header);
+        return 0;
+    }
+    return 1;
+
+fail:
+    profile_free(header->resync_data);
+    header->resync_data = NULL;
+    munmap(fmap, st.st_size);
+    return 0;
 }
 
-// Get the next id3v2 frame from the tag.
-//
-// idheader is a pointer the id3v2 header structure
-// header will contain the next frame header information
-//
-// Returns 1 if a frame was retrieved successfully, 0 otherwise
-int get_id3v2_frame(struct id3v2_header *idheader,
-        struct id3v2_frame_header *header) {
-    uint8_t *synchronized;
-    uint8_t flags;
-    size_t sync_len;
-    int ret;
-    uLongf uncompresslen;
+// Get the number of bytes a tag takes up in a file, from the
+// ID3V2_HEADER_SIZE bytes at data, which are its header or its footer
+// Return the size including the header and any footer, or 0 if data
+// isn't a valid header or footer
+size_t get_id3v2_tag_extent(const uint8_t *data) {
+    struct id3v2_header header;
+    size_t i = 0;
+    int footer;
 
-    assert(idheader);
-    assert(header);
+    assert(data);
 
-    // We've reached the end of the tag
-    if (idheader->i + ID3V2_FRAME_HEADER_SIZE > idheader->frame_data_len) {
+    footer = !memcmp(data, ID3V2_FOOTER_IDENTIFIER, ID3V2_FOOTER_ID_SIZE);
+    if (!footer && memcmp(data, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
+        return 0;
+    }
+    if (data[3] == 0xFF || data[4] == 0xFF) {
         return 0;
-    } else if (idheader->frame_data[idheader->i] == 0) {
-        // We've found padding
+    }
+    if (!parse_id3v2_header(data, &i, &header)) {
         return 0;
     }
+    if (footer || header.footer_present) {
+        return ID3V2_HEADER_SIZE + header.tag_size + ID3V2_FOOTER_SIZE;
+    }
+    return ID3V2_HEADER_SIZE + header.tag_size;
+}
+
+// zlib's allocations are counted with the rest
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    return profile_malloc((size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf address) {
+    profile_free(address);
+}
+
+// Inflate a compressed frame into data, which holds datalen bytes.
+// The zlib stream is only initialized once a compressed frame is seen,
+// and is reset rather than reallocated for each later frame.
+// Returns a zlib status code, Z_OK on success
+static int inflate_frame(uint8_t *compressed, size_t len, uint8_t *data,
+        size_t datalen, uLongf *outlen) {
+    static __thread z_stream stream;
+    static __thread int initialized;
+    int ret;
+
+    if (!initialized) {
+        stream.zalloc = zlib_alloc;
+        stream.zfree = zlib_free;
+        ret = inflateInit(&stream);
+        if (ret != Z_OK) {
+            return ret;
+        }
+        initialized = 1;
+    } else {
+        ret = inflateReset(&stream);
+        if (ret != Z_OK) {
+            return ret;
+        }
+    }
+
+    stream.next_in = compressed;
+    stream.avail_in = len;
+    stream.next_out = data;
+    stream.avail_out = datalen;
+    ret = inflate(&stream, Z_FINISH);
+    *outlen = stream.total_out;
+    if (ret == Z_STREAM_END) {
+        return Z_OK;
+    } else if (ret == Z_OK) {
+        // Output didn't fit, so the data length is wrong
+        return Z_BUF_ERROR;
+    }
+    return ret;
+}
+
+// Parse a frame header and its flag data from the len bytes at data,
+// which must hold at least ID3V2_FRAME_HEADER_SIZE, for a tag of version.
+// header->raw_len is set to the length of the data that follows.
+// Return the length of the header with its flag data, or 0 on failure
+size_t parse_id3v2_frame_header(const uint8_t *data, size_t len,
+        uint8_t version, struct id3v2_frame_header *header) {
+    uint8_t flags;
+    size_t i = 0;
+
+    assert(data);
+    assert(len >= ID3V2_FRAME_HEADER_SIZE);
+    assert(header);
 
-    // Parse frame header
-    memcpy(header->id, idheader->frame_data + idheader->i,
-            ID3V2_FRAME_ID_SIZE);
+    memcpy(header->id, data, ID3V2_FRAME_ID_SIZE);
     header->id[ID3V2_FRAME_ID_SIZE] = 0;
-    idheader->i += ID3V2_FRAME_ID_SIZE;
-    header->size = byte_swap_32(*(uint32_t *)(idheader->frame_data +
-                idheader->i));
-    idheader->i += sizeof(uint32_t);
-    if (idheader->version >= 4) {
+    i += ID3V2_FRAME_ID_SIZE;
+    header->size = byte_swap_32(*(uint32_t *)(data + i));
+    i += sizeof(uint32_t);
+    if (version >= 4) {
         if (!is_synchsafe(header->size)) {
             debug("Frame size %"PRIx32" not synchsafe", header->size);
             return 0;
@@ -312,13 +570,13 @@ int get_id3v2_frame(struct id3v2_header *idheader,
     }
 
     // Read flags
-    flags = idheader->frame_data[idheader->i];
-    (idheader->i)++;
+    flags = data[i];
+    i++;
     header->tag_alter_pres = flags & ID3V2_FRAME_HEADER_TAG_ALTER_BIT;
     header->file_alter_pres = flags & ID3V2_FRAME_HEADER_FILE_ALTER_BIT;
     header->read_only = flags & ID3V2_FRAME_HEADER_READ_ONLY_BIT;
-    flags = idheader->frame_data[idheader->i];
-    (idheader->i)++;
+    flags = data[i];
+    i++;
     header->group_id_present = flags & ID3V2_FRAME_HEADER_GROUPING_BIT;
     header->compressed = flags & ID3V2_FRAME_HEADER_COMPRESSION_BIT;
     header->encrypted = flags & ID3V2_FRAME_HEADER_ENCRYPTION_BIT;
@@ -327,16 +585,24 @@ int get_id3v2_frame(struct id3v2_header *idheader,
 
     // Read the grouping id if it exists
     if (header->group_id_present) {
-        header->group_id = idheader->frame_data[idheader->i];
-        (idheader->i)++;
+        if (i + 1 > len) {
+            debug("Unexpected end of tag in frame %s flags", header->id);
+            return 0;
+        }
+        header->group_id = data[i];
+        i++;
     }
 
     // Get the data length if it exists
+    header->data_len = 0;
     if (header->data_length_present) {
-        header->data_len = byte_swap_32(*(uint32_t *)(idheader->frame_data +
-                    idheader->i));
-        idheader->i += sizeof(uint32_t);
-        if (idheader->version >= 4) {
+        if (i + sizeof(uint32_t) > len) {
+            debug("Unexpected end of tag in frame %s flags", header->id);
+            return 0;
+        }
+        header->data_len = byte_swap_32(*(uint32_t *)(data + i));
+        i += sizeof(uint32_t);
+        if (version >= 4) {
             if (!is_synchsafe(header->data_len)) {
                 debug("Frame data length %"PRIx32" not synchsafe",
                         header->data_len);
@@ -346,69 +612,264 @@ int get_id3v2_frame(struct id3v2_header *idheader,
         }
     }
 
+    // The frame size counts everything that follows the flags
+    if (i - ID3V2_FRAME_HEADER_SIZE > header->size) {
+        debug("Frame size %"PRIu32" too small for flag data", header->size);
+        return 0;
+    }
+    header->raw_len = header->size - (i - ID3V2_FRAME_HEADER_SIZE);
+    return i;
+}
+
+// Get the next id3v2 frame header from the tag, skipping over the data.
+//
+// idheader is a pointer the id3v2 header structure
+// header will contain the next frame header information, with data
+//     pointing at the frame data as stored in the tag
+//
+// Returns 1 if a frame was retrieved successfully, 0 otherwise
+int get_id3v2_frame_header(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header) {
+    size_t start, len;
+
+    assert(idheader);
+    assert(header);
+
+    // We've reached the end of the tag, or padding which fills the rest
+    if (idheader->i + ID3V2_FRAME_HEADER_SIZE > idheader->frame_data_len ||
+            idheader->frame_data[idheader->i] == 0) {
+        idheader->padding = idheader->frame_data_len - idheader->i;
+        // The 2.4 CRC covers the padding too, the 2.3 one stops before it
+        if (idheader->verify_crc && !idheader->frames_crc_done) {
+            if (idheader->version >= 4) {
+                idheader->frames_crc = crc32(idheader->frames_crc,
+                        idheader->frame_data + idheader->i,
+                        idheader->padding);
+            }
+            idheader->frames_crc_done = 1;
+        }
+        return 0;
+    }
+
+    start = idheader->i;
+    len = parse_id3v2_frame_header(idheader->frame_data + start,
+            idheader->frame_data_len - start, idheader->version, header);
+    if (len == 0) {
+        return 0;
+    }
+
     // Make sure the data fits
-    if (idheader->i + header->size > idheader->frame_data_len) {
+    if (start + ID3V2_FRAME_HEADER_SIZE + header->size >
+            idheader->frame_data_len) {
         debug("Index %zu tag data %"PRIu32" overflows frame %zu",
-                idheader->i, header->size, idheader->frame_data_len);
+                start, header->size, idheader->frame_data_len);
         return 0;
     }
+    idheader->i = start + len;
+    header->data = idheader->frame_data + idheader->i;
+    len = header->raw_len;
 
     if (!verify_id3v2_frame_header(header)) {
         return 0;
     }
 
-    // Resynchronize if needed
-    if (header->unsynchronized || idheader->unsynchronization) {
-        sync_len = resync_len(idheader->frame_data + idheader->i, header->size);
-        synchronized = malloc(sync_len);
-        if (synchronized == NULL) {
-            debug("malloc %zu failed: %m", sync_len);
-            return 0;
-        }
-        resynchronize(idheader->frame_data + idheader->i, header->size,
-                synchronized);
+    // Only untransformed data can be read straight from the file
+    if (header->unsynchronized || idheader->unsynchronization ||
+            header->compressed) {
+        header->data_offset = -1;
     } else {
-        sync_len = header->size;
-        synchronized = malloc(sync_len);
+        header->data_offset = idheader->frame_data_offset + idheader->i;
+    }
+
+    idheader->i += len;
+    idheader->frames++;
+    PROFILE_COUNT(PROFILE_FRAMES, 1);
+    // Each frame is added while it's being read, rather than in a pass
+    // of its own over the tag
+    if (idheader->verify_crc) {
+        idheader->frames_crc = crc32(idheader->frames_crc,
+                idheader->frame_data + start, idheader->i - start);
+    }
+
+    return 1;
+}
+
+// Allocate len bytes of frame data against the tag's memory budget, plus
+// a terminator for text that runs to the end of the frame
+// Returns the data, or NULL if it doesn't fit the budget or on failure
+static uint8_t *alloc_frame_data(struct id3v2_header *idheader,
+        const char *id, size_t len) {
+    uint8_t *data;
+
+    if (len > idheader->budget) {
+        debug("Frame %s needs %zu bytes, over the %zu left in the budget",
+                id, len, idheader->budget);
+        return NULL;
+    }
+    data = profile_malloc(len + ID3V2_DATA_TERMINATOR_SIZE);
+    if (data == NULL) {
+        debug("malloc %zu failed: %m", len + ID3V2_DATA_TERMINATOR_SIZE);
+        return NULL;
+    }
+    memset(data + len, 0, ID3V2_DATA_TERMINATOR_SIZE);
+    idheader->budget -= len;
+    return data;
+}
+
+static void release_frame_data(struct id3v2_header *idheader, uint8_t *data,
+        size_t len) {
+    profile_free(data);
+    idheader->budget += len;
+}
+
+// Decode the data of a frame, between its tracepoints
+static int decode_frame_data(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header) {
+    uint8_t *raw, *synchronized, *data;
+    size_t sync_len, sync_alloc = 0;
+    uint64_t timer;
+    int ret;
+    uLongf uncompresslen;
+
+    assert(idheader);
+    assert(header);
+
+    raw = header->data;
+    header->alloc_len = 0;
+    PROFILE_COUNT(PROFILE_BYTES_DECODED, header->raw_len);
+
+    // Resynchronize if needed, unless the whole tag already was
+    if (header->unsynchronized ||
+            (idheader->unsynchronization && !idheader->resync_data)) {
+        sync_len = resync_len(raw, header->raw_len);
+        synchronized = alloc_frame_data(idheader, header->id, sync_len);
         if (synchronized == NULL) {
-            debug("malloc %zu failed: %m", sync_len);
             return 0;
         }
-        memcpy(synchronized, idheader->frame_data + idheader->i, header->size);
+        timer = PROFILE_START();
+        resynchronize(raw, header->raw_len, synchronized);
+        PROFILE_END(PROFILE_RESYNC, timer);
+        ID3AL_PROBE3(frame__resync, header->id, header->raw_len, sync_len);
+        sync_alloc = sync_len;
+    } else {
+        sync_len = header->raw_len;
+        synchronized = raw;
     }
 
     // Uncompress if needed
     // Note verify_id3v2_frame_header ensures data length is present
     if (header->compressed) {
-        header->data = malloc(header->data_len);
-        if (header->data == NULL) {
-            debug("malloc %"PRIu32" failed: %m", header->data_len);
-            free(synchronized);
+        // No zlib stream expands by more than this, so a larger claimed
+        // length can only be a lie meant to exhaust memory
+        if (header->data_len / ID3V2_MAX_INFLATE_RATIO > sync_len) {
+            debug("Frame %s claims %"PRIu32" bytes from %zu compressed",
+                    header->id, header->data_len, sync_len);
+            release_frame_data(idheader, sync_alloc ? synchronized : NULL,
+                    sync_alloc);
+            return 0;
+        }
+        data = alloc_frame_data(idheader, header->id, header->data_len);
+        if (data == NULL) {
+            release_frame_data(idheader, sync_alloc ? synchronized : NULL,
+                    sync_alloc);
             return 0;
         }
 
-        uncompresslen = header->data_len;
-        ret = uncompress(header->data, &uncompresslen, synchronized, sync_len);
-        free(synchronized);
+        timer = PROFILE_START();
+        ret = inflate_frame(synchronized, sync_len, data, header->data_len,
+                &uncompresslen);
+        PROFILE_END(PROFILE_INFLATE, timer);
+        ID3AL_PROBE4(frame__inflate, header->id, sync_len, uncompresslen, ret);
+        release_frame_data(idheader, sync_alloc ? synchronized : NULL,
+                sync_alloc);
         if (ret != Z_OK) {
-            debug("uncompress failed: %s", zError(ret));
-            free(header->data);
+            debug("inflate failed: %s", zError(ret));
+            release_frame_data(idheader, data, header->data_len);
             return 0;
         } else if (uncompresslen != header->data_len) {
             debug("uncompressed length mismatch: %lu != %"PRIu32,
                     uncompresslen, header->data_len);
-            free(header->data);
+            release_frame_data(idheader, data, header->data_len);
             return 0;
         }
-    } else {
+        header->data = data;
+        header->alloc_len = header->data_len;
+    } else if (sync_alloc) {
         header->data = synchronized;
         header->data_len = sync_len;
+        header->alloc_len = sync_alloc;
+    } else if (sync_len > ID3V2_COPY_THRESHOLD) {
+        // Large frames are read in place from the mapped tag
+        header->data_len = sync_len;
+    } else {
+        header->data = alloc_frame_data(idheader, header->id, sync_len);
+        if (header->data == NULL) {
+            header->data = raw;
+            return 0;
+        }
+        memcpy(header->data, raw, sync_len);
+        header->data_len = sync_len;
+        header->alloc_len = sync_len;
     }
-    idheader->i += header->size;
-
     return 1;
 }
 
+// Decode the data of a frame from get_id3v2_frame_header.
+//
+// header will have data replaced with resynchronized, uncompressed
+//     frame data, to be released with free_id3v2_frame_data, and
+//     data_len set to its length
+//
+// Returns 1 if the data was decoded successfully, 0 otherwise
+int get_id3v2_frame_data(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header) {
+    int ret;
+
+    ID3AL_PROBE3(frame__start, header->id, header->raw_len,
+            ID3AL_FRAME_FLAGS(header));
+    ret = decode_frame_data(idheader, header);
+    ID3AL_PROBE3(frame__end, header->id, header->data_len, ret);
+    return ret;
+}
+
+// Release the data of a frame from get_id3v2_frame_data
+void free_id3v2_frame_data(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header) {
+    assert(idheader);
+    assert(header);
+
+    if (header->alloc_len) {
+        release_frame_data(idheader, header->data, header->alloc_len);
+        header->alloc_len = 0;
+    }
+    header->data = NULL;
+}
+
+// Release a tag from get_id3v2_tag
+void free_id3v2_tag(struct id3v2_header *header) {
+    assert(header);
+
+    if (header->map) {
+        munmap(header->map, header->map_len);
+        header->map = NULL;
+        profile_free(header->resync_data);
+        header->resync_data = NULL;
+    }
+    header->frame_data = NULL;
+}
+
+// Get the next id3v2 frame from the tag.
+//
+// idheader is a pointer the id3v2 header structure
+// header will contain the next frame header information
+//
+// Returns 1 if a frame was retrieved successfully, 0 otherwise
+int get_id3v2_frame(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header) {
+    return get_id3v2_frame_header(idheader, header) &&
+        get_id3v2_frame_data(idheader, header);
+}
+
 enum id3v2_restriction_tag_size get_tag_size_restriction(uint8_t flags) {
     return (flags & ID3V2_RESTRICTION_TAG_SIZE_BITS) >> 6;
 }
@@ -431,33 +892,57 @@ enum id3v2_restriction_image_size get_image_size_restriction(uint8_t flags) {
     return (flags & ID3V2_RESTRICTION_IMAGE_SIZE_BITS);
 }
 
-int parse_AENC_frame(uint8_t *fdata, struct id3v2_frame_AENC *frame) {
+int parse_AENC_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_AENC *frame) {
     size_t i;
-    frame->owner_id = (char *)fdata;
-    i = strlen(frame->owner_id) + 1;
-    frame->preview_start = *(uint16_t *)(fdata + i);
+
+    assert(header);
+    assert(frame);
+
+    frame->owner_id = (char *)header->data;
+    i = strnlen_enc(frame->owner_id, header->data_len,
+            ID3V2_ENCODING_ISO_8859_1);
+    if (i == 0 || header->data_len - i < 2 * sizeof(uint16_t)) {
+        return 0;
+    }
+    frame->preview_start = *(uint16_t *)(header->data + i);
     i += sizeof(uint16_t);
-    frame->preview_length = *(uint16_t *)(fdata + i);
+    frame->preview_length = *(uint16_t *)(header->data + i);
     i += sizeof(uint16_t);
-    frame->encryption_info = fdata + i;
+    frame->encryption_info = header->data + i;
+    frame->encryption_info_len = header->data_len - i;
     return 1;
 }
 
 int parse_APIC_frame(struct id3v2_frame_header *header,
         struct id3v2_frame_APIC *frame) {
-    size_t i = 0;
+    size_t i = 0, len;
 
     assert(header);
     assert(frame);
 
+    if (header->data_len < 1) {
+        return 0;
+    }
     frame->encoding = header->data[i];
     i++;
     frame->mime_type = (char *)(header->data + i);
-    i += strlen(frame->mime_type) + 1;
+    len = strnlen_enc(frame->mime_type, header->data_len - i,
+            ID3V2_ENCODING_ISO_8859_1);
+    // The picture type follows
+    if (len == 0 || len == header->data_len - i) {
+        return 0;
+    }
+    i += len;
     frame->picture_type = header->data[i];
     i++;
     frame->description = (char *)(header->data + i);
-    i += strlen_enc(frame->description, frame->encoding);
+    len = strnlen_enc(frame->description, header->data_len - i,
+            frame->encoding);
+    if (len == 0) {
+        return 0;
+    }
+    i += len;
     frame->picture = header->data + i;
     frame->picture_len = header->data_len - i;
     return 1;
@@ -465,53 +950,116 @@ int parse_APIC_frame(struct id3v2_frame_header *header,
 
 int parse_COMM_frame(struct id3v2_frame_header *header,
         struct id3v2_frame_COMM *frame) {
-    size_t i = 0;
+    size_t i = 0, len;
 
     assert(header);
     assert(frame);
 
+    if (header->data_len < 1 + ID3V2_LANGUAGE_ID_SIZE) {
+        return 0;
+    }
     frame->encoding = header->data[i];
     i++;
     memcpy(frame->language, header->data + i, ID3V2_LANGUAGE_ID_SIZE);
     frame->language[ID3V2_LANGUAGE_ID_SIZE] = 0;
     i += ID3V2_LANGUAGE_ID_SIZE;
     frame->content_descriptor = (char *)(header->data + i);
-    i += strlen_enc(frame->content_descriptor, frame->encoding);
+    len = strnlen_enc(frame->content_descriptor, header->data_len - i,
+            frame->encoding);
+    if (len == 0) {
+        return 0;
+    }
+    i += len;
     frame->comment = (char *)(header->data + i);
     frame->comment_len = header->data_len - i;
     return 1;
 }
 
-int parse_UFID_frame(uint8_t *fdata, struct id3v2_frame_UFID *frame) {
-    frame->owner = (char *)fdata;
-    frame->id = fdata + strlen(frame->owner) + 1;
+int parse_UFID_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_UFID *frame) {
+    size_t len;
+
+    assert(header);
+    assert(frame);
+
+    frame->owner = (char *)header->data;
+    len = strnlen_enc(frame->owner, header->data_len,
+            ID3V2_ENCODING_ISO_8859_1);
+    if (len == 0) {
+        return 0;
+    }
+    frame->id = header->data + len;
+    frame->id_len = header->data_len - len;
     return 1;
 }
 
 // Parse frames T000-TZZZ, excluding TXXX
-int parse_text_frame(uint8_t *fdata, struct id3v2_frame_text *frame) {
-    frame->encoding = *fdata;
-    frame->text = (char *)(fdata + 1);
+int parse_text_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_text *frame) {
+    assert(header);
+    assert(frame);
+
+    if (header->data_len < 1) {
+        return 0;
+    }
+    frame->encoding = header->data[0];
+    frame->text = (char *)(header->data + 1);
+    frame->text_len = header->data_len - 1;
     return 1;
 }
 
-int parse_TXXX_frame(uint8_t *fdata, struct id3v2_frame_TXXX *frame) {
-    frame->encoding = *fdata;
-    frame->description = (char *)(fdata + 1);
-    frame->value = (char *)(fdata + strlen(frame->description) + 2);
+int parse_TXXX_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_TXXX *frame) {
+    size_t len;
+
+    assert(header);
+    assert(frame);
+
+    if (header->data_len < 1) {
+        return 0;
+    }
+    frame->encoding = header->data[0];
+    frame->description = (char *)(header->data + 1);
+    len = strnlen_enc(frame->description, header->data_len - 1,
+            frame->encoding);
+    if (len == 0) {
+        return 0;
+    }
+    frame->value = frame->description + len;
+    frame->value_len = header->data_len - 1 - len;
     return 1;
 }
 
 // Parse frames W000-WZZZ, excluding WXXX
-int parse_url_frame(uint8_t *fdata, struct id3v2_frame_url *frame) {
-    frame->url = (char *)fdata;
+int parse_url_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_url *frame) {
+    assert(header);
+    assert(frame);
+
+    frame->url = (char *)header->data;
+    frame->url_len = header->data_len;
     return 1;
 }
 
-int parse_WXXX_frame(uint8_t *fdata, struct id3v2_frame_WXXX *frame) {
-    frame->encoding = *fdata;
-    frame->description = (char *)(fdata + 1);
-    frame->url = (char *)(fdata + 1 + strlen(frame->description));
+int parse_WXXX_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_WXXX *frame) {
+    size_t len;
+
+    assert(header);
+    assert(frame);
+
+    if (header->data_len < 1) {
+        return 0;
+    }
+    frame->encoding = header->data[0];
+    frame->description = (char *)(header->data + 1);
+    len = strnlen_enc(frame->description, header->data_len - 1,
+            frame->encoding);
+    if (len == 0) {
+        return 0;
+    }
+    frame->url = frame->description + len;
+    frame->url_len = header->data_len - 1 - len;
     return 1;
 }
 
@@ -0,0 +1,220 @@
+// Implementation of ID3v2 tag writing functions
+// Copyright 2015 David Gloe.
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+#include "id3v2.h"
+
+static uint8_t *put_synchsafe(uint8_t *p, uint32_t val) {
+    val = byte_swap_32(to_synchsafe(val));
+    memcpy(p, &val, sizeof(val));
+    return p + sizeof(val);
+}
+
+// Write a tag header or footer, whose ID is given
+static uint8_t *put_header(uint8_t *p, const char *id,
+        const struct id3v2_header *header) {
+    memcpy(p, id, ID3V2_HEADER_ID_SIZE);
+    p += ID3V2_HEADER_ID_SIZE;
+    *p++ = header->version;
+    *p++ = header->revision;
+    *p++ = (header->extheader_present ? ID3V2_HEADER_EXTENDED_HEADER_BIT : 0) |
+        (header->experimental ? ID3V2_HEADER_EXPERIMENTAL_BIT : 0) |
+        (header->footer_present ? ID3V2_HEADER_FOOTER_BIT : 0);
+    return put_synchsafe(p, header->tag_size);
+}
+
+// Get the length of an extended header, including its size field
+static size_t extheader_len(const struct id3v2_extended_header *extheader) {
+    return sizeof(uint32_t) + 1 + ID3V2_EXTENDED_FLAG_SIZE +
+        (extheader->update ? 1 : 0) + (extheader->crc_present ? 6 : 0) +
+        (extheader->restrictions ? 2 : 0);
+}
+
+// Write an extended header with the CRC of the frames and padding at
+// frames, len bytes long
+static uint8_t *put_extheader(uint8_t *p,
+        const struct id3v2_extended_header *extheader, const uint8_t *frames,
+        size_t len) {
+    uint32_t crc;
+
+    p = put_synchsafe(p, extheader->size);
+    *p++ = ID3V2_EXTENDED_FLAG_SIZE;
+    *p++ = (extheader->update ? ID3V2_EXTENDED_HEADER_UPDATE_BIT : 0) |
+        (extheader->crc_present ? ID3V2_EXTENDED_HEADER_CRC_BIT : 0) |
+        (extheader->restrictions ?
+         ID3V2_EXTENDED_HEADER_TAG_RESTRICTIONS_BIT : 0);
+    if (extheader->update) {
+        *p++ = 0;
+    }
+    if (extheader->crc_present) {
+        // 35 synchsafe bits, the first byte holding the top 4
+        crc = crc32(crc32(0L, Z_NULL, 0), frames, len);
+        *p++ = 5;
+        *p++ = crc >> 28;
+        p = put_synchsafe(p, crc & ID3V2_MAX_SIZE);
+    }
+    if (extheader->restrictions) {
+        *p++ = 1;
+        *p++ = extheader->tag_size_restrict << 6 |
+            extheader->text_enc_restrict << 5 |
+            extheader->text_size_restrict << 3 |
+            extheader->img_enc_restrict << 2 |
+            extheader->img_size_restrict;
+    }
+    return p;
+}
+
+// Get the length of a frame's header with its flag data
+static size_t frame_header_len(const struct id3v2_frame_header *frame) {
+    return ID3V2_FRAME_HEADER_SIZE + (frame->group_id_present ? 1 : 0) +
+        (frame->data_length_present ? sizeof(uint32_t) : 0);
+}
+
+// Write a frame, unsynchronising its data if it's flagged for that
+static uint8_t *put_frame(uint8_t *p, const struct id3v2_frame_header *frame) {
+    memcpy(p, frame->id, ID3V2_FRAME_ID_SIZE);
+    p = put_synchsafe(p + ID3V2_FRAME_ID_SIZE, frame->size);
+    *p++ = (frame->tag_alter_pres ? ID3V2_FRAME_HEADER_TAG_ALTER_BIT : 0) |
+        (frame->file_alter_pres ? ID3V2_FRAME_HEADER_FILE_ALTER_BIT : 0) |
+        (frame->read_only ? ID3V2_FRAME_HEADER_READ_ONLY_BIT : 0);
+    *p++ = (frame->group_id_present ? ID3V2_FRAME_HEADER_GROUPING_BIT : 0) |
+        (frame->unsynchronized ?
+         ID3V2_FRAME_HEADER_UNSYNCHRONIZATION_BIT : 0) |
+        (frame->data_length_present ? ID3V2_FRAME_HEADER_DATA_LENGTH_BIT : 0);
+    if (frame->group_id_present) {
+        *p++ = frame->group_id;
+    }
+    if (frame->data_length_present) {
+        p = put_synchsafe(p, frame->data_len);
+    }
+    if (frame->unsynchronized) {
+        unsynchronize(frame->data, frame->data_len, p);
+        // Data ending in $FF gets a $00, so it can't combine with what
+        // follows into a false sync
+        if (frame->data[frame->data_len - 1] == 0xFF) {
+            p[frame->raw_len - 1] = 0;
+        }
+    } else if (frame->data_len) {
+        memcpy(p, frame->data, frame->data_len);
+    }
+    return p + frame->raw_len;
+}
+
+// Work out the layout of a tag, filling in the sizes of header, its
+// extended header and frames
+// Return the bytes the whole tag takes, or 0 if it can't be written
+size_t size_id3v2_tag(struct id3v2_header *header,
+        struct id3v2_frame_header *frames, size_t nframes, size_t padding) {
+    size_t i, len, total = 0;
+
+    assert(header);
+    assert(frames || nframes == 0);
+
+    if (header->version != ID3V2_SUPPORTED_VERSION) {
+        debug("Only version %d tags can be written, not %"PRIu8,
+                ID3V2_SUPPORTED_VERSION, header->version);
+        return 0;
+    } else if (header->footer_present && padding) {
+        debug("A tag with a footer can't have padding");
+        return 0;
+    }
+
+    if (header->extheader_present) {
+        header->extheader.size = extheader_len(&header->extheader);
+        header->extheader.flag_size = ID3V2_EXTENDED_FLAG_SIZE;
+        total += header->extheader.size;
+    }
+    for (i = 0; i < nframes; i++) {
+        if (frames[i].compressed || frames[i].encrypted) {
+            debug("Frame %s can't be written compressed or encrypted",
+                    frames[i].id);
+            return 0;
+        }
+        // Only frames holding false syncs are unsynchronised, and they
+        // carry their decoded length
+        len = frames[i].data_len > 1 ?
+            unsync_len(frames[i].data, frames[i].data_len) :
+            frames[i].data_len;
+        frames[i].unsynchronized = len > frames[i].data_len;
+        if (frames[i].unsynchronized) {
+            frames[i].data_length_present = 1;
+            len += frames[i].data[frames[i].data_len - 1] == 0xFF;
+        }
+        frames[i].raw_len = len;
+        len += frame_header_len(&frames[i]) - ID3V2_FRAME_HEADER_SIZE;
+        if (len > ID3V2_MAX_SIZE) {
+            debug("Frame %s of %zu bytes is too large", frames[i].id, len);
+            return 0;
+        }
+        frames[i].size = len;
+        total += ID3V2_FRAME_HEADER_SIZE + len;
+    }
+    total += padding;
+    if (total > ID3V2_MAX_SIZE) {
+        debug("Tag of %zu bytes is too large", total);
+        return 0;
+    }
+    // Frames are unsynchronised one by one instead
+    header->unsynchronization = 0;
+    header->tag_size = total;
+    return ID3V2_HEADER_SIZE + total +
+        (header->footer_present ? ID3V2_FOOTER_SIZE : 0);
+}
+
+// Write a tag laid out by size_id3v2_tag into buf, which must hold the
+// len bytes it returned
+void encode_id3v2_tag(const struct id3v2_header *header,
+        const struct id3v2_frame_header *frames, size_t nframes,
+        uint8_t *buf, size_t len) {
+    uint8_t *p, *ext = NULL, *start;
+    size_t i;
+
+    assert(header);
+    assert(buf);
+
+    p = put_header(buf, ID3V2_FILE_IDENTIFIER, header);
+    // The CRC covers the frames, so the extended header comes last
+    if (header->extheader_present) {
+        ext = p;
+        p += header->extheader.size;
+    }
+    start = p;
+    for (i = 0; i < nframes; i++) {
+        p = put_frame(p, &frames[i]);
+    }
+    if (header->footer_present) {
+        len -= ID3V2_FOOTER_SIZE;
+        put_header(buf + len, ID3V2_FOOTER_IDENTIFIER, header);
+    }
+    memset(p, 0, buf + len - p);
+    if (ext) {
+        put_extheader(ext, &header->extheader, start, buf + len - start);
+    }
+}
+
+// Write a tag with the given frames and padding into one allocation. The
+// sizes and flags size_id3v2_tag works out are filled in.
+// Return the tag, to be freed, with its length in len, or NULL on failure
+uint8_t *serialize_id3v2_tag(struct id3v2_header *header,
+        struct id3v2_frame_header *frames, size_t nframes, size_t padding,
+        size_t *len) {
+    uint8_t *buf;
+
+    assert(len);
+
+    *len = size_id3v2_tag(header, frames, nframes, padding);
+    if (*len == 0) {
+        return NULL;
+    }
+    buf = malloc(*len);
+    if (buf == NULL) {
+        debug("malloc %zu failed: %m", *len);
+        return NULL;
+    }
+    encode_id3v2_tag(header, frames, nframes, buf, *len);
+    return buf;
+}
@@ -0,0 +1,407 @@
+// Implementation of embedded object extraction
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+#define DEFAULT_EXTRACT_NAME "id3al-XXXXXX"
+#define TEMPLATE_CHARS "XXXXXX"
+
+// The store index is a header followed by the key of every object, its
+// content hash combined with its extension
+#define STORE_INDEX_NAME "index"
+#define STORE_INDEX_MAGIC "ID3ALIDX"
+#define STORE_INDEX_MAGIC_SIZE 8
+#define STORE_INDEX_VERSION 2
+#define STORE_MIN_CAPACITY 65536
+
+struct store_index_header {
+    char magic[STORE_INDEX_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct extract_store {
+    char *dir;
+    int index_fd;
+    struct hashset *set;
+};
+
+// Expand a file name pattern for an extracted object
+//     %f is the source file name without directories or extension
+//     %i is the index of the frame within the tag
+//     %e is the extension for the object type
+//     %% is a literal percent sign
+// A trailing XXXXXX is replaced with a unique string when the file is
+// created, as with mkstemp.
+// Returns the path of the file, which must be freed, or NULL on failure
+static char *expand_name(struct extract_options *ex, const char *ext) {
+    const char *pattern, *source, *dot, *p;
+    char *name;
+    size_t namelen;
+    FILE *fp;
+
+    pattern = ex->name ? ex->name : DEFAULT_EXTRACT_NAME;
+    source = ex->source ? ex->source : "";
+    p = strrchr(source, '/');
+    if (p) {
+        source = p + 1;
+    }
+    dot = strrchr(source, '.');
+    if (dot == NULL || dot == source) {
+        dot = source + strlen(source);
+    }
+
+    fp = open_memstream(&name, &namelen);
+    if (fp == NULL) {
+        debug("open_memstream failed: %m");
+        return NULL;
+    }
+    if (ex->dir) {
+        fprintf(fp, "%s/", ex->dir);
+    }
+    for (p = pattern; *p; p++) {
+        if (*p != '%') {
+            fputc(*p, fp);
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'f':
+                fprintf(fp, "%.*s", (int)(dot - source), source);
+                break;
+            case 'i':
+                fprintf(fp, "%u", ex->index);
+                break;
+            case 'e':
+                fputs(ext, fp);
+                break;
+            case '%':
+                fputc('%', fp);
+                break;
+            default:
+                debug("Unknown conversion %%%c in %s", *p, pattern);
+                fclose(fp);
+                free(name);
+                return NULL;
+        }
+    }
+    if (fclose(fp)) {
+        debug("fclose failed: %m");
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+// Create the file for an extracted object, filling in any template.
+// A name without one must not exist yet, so nothing is overwritten.
+// Returns a file descriptor, or -1 on failure
+static int create_file(char *path) {
+    char *template = NULL, *p;
+    int fd;
+
+    for (p = strstr(path, TEMPLATE_CHARS); p; p = strstr(p + 1,
+                TEMPLATE_CHARS)) {
+        template = p;
+    }
+    if (template) {
+        fd = mkstemps(path, strlen(template) - strlen(TEMPLATE_CHARS));
+    } else {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    }
+    if (fd == -1) {
+        debug("Creating %s failed: %m", path);
+    }
+    return fd;
+}
+
+// Write an object to fd, copying from the source file where possible
+// Returns 1 on success, 0 otherwise
+static int write_object(struct extract_options *ex, int fd,
+        const uint8_t *data, size_t len, off_t offset) {
+    size_t copied = 0;
+
+    if (offset != -1) {
+        copied = copy_range(ex->fd, offset, fd, len);
+    }
+    return write_all(fd, data + copied, len - copied);
+}
+
+// Write the index header to an empty or outdated index
+// Returns 1 on success, 0 otherwise
+static int init_store_index(int fd) {
+    struct store_index_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_INDEX_MAGIC, STORE_INDEX_MAGIC_SIZE);
+    header.version = STORE_INDEX_VERSION;
+    if (ftruncate(fd, 0)) {
+        debug("ftruncate failed: %m");
+        return 0;
+    }
+    return write_all(fd, (uint8_t *)&header, sizeof(header));
+}
+
+// Load the keys of objects from earlier runs
+// Returns 1 on success, 0 otherwise
+static int load_store_index(struct extract_store *store) {
+    struct store_index_header *header;
+    struct stat st;
+    uint8_t *map;
+    uint64_t key;
+    size_t count, i;
+
+    if (fstat(store->index_fd, &st)) {
+        debug("fstat failed: %m");
+        return 0;
+    }
+    count = 0;
+    if (st.st_size >= sizeof(*header)) {
+        count = (st.st_size - sizeof(*header)) / sizeof(key);
+    }
+    store->set = hashset_create(count * 2 + STORE_MIN_CAPACITY);
+    if (store->set == NULL) {
+        return 0;
+    }
+    if (st.st_size < sizeof(*header)) {
+        return init_store_index(store->index_fd);
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, store->index_fd, 0);
+    if (map == MAP_FAILED) {
+        debug("mmap %zu bytes failed: %m", (size_t)st.st_size);
+        return 0;
+    }
+    header = (struct store_index_header *)map;
+    if (memcmp(header->magic, STORE_INDEX_MAGIC, STORE_INDEX_MAGIC_SIZE) ||
+            header->version != STORE_INDEX_VERSION) {
+        // Objects are still found by name, so just start a new index
+        debug("Ignoring index with unknown format");
+        munmap(map, st.st_size);
+        return init_store_index(store->index_fd);
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(&key, map + sizeof(*header) + i * sizeof(key), sizeof(key));
+        hashset_insert(store->set, key);
+    }
+    munmap(map, st.st_size);
+    return 1;
+}
+
+// Open a deduplicating store of extracted objects in dir
+// Returns the store, or NULL on failure
+struct extract_store *open_extract_store(const char *dir) {
+    struct extract_store *store;
+    char *path;
+
+    assert(dir);
+
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        debug("mkdir %s failed: %m", dir);
+        return NULL;
+    }
+    store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        debug("calloc %zu failed: %m", sizeof(*store));
+        return NULL;
+    }
+    store->dir = strdup(dir);
+    if (store->dir == NULL ||
+            asprintf(&path, "%s/%s", dir, STORE_INDEX_NAME) == -1) {
+        debug("Allocating store paths failed");
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    store->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (store->index_fd == -1) {
+        debug("Opening %s failed: %m", path);
+        free(path);
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    free(path);
+    if (!load_store_index(store)) {
+        close_extract_store(store);
+        return NULL;
+    }
+    return store;
+}
+
+void close_extract_store(struct extract_store *store) {
+    if (store) {
+        close(store->index_fd);
+        hashset_free(store->set);
+        free(store->dir);
+        free(store);
+    }
+}
+
+// Add an object to the store unless identical bytes are already there
+// Returns the path of the stored object, which must be freed,
+// or NULL on failure
+static char *store_object(struct extract_options *ex, const char *ext,
+        const uint8_t *data, size_t len, off_t offset) {
+    struct extract_store *store = ex->store;
+    char *path, *tmppath;
+    uint64_t hash, key;
+    int fd, ret, added;
+
+    hash = hash64(data, len, 0);
+    key = hash64(ext, strlen(ext), hash);
+    if (asprintf(&path, "%s/%016"PRIx64".%s", store->dir, hash, ext) == -1) {
+        debug("asprintf failed");
+        return NULL;
+    }
+    // The object may have been deleted since it was indexed, or still be
+    // being written by another thread, in which case it's written again
+    added = hashset_insert(store->set, key) == 1;
+    if (!added && access(path, F_OK) == 0) {
+        return path;
+    }
+
+    // Write under a temporary name so readers never see a partial object
+    if (asprintf(&tmppath, "%s/.tmp-XXXXXX", store->dir) == -1) {
+        debug("asprintf failed");
+        free(path);
+        return NULL;
+    }
+    fd = mkstemp(tmppath);
+    if (fd == -1) {
+        debug("mkstemp %s failed: %m", tmppath);
+        free(tmppath);
+        goto fail;
+    }
+    // Stored objects are shared, unlike private mkstemp files
+    ret = write_object(ex, fd, data, len, offset) && !fchmod(fd, 0644);
+    if (close(fd)) {
+        ret = 0;
+    }
+    if (!ret || rename(tmppath, path)) {
+        debug("Storing %s failed: %m", path);
+        unlink(tmppath);
+        free(tmppath);
+        goto fail;
+    }
+    free(tmppath);
+
+    // Appends this small are atomic, so concurrent runs can share an index
+    if (write(store->index_fd, &key, sizeof(key)) != sizeof(key)) {
+        debug("Appending to store index failed: %m");
+    }
+    return path;
+
+fail:
+    // Let a later attempt write the object
+    if (added) {
+        hashset_remove(store->set, key);
+    }
+    free(path);
+    return NULL;
+}
+
+// Add an object to the archive, named by its source file and frame index
+// Returns the name of the archive entry, which must be freed,
+// or NULL on failure
+static char *archive_object(struct extract_options *ex, const char *ext,
+        const uint8_t *data, size_t len) {
+    struct stat st;
+    char *name;
+
+    if (asprintf(&name, "%s/%u.%s", ex->source ? ex->source : "",
+                ex->index, ext) == -1) {
+        debug("asprintf failed");
+        return NULL;
+    }
+    if (fstat(ex->fd, &st)) {
+        st.st_mtime = 0;
+    }
+    if (!tar_add(ex->tar, name, data, len, st.st_mtime)) {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+// Write an embedded object to a new file named by ex.
+// data holds len bytes of the object. If offset is not -1 the same bytes
+// are stored verbatim at that offset of ex->fd, and are copied from there
+// within the kernel instead.
+// Returns the name of the file, which must be freed, or NULL on failure
+char *extract_object(struct extract_options *ex, const char *ext,
+        const uint8_t *data, size_t len, off_t offset) {
+    char *path;
+    int fd;
+
+    assert(ex);
+    assert(ext);
+
+    if (ex->store) {
+        return store_object(ex, ext, data, len, offset);
+    } else if (ex->tar) {
+        return archive_object(ex, ext, data, len);
+    }
+
+    path = expand_name(ex, ext);
+    if (path == NULL) {
+        return NULL;
+    }
+    fd = create_file(path);
+    if (fd == -1) {
+        free(path);
+        return NULL;
+    }
+    if (!write_object(ex, fd, data, len, offset)) {
+        close(fd);
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+    if (close(fd)) {
+        debug("close failed: %m");
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+// Write the decoded data of a frame from get_id3v2_frame_header to outfd.
+// Data stored verbatim is copied straight from the file.
+// Returns 1 on success, 0 otherwise
+int dump_frame(struct id3v2_header *idheader,
+        struct id3v2_frame_header *fheader, int outfd) {
+    size_t copied = 0;
+    int ret;
+
+    assert(idheader);
+    assert(fheader);
+
+    if (fheader->data_offset != -1) {
+        copied = copy_range(idheader->fd, fheader->data_offset, outfd,
+                fheader->raw_len);
+        if (copied == fheader->raw_len) {
+            return 1;
+        }
+    }
+    if (!get_id3v2_frame_data(idheader, fheader)) {
+        return 0;
+    }
+    ret = write_all(outfd, fheader->data + copied,
+            fheader->data_len - copied);
+    free_id3v2_frame_data(idheader, fheader);
+    return ret;
+}
@@ -0,0 +1,317 @@
+// Implementation of hashing and hash sets
+// Copyright 2015 David Gloe.
+//
+// The hash function is XXH64, from:
+// https://github.com/Cyan4973/xxHash
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "id3v2.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+// Sets are kept at most three quarters full so probe sequences stay short
+#define HASHSET_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+// Marks a slot whose key was removed, which isn't reused
+#define HASHSET_REMOVED UINT64_MAX
+
+struct hashset {
+    _Atomic uint64_t *slots;
+    size_t mask;
+    atomic_size_t count;        // Slots used, including removed keys
+    atomic_size_t removed;
+};
+
+static uint64_t rotl64(uint64_t val, int bits) {
+    return (val << bits) | (val >> (64 - bits));
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Mix the last len % 32 bytes of input into h and finish it
+static uint64_t hash_finish(uint64_t h, const uint8_t *p, const uint8_t *end) {
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Combine the four accumulators once 32 bytes or more have been seen
+static uint64_t hash_converge(const uint64_t v[4]) {
+    uint64_t h;
+
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+            rotl64(v[3], 18);
+    h = hash_merge(h, v[0]);
+    h = hash_merge(h, v[1]);
+    h = hash_merge(h, v[2]);
+    h = hash_merge(h, v[3]);
+    return h;
+}
+
+// Consume whole 32 byte stripes from p, returning the first byte left over
+static const uint8_t *hash_stripes(uint64_t v[4], const uint8_t *p,
+        const uint8_t *end) {
+    for (; p + 32 <= end; p += 32) {
+        v[0] = hash_round(v[0], read64(p));
+        v[1] = hash_round(v[1], read64(p + 8));
+        v[2] = hash_round(v[2], read64(p + 16));
+        v[3] = hash_round(v[3], read64(p + 24));
+    }
+    return p;
+}
+
+static void hash_seed(uint64_t v[4], uint64_t seed) {
+    v[0] = seed + PRIME64_1 + PRIME64_2;
+    v[1] = seed + PRIME64_2;
+    v[2] = seed;
+    v[3] = seed - PRIME64_1;
+}
+
+// Hash arbitrary data with a fast non-cryptographic hash
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data, *end = p + len;
+    uint64_t v[4], h;
+
+    if (len >= 32) {
+        hash_seed(v, seed);
+        p = hash_stripes(v, p, end);
+        h = hash_converge(v);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    return hash_finish(h + len, p, end);
+}
+
+// Start hashing data given in pieces. The result is the same as hash64
+// of all the pieces joined together.
+void hash64_init(struct hash64_state *state, uint64_t seed) {
+    assert(state);
+
+    hash_seed(state->v, seed);
+    state->seed = seed;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+void hash64_update(struct hash64_state *state, const void *data,
+        size_t len) {
+    const uint8_t *p = data, *end = p + len;
+    size_t fill;
+
+    assert(state);
+
+    state->total += len;
+    if (state->buffered) {
+        fill = sizeof(state->buffer) - state->buffered;
+        if (len < fill) {
+            memcpy(state->buffer + state->buffered, p, len);
+            state->buffered += len;
+            return;
+        }
+        memcpy(state->buffer + state->buffered, p, fill);
+        hash_stripes(state->v, state->buffer,
+                state->buffer + sizeof(state->buffer));
+        state->buffered = 0;
+        p += fill;
+    }
+    p = hash_stripes(state->v, p, end);
+    memcpy(state->buffer, p, end - p);
+    state->buffered = end - p;
+}
+
+uint64_t hash64_final(const struct hash64_state *state) {
+    uint64_t h;
+
+    assert(state);
+
+    if (state->total >= 32) {
+        h = hash_converge(state->v);
+    } else {
+        h = state->seed + PRIME64_5;
+    }
+    return hash_finish(h + state->total, state->buffer,
+            state->buffer + state->buffered);
+}
+
+// Create a hash set able to hold at least capacity keys
+// Returns the set, or NULL on failure
+struct hashset *hashset_create(size_t capacity) {
+    struct hashset *set;
+    size_t size = 64;
+
+    while (HASHSET_MAX_LOAD(size) < capacity) {
+        size *= 2;
+    }
+    set = malloc(sizeof(*set));
+    if (set == NULL) {
+        debug("malloc %zu failed: %m", sizeof(*set));
+        return NULL;
+    }
+    set->slots = calloc(size, sizeof(*set->slots));
+    if (set->slots == NULL) {
+        debug("calloc %zu failed: %m", size * sizeof(*set->slots));
+        free(set);
+        return NULL;
+    }
+    set->mask = size - 1;
+    atomic_init(&set->count, 0);
+    atomic_init(&set->removed, 0);
+    return set;
+}
+
+void hashset_free(struct hashset *set) {
+    if (set) {
+        free(set->slots);
+        free(set);
+    }
+}
+
+// Map the keys standing for empty and removed slots onto others
+static uint64_t set_key(uint64_t key) {
+    if (key == 0) {
+        return 1;
+    } else if (key == HASHSET_REMOVED) {
+        return HASHSET_REMOVED - 1;
+    }
+    return key;
+}
+
+// Add a key to the set. Safe to call from several threads at once
+// without locking; exactly one caller adding a given key sees 1.
+// Returns 1 if the key was added, 0 if it was already present,
+// or -1 if it is absent but the set is full
+int hashset_insert(struct hashset *set, uint64_t key) {
+    uint64_t cur;
+    size_t i, probes;
+
+    assert(set);
+
+    key = set_key(key);
+    i = key & set->mask;
+    for (probes = 0; probes <= set->mask; probes++) {
+        cur = atomic_load_explicit(&set->slots[i], memory_order_acquire);
+        if (cur == key) {
+            return 0;
+        } else if (cur == 0) {
+            if (atomic_load_explicit(&set->count, memory_order_relaxed) >=
+                    HASHSET_MAX_LOAD(set->mask + 1)) {
+                return -1;
+            }
+            if (atomic_compare_exchange_strong_explicit(&set->slots[i],
+                        &cur, key, memory_order_acq_rel,
+                        memory_order_acquire)) {
+                atomic_fetch_add_explicit(&set->count, 1,
+                        memory_order_relaxed);
+                return 1;
+            } else if (cur == key) {
+                // Another thread added it first
+                return 0;
+            }
+        }
+        i = (i + 1) & set->mask;
+    }
+    return -1;
+}
+
+// Determine whether a key is in the set
+int hashset_contains(struct hashset *set, uint64_t key) {
+    uint64_t cur;
+    size_t i, probes;
+
+    assert(set);
+
+    key = set_key(key);
+    i = key & set->mask;
+    for (probes = 0; probes <= set->mask; probes++) {
+        cur = atomic_load_explicit(&set->slots[i], memory_order_acquire);
+        if (cur == key) {
+            return 1;
+        } else if (cur == 0) {
+            return 0;
+        }
+        i = (i + 1) & set->mask;
+    }
+    return 0;
+}
+
+// Remove a key from the set, such as one added for work that then failed.
+// Its slot stays used, so removing doesn't make room for more keys.
+// Returns 1 if the key was removed, 0 if it wasn't present
+int hashset_remove(struct hashset *set, uint64_t key) {
+    uint64_t cur;
+    size_t i, probes;
+
+    assert(set);
+
+    key = set_key(key);
+    i = key & set->mask;
+    for (probes = 0; probes <= set->mask; probes++) {
+        cur = atomic_load_explicit(&set->slots[i], memory_order_acquire);
+        if (cur == key) {
+            if (!atomic_compare_exchange_strong_explicit(&set->slots[i],
+                        &cur, HASHSET_REMOVED, memory_order_acq_rel,
+                        memory_order_acquire)) {
+                // Another thread removed it first
+                return 0;
+            }
+            atomic_fetch_add_explicit(&set->removed, 1,
+                    memory_order_relaxed);
+            return 1;
+        } else if (cur == 0) {
+            return 0;
+        }
+        i = (i + 1) & set->mask;
+    }
+    return 0;
+}
+
+// Get the number of keys in the set
+size_t hashset_count(struct hashset *set) {
+    return atomic_load_explicit(&set->count, memory_order_relaxed) -
+        atomic_load_explicit(&set->removed, memory_order_relaxed);
+}
@@ -1,56 +1,370 @@
 // Implementation of the id3al command
 // Copyright 2015 David Gloe
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 #include "id3v2.h"
 
+// Long options without a short equivalent
+enum {
+    OPT_EXTRACT_DIR = 256,
+    OPT_EXTRACT_NAME,
+    OPT_EXTRACT_STORE,
+    OPT_EXTRACT_TAR,
+    OPT_DUMP_FRAME,
+    OPT_CACHE,
+    OPT_SERVE,
+    OPT_WATCH,
+    OPT_BUILD_INDEX,
+    OPT_QUERY,
+    OPT_HASH_AUDIO,
+    OPT_STATS,
+    OPT_SURVEY,
+    OPT_PROFILE,
+    OPT_VERIFY_CRC,
+    OPT_CHECK,
+    OPT_SET,
+    OPT_PADDING,
+    OPT_SYNC,
+    OPT_STRIP,
+    OPT_SHRINK,
+    OPT_DRY_RUN
+};
+
+// Frames dropped by --strip without a list, which take the most space
+static char *default_strip_ids[] = {
+    ID3V2_FRAME_ID_APIC, ID3V2_FRAME_ID_PRIV, ID3V2_FRAME_ID_GEOB
+};
+
+struct options {
+    int verbosity;
+    int extract;
+    const char *store_dir;
+    const char *tar_path;
+    struct extract_options extract_opts;
+    char dump_id[ID3V2_FRAME_ID_SIZE + 1];
+    unsigned int dump_index;
+    const char *cache_path;
+    const char *socket_path;
+    const char *watch_dir;
+    const char *index_path;
+    const char *query_path;
+    int hash_audio;
+    int stats;
+    int survey;
+    int profile;
+    int verify_crc;
+    int check;
+    unsigned int jobs;
+    char **sets;
+    int nsets;
+    struct id3v2_padding_policy padding;
+    int update_flags;
+    int shrink;
+    char **strip_ids;
+    int nstrip;
+};
+
 static void print_usage(const char *name, FILE *fp);
-static void parse_args(int argc, char * const argv[], int *verbosity,
-        int *extract);
+static void parse_args(int argc, char * const argv[], struct options *opts);
+static int parse_dump_frame(const char *arg, struct options *opts);
+static int parse_set(const char *arg);
+static int parse_padding(const char *arg, struct id3v2_padding_policy *policy);
+static int parse_strip(char *arg, struct options *opts);
+static int dump_file_frame(struct id3v2_header *header, struct options *opts);
+static int print_cached_tag(struct id3v2_header *header,
+        struct options *opts, struct metadata_cache *cache,
+        const struct stat *st);
+static struct stat *stat_files(int count, char * const paths[]);
+static void print_profile_at_exit(void);
+
+static int profile_json;
 
 // Print usage information to stdout
 static void print_usage(const char *name, FILE *fp) {
-    fprintf(fp, "Usage: %s [-h] [-v] [-e] FILE...\n"
+    fprintf(fp, "Usage: %s [-h] [-v] [-e] [--extract-dir=DIR] "
+            "[--extract-name=PATTERN]\n"
+            "        [--extract-store=DIR] [--extract-to-tar=PATH]\n"
+            "        [--dump-frame=ID[:INDEX]] [--cache=FILE] [--verify-crc]\n"
+            "        FILE...\n"
+            "       %s [-v] [-j JOBS] --serve=SOCKET\n"
+            "       %s [-v] [-j JOBS] [--cache=FILE] --watch=DIR\n"
+            "       %s --build-index=INDEX FILE...\n"
+            "       %s --query=INDEX TERM...\n"
+            "       %s [-v] [-j JOBS] --hash-audio FILE...\n"
+            "       %s [-j JOBS] (--stats | --survey) FILE...\n"
+            "       %s [-j JOBS] --check FILE...\n"
+            "       %s [--padding=MIN[,PERCENT[,ALIGN]]] [--sync] "
+            "--set=ID=TEXT... FILE...\n"
+            "       %s [--padding=MIN] [--sync] [--dry-run] "
+            "(--strip[=IDS] | --shrink) FILE...\n"
+            "    All forms accept --profile[=json]\n"
             "    -h, --help:    Print this message\n"
             "    -v, --verbose: Print more information\n"
             "    -e, --extract: Extract embedded files\n"
-            "    FILE:          One or more audio files to read\n", name);
+            "    -j, --jobs=JOBS:\n"
+            "                   Use JOBS threads when serving, watching,\n"
+            "                   hashing, counting or checking\n"
+            "    --extract-dir=DIR:\n"
+            "                   Extract embedded files into DIR\n"
+            "    --extract-name=PATTERN:\n"
+            "                   Name extracted files after PATTERN, where\n"
+            "                   %%f is the audio file name, %%i the frame\n"
+            "                   index and %%e the file type extension. A\n"
+            "                   trailing XXXXXX is made unique; without one,\n"
+            "                   existing files aren't overwritten. The\n"
+            "                   default is id3al-XXXXXX\n"
+            "    --extract-store=DIR:\n"
+            "                   Extract each distinct embedded file once\n"
+            "                   into DIR, named by a hash of its contents\n"
+            "    --extract-to-tar=PATH:\n"
+            "                   Write embedded files into one tar archive at\n"
+            "                   PATH, or on stdout if PATH is -, in which\n"
+            "                   case other output goes to stderr\n"
+            "    --dump-frame=ID[:INDEX]:\n"
+            "                   Write only the data of frame ID to stdout,\n"
+            "                   or of its INDEX'th occurrence counting\n"
+            "                   from 0\n"
+            "    --cache=FILE:  Keep the output for each file in FILE, and\n"
+            "                   reuse it while the file is unchanged. Not\n"
+            "                   used when extracting, dumping frames or\n"
+            "                   verifying CRCs\n"
+            "    --verify-crc:  Check each tag against the CRC in its\n"
+            "                   extended header, if it has one, while its\n"
+            "                   frames are read. Mismatches are reported and\n"
+            "                   make the exit status 1\n"
+            "    --serve=SOCKET:\n"
+            "                   Answer JSON requests for tags on the Unix\n"
+            "                   socket SOCKET until interrupted. Only this\n"
+            "                   user can connect to it\n"
+            "    --watch=DIR:   Print the tags of files under DIR as they\n"
+            "                   are written or moved in, until interrupted\n"
+            "    --build-index=INDEX:\n"
+            "                   Index the text frame, TXXX and COMM values\n"
+            "                   of each FILE into INDEX\n"
+            "    --query=INDEX: Print the files in INDEX matching every\n"
+            "                   TERM, which is FRAME=VALUE, or FRAME<VALUE\n"
+            "                   and so on to compare values as text.\n"
+            "                   FRAME may be TXXX:DESCRIPTION. Case is\n"
+            "                   ignored\n"
+            "    --hash-audio:  Print groups of FILEs with the same audio,\n"
+            "                   whatever their tags\n"
+            "    --stats:       Print totals of tag versions, sizes, frame\n"
+            "                   IDs and encodings over all FILEs, reading\n"
+            "                   only their headers\n"
+            "    --survey:      Print the tag size, bytes used and padding\n"
+            "                   of each FILE, reading only the headers\n"
+            "    --check:       Check that each FILE has a sound tag that\n"
+            "                   keeps to the spec and its own restrictions,\n"
+            "                   printing only the files that don't. The exit\n"
+            "                   status is that of the first to fail: 2 if\n"
+            "                   unreadable, 3 if untagged, 4 for a bad tag\n"
+            "                   header, 5 for a bad frame, 6 for a CRC\n"
+            "                   mismatch and 7 for a broken restriction\n"
+            "    --set=ID=TEXT: Set the text frame ID of each FILE to TEXT,\n"
+            "                   or remove it if TEXT is empty. May be given\n"
+            "                   more than once. Tags are rewritten in place\n"
+            "                   when the new tag fits in the old one\n"
+            "    --padding=MIN[,PERCENT[,ALIGN]]:\n"
+            "                   When a tag has to grow, give it padding of\n"
+            "                   at least MIN bytes and PERCENT of its size,\n"
+            "                   rounding the tag up to a multiple of ALIGN\n"
+            "                   bytes. The default is %d,%d\n"
+            "    --sync:        Flush each updated tag to disk\n"
+            "    --strip[=IDS]: Drop the frames with the comma separated\n"
+            "                   IDS, by default APIC,PRIV,GEOB, from each\n"
+            "                   FILE, then shrink it\n"
+            "    --shrink:      Cut padding beyond MIN out of each FILE,\n"
+            "                   printing the bytes reclaimed. Only whole\n"
+            "                   filesystem blocks are cut, so less than a\n"
+            "                   block frees nothing\n"
+            "    --dry-run:     Only print the bytes --strip or --shrink\n"
+            "                   would reclaim\n"
+            "    --profile[=json]:\n"
+            "                   Print the time spent in each stage of\n"
+            "                   reading tags and counts of bytes, frames and\n"
+            "                   allocations to stderr on exit, as text or\n"
+            "                   JSON\n"
+            "    FILE:          One or more audio files to read\n",
+            name, name, name, name, name, name, name, name, name, name,
+            ID3V2_DEFAULT_PADDING_MIN, ID3V2_DEFAULT_PADDING_PERCENT);
     return;
 }
 
 // Parse arguments
-static void parse_args(int argc, char * const argv[], int *verbosity,
-        int *extract) {
+static void parse_args(int argc, char * const argv[], struct options *opts) {
     int opt;
+    char *end;
+    unsigned long jobs;
     struct option longopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"verbose", no_argument, NULL, 'v'},
         {"extract", no_argument, NULL, 'e'},
+        {"extract-dir", required_argument, NULL, OPT_EXTRACT_DIR},
+        {"extract-name", required_argument, NULL, OPT_EXTRACT_NAME},
+        {"extract-store", required_argument, NULL, OPT_EXTRACT_STORE},
+        {"extract-to-tar", required_argument, NULL, OPT_EXTRACT_TAR},
+        {"dump-frame", required_argument, NULL, OPT_DUMP_FRAME},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"watch", required_argument, NULL, OPT_WATCH},
+        {"build-index", required_argument, NULL, OPT_BUILD_INDEX},
+        {"query", required_argument, NULL, OPT_QUERY},
+        {"jobs", required_argument, NULL, 'j'},
+        {"hash-audio", no_argument, NULL, OPT_HASH_AUDIO},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"survey", no_argument, NULL, OPT_SURVEY},
+        {"profile", optional_argument, NULL, OPT_PROFILE},
+        {"verify-crc", no_argument, NULL, OPT_VERIFY_CRC},
+        {"check", no_argument, NULL, OPT_CHECK},
+        {"set", required_argument, NULL, OPT_SET},
+        {"padding", required_argument, NULL, OPT_PADDING},
+        {"sync", no_argument, NULL, OPT_SYNC},
+        {"strip", optional_argument, NULL, OPT_STRIP},
+        {"shrink", no_argument, NULL, OPT_SHRINK},
+        {"dry-run", no_argument, NULL, OPT_DRY_RUN},
         {NULL, 0, NULL, 0}
     };
 
-    assert(verbosity);
-    assert(extract);
+    assert(opts);
 
-    *verbosity = 0;
-    *extract = 0;
-    while ((opt = getopt_long(argc, argv, "hve", longopts, NULL)) != -1) {
+    memset(opts, 0, sizeof(*opts));
+    opts->padding.min = ID3V2_DEFAULT_PADDING_MIN;
+    opts->padding.percent = ID3V2_DEFAULT_PADDING_PERCENT;
+    opts->padding.max = ID3V2_DEFAULT_PADDING_MAX;
+    while ((opt = getopt_long(argc, argv, "hvej:", longopts, NULL)) != -1) {
         switch (opt) {
             case 'v':
-                (*verbosity)++;
+                opts->verbosity++;
                 break;
             case 'h':
                 print_usage(argv[0], stdout);
                 exit(0);
                 break;
             case 'e':
-                *extract = 1;
+                opts->extract = 1;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, &end, 10);
+                if (*optarg == 0 || *end || jobs == 0 || jobs > UINT_MAX) {
+                    fprintf(stderr, "Invalid jobs %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                opts->jobs = jobs;
+                break;
+            case OPT_EXTRACT_DIR:
+                opts->extract = 1;
+                opts->extract_opts.dir = optarg;
+                break;
+            case OPT_EXTRACT_NAME:
+                opts->extract = 1;
+                opts->extract_opts.name = optarg;
+                break;
+            case OPT_EXTRACT_STORE:
+                opts->extract = 1;
+                opts->store_dir = optarg;
+                break;
+            case OPT_EXTRACT_TAR:
+                opts->extract = 1;
+                opts->tar_path = optarg;
+                break;
+            case OPT_DUMP_FRAME:
+                if (!parse_dump_frame(optarg, opts)) {
+                    fprintf(stderr, "Invalid frame %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                break;
+            case OPT_CACHE:
+                opts->cache_path = optarg;
+                break;
+            case OPT_SERVE:
+                opts->socket_path = optarg;
+                break;
+            case OPT_WATCH:
+                opts->watch_dir = optarg;
+                break;
+            case OPT_BUILD_INDEX:
+                opts->index_path = optarg;
+                break;
+            case OPT_QUERY:
+                opts->query_path = optarg;
+                break;
+            case OPT_HASH_AUDIO:
+                opts->hash_audio = 1;
+                break;
+            case OPT_STATS:
+                opts->stats = 1;
+                break;
+            case OPT_SURVEY:
+                opts->survey = 1;
+                break;
+            case OPT_PROFILE:
+                if (optarg && strcmp(optarg, "json")) {
+                    fprintf(stderr, "Invalid profile format %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                opts->profile = 1;
+                profile_json = optarg != NULL;
+                break;
+            case OPT_VERIFY_CRC:
+                opts->verify_crc = 1;
+                break;
+            case OPT_CHECK:
+                opts->check = 1;
+                break;
+            case OPT_SET:
+                if (!parse_set(optarg)) {
+                    fprintf(stderr, "Invalid text frame %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                // There can't be more than there are arguments
+                if (opts->sets == NULL) {
+                    opts->sets = calloc(argc, sizeof(*opts->sets));
+                    if (opts->sets == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                    }
+                }
+                opts->sets[opts->nsets++] = optarg;
+                break;
+            case OPT_PADDING:
+                if (!parse_padding(optarg, &opts->padding)) {
+                    fprintf(stderr, "Invalid padding %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                break;
+            case OPT_SYNC:
+                opts->update_flags |= ID3V2_UPDATE_SYNC;
+                break;
+            case OPT_STRIP:
+                opts->shrink = 1;
+                if (!parse_strip(optarg, opts)) {
+                    fprintf(stderr, "Invalid frames %s\n", optarg);
+                    print_usage(argv[0], stderr);
+                    exit(1);
+                }
+                break;
+            case OPT_SHRINK:
+                opts->shrink = 1;
+                break;
+            case OPT_DRY_RUN:
+                opts->update_flags |= ID3V2_UPDATE_DRY_RUN;
                 break;
             default:
                 print_usage(argv[0], stderr);
@@ -58,23 +372,299 @@ static void parse_args(int argc, char * const argv[], int *verbosity,
                 break;
         }
     }
-    if (optind >= argc) {
+    if (opts->store_dir && opts->tar_path) {
+        fprintf(stderr, "--extract-store and --extract-to-tar can't be "
+                "used together\n");
+        print_usage(argv[0], stderr);
+        exit(1);
+    }
+    if (optind >= argc && !opts->socket_path && !opts->watch_dir) {
         print_usage(argv[0], stderr);
         exit(1);
     }
     return;
 }
 
+// Parse a frame ID with an optional index
+// Return 1 on success, 0 otherwise
+static int parse_dump_frame(const char *arg, struct options *opts) {
+    const char *colon;
+    char *end;
+    unsigned long index = 0;
+
+    colon = strchr(arg, ':');
+    if (colon) {
+        index = strtoul(colon + 1, &end, 10);
+        if (colon[1] == 0 || *end || index > UINT_MAX) {
+            return 0;
+        }
+    } else {
+        colon = arg + strlen(arg);
+    }
+    if (colon - arg != ID3V2_FRAME_ID_SIZE) {
+        return 0;
+    }
+    memcpy(opts->dump_id, arg, ID3V2_FRAME_ID_SIZE);
+    opts->dump_id[ID3V2_FRAME_ID_SIZE] = 0;
+    opts->dump_index = index;
+    return 1;
+}
+
+// Check a text frame to set, given as ID=TEXT, where ID is a text frame
+// other than TXXX
+// Return 1 on success, 0 otherwise
+static int parse_set(const char *arg) {
+    char id[ID3V2_FRAME_ID_SIZE + 1];
+
+    if (strlen(arg) <= ID3V2_FRAME_ID_SIZE ||
+            arg[ID3V2_FRAME_ID_SIZE] != '=') {
+        return 0;
+    }
+    memcpy(id, arg, ID3V2_FRAME_ID_SIZE);
+    id[ID3V2_FRAME_ID_SIZE] = 0;
+    return id[0] == 'T' && strcmp(id, ID3V2_FRAME_ID_TXXX) &&
+        verify_id3v2_frame_id(id);
+}
+
+// Parse a padding policy of MIN[,PERCENT[,ALIGN]]
+// Return 1 on success, 0 otherwise
+static int parse_padding(const char *arg,
+        struct id3v2_padding_policy *policy) {
+    unsigned long val[3] = { 0, 0, 0 };
+    const char *p = arg;
+    char *end;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        val[i] = strtoul(p, &end, 10);
+        if (end == p || val[i] > ID3V2_MAX_SIZE) {
+            return 0;
+        } else if (*end == 0) {
+            break;
+        } else if (*end != ',' || i == 2) {
+            return 0;
+        }
+        p = end + 1;
+    }
+    policy->min = val[0];
+    policy->percent = val[1];
+    policy->max = ID3V2_MAX_SIZE;
+    policy->align = val[2];
+    return 1;
+}
+
+// Parse a comma separated list of frame IDs to strip, splitting arg, or
+// use the default ones if it's NULL
+// Return 1 on success, 0 otherwise
+static int parse_strip(char *arg, struct options *opts) {
+    char *id, *save;
+    int n = 0;
+
+    if (arg == NULL) {
+        opts->strip_ids = default_strip_ids;
+        opts->nstrip = sizeof(default_strip_ids) /
+            sizeof(default_strip_ids[0]);
+        return 1;
+    }
+    // Each ID takes at least two characters with its comma
+    opts->strip_ids = calloc(strlen(arg) / 2 + 1, sizeof(*opts->strip_ids));
+    if (opts->strip_ids == NULL) {
+        return 0;
+    }
+    for (id = strtok_r(arg, ",", &save); id; id = strtok_r(NULL, ",", &save)) {
+        if (strlen(id) != ID3V2_FRAME_ID_SIZE || !verify_id3v2_frame_id(id)) {
+            return 0;
+        }
+        opts->strip_ids[n++] = id;
+    }
+    opts->nstrip = n;
+    return n > 0;
+}
+
+// Write the data of the requested frame to stdout. Other frames are
+// skipped without being decoded.
+// Return 1 if the frame was found and written, 0 otherwise
+static int dump_file_frame(struct id3v2_header *header, struct options *opts) {
+    struct id3v2_frame_header fheader;
+    unsigned int seen = 0;
+
+    while (get_id3v2_frame_header(header, &fheader)) {
+        if (!strcmp(fheader.id, opts->dump_id) &&
+                seen++ == opts->dump_index) {
+            return dump_frame(header, &fheader, STDOUT_FILENO);
+        }
+        PROFILE_COUNT(PROFILE_FRAMES_SKIPPED, 1);
+    }
+    return 0;
+}
+
+// Print a tag to stdout and add the output to the cache
+// Return 1 on success, 0 otherwise
+static int print_cached_tag(struct id3v2_header *header,
+        struct options *opts, struct metadata_cache *cache,
+        const struct stat *st) {
+    char *buf;
+    size_t len;
+    FILE *fp;
+
+    fp = open_memstream(&buf, &len);
+    if (fp == NULL) {
+        debug("open_memstream failed: %m");
+        return 0;
+    }
+    print_id3v2_tag(fp, header, opts->verbosity, NULL, NULL);
+    if (fclose(fp)) {
+        debug("fclose failed: %m");
+        free(buf);
+        return 0;
+    }
+    fwrite(buf, 1, len, stdout);
+    // A file that couldn't be examined is just printed every time
+    if (st->st_ino) {
+        metadata_cache_store(cache, st, (uint8_t *)buf, len);
+    }
+    free(buf);
+    return 1;
+}
+
+// Look up the identity of every file before any is opened, without
+// forcing attributes to be fetched from a remote server
+// Returns an array of count results, which must be freed, or NULL on
+// failure. Files that couldn't be examined are left zeroed.
+static struct stat *stat_files(int count, char * const paths[]) {
+    struct stat *stats;
+    struct statx stx;
+    int i;
+
+    stats = calloc(count, sizeof(*stats));
+    if (stats == NULL) {
+        debug("calloc %zu failed: %m", count * sizeof(*stats));
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (statx(AT_FDCWD, paths[i], AT_STATX_DONT_SYNC,
+                    STATX_INO | STATX_SIZE | STATX_MTIME, &stx)) {
+            continue;
+        }
+        stats[i].st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        stats[i].st_ino = stx.stx_ino;
+        stats[i].st_size = stx.stx_size;
+        stats[i].st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        stats[i].st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    }
+    return stats;
+}
+
+// Report the profile however main returns
+static void print_profile_at_exit(void) {
+    fflush(stdout);
+    print_profile(stderr, profile_json);
+}
+
 // Main function
 int main(int argc, char * const argv[]) {
     struct id3v2_header header;
-    struct id3v2_frame_header fheader;
-    int verbosity, extract, fd, i;
+    struct options opts;
+    struct extract_options *extract;
+    struct metadata_cache *cache = NULL;
+    struct stat *stats = NULL, *st;
+    const uint8_t *cached;
+    size_t cached_len;
+    uint64_t timer;
+    int fd, i, status = 0;
 
-    parse_args(argc, argv, &verbosity, &extract);
+    parse_args(argc, argv, &opts);
+    if (opts.profile) {
+        profile_enable();
+        atexit(print_profile_at_exit);
+    }
+    if (opts.socket_path) {
+        return !run_server(opts.socket_path, opts.jobs, opts.verbosity);
+    } else if (opts.index_path) {
+        return !build_index(opts.index_path, argv + optind, argc - optind);
+    } else if (opts.query_path) {
+        return !query_index(opts.query_path, argv + optind, argc - optind,
+                stdout);
+    } else if (opts.hash_audio) {
+        return !hash_audio(argv + optind, argc - optind, opts.jobs,
+                opts.verbosity, stdout);
+    } else if (opts.stats) {
+        return !print_tag_stats(argv + optind, argc - optind, opts.jobs,
+                stdout);
+    } else if (opts.survey) {
+        return !print_tag_survey(argv + optind, argc - optind, opts.jobs,
+                stdout);
+    } else if (opts.check) {
+        return check_files(argv + optind, argc - optind, opts.jobs, stdout);
+    } else if (opts.nsets) {
+        for (i = optind; i < argc; i++) {
+            if (!set_id3v2_text_frames(argv[i], opts.sets, opts.nsets,
+                        &opts.padding, opts.update_flags)) {
+                fprintf(stderr, "Couldn't update %s\n", argv[i]);
+                status = 1;
+            }
+        }
+        free(opts.sets);
+        return status;
+    } else if (opts.shrink) {
+        status = !shrink_files(argv + optind, argc - optind, opts.strip_ids,
+                opts.nstrip, &opts.padding, opts.update_flags, stdout);
+        if (opts.strip_ids != default_strip_ids) {
+            free(opts.strip_ids);
+        }
+        return status;
+    }
+    extract = opts.extract ? &opts.extract_opts : NULL;
+    if (opts.store_dir) {
+        opts.extract_opts.store = open_extract_store(opts.store_dir);
+        if (opts.extract_opts.store == NULL) {
+            fprintf(stderr, "Couldn't open store %s\n", opts.store_dir);
+            return 1;
+        }
+    }
+    if (opts.tar_path) {
+        opts.extract_opts.tar = tar_open(opts.tar_path);
+        if (opts.extract_opts.tar == NULL) {
+            fprintf(stderr, "Couldn't open archive %s\n", opts.tar_path);
+            return 1;
+        }
+        // Keep the listing out of an archive written to stdout
+        if (!strcmp(opts.tar_path, "-")) {
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+    }
+    // Extraction, dumping and verification need the file contents every
+    // time
+    if (opts.cache_path && !extract && !opts.dump_id[0] && !opts.verify_crc) {
+        cache = open_metadata_cache(opts.cache_path, opts.verbosity);
+        if (cache == NULL) {
+            fprintf(stderr, "Couldn't open cache %s\n", opts.cache_path);
+            return 1;
+        }
+    }
+    if (opts.watch_dir) {
+        i = run_watch(opts.watch_dir, opts.jobs, opts.verbosity, cache);
+        close_metadata_cache(cache);
+        return !i;
+    }
+    if (cache) {
+        stats = stat_files(argc - optind, argv + optind);
+        if (stats == NULL) {
+            return 1;
+        }
+    }
 
     for (i = optind; i < argc; i++) {
+        st = stats ? &stats[i - optind] : NULL;
+        if (st && st->st_ino &&
+                metadata_cache_lookup(cache, st, &cached, &cached_len)) {
+            fwrite(cached, 1, cached_len, stdout);
+            continue;
+        }
+
+        timer = PROFILE_START();
         fd = open(argv[i], O_RDONLY);
+        PROFILE_END(PROFILE_OPEN, timer);
         if (fd == -1) {
             fprintf(stderr, "Couldn't open %s: %m\n", argv[i]);
             return 1;
@@ -83,18 +673,36 @@ int main(int argc, char * const argv[]) {
         if (!get_id3v2_tag(fd, &header)) {
             return 1;
         }
+        header.verify_crc = opts.verify_crc;
 
-        print_id3v2_header(&header, verbosity);
-        if (header.extheader_present) {
-            print_id3v2_extended_header(&header.extheader, verbosity);
+        if (opts.dump_id[0]) {
+            if (!dump_file_frame(&header, &opts)) {
+                fprintf(stderr, "Couldn't dump frame %s:%u from %s\n",
+                        opts.dump_id, opts.dump_index, argv[i]);
+                return 1;
+            }
+        } else if (cache) {
+            if (!print_cached_tag(&header, &opts, cache, st)) {
+                return 1;
+            }
+        } else {
+            opts.extract_opts.source = argv[i];
+            opts.extract_opts.fd = fd;
+            print_id3v2_tag(stdout, &header, opts.verbosity, extract, NULL);
         }
-
-        while (get_id3v2_frame(&header, &fheader)) {
-            print_id3v2_frame_header(&fheader, verbosity);
-            print_id3v2_frame(&fheader, verbosity, extract);
-            free(fheader.data);
+        if (opts.verify_crc && !verify_id3v2_crc(&header)) {
+            fprintf(stderr, "CRC mismatch in %s\n", argv[i]);
+            status = 1;
         }
+        free_id3v2_tag(&header);
+        close(fd);
     }
-    free(header.frame_data);
-    return 0;
+    close_metadata_cache(cache);
+    free(stats);
+    close_extract_store(opts.extract_opts.store);
+    if (!tar_close(opts.extract_opts.tar)) {
+        fprintf(stderr, "Couldn't write archive %s\n", opts.tar_path);
+        return 1;
+    }
+    return status;
 }
@@ -7,9 +7,13 @@
 #ifndef _ID3V2_H
 #define _ID3V2_H
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 
 // Used for 3 byte integer values
 typedef struct uint24 { uint8_t byte[3]; } uint24_t;
@@ -25,13 +29,19 @@ typedef struct uint24 { uint8_t byte[3]; } uint24_t;
 #define ID3V2_HEADER_ID_SIZE 3
 #define ID3V2_SUPPORTED_VERSION 4
 #define ID3V2_HEADER_SIZE 10
+// Sizes in a tag are 28 bit synchsafe integers
+#define ID3V2_MAX_SIZE 0x0FFFFFFF
 
 #define ID3V2_EXTENDED_HEADER_MIN_SIZE 6
+#define ID3V2_EXTENDED_HEADER_MAX_SIZE 15
 #define ID3V2_EXTENDED_FLAG_SIZE 0x01
 
 #define ID3V2_EXTENDED_HEADER_UPDATE_BIT           0x40
 #define ID3V2_EXTENDED_HEADER_CRC_BIT              0x20
 #define ID3V2_EXTENDED_HEADER_TAG_RESTRICTIONS_BIT 0x10
+// The 2.3 extended header has 2 flag bytes and the padding size instead
+#define ID3V23_EXTENDED_FLAGS_SIZE     2
+#define ID3V23_EXTENDED_HEADER_CRC_BIT 0x80
 
 #define ID3V2_RESTRICTION_TAG_SIZE_BITS       0xC0
 #define ID3V2_RESTRICTION_TEXT_ENCODING_BITS  0x20
@@ -77,6 +87,7 @@ struct id3v2_extended_header {
     short crc_present;
     short restrictions;
     uint32_t crc;
+    uint32_t padding_size; // Version 3 only
     enum id3v2_restriction_tag_size tag_size_restrict;
     enum id3v2_restriction_text_encoding text_enc_restrict;
     enum id3v2_restriction_text_size text_size_restrict;
@@ -114,8 +125,29 @@ struct id3v2_header {
     size_t frame_data_len;
     size_t i;
     struct id3v2_footer footer;
+    int fd;                  // File the tag was read from
+    off_t offset;            // File offset of the tag header
+    off_t frame_data_offset; // File offset of the frame data
+    unsigned int frames;     // Number of frames read so far
+    size_t padding;          // Bytes after the last frame, once reached
+    void *map;               // Mapping of the file holding frame_data
+    size_t map_len;
+    size_t budget;           // Bytes decoded frame data may still take
+    uint8_t *resync_data;    // Resynchronized copy of a whole 2.3 tag
+    int verify_crc;          // Compute the CRC of frames as they're read
+    uint32_t frames_crc;     // CRC-32 of the frame data read so far
+    short frames_crc_done;   // frames_crc covers all the frame data
 };
 
+// Decoded frame data of one tag may take at most this much memory at once
+#define ID3V2_DEFAULT_BUDGET (64 << 20)
+// Untransformed frames larger than this are read in place, not copied
+#define ID3V2_COPY_THRESHOLD (64 << 10)
+// zlib can't expand data by more than this
+#define ID3V2_MAX_INFLATE_RATIO 1032
+// Zero bytes after copied frame data, enough to end any encoded string
+#define ID3V2_DATA_TERMINATOR_SIZE 2
+
 // Frame header
 #define ID3V2_FRAME_HEADER_TAG_ALTER_BIT  0x40
 #define ID3V2_FRAME_HEADER_FILE_ALTER_BIT 0x20
@@ -144,6 +176,9 @@ struct id3v2_frame_header {
     uint8_t group_id;
     uint32_t data_len;
     uint8_t *data;
+    size_t raw_len;    // Length of the data as stored in the tag
+    off_t data_offset; // File offset of data if stored verbatim, else -1
+    size_t alloc_len;  // Bytes allocated for data, 0 if read in place
 };
 
 // Encodings
@@ -245,29 +280,34 @@ enum id3v2_encoding {
 struct id3v2_frame_UFID {
     char *owner;
     uint8_t *id;
+    size_t id_len;
 };
 
 // T000-TZZZ, excluding TXXX
 struct id3v2_frame_text {
     uint8_t encoding;
     char *text;
+    size_t text_len;
 };
 
 struct id3v2_frame_TXXX {
     uint8_t encoding;
     char *description;
     char *value;
+    size_t value_len;
 };
 
 // W000-WZZZ, excluding WXXX
 struct id3v2_frame_url {
     char *url;
+    size_t url_len;
 };
 
 struct id3v2_frame_WXXX {
     uint8_t encoding;
     char *description;
     char *url;
+    size_t url_len;
 };
 
 struct id3v2_frame_MCDI {
@@ -487,6 +527,7 @@ struct id3v2_frame_AENC {
     uint16_t preview_start;
     uint16_t preview_length;
     uint8_t *encryption_info;
+    size_t encryption_info_len;
 };
 
 struct id3v2_frame_LINK {
@@ -534,11 +575,54 @@ void resynchronize(const uint8_t *data, size_t len, uint8_t *outdata);
 // Check for compliance with spec and return 1 on success
 int verify_id3v2_header(struct id3v2_header *header);
 int verify_id3v2_frame_header(struct id3v2_frame_header *fheader);
+int verify_id3v2_crc(struct id3v2_header *header);
+int verify_id3v2_frame_id(const char *id);
+int verify_id3v2_tag_restrictions(struct id3v2_header *header);
+int verify_id3v2_frame_restrictions(struct id3v2_header *header,
+        struct id3v2_frame_header *fheader, const uint8_t *data, size_t len);
+
+// Validation of whole files, without decoding more than checks need.
+// Each result is also the exit status of id3al --check.
+enum id3v2_check_status {
+    ID3V2_CHECK_OK = 0,
+    ID3V2_CHECK_FAILED = 1,     // The check couldn't be run
+    ID3V2_CHECK_UNREADABLE = 2, // The file couldn't be opened or read
+    ID3V2_CHECK_NO_TAG = 3,
+    ID3V2_CHECK_BAD_HEADER = 4, // Header, extended header or footer
+    ID3V2_CHECK_BAD_FRAME = 5,  // Frame header, size or padding
+    ID3V2_CHECK_BAD_CRC = 6,
+    ID3V2_CHECK_RESTRICTED = 7  // Breaks the tag's own restrictions
+};
 
-// Find and decode the next ID3v2 tag in the file
-// Caller must free the frame data
+enum id3v2_check_status check_id3v2_file(const char *path);
+const char *check_status_str(enum id3v2_check_status status);
+int check_files(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp);
+
+// Find and decode the next ID3v2 tag in the file. Frames are read in
+// place from a mapping of the file.
+// Caller must release the tag with free_id3v2_tag
 // Return 1 if successful, 0 otherwise
 int get_id3v2_tag(int fd, struct id3v2_header *header);
+void free_id3v2_tag(struct id3v2_header *header);
+
+// Search the len bytes at data for the first valid tag header, which is
+// parsed into header
+// Return the offset just past the header, or 0 if there is none
+size_t find_id3v2_header(const uint8_t *data, size_t len,
+        struct id3v2_header *header);
+
+// Parse the header and any extended header of the tag at the start of the
+// len bytes at data, without its frames. frame_data is left NULL with
+// frame_data_offset counted from data, so frame headers can be read
+// elsewhere and parsed with parse_id3v2_frame_header.
+// Return 1 if successful, 0 otherwise
+int parse_id3v2_tag_header(const uint8_t *data, size_t len,
+        struct id3v2_header *header);
+
+// Get the bytes taken by the tag whose header or footer is at data,
+// including both, or 0 if data holds neither
+size_t get_id3v2_tag_extent(const uint8_t *data);
 
 // Get the next id3v2 frame from the tag.
 //
@@ -550,28 +634,152 @@ int get_id3v2_tag(int fd, struct id3v2_header *header);
 // header will contain the next frame header information
 // group_id will contain the grouping identifier, if one is present
 // frame_data will contain resynchronized, uncompressed frame data,
-//     and must be freed by the caller
+//     to be released with free_id3v2_frame_data
 // frame_data_len will contain the length of the frame data
 //
 // Returns 1 if a frame was retrieved successfully, 0 otherwise
 int get_id3v2_frame(struct id3v2_header *idheader,
         struct id3v2_frame_header *header);
 
+// Get the next id3v2 frame header from the tag without decoding its data.
+// header->data points at the data as stored in the tag and must not be
+// freed. Frames that aren't needed are skipped for free this way.
+// At the end of the frames idheader->padding is set to the number of
+// bytes left in the tag.
+//
+// Returns 1 if a frame was retrieved successfully, 0 otherwise
+int get_id3v2_frame_header(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header);
+
+// Parse a frame header and its flag data from the len bytes at data,
+// which must hold at least ID3V2_FRAME_HEADER_SIZE, for a tag of version.
+// The data isn't touched; header->raw_len is set to its length.
+// Return the length of the header with its flag data, or 0 on failure
+size_t parse_id3v2_frame_header(const uint8_t *data, size_t len,
+        uint8_t version, struct id3v2_frame_header *header);
+
+// Decode the data of a frame from get_id3v2_frame_header, replacing
+// header->data with resynchronized, uncompressed frame data which
+// must be released with free_id3v2_frame_data. Large frames that need
+// no decoding are left in place. Data that would take more than
+// idheader->budget bytes isn't decoded, and compressed data is refused
+// if it claims to expand more than zlib can.
+//
+// Returns 1 if the data was decoded successfully, 0 otherwise
+int get_id3v2_frame_data(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header);
+void free_id3v2_frame_data(struct id3v2_header *idheader,
+        struct id3v2_frame_header *header);
+
+// Writing tags. Only version 4 tags are written, and frames are
+// unsynchronised one by one where their data holds false syncs.
+// Compressed and encrypted frames aren't supported.
+//
+// size_id3v2_tag lays out a tag from header, with the extended header and
+// footer it flags, nframes frames with their id, flags, data and data_len,
+// and padding bytes of padding. The tag size, extended header size and
+// each frame's size, raw_len and unsynchronisation are filled in.
+// Returns the length of the whole tag, or 0 if it can't be written.
+size_t size_id3v2_tag(struct id3v2_header *header,
+        struct id3v2_frame_header *frames, size_t nframes, size_t padding);
+// Write a tag laid out by size_id3v2_tag into the len bytes it returned
+void encode_id3v2_tag(const struct id3v2_header *header,
+        const struct id3v2_frame_header *frames, size_t nframes,
+        uint8_t *buf, size_t len);
+// Lay out and write a tag into a buffer allocated once, to be freed
+// Returns the buffer with its length in len, or NULL on failure
+uint8_t *serialize_id3v2_tag(struct id3v2_header *header,
+        struct id3v2_frame_header *frames, size_t nframes, size_t padding,
+        size_t *len);
+
+// Updating the tag of a file. A new tag that fits in the old one's place
+// is written over it with one pwrite, its padding taking up the slack.
+// Otherwise the file is rebuilt with the new tag, with padding from a
+// policy to let later updates be made in place. The rebuilt file is
+// written next to the old one and renamed over it, so an interrupted
+// rebuild leaves the old file whole, but other hard links to it keep the
+// old tag.
+struct id3v2_padding_policy {
+    size_t min;           // Padding for a rebuilt tag is at least min
+    unsigned int percent; // and percent of the tag's size,
+    size_t max;           // but at most max,
+    size_t align;         // then the tag is rounded up to a multiple of
+                          // align bytes, if it's not 0
+};
+#define ID3V2_DEFAULT_PADDING_MIN 1024
+#define ID3V2_DEFAULT_PADDING_PERCENT 10
+#define ID3V2_DEFAULT_PADDING_MAX (1 << 20)
+
+// Flags for update_id3v2_tag and shrink_id3v2_file
+#define ID3V2_UPDATE_SYNC    0x01 // fdatasync once the tag is written
+#define ID3V2_UPDATE_DRY_RUN 0x02 // Only work out what shrinking reclaims
+
+// Get the padding for a rebuilt tag of len bytes without any, following
+// policy, or the defaults if it's NULL
+size_t grow_id3v2_padding(const struct id3v2_padding_policy *policy,
+        size_t len);
+// Replace the tag old, from get_id3v2_tag on fd, the file at path, with
+// one laid out from header and frames as by size_id3v2_tag, or add one at
+// the start of the file if old is NULL. fd must be open for writing. The
+// frames may be read in place from old, which should only be freed
+// afterwards.
+// Return 1 on success, 0 otherwise
+int update_id3v2_tag(const char *path, int fd, struct id3v2_header *old,
+        struct id3v2_header *header, struct id3v2_frame_header *frames,
+        size_t nframes, const struct id3v2_padding_policy *policy,
+        int flags);
+// Set text frames in the tag of the file at path, given as ID=TEXT and
+// written as UTF-8, replacing frames with the same IDs. An empty TEXT
+// removes a frame. Other frames are kept. Tags of versions before 4 are
+// refused rather than converted.
+// Return 1 on success, 0 otherwise
+int set_id3v2_text_frames(const char *path, char * const sets[], int count,
+        const struct id3v2_padding_policy *policy, int flags);
+// Drop the frames with the count IDs given from the tag of the file at
+// path, and padding beyond policy's min, cutting the space freed out of
+// the file. Whole filesystem blocks of it are cut, and what's left kept
+// as padding; a tag with a footer has exactly the space freed cut. The
+// blocks are collapsed out without moving the audio, or where the
+// filesystem can't collapse, the file is rebuilt as by update_id3v2_tag.
+// reclaimed is set to the bytes the file shrank by, or for
+// ID3V2_UPDATE_DRY_RUN the bytes it would. Tags of versions before 4 are
+// refused.
+// Return 1 on success, including for a file without a tag, 0 otherwise
+int shrink_id3v2_file(const char *path, char * const ids[], int count,
+        const struct id3v2_padding_policy *policy, int flags,
+        off_t *reclaimed);
+int shrink_files(char * const files[], int nfiles, char * const ids[],
+        int count, const struct id3v2_padding_policy *policy, int flags,
+        FILE *fp);
+
 // Get the length of a terminated encoded string in bytes,
 // including the terminator.
 size_t strlen_enc(const char *str, enum id3v2_encoding enc);
-
-// Parse frame data
-int parse_AENC_frame(uint8_t *fdata, struct id3v2_frame_AENC *frame);
+// Get the length of an encoded string terminated within max bytes,
+// including the terminator, or 0 if it isn't
+size_t strnlen_enc(const char *str, size_t max, enum id3v2_encoding enc);
+
+// Parse frame data. Large frames are read in place from the file, without
+// a terminator after them, so strings are only looked for within the
+// frame. The strings before the last field are terminated, and the last
+// field's length is given.
+// Return 1 on success, 0 if the frame is too short for its fields
+int parse_AENC_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_AENC *frame);
 int parse_APIC_frame(struct id3v2_frame_header *header,
         struct id3v2_frame_APIC *frame);
 int parse_COMM_frame(struct id3v2_frame_header *header,
         struct id3v2_frame_COMM *frame);
-int parse_UFID_frame(uint8_t *fdata, struct id3v2_frame_UFID *frame);
-int parse_text_frame(uint8_t *fdata, struct id3v2_frame_text *frame);
-int parse_TXXX_frame(uint8_t *fdata, struct id3v2_frame_TXXX *frame);
-int parse_url_frame(uint8_t *fdata, struct id3v2_frame_url *frame);
-int parse_WXXX_frame(uint8_t *fdata, struct id3v2_frame_WXXX *frame);
+int parse_UFID_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_UFID *frame);
+int parse_text_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_text *frame);
+int parse_TXXX_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_TXXX *frame);
+int parse_url_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_url *frame);
+int parse_WXXX_frame(struct id3v2_frame_header *header,
+        struct id3v2_frame_WXXX *frame);
 
 // Convenience functions for extracting useful information
 enum id3v2_restriction_tag_size get_tag_size_restriction(uint8_t flags);
@@ -581,6 +789,7 @@ enum id3v2_restriction_text_size get_text_size_restriction(uint8_t flags);
 enum id3v2_restriction_image_encoding get_image_encoding_restriction(
         uint8_t flags);
 enum id3v2_restriction_image_size get_image_size_restriction(uint8_t flags);
+int frame_has_encoding(const char *id);
 
 // Describe various constants
 const char *boolstr(int b);
@@ -597,14 +806,234 @@ const char *sync_text_str(enum id3v2_SYLT_text text_type);
 const char *channel_str(enum id3v2_RVA2_channel_type channel);
 const char *interp_str(enum id3v2_EQU2_interpolation_method interp);
 const char *pic_type_str(enum id3v2_APIC_picture_type pic_type);
+const char *mime_ext(const char *mime_type);
+
+// Profiling of the stages of reading tags
+enum profile_phase {
+    PROFILE_OPEN,
+    PROFILE_MAP,
+    PROFILE_SCAN,
+    PROFILE_RESYNC,
+    PROFILE_INFLATE,
+    PROFILE_TRANSCODE,
+    PROFILE_OUTPUT,     // Printing frames, including their transcoding
+    PROFILE_WRITE,      // Writing tags and moving audio to make room
+    PROFILE_PHASES
+};
+
+enum profile_counter {
+    PROFILE_FILES,
+    PROFILE_BYTES_MAPPED,
+    PROFILE_BYTES_SCANNED,
+    PROFILE_BYTES_DECODED,
+    PROFILE_BYTES_TRANSCODED,
+    PROFILE_FRAMES,
+    PROFILE_FRAMES_SKIPPED,
+    PROFILE_ALLOCATIONS,
+    PROFILE_BYTES_ALLOCATED,
+    PROFILE_FREES,
+    PROFILE_BYTES_WRITTEN,
+    PROFILE_BYTES_MOVED,
+    PROFILE_COUNTERS
+};
+
+extern int profile_enabled;
+void profile_enable(void);
+uint64_t profile_now(void);
+void profile_add_time(enum profile_phase phase, uint64_t start);
+void profile_add_count(enum profile_counter counter, uint64_t count);
+void print_profile(FILE *fp, int json);
+
+// Allocation for the tag reading functions, counting allocations and
+// each thread's live and peak bytes while profiling
+void *profile_malloc(size_t size);
+void *profile_realloc(void *ptr, size_t size);
+void profile_free(void *ptr);
+
+// Time a phase from PROFILE_START to PROFILE_END and add to counters,
+// each costing only a test of profile_enabled while profiling is off
+#define PROFILE_START() (profile_enabled ? profile_now() : 0)
+#define PROFILE_END(phase, start) \
+    do { \
+        if (start) { \
+            profile_add_time(phase, start); \
+        } \
+    } while (0)
+#define PROFILE_COUNT(counter, count) \
+    do { \
+        if (profile_enabled) { \
+            profile_add_count(counter, count); \
+        } \
+    } while (0)
+
+// Hashing
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+// Incremental hashing of data too large to hold at once
+struct hash64_state {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t buffer[32];
+    size_t buffered;
+};
+void hash64_init(struct hash64_state *state, uint64_t seed);
+void hash64_update(struct hash64_state *state, const void *data, size_t len);
+uint64_t hash64_final(const struct hash64_state *state);
+
+// Lock-free set of 64 bit hashes, shared between threads
+struct hashset;
+struct hashset *hashset_create(size_t capacity);
+void hashset_free(struct hashset *set);
+int hashset_insert(struct hashset *set, uint64_t key);
+int hashset_contains(struct hashset *set, uint64_t key);
+int hashset_remove(struct hashset *set, uint64_t key);
+size_t hashset_count(struct hashset *set);
+
+// Thread pools. Items are taken from a work queue by index until it runs
+// out, by threads each passed their own slice of args.
+struct work_queue {
+    int count;
+    atomic_int next;
+};
+unsigned int pool_size(unsigned int workers, unsigned int min, int count);
+void init_work_queue(struct work_queue *queue, int count);
+int next_work(struct work_queue *queue);
+unsigned int run_pool(void *(*worker)(void *), void *args, size_t size,
+        unsigned int nthreads);
+
+// File I/O
+// Write a buffer completely, retrying after short writes
+// Returns 1 on success, 0 otherwise
+int write_all(int fd, const uint8_t *data, size_t len);
+// Copy len bytes at offset in the file in to the current position of out
+// within the kernel. Returns the number of bytes copied, which is short
+// if the kernel can't copy between these files.
+size_t copy_range(int in, off_t offset, int out, size_t len);
+
+// Streaming tar archives
+struct tar_writer;
+struct tar_writer *tar_open(const char *path);
+int tar_add(struct tar_writer *tar, const char *name, const uint8_t *data,
+        size_t len, time_t mtime);
+int tar_close(struct tar_writer *tar);
+
+// Extraction of embedded objects
+struct extract_store;
+
+struct extract_options {
+    const char *dir;    // Directory to write to, NULL for the cwd
+    const char *name;   // File name pattern, NULL for id3al-XXXXXX
+    const char *source; // Name of the file the tag was read from
+    int fd;             // Descriptor of the file the tag was read from
+    unsigned int index; // Index of the frame within the tag
+    struct extract_store *store; // Deduplicating store, or NULL
+    struct tar_writer *tar;      // Archive to write to, or NULL
+};
+
+// Open a store that keeps one copy of each distinct object in dir,
+// named by a hash of its contents. Hashes of stored objects persist in
+// an index file so later runs don't store them again.
+// Returns the store, or NULL on failure
+struct extract_store *open_extract_store(const char *dir);
+void close_extract_store(struct extract_store *store);
+
+// Write the decoded data of a frame from get_id3v2_frame_header to outfd
+// Return 1 if successful, 0 otherwise
+int dump_frame(struct id3v2_header *idheader,
+        struct id3v2_frame_header *fheader, int outfd);
+
+// Write an embedded object to a new file named by ex.
+// data holds len bytes of the object. If offset is not -1 the same bytes
+// are stored verbatim at that offset of ex->fd, and are copied from there
+// within the kernel instead.
+// Returns the name of the file, which must be freed, or NULL on failure
+char *extract_object(struct extract_options *ex, const char *ext,
+        const uint8_t *data, size_t len, off_t offset);
+
+// Persistent cache of rendered output, keyed by file identity
+struct metadata_cache;
+
+// Open the cache file at path, creating it if needed. Entries are only
+// returned for lookups made with the same options fingerprint.
+// Returns the cache, or NULL on failure
+struct metadata_cache *open_metadata_cache(const char *path,
+        uint64_t options);
+void close_metadata_cache(struct metadata_cache *cache);
+
+// Find the output cached for the file described by st. The data remains
+// valid until the cache is closed.
+// Return 1 and set data and len if found, 0 otherwise
+int metadata_cache_lookup(struct metadata_cache *cache, const struct stat *st,
+        const uint8_t **data, size_t *len);
+
+// Add the output rendered for the file described by st
+// Return 1 on success, 0 otherwise
+int metadata_cache_store(struct metadata_cache *cache, const struct stat *st,
+        const uint8_t *data, size_t len);
+
+// Serve tag queries on a Unix domain socket until interrupted, with
+// workers threads, or one per CPU if workers is 0
+// Return 1 after a clean shutdown, 0 on failure
+int run_server(const char *path, unsigned int workers, int verbosity);
+
+// Read files under dir as they are written or moved in, until
+// interrupted, with workers threads, or one per CPU if workers is 0.
+// Listings are also added to cache if it isn't NULL.
+// Return 1 after a clean shutdown, 0 on failure
+int run_watch(const char *dir, unsigned int workers, int verbosity,
+        struct metadata_cache *cache);
+
+// Hash the audio of each file, leaving out its tags, with workers threads,
+// or at least one per CPU if workers is 0, and print the groups of files
+// with the same audio to fp
+// Return 1 if every file was read, 0 otherwise
+int hash_audio(char * const files[], int nfiles, unsigned int workers,
+        int verbosity, FILE *fp);
+
+// Count tag versions, sizes, padding, frame IDs and encodings over the
+// files from their headers alone, with workers threads, or one per CPU if
+// workers is 0, and print the totals to fp
+// Return 1 on success, 0 otherwise
+int print_tag_stats(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp);
+
+// Print how many bytes the tag of each file takes, how many of those are
+// used and how many are padding, reading only the tag and frame headers,
+// with workers threads, or one per CPU if workers is 0
+// Return 1 if every file was read, 0 otherwise
+int print_tag_survey(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp);
+
+// Inverted index of frame values
+// Build an index of the text, TXXX and COMM values in files at path
+// Return 1 on success, 0 otherwise
+int build_index(const char *path, char * const files[], int nfiles);
+// Print the files matching all the terms, like TPE1=value or TDRC<2000
+// Return 1 on success, 0 otherwise
+int query_index(const char *path, char * const terms[], int nterms,
+        FILE *fp);
 
 // Output
-void print_id3v2_header(struct id3v2_header *header, int verbosity);
-void print_id3v2_extended_header(struct id3v2_extended_header *eheader,
+void print_id3v2_header(FILE *fp, struct id3v2_header *header,
         int verbosity);
-void print_id3v2_frame_header(struct id3v2_frame_header *fheader,
+void print_id3v2_extended_header(FILE *fp,
+        struct id3v2_extended_header *eheader, int verbosity);
+void print_id3v2_frame_header(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-void print_id3v2_frame(struct id3v2_frame_header *header,
-        int verbosity, int extract);
+void print_id3v2_frame(FILE *fp, struct id3v2_frame_header *header,
+        int verbosity, struct extract_options *extract);
+void print_id3v2_tag(FILE *fp, struct id3v2_header *header, int verbosity,
+        struct extract_options *extract, const char *frames);
+// Print the string with the given encoding as UTF-8. len should be -1
+// for NULL terminated strings and the length in bytes otherwise.
+// Returns the number of bytes printed on success, -1 otherwise.
+int print_enc(FILE *fp, const char *str, int len, enum id3v2_encoding enc);
+// Decode len bytes of UTF-16 text into host order units, skipping a BOM.
+// bigendian is the byte order to assume without one. text must have room
+// for len / 2 units.
+// Returns the number of units
+int32_t decode_utf16(const char *str, size_t len, int bigendian,
+        uint16_t *text);
 
 #endif // _ID3V2_H
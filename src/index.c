@@ -0,0 +1,931 @@
+// Implementation of the inverted index of frame values
+// Copyright 2015 David Gloe.
+//
+// The index maps each term, a field name and a case-folded value, to the
+// sorted list of files containing it. Fields are text frame IDs such as
+// TPE1, COMM for comments, and TXXX:description for user defined text.
+//
+// Index file layout, in native byte order:
+//     struct index_header
+//     uint64_t path offset for each file, into the strings
+//     struct index_term for each term, sorted by key
+//     strings: NUL terminated paths, then term keys
+//     postings: for each term, file ids as varint encoded deltas
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "unicode/uchar.h"
+#include "unicode/ustring.h"
+#include "id3v2.h"
+
+#define INDEX_MAGIC "ID3ALINV"
+#define INDEX_MAGIC_SIZE 8
+#define INDEX_VERSION 1
+#define INDEX_MIN_TERMS 1024
+// Keys are the field name and value separated by a NUL
+#define INDEX_KEY_SEP '\0'
+
+struct index_header {
+    char magic[INDEX_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t files;
+    uint64_t terms;
+    uint64_t paths_offset;
+    uint64_t terms_offset;
+    uint64_t strings_offset;
+    uint64_t postings_offset;
+    uint64_t size;
+};
+
+struct index_term {
+    uint64_t key_offset;
+    uint32_t key_len;
+    uint32_t count;
+    uint64_t postings_offset;
+    uint64_t postings_len;
+};
+
+// A term while the index is being built
+struct build_term {
+    char *key;
+    uint32_t key_len;
+    uint64_t hash;
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct index_builder {
+    struct build_term **slots;
+    size_t mask;
+    size_t count;
+    UChar *text;
+    int32_t text_size;
+    UChar *folded;
+    int32_t folded_size;
+    char *utf8;
+    int32_t utf8_size;
+};
+
+struct index_reader {
+    uint8_t *map;
+    size_t len;
+    const struct index_header *header;
+    const uint64_t *paths;
+    const struct index_term *terms;
+};
+
+// Grow a buffer of UChars to hold at least size
+static int reserve_uchars(UChar **buf, int32_t *cur, int32_t size) {
+    UChar *p;
+
+    if (size <= *cur) {
+        return 1;
+    }
+    p = realloc(*buf, size * sizeof(UChar));
+    if (p == NULL) {
+        debug("realloc %zu failed: %m", size * sizeof(UChar));
+        return 0;
+    }
+    *buf = p;
+    *cur = size;
+    return 1;
+}
+
+// Decode len bytes of text in an ID3v2 encoding into builder->text
+// Returns the number of UTF-16 units, or -1 on failure
+static int32_t decode_text(struct index_builder *builder, const uint8_t *data,
+        size_t len, enum id3v2_encoding enc) {
+    UErrorCode uerr = U_ZERO_ERROR;
+    int32_t units, i;
+
+    switch (enc) {
+        case ID3V2_ENCODING_UTF_16:
+        case ID3V2_ENCODING_UTF_16BE:
+            if (!reserve_uchars(&builder->text, &builder->text_size,
+                        len / sizeof(UChar) + 1)) {
+                return -1;
+            }
+            return decode_utf16((const char *)data, len,
+                    enc == ID3V2_ENCODING_UTF_16BE, builder->text);
+        case ID3V2_ENCODING_UTF_8:
+            if (!reserve_uchars(&builder->text, &builder->text_size,
+                        len + 1)) {
+                return -1;
+            }
+            u_strFromUTF8Lenient(builder->text, builder->text_size, &units,
+                    (const char *)data, len, &uerr);
+            if (U_FAILURE(uerr)) {
+                debug("Conversion from UTF-8 failed: %s", u_errorName(uerr));
+                return -1;
+            }
+            return units;
+        default:
+            if (!reserve_uchars(&builder->text, &builder->text_size,
+                        len + 1)) {
+                return -1;
+            }
+            for (i = 0; i < len; i++) {
+                builder->text[i] = data[i];
+            }
+            return len;
+    }
+}
+
+static int is_space(UChar c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Case fold and trim a value, converting it to UTF-8 in builder->utf8
+// Returns the length in bytes, or -1 on failure
+static int32_t normalize(struct index_builder *builder, const UChar *text,
+        int32_t units) {
+    UErrorCode uerr = U_ZERO_ERROR;
+    int32_t folded, len;
+
+    while (units > 0 && is_space(*text)) {
+        text++;
+        units--;
+    }
+    while (units > 0 && is_space(text[units - 1])) {
+        units--;
+    }
+    // Folding expands a unit into at most three
+    if (!reserve_uchars(&builder->folded, &builder->folded_size,
+                units * 3 + 1)) {
+        return -1;
+    }
+    folded = u_strFoldCase(builder->folded, builder->folded_size, text,
+            units, U_FOLD_CASE_DEFAULT, &uerr);
+    if (U_FAILURE(uerr)) {
+        debug("Case folding failed: %s", u_errorName(uerr));
+        return -1;
+    }
+    if (folded * 3 + 1 > builder->utf8_size) {
+        free(builder->utf8);
+        builder->utf8 = malloc(folded * 3 + 1);
+        if (builder->utf8 == NULL) {
+            builder->utf8_size = 0;
+            return -1;
+        }
+        builder->utf8_size = folded * 3 + 1;
+    }
+    u_strToUTF8(builder->utf8, builder->utf8_size, &len, builder->folded,
+            folded, &uerr);
+    if (U_FAILURE(uerr)) {
+        debug("Conversion to UTF-8 failed: %s", u_errorName(uerr));
+        return -1;
+    }
+    return len;
+}
+
+static void free_builder(struct index_builder *builder) {
+    size_t i;
+
+    for (i = 0; builder->slots && i <= builder->mask; i++) {
+        if (builder->slots[i]) {
+            free(builder->slots[i]->key);
+            free(builder->slots[i]->ids);
+            free(builder->slots[i]);
+        }
+    }
+    free(builder->slots);
+    free(builder->text);
+    free(builder->folded);
+    free(builder->utf8);
+}
+
+static int init_builder(struct index_builder *builder) {
+    memset(builder, 0, sizeof(*builder));
+    builder->slots = calloc(INDEX_MIN_TERMS, sizeof(*builder->slots));
+    if (builder->slots == NULL) {
+        debug("calloc failed: %m");
+        return 0;
+    }
+    builder->mask = INDEX_MIN_TERMS - 1;
+    return 1;
+}
+
+// Double the term table
+static int grow_terms(struct index_builder *builder) {
+    struct build_term **slots;
+    size_t size = (builder->mask + 1) * 2, i, j;
+
+    slots = calloc(size, sizeof(*slots));
+    if (slots == NULL) {
+        debug("calloc failed: %m");
+        return 0;
+    }
+    for (i = 0; i <= builder->mask; i++) {
+        if (builder->slots[i]) {
+            j = builder->slots[i]->hash & (size - 1);
+            while (slots[j]) {
+                j = (j + 1) & (size - 1);
+            }
+            slots[j] = builder->slots[i];
+        }
+    }
+    free(builder->slots);
+    builder->slots = slots;
+    builder->mask = size - 1;
+    return 1;
+}
+
+// Add a file to the postings of a term
+// Returns 1 on success, 0 otherwise
+static int add_posting(struct index_builder *builder, const char *key,
+        uint32_t key_len, uint32_t id) {
+    struct build_term *term;
+    uint64_t hash = hash64(key, key_len, 0);
+    uint32_t *ids;
+    size_t i;
+
+    if (builder->count >= (builder->mask + 1) / 4 * 3 &&
+            !grow_terms(builder)) {
+        return 0;
+    }
+    i = hash & builder->mask;
+    while ((term = builder->slots[i]) && (term->hash != hash ||
+                term->key_len != key_len || memcmp(term->key, key, key_len))) {
+        i = (i + 1) & builder->mask;
+    }
+    if (term == NULL) {
+        term = calloc(1, sizeof(*term));
+        if (term == NULL || (term->key = malloc(key_len)) == NULL) {
+            debug("malloc failed: %m");
+            free(term);
+            return 0;
+        }
+        memcpy(term->key, key, key_len);
+        term->key_len = key_len;
+        term->hash = hash;
+        builder->slots[i] = term;
+        builder->count++;
+    }
+    // Files are added in order, so lists stay sorted
+    if (term->count && term->ids[term->count - 1] == id) {
+        return 1;
+    }
+    if (term->count == term->cap) {
+        term->cap = term->cap ? term->cap * 2 : 4;
+        ids = realloc(term->ids, term->cap * sizeof(*ids));
+        if (ids == NULL) {
+            debug("realloc failed: %m");
+            return 0;
+        }
+        term->ids = ids;
+    }
+    term->ids[term->count++] = id;
+    return 1;
+}
+
+// Add a term for each of the NUL separated values in text
+// Returns 1 on success, 0 otherwise
+static int add_values(struct index_builder *builder, const char *field,
+        const UChar *text, int32_t units, uint32_t id) {
+    char *key;
+    size_t field_len = strlen(field);
+    int32_t start = 0, end, len;
+
+    while (start < units) {
+        for (end = start; end < units && text[end]; end++);
+        len = normalize(builder, text + start, end - start);
+        if (len == -1) {
+            return 0;
+        }
+        if (len > 0) {
+            key = malloc(field_len + 1 + len);
+            if (key == NULL) {
+                return 0;
+            }
+            memcpy(key, field, field_len);
+            key[field_len] = INDEX_KEY_SEP;
+            memcpy(key + field_len + 1, builder->utf8, len);
+            if (!add_posting(builder, key, field_len + 1 + len, id)) {
+                free(key);
+                return 0;
+            }
+            free(key);
+        }
+        start = end + 1;
+    }
+    return 1;
+}
+
+static size_t terminator_len(enum id3v2_encoding enc) {
+    return enc == ID3V2_ENCODING_UTF_16 || enc == ID3V2_ENCODING_UTF_16BE ?
+        2 : 1;
+}
+
+// Add the values of a frame to the index
+// Returns 1 on success, 0 otherwise
+static int index_frame(struct index_builder *builder,
+        struct id3v2_frame_header *fheader, uint32_t id) {
+    struct id3v2_frame_text text;
+    struct id3v2_frame_TXXX txxx;
+    struct id3v2_frame_COMM comm;
+    const uint8_t *data;
+    char *field;
+    size_t len;
+    int32_t units, flen;
+    int ret;
+
+    if (fheader->data_len < 1) {
+        return 1;
+    }
+    if (!strcmp(fheader->id, ID3V2_FRAME_ID_TXXX)) {
+        if (!parse_TXXX_frame(fheader, &txxx)) {
+            return 1;
+        }
+        data = (const uint8_t *)txxx.description;
+        len = txxx.value - txxx.description -
+            terminator_len(txxx.encoding);
+        units = decode_text(builder, data, len, txxx.encoding);
+        flen = units == -1 ? -1 : normalize(builder, builder->text, units);
+        if (flen == -1 ||
+                asprintf(&field, "TXXX:%.*s", flen, builder->utf8) == -1) {
+            return 0;
+        }
+        units = decode_text(builder, (const uint8_t *)txxx.value,
+                txxx.value_len, txxx.encoding);
+        ret = units != -1 &&
+            add_values(builder, field, builder->text, units, id);
+        free(field);
+        return ret;
+    } else if (!strcmp(fheader->id, ID3V2_FRAME_ID_COMM)) {
+        if (!parse_COMM_frame(fheader, &comm)) {
+            return 1;
+        }
+        units = decode_text(builder, (const uint8_t *)comm.comment,
+                comm.comment_len, comm.encoding);
+        return units != -1 &&
+            add_values(builder, ID3V2_FRAME_ID_COMM, builder->text, units,
+                    id);
+    } else if (fheader->id[0] == 'T') {
+        if (!parse_text_frame(fheader, &text)) {
+            return 1;
+        }
+        units = decode_text(builder, (const uint8_t *)text.text,
+                text.text_len, text.encoding);
+        return units != -1 &&
+            add_values(builder, fheader->id, builder->text, units, id);
+    }
+    return 1;
+}
+
+// Add the frames of one file to the index
+// Returns 1 if the file had a tag, 0 otherwise
+static int index_file(struct index_builder *builder, const char *path,
+        uint32_t id) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        debug("Opening %s failed: %m", path);
+        return 0;
+    }
+    if (!get_id3v2_tag(fd, &header)) {
+        close(fd);
+        return 0;
+    }
+    while (get_id3v2_frame_header(&header, &fheader)) {
+        if (fheader.id[0] != 'T' &&
+                strcmp(fheader.id, ID3V2_FRAME_ID_COMM)) {
+            continue;
+        }
+        if (!get_id3v2_frame_data(&header, &fheader)) {
+            break;
+        }
+        index_frame(builder, &fheader, id);
+        free_id3v2_frame_data(&header, &fheader);
+    }
+    free_id3v2_tag(&header);
+    close(fd);
+    return 1;
+}
+
+static int compare_terms(const void *a, const void *b) {
+    const struct build_term *x = *(const struct build_term **)a;
+    const struct build_term *y = *(const struct build_term **)b;
+    int cmp;
+
+    cmp = memcmp(x->key, y->key, x->key_len < y->key_len ?
+            x->key_len : y->key_len);
+    if (cmp == 0) {
+        cmp = (x->key_len > y->key_len) - (x->key_len < y->key_len);
+    }
+    return cmp;
+}
+
+static size_t put_varint(uint8_t *out, uint32_t val) {
+    size_t len = 0;
+
+    while (val >= 0x80) {
+        out[len++] = val | 0x80;
+        val >>= 7;
+    }
+    out[len++] = val;
+    return len;
+}
+
+// Write the index to fp
+// Returns 1 on success, 0 otherwise
+static int write_index(struct index_builder *builder, FILE *fp,
+        char * const paths[], const uint32_t *path_ids, uint32_t files) {
+    struct index_header header;
+    struct index_term entry;
+    struct build_term **terms;
+    uint64_t offset, strings_len = 0, postings_len = 0;
+    uint8_t varint[5];
+    size_t i, j, n = 0;
+    uint32_t prev;
+    int ok = 1;
+
+    terms = malloc((builder->count + 1) * sizeof(*terms));
+    if (terms == NULL) {
+        debug("malloc failed: %m");
+        return 0;
+    }
+    for (i = 0; i <= builder->mask; i++) {
+        if (builder->slots[i]) {
+            terms[n++] = builder->slots[i];
+        }
+    }
+    qsort(terms, n, sizeof(*terms), compare_terms);
+
+    // Work out where everything goes before writing it in order
+    for (i = 0; i < files; i++) {
+        strings_len += strlen(paths[path_ids[i]]) + 1;
+    }
+    for (i = 0; i < n; i++) {
+        strings_len += terms[i]->key_len;
+        prev = 0;
+        for (j = 0; j < terms[i]->count; j++) {
+            postings_len += put_varint(varint, terms[i]->ids[j] - prev);
+            prev = terms[i]->ids[j];
+        }
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    header.version = INDEX_VERSION;
+    header.files = files;
+    header.terms = n;
+    header.paths_offset = sizeof(header);
+    header.terms_offset = header.paths_offset + files * sizeof(uint64_t);
+    header.strings_offset = header.terms_offset + n * sizeof(entry);
+    header.postings_offset = header.strings_offset + strings_len;
+    header.size = header.postings_offset + postings_len;
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    offset = header.strings_offset;
+    for (i = 0; ok && i < files; i++) {
+        ok = fwrite(&offset, sizeof(offset), 1, fp) == 1;
+        offset += strlen(paths[path_ids[i]]) + 1;
+    }
+    entry.postings_offset = header.postings_offset;
+    for (i = 0; ok && i < n; i++) {
+        entry.key_offset = offset;
+        entry.key_len = terms[i]->key_len;
+        entry.count = terms[i]->count;
+        entry.postings_len = 0;
+        prev = 0;
+        for (j = 0; j < terms[i]->count; j++) {
+            entry.postings_len += put_varint(varint, terms[i]->ids[j] - prev);
+            prev = terms[i]->ids[j];
+        }
+        ok = fwrite(&entry, sizeof(entry), 1, fp) == 1;
+        offset += terms[i]->key_len;
+        entry.postings_offset += entry.postings_len;
+    }
+    for (i = 0; ok && i < files; i++) {
+        ok = fwrite(paths[path_ids[i]], strlen(paths[path_ids[i]]) + 1, 1,
+                fp) == 1;
+    }
+    for (i = 0; ok && i < n; i++) {
+        ok = fwrite(terms[i]->key, terms[i]->key_len, 1, fp) == 1;
+    }
+    for (i = 0; ok && i < n; i++) {
+        prev = 0;
+        for (j = 0; ok && j < terms[i]->count; j++) {
+            ok = fwrite(varint, put_varint(varint, terms[i]->ids[j] - prev),
+                    1, fp) == 1;
+            prev = terms[i]->ids[j];
+        }
+    }
+    free(terms);
+    return ok;
+}
+
+// Build an index of the frame values in files, written to path
+// Returns 1 on success, 0 otherwise
+int build_index(const char *path, char * const files[], int nfiles) {
+    struct index_builder builder;
+    uint32_t *path_ids, count = 0;
+    char *tmp_path;
+    FILE *fp;
+    int fd, i, ok;
+
+    assert(path);
+
+    path_ids = calloc(nfiles, sizeof(*path_ids));
+    if ((path_ids == NULL && nfiles) || !init_builder(&builder)) {
+        free(path_ids);
+        return 0;
+    }
+    // Files without a tag get no id
+    for (i = 0; i < nfiles; i++) {
+        if (index_file(&builder, files[i], count)) {
+            path_ids[count++] = i;
+        }
+    }
+
+    // Replace any old index only once the new one is complete
+    if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1) {
+        free_builder(&builder);
+        free(path_ids);
+        return 0;
+    }
+    fd = mkstemp(tmp_path);
+    fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        debug("Creating %s failed: %m", tmp_path);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        ok = 0;
+    } else {
+        ok = write_index(&builder, fp, files, path_ids, count);
+        ok = !fchmod(fd, 0644) && !fclose(fp) && ok;
+        if (!ok || rename(tmp_path, path)) {
+            debug("Writing %s failed: %m", tmp_path);
+            unlink(tmp_path);
+            ok = 0;
+        }
+    }
+    free(tmp_path);
+    free_builder(&builder);
+    free(path_ids);
+    return ok;
+}
+
+// Check that every path and key lies in the strings and every posting
+// list in the postings, so a damaged index can't be read past its end
+// Returns 1 if they do, 0 otherwise
+static int check_offsets(const struct index_reader *reader) {
+    const struct index_header *header = reader->header;
+    const struct index_term *term;
+    uint64_t i, offset;
+
+    for (i = 0; i < header->files; i++) {
+        offset = reader->paths[i];
+        if (offset < header->strings_offset ||
+                offset >= header->postings_offset ||
+                memchr(reader->map + offset, 0,
+                    header->postings_offset - offset) == NULL) {
+            return 0;
+        }
+    }
+    for (i = 0; i < header->terms; i++) {
+        term = &reader->terms[i];
+        // Each id takes at least a byte
+        if (term->key_offset < header->strings_offset ||
+                term->key_offset > header->postings_offset ||
+                term->key_len > header->postings_offset - term->key_offset ||
+                term->postings_offset < header->postings_offset ||
+                term->postings_offset > header->size ||
+                term->postings_len > header->size - term->postings_offset ||
+                term->count > term->postings_len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Map an index and check that it is complete
+// Returns 1 on success, 0 otherwise
+static int open_index(const char *path, struct index_reader *reader) {
+    const struct index_header *header;
+    struct stat st;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        debug("Opening %s failed: %m", path);
+        return 0;
+    }
+    if (fstat(fd, &st) || st.st_size < sizeof(*header)) {
+        debug("%s is not an index", path);
+        close(fd);
+        return 0;
+    }
+    reader->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->map == MAP_FAILED) {
+        debug("mmap %s failed: %m", path);
+        reader->map = NULL;
+        return 0;
+    }
+    reader->len = st.st_size;
+    header = reader->header = (const struct index_header *)reader->map;
+    if (memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) ||
+            header->version != INDEX_VERSION || header->size != st.st_size ||
+            header->paths_offset != sizeof(*header) ||
+            header->files > header->size / sizeof(uint64_t) ||
+            header->terms > header->size / sizeof(struct index_term) ||
+            header->terms_offset != header->paths_offset +
+                header->files * sizeof(uint64_t) ||
+            header->strings_offset != header->terms_offset +
+                header->terms * sizeof(struct index_term) ||
+            header->strings_offset > header->postings_offset ||
+            header->postings_offset > header->size) {
+        debug("%s is not a valid index", path);
+        munmap(reader->map, reader->len);
+        return 0;
+    }
+    reader->paths = (const uint64_t *)(reader->map + header->paths_offset);
+    reader->terms = (const struct index_term *)(reader->map +
+            header->terms_offset);
+    if (!check_offsets(reader)) {
+        debug("%s is not a valid index", path);
+        munmap(reader->map, reader->len);
+        return 0;
+    }
+    return 1;
+}
+
+// Compare a term's key with a key
+static int compare_key(struct index_reader *reader,
+        const struct index_term *term, const char *key, size_t key_len) {
+    int cmp;
+
+    cmp = memcmp(reader->map + term->key_offset, key,
+            term->key_len < key_len ? term->key_len : key_len);
+    if (cmp == 0) {
+        cmp = (term->key_len > key_len) - (term->key_len < key_len);
+    }
+    return cmp;
+}
+
+// Find the first term not less than key, or with after set, the first
+// term greater than key
+static uint64_t lower_bound(struct index_reader *reader, const char *key,
+        size_t key_len, int after) {
+    uint64_t lo = 0, hi = reader->header->terms, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = compare_key(reader, &reader->terms[mid], key, key_len);
+        if (cmp < 0 || (after && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Decode a posting list, appending its ids to ids
+static size_t decode_postings(struct index_reader *reader,
+        const struct index_term *term, uint32_t *ids) {
+    const uint8_t *p = reader->map + term->postings_offset;
+    const uint8_t *end = p + term->postings_len;
+    uint32_t id = 0, delta;
+    size_t n = 0;
+    int shift;
+
+    while (p < end && n < term->count) {
+        delta = 0;
+        shift = 0;
+        while (p < end && (*p & 0x80) && shift < 28) {
+            delta |= (uint32_t)(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        if (p < end) {
+            delta |= (uint32_t)*p++ << shift;
+        }
+        id += delta;
+        ids[n++] = id;
+    }
+    return n;
+}
+
+enum query_op {
+    QUERY_EQ,
+    QUERY_LT,
+    QUERY_LE,
+    QUERY_GT,
+    QUERY_GE
+};
+
+// Split a query term like TPE1=value into a normalized key and operator
+// Returns the key, which must be freed, or NULL if the term is invalid
+static char *parse_term(struct index_builder *builder, const char *term,
+        enum query_op *op, size_t *key_len, size_t *field_len) {
+    const char *p, *value;
+    char *field, *colon, *key;
+    int32_t units, len;
+    size_t i;
+
+    p = strpbrk(term, "=<>");
+    if (p == NULL || p == term) {
+        return NULL;
+    }
+    if (p[0] == '=') {
+        *op = QUERY_EQ;
+        value = p + 1;
+    } else if (p[1] == '=') {
+        *op = p[0] == '<' ? QUERY_LE : QUERY_GE;
+        value = p + 2;
+    } else {
+        *op = p[0] == '<' ? QUERY_LT : QUERY_GT;
+        value = p + 1;
+    }
+
+    // Frame IDs are upper case and TXXX descriptions are case folded
+    field = strndup(term, p - term);
+    if (field == NULL) {
+        return NULL;
+    }
+    colon = strchr(field, ':');
+    for (i = 0; field + i != colon && field[i]; i++) {
+        if (field[i] >= 'a' && field[i] <= 'z') {
+            field[i] -= 'a' - 'A';
+        }
+    }
+    if (colon) {
+        *colon = 0;
+        units = decode_text(builder, (const uint8_t *)colon + 1,
+                strlen(colon + 1), ID3V2_ENCODING_UTF_8);
+        len = units == -1 ? -1 : normalize(builder, builder->text, units);
+        if (len == -1 || asprintf(&key, "%s:%.*s", field, len,
+                    builder->utf8) == -1) {
+            free(field);
+            return NULL;
+        }
+        free(field);
+        field = key;
+    }
+    *field_len = strlen(field);
+
+    units = decode_text(builder, (const uint8_t *)value, strlen(value),
+            ID3V2_ENCODING_UTF_8);
+    len = units == -1 ? -1 : normalize(builder, builder->text, units);
+    key = len == -1 ? NULL : malloc(*field_len + 1 + len);
+    if (key) {
+        memcpy(key, field, *field_len);
+        key[*field_len] = INDEX_KEY_SEP;
+        memcpy(key + *field_len + 1, builder->utf8, len);
+        *key_len = *field_len + 1 + len;
+    }
+    free(field);
+    return key;
+}
+
+// Find the files matching one query term
+// Returns a sorted array of file ids, which must be freed, or NULL on
+// failure
+static uint32_t *match_term(struct index_reader *reader,
+        struct index_builder *builder, const char *term, size_t *count) {
+    enum query_op op;
+    char *key;
+    size_t key_len, field_len, n = 0, total = 0;
+    uint64_t first, last, i;
+    uint32_t *ids, *merged;
+    uint8_t *seen;
+
+    key = parse_term(builder, term, &op, &key_len, &field_len);
+    if (key == NULL) {
+        fprintf(stderr, "Invalid query term %s\n", term);
+        return NULL;
+    }
+
+    // Every term of the field lies after field\0 and before field\1
+    switch (op) {
+        case QUERY_EQ:
+            first = lower_bound(reader, key, key_len, 0);
+            last = lower_bound(reader, key, key_len, 1);
+            break;
+        case QUERY_LT:
+        case QUERY_LE:
+            first = lower_bound(reader, key, field_len + 1, 0);
+            last = lower_bound(reader, key, key_len, op == QUERY_LE);
+            break;
+        default:
+            first = lower_bound(reader, key, key_len, op == QUERY_GT);
+            key[field_len] = INDEX_KEY_SEP + 1;
+            last = lower_bound(reader, key, field_len + 1, 0);
+            break;
+    }
+    free(key);
+
+    for (i = first; i < last; i++) {
+        total += reader->terms[i].count;
+    }
+    ids = malloc((total + 1) * sizeof(*ids));
+    if (ids == NULL) {
+        return NULL;
+    }
+    for (i = first; i < last; i++) {
+        n += decode_postings(reader, &reader->terms[i], ids + n);
+    }
+    if (last - first > 1) {
+        // Merge the lists of a range through a bitmap of files
+        seen = calloc(reader->header->files, 1);
+        merged = malloc((n + 1) * sizeof(*merged));
+        if (seen == NULL || merged == NULL) {
+            free(seen);
+            free(merged);
+            free(ids);
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            if (ids[i] < reader->header->files) {
+                seen[ids[i]] = 1;
+            }
+        }
+        n = 0;
+        for (i = 0; i < reader->header->files; i++) {
+            if (seen[i]) {
+                merged[n++] = i;
+            }
+        }
+        free(seen);
+        free(ids);
+        ids = merged;
+    }
+    *count = n;
+    return ids;
+}
+
+// Keep the ids in a that are also in b, both sorted
+static size_t intersect(uint32_t *a, size_t na, const uint32_t *b, size_t nb) {
+    size_t i = 0, j = 0, n = 0;
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            a[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+// Print the paths of files matching every query term to fp. Terms have
+// the form FIELD=value, or use <, <=, > or >= to compare values as
+// case-folded strings, which orders ISO 8601 dates correctly.
+// Returns 1 on success, 0 otherwise
+int query_index(const char *path, char * const terms[], int nterms,
+        FILE *fp) {
+    struct index_reader reader;
+    struct index_builder builder;
+    uint32_t *result = NULL, *ids;
+    size_t count = 0, n, i;
+    int t, ok = 1;
+
+    assert(path);
+
+    if (!open_index(path, &reader)) {
+        return 0;
+    }
+    memset(&builder, 0, sizeof(builder));
+    for (t = 0; t < nterms && ok; t++) {
+        ids = match_term(&reader, &builder, terms[t], &n);
+        if (ids == NULL) {
+            ok = 0;
+        } else if (result == NULL) {
+            result = ids;
+            count = n;
+        } else {
+            count = intersect(result, count, ids, n);
+            free(ids);
+        }
+    }
+    for (i = 0; ok && i < count; i++) {
+        if (result[i] < reader.header->files) {
+            fprintf(fp, "%s\n", (const char *)reader.map +
+                    reader.paths[result[i]]);
+        }
+    }
+    free(result);
+    free_builder(&builder);
+    munmap(reader.map, reader.len);
+    return ok;
+}
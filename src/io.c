@@ -0,0 +1,91 @@
+// Implementation of file I/O helpers
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// Write a buffer completely, retrying after short writes
+// Returns 1 on success, 0 otherwise
+int write_all(int fd, const uint8_t *data, size_t len) {
+    size_t written = 0;
+    ssize_t count;
+
+    while (written < len) {
+        count = write(fd, data + written, len - written);
+        if (count == -1) {
+            if (errno != EINTR && errno != EAGAIN) {
+                debug("write failed: %m");
+                return 0;
+            }
+        } else {
+            written += count;
+        }
+    }
+    return 1;
+}
+
+// Copy len bytes at offset in the file in to the current position of out
+// without passing them through user space. Block aligned ranges are
+// reflinked where the filesystem supports it, others use copy_file_range,
+// sendfile or splice.
+// Returns the number of bytes copied, which may be short if the kernel
+// can't copy between these files
+size_t copy_range(int in, off_t offset, int out, size_t len) {
+    struct file_clone_range clone;
+    struct stat st;
+    off_t off = offset, outoff;
+    size_t copied = 0;
+    ssize_t count;
+
+    outoff = lseek(out, 0, SEEK_CUR);
+    if (outoff != -1 && fstat(in, &st) == 0 && st.st_blksize > 0 &&
+            offset % st.st_blksize == 0 && outoff % st.st_blksize == 0 &&
+            (len % st.st_blksize == 0 || offset + len == st.st_size)) {
+        clone.src_fd = in;
+        clone.src_offset = offset;
+        clone.src_length = len;
+        clone.dest_offset = outoff;
+        if (ioctl(out, FICLONERANGE, &clone) == 0 &&
+                lseek(out, len, SEEK_CUR) != -1) {
+            return len;
+        }
+    }
+
+    while (copied < len) {
+        count = copy_file_range(in, &off, out, NULL, len - copied, 0);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+        copied += count;
+    }
+    while (copied < len) {
+        count = sendfile(out, in, &off, len - copied);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+        copied += count;
+    }
+    while (copied < len) {
+        count = splice(in, &off, out, NULL, len - copied, SPLICE_F_MOVE);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+        copied += count;
+    }
+    return copied;
+}
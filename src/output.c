@@ -4,500 +4,618 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
-#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include "unicode/ustdio.h"
 #include "unicode/ustring.h"
 #include "id3v2.h"
+#include "probes.h"
 
 #define TITLE_WIDTH 24
 
-static int print_enc(const char *str, int len, enum id3v2_encoding enc);
-static void print_bin(uint8_t *data, size_t len);
-static char * write_tmpfile(uint8_t *data, size_t len);
+static void print_bin(FILE *fp, uint8_t *data, size_t len);
 
-static void print_AENC_frame(struct id3v2_frame_header *fheader,
+static void print_AENC_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-static void print_APIC_frame(struct id3v2_frame_header *fheader,
-        int verbosity, int extract);
-//static void print_ASPI_frame(struct id3v2_frame_header *fheader,
+static void print_APIC_frame(FILE *fp, struct id3v2_frame_header *fheader,
+        int verbosity, struct extract_options *extract);
+//static void print_ASPI_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-static void print_COMM_frame(struct id3v2_frame_header *fheader,
+static void print_COMM_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-//static void print_COMR_frame(struct id3v2_frame_header *fheader,
+//static void print_COMR_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_ENCR_frame(struct id3v2_frame_header *fheader,
+//static void print_ENCR_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_EQU2_frame(struct id3v2_frame_header *fheader,
+//static void print_EQU2_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_ETCO_frame(struct id3v2_frame_header *fheader,
+//static void print_ETCO_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_GEOB_frame(struct id3v2_frame_header *fheader,
+//static void print_GEOB_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_GRID_frame(struct id3v2_frame_header *fheader,
+//static void print_GRID_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_LINK_frame(struct id3v2_frame_header *fheader,
+//static void print_LINK_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_MCDI_frame(struct id3v2_frame_header *fheader,
+//static void print_MCDI_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_MLLT_frame(struct id3v2_frame_header *fheader,
+//static void print_MLLT_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_OWNE_frame(struct id3v2_frame_header *fheader,
+//static void print_OWNE_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-static void print_PRIV_frame(struct id3v2_frame_header *fheader,
+static void print_PRIV_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-//static void print_PCNT_frame(struct id3v2_frame_header *fheader,
+//static void print_PCNT_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_POPM_frame(struct id3v2_frame_header *fheader,
+//static void print_POPM_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_POSS_frame(struct id3v2_frame_header *fheader,
+//static void print_POSS_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_RBUF_frame(struct id3v2_frame_header *fheader,
+//static void print_RBUF_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_RVA2_frame(struct id3v2_frame_header *fheader,
+//static void print_RVA2_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_RVRB_frame(struct id3v2_frame_header *fheader,
+//static void print_RVRB_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_SEEK_frame(struct id3v2_frame_header *fheader,
+//static void print_SEEK_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_SIGN_frame(struct id3v2_frame_header *fheader,
+//static void print_SIGN_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_SYLT_frame(struct id3v2_frame_header *fheader,
+//static void print_SYLT_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_SYTC_frame(struct id3v2_frame_header *fheader,
+//static void print_SYTC_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-static void print_UFID_frame(struct id3v2_frame_header *fheader,
+static void print_UFID_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-//static void print_USER_frame(struct id3v2_frame_header *fheader,
+//static void print_USER_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-//static void print_USLT_frame(struct id3v2_frame_header *fheader,
+//static void print_USLT_frame(FILE *fp, struct id3v2_frame_header *fheader,
 //        int verbosity);
-static void print_text_frame(struct id3v2_frame_header *fheader,
+static void print_text_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-static void print_TXXX_frame(struct id3v2_frame_header *fheader,
+static void print_TXXX_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-static void print_url_frame(struct id3v2_frame_header *fheader,
+static void print_url_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
-static void print_WXXX_frame(struct id3v2_frame_header *fheader,
+static void print_WXXX_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity);
 
 // Print arbitrary data in sections of four hex digits
-static void print_bin(uint8_t *data, size_t len) {
+static void print_bin(FILE *fp, uint8_t *data, size_t len) {
     size_t i;
 
     for (i = 0; i < len - 1; i += 2) {
         if (i) {
-            printf(" ");
+            fprintf(fp, " ");
         }
-        printf("%02"PRIx8"%02"PRIx8, data[i], data[i + 1]);
+        fprintf(fp, "%02"PRIx8"%02"PRIx8, data[i], data[i + 1]);
     }
     if (i == len - 1) {
         if (i) {
-            printf(" ");
+            fprintf(fp, " ");
         }
-        printf("%02"PRIx8, data[i]);
+        fprintf(fp, "%02"PRIx8, data[i]);
     }
 }
 
-// Save arbitrary data to a temporary file
-// Returns the name of the file, or NULL on failure
-// The return value must be freed
-static char * write_tmpfile(uint8_t *data, size_t len) {
-    char *template;
-    int fd;
-    size_t written = 0;
-    ssize_t count;
-
-    if (asprintf(&template, "id3al-XXXXXX") == -1) {
-        debug("asprintf failed");
-        return NULL;
+// Determine whether a frame ID appears in a comma separated list
+static int frame_selected(const char *frames, const char *id) {
+    const char *p;
+
+    for (p = frames; p; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (!strncmp(p, id, ID3V2_FRAME_ID_SIZE) &&
+                (p[ID3V2_FRAME_ID_SIZE] == ',' ||
+                 p[ID3V2_FRAME_ID_SIZE] == 0)) {
+            return 1;
+        }
     }
-    fd = mkstemp(template);
-    if (fd == -1) {
-        debug("mkstemp failed: %m");
-        free(template);
-        return NULL;
+    return 0;
+}
+
+// Print where the undecoded data of a frame lies in the file
+static void print_frame_reference(FILE *fp,
+        struct id3v2_frame_header *fheader) {
+    if (fheader->data_offset != -1) {
+        fprintf(fp, "%*s: %zu bytes at offset %jd, not decoded\n",
+                TITLE_WIDTH, "Data", fheader->raw_len,
+                (intmax_t)fheader->data_offset);
+    } else {
+        fprintf(fp, "%*s: %zu bytes, not decoded\n", TITLE_WIDTH, "Data",
+                fheader->raw_len);
     }
-    while (written < len) {
-        count = write(fd, data + written, len - written);
-        if (count == -1) {
-            if (errno != EINTR && errno != EAGAIN) {
-                debug("write failed: %m");
-                close(fd);
-                unlink(template);
-                free(template);
-                return NULL;
-            }
-        } else {
-            written += count;
+    fprintf(fp, "\n");
+}
+
+// Print a tag and its frames, or only those listed in frames if it isn't
+// NULL. Other frames are skipped without being decoded.
+void print_id3v2_tag(FILE *fp, struct id3v2_header *header, int verbosity,
+        struct extract_options *extract, const char *frames) {
+    struct id3v2_frame_header fheader;
+    uint64_t timer;
+
+    assert(header);
+
+    print_id3v2_header(fp, header, verbosity);
+    if (header->extheader_present) {
+        print_id3v2_extended_header(fp, &header->extheader, verbosity);
+    }
+    while (get_id3v2_frame_header(header, &fheader)) {
+        if (frames && !frame_selected(frames, fheader.id)) {
+            PROFILE_COUNT(PROFILE_FRAMES_SKIPPED, 1);
+            continue;
         }
+        if (extract) {
+            extract->index = header->frames - 1;
+        }
+        // A frame that can't be decoded, perhaps for being too large, is
+        // only described, and the rest of the tag is still listed
+        if (!get_id3v2_frame_data(header, &fheader)) {
+            PROFILE_COUNT(PROFILE_FRAMES_SKIPPED, 1);
+            print_id3v2_frame_header(fp, &fheader, verbosity);
+            print_frame_reference(fp, &fheader);
+            continue;
+        }
+        timer = PROFILE_START();
+        print_id3v2_frame_header(fp, &fheader, verbosity);
+        print_id3v2_frame(fp, &fheader, verbosity, extract);
+        PROFILE_END(PROFILE_OUTPUT, timer);
+        free_id3v2_frame_data(header, &fheader);
+    }
+    if (verbosity > 0) {
+        fprintf(fp, "%*s: %zu bytes\n", TITLE_WIDTH, "Padding",
+                header->padding);
     }
-    close(fd);
-    return template;
+    ID3AL_PROBE2(output__flush, header->frames, header->padding);
 }
 
 // Print an id3v2 header
-void print_id3v2_header(struct id3v2_header *header, int verbosity) {
+void print_id3v2_header(FILE *fp, struct id3v2_header *header,
+        int verbosity) {
     assert(header);
 
     if (verbosity > 0) {
-        printf("%*s: 2.%"PRIu8".%"PRIu8"\n", TITLE_WIDTH, "ID3 Version",
+        fprintf(fp, "%*s: 2.%"PRIu8".%"PRIu8"\n", TITLE_WIDTH, "ID3 Version",
                 header->version, header->revision);
-        printf("%*s: %"PRIu32" bytes\n", TITLE_WIDTH, "Tag Size",
-                from_synchsafe(header->tag_size));
+        fprintf(fp, "%*s: %"PRIu32" bytes\n", TITLE_WIDTH, "Tag Size",
+                header->tag_size);
     }
 
     if (verbosity > 1) {
-        printf("%*s: %s\n", TITLE_WIDTH, "Unsynchronization",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Unsynchronization",
                 boolstr(header->unsynchronization));
-        printf("%*s: %s\n", TITLE_WIDTH, "Extended Header",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Extended Header",
                 boolstr(header->extheader_present));
-        printf("%*s: %s\n", TITLE_WIDTH, "Experimental",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Experimental",
                 boolstr(header->experimental));
-        printf("%*s: %s\n", TITLE_WIDTH, "Footer",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Footer",
                 boolstr(header->footer_present));
     }
 
     if (verbosity > 0) {
-        printf("\n");
+        fprintf(fp, "\n");
     }
     return;
 }
 
 // Print an id3v2 extended header
-void print_id3v2_extended_header(struct id3v2_extended_header *eheader,
-        int verbosity) {
+void print_id3v2_extended_header(FILE *fp,
+        struct id3v2_extended_header *eheader, int verbosity) {
     assert(eheader);
 
     if (verbosity > 0) {
-        printf("%*s: %"PRIu32" bytes\n", TITLE_WIDTH, "Extended Header Size",
-                from_synchsafe(eheader->size));
+        fprintf(fp, "%*s: %"PRIu32" bytes\n", TITLE_WIDTH,
+                "Extended Header Size", eheader->size);
     }
 
     if (verbosity > 1) {
-        printf("%*s: %s\n", TITLE_WIDTH, "Tag is an Update",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Tag is an Update",
                 boolstr(eheader->update));
         if (eheader->crc_present) {
-            printf("%*s: 0x%"PRIx32"\n", TITLE_WIDTH, "CRC-32", eheader->crc);
+            fprintf(fp, "%*s: 0x%"PRIx32"\n", TITLE_WIDTH, "CRC-32",
+                    eheader->crc);
         }
         if (eheader->restrictions) {
-            printf("%*s: %s\n", TITLE_WIDTH, "Tag Size Restriction",
+            fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Tag Size Restriction",
                     tag_size_restrict_str(eheader->tag_size_restrict));
-            printf("%*s: %s\n", TITLE_WIDTH, "Text Restriction",
+            fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Text Restriction",
                     text_enc_restrict_str(eheader->text_enc_restrict));
-            printf("%*s: %s\n", TITLE_WIDTH, "Text Size Restriction",
+            fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Text Size Restriction",
                     text_size_restrict_str(eheader->text_size_restrict));
-            printf("%*s: %s\n", TITLE_WIDTH, "Image Restriction",
+            fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Image Restriction",
                     img_enc_restrict_str(eheader->img_enc_restrict));
-            printf("%*s: %s\n", TITLE_WIDTH, "Image Size Restriction",
+            fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Image Size Restriction",
                     img_size_restrict_str(eheader->img_size_restrict));
         }
     }
 }
 
 // Print an id3v2 frame header
-void print_id3v2_frame_header(struct id3v2_frame_header *fheader,
-        int verbosity) {
+void print_id3v2_frame_header(FILE *fp,
+        struct id3v2_frame_header *fheader, int verbosity) {
     assert(fheader);
 
     if (verbosity > 0) {
-        printf("%*s: %.*s\n", TITLE_WIDTH, "Frame ID", ID3V2_FRAME_ID_SIZE,
+        fprintf(fp, "%*s: %.*s\n", TITLE_WIDTH, "Frame ID",
+                ID3V2_FRAME_ID_SIZE,
                 fheader->id);
-        printf("%*s: %"PRIu32" bytes\n", TITLE_WIDTH, "Frame Size",
+        fprintf(fp, "%*s: %"PRIu32" bytes\n", TITLE_WIDTH, "Frame Size",
                 fheader->size);
 
         if (fheader->group_id_present) {
-            printf("%*s: %"PRIu8"\n", TITLE_WIDTH, "Grouping Identifier",
+            fprintf(fp, "%*s: %"PRIu8"\n", TITLE_WIDTH, "Grouping Identifier",
                     fheader->group_id);
         }
         if (fheader->data_length_present) {
-            printf("%*s: %"PRIu32"\n", TITLE_WIDTH, "Data Length",
+            fprintf(fp, "%*s: %"PRIu32"\n", TITLE_WIDTH, "Data Length",
                     fheader->data_len);
         }
 
     }
 
     if (verbosity > 1) {
-        printf("%*s: %s\n", TITLE_WIDTH, "Tag Alter Discard",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Tag Alter Discard",
                 boolstr(fheader->tag_alter_pres));
-        printf("%*s: %s\n", TITLE_WIDTH, "File Alter Discard",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "File Alter Discard",
                 boolstr(fheader->file_alter_pres));
-        printf("%*s: %s\n", TITLE_WIDTH, "Read Only",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Read Only",
                 boolstr(fheader->read_only));
 
-        printf("%*s: %s\n", TITLE_WIDTH, "Group Information",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Group Information",
                 boolstr(fheader->group_id_present));
-        printf("%*s: %s\n", TITLE_WIDTH, "Compression",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Compression",
                 boolstr(fheader->compressed));
-        printf("%*s: %s\n", TITLE_WIDTH, "Encryption",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Encryption",
                 boolstr(fheader->encrypted));
-        printf("%*s: %s\n", TITLE_WIDTH, "Unsynchronization",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Unsynchronization",
                 boolstr(fheader->unsynchronized));
-        printf("%*s: %s\n", TITLE_WIDTH, "Data Length Indicator",
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, "Data Length Indicator",
                 boolstr(fheader->data_length_present));
     }
 }
 
+// Decode len bytes of UTF-16 text into host order units, skipping a BOM.
+// bigendian is the byte order to assume when no BOM is present.
+// text must have room for len / 2 units.
+// Returns the number of units
+int32_t decode_utf16(const char *str, size_t len, int bigendian,
+        uint16_t *text) {
+    const uint8_t *data = (const uint8_t *)str;
+    int32_t units, i;
+
+    units = len / sizeof(uint16_t);
+    if (units > 0 && data[0] == 0xFE && data[1] == 0xFF) {
+        bigendian = 1;
+        data += sizeof(uint16_t);
+        units--;
+    } else if (units > 0 && data[0] == 0xFF && data[1] == 0xFE) {
+        bigendian = 0;
+        data += sizeof(uint16_t);
+        units--;
+    }
+    for (i = 0; i < units; i++) {
+        if (bigendian) {
+            text[i] = (data[2 * i] << 8) | data[2 * i + 1];
+        } else {
+            text[i] = data[2 * i] | (data[2 * i + 1] << 8);
+        }
+    }
+    return units;
+}
+
+// Convert UTF-16 text to UTF-8 in a buffer that is reused between calls.
+// bigendian is the byte order to assume when no BOM is present.
+// Returns the UTF-8 string, or NULL on failure.
+static char *utf16_to_utf8(const char *str, int len, int bigendian,
+        int32_t *outlen) {
+    static __thread UChar *text;
+    static __thread char *utf8;
+    static __thread int32_t text_size, utf8_size;
+    UErrorCode uerr = U_ZERO_ERROR;
+    int32_t units;
+    void *p;
+
+    if (len == -1) {
+        len = strlen_enc(str, ID3V2_ENCODING_UTF_16) - sizeof(UChar);
+    }
+    units = len / sizeof(UChar);
+
+    // Buffers are only allocated once UTF-16 text is actually seen
+    if (units + 1 > text_size) {
+        p = profile_realloc(text, (units + 1) * sizeof(UChar));
+        if (p == NULL) {
+            debug("realloc %zu failed: %m", (units + 1) * sizeof(UChar));
+            return NULL;
+        }
+        text = p;
+        text_size = units + 1;
+    }
+    units = decode_utf16(str, len, bigendian, text);
+
+    // Each UTF-16 unit becomes at most 3 UTF-8 bytes
+    if (units * 3 + 1 > utf8_size) {
+        p = profile_realloc(utf8, units * 3 + 1);
+        if (p == NULL) {
+            debug("realloc %"PRId32" failed: %m", units * 3 + 1);
+            return NULL;
+        }
+        utf8 = p;
+        utf8_size = units * 3 + 1;
+    }
+    u_strToUTF8(utf8, utf8_size, outlen, text, units, &uerr);
+    if (U_FAILURE(uerr)) {
+        debug("Conversion to UTF-8 failed: %s", u_errorName(uerr));
+        return NULL;
+    }
+    return utf8;
+}
+
 // Print the string with the given encoding. len should be -1 for NULL
 // terminated strings and the string length in bytes otherwise.
+// Text is written as UTF-8, so only UTF-16 strings need converting.
 // Returns the number of bytes printed on success, -1 otherwise.
-static int print_enc(const char *str, int len, enum id3v2_encoding enc) {
-    UChar *text;
-    UErrorCode uerr = U_ZERO_ERROR;
-    int ret;
-    int32_t textlen;
+int print_enc(FILE *fp, const char *str, int len,
+        enum id3v2_encoding enc) {
+    char *utf8;
+    int32_t utf8len;
+    uint64_t timer;
 
     assert(str);
 
     switch (enc) {
         case ID3V2_ENCODING_UTF_16:
         case ID3V2_ENCODING_UTF_16BE:
-            if (len == -1) {
-                text = (UChar *)str;
-            } else {
-                text = malloc(len + sizeof(UChar));
-                if (text == NULL) {
-                    debug("malloc %d failed: %m", len + 2);
-                    return -1;
-                }
-                memcpy(text, str, len);
-                text[len / sizeof(UChar)] = 0;
-            }
-            ret = u_printf("%S", text);
-            if (len != -1) {
-                free(text);
-            }
-            break;
-        case ID3V2_ENCODING_UTF_8:
-            // Must convert to UTF-16 before printing
-            if (len == -1) {
-                textlen = strlen(str) * 2 + 2;
-            } else {
-                textlen = len * 2 + 2;
-            }
-            text = malloc(textlen);
-            if (text == NULL) {
-                debug("malloc %"PRId32" failed: %m", textlen);
-                return -1;
-            }
-            u_strFromUTF8(text, textlen, NULL, str, len, &uerr);
-            if (U_FAILURE(uerr)) {
-                debug("Conversion from UTF-8 failed: %s", u_errorName(uerr));
-                free(text);
+            timer = PROFILE_START();
+            utf8 = utf16_to_utf8(str, len, enc == ID3V2_ENCODING_UTF_16BE,
+                    &utf8len);
+            PROFILE_END(PROFILE_TRANSCODE, timer);
+            if (utf8 == NULL) {
                 return -1;
             }
-            ret = u_printf("%S", text);
-            free(text);
-            break;
+            PROFILE_COUNT(PROFILE_BYTES_TRANSCODED, utf8len);
+            return fwrite(utf8, 1, utf8len, fp);
         default:
-            if (len == -1) {
-                ret = printf("%s", str);
-            } else {
-                ret = printf("%.*s", len, str);
-            }
             break;
     }
-    return ret;
+    if (len == -1) {
+        return fprintf(fp, "%s", str);
+    }
+    return fprintf(fp, "%.*s", len, str);
+}
+
+// Print that a frame is too short for its fields
+static void print_malformed_frame(FILE *fp,
+        struct id3v2_frame_header *fheader) {
+    fprintf(fp, "%*s: Malformed frame of %"PRIu32" bytes\n", TITLE_WIDTH,
+            frame_title(fheader), fheader->data_len);
 }
 
 // Print an AENC frame
-static void print_AENC_frame(struct id3v2_frame_header *fheader,
+static void print_AENC_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     struct id3v2_frame_AENC frame;
     const char *title;
 
-    parse_AENC_frame(fheader->data, &frame);
+    if (!parse_AENC_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     title = frame_title(fheader);
 
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", frame.owner_id);
-    printf("%*s: %s - %"PRIu16"\n", TITLE_WIDTH, title, "Preview Start",
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", frame.owner_id);
+    fprintf(fp, "%*s: %s - %"PRIu16"\n", TITLE_WIDTH, title, "Preview Start",
             frame.preview_start);
-    printf("%*s: %s - %"PRIu16"\n", TITLE_WIDTH, title, "Preview Length",
+    fprintf(fp, "%*s: %s - %"PRIu16"\n", TITLE_WIDTH, title, "Preview Length",
             frame.preview_length);
-    printf("%*s: %s - ", TITLE_WIDTH, title, "Encryption Info");
-    print_bin(frame.encryption_info,
-            fheader->data_len - strlen(frame.owner_id) - 5);
-    printf("\n");
+    fprintf(fp, "%*s: %s - ", TITLE_WIDTH, title, "Encryption Info");
+    print_bin(fp, frame.encryption_info, frame.encryption_info_len);
+    fprintf(fp, "\n");
 }
 
 // Print an APIC frame
-static void print_APIC_frame(struct id3v2_frame_header *fheader,
-        int verbosity, int extract) {
+static void print_APIC_frame(FILE *fp, struct id3v2_frame_header *fheader,
+        int verbosity, struct extract_options *extract) {
     struct id3v2_frame_APIC frame;
     const char *title;
     char *picfile;
+    off_t offset = -1;
 
-    parse_APIC_frame(fheader, &frame);
+    if (!parse_APIC_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     title = frame_title(fheader);
 
     if (verbosity > 0) {
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
                 encoding_str(frame.encoding));
     }
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "MIME Type", frame.mime_type);
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Picture Type",
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "MIME Type",
+            frame.mime_type);
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Picture Type",
             pic_type_str(frame.picture_type));
-    printf("%*s: %s - ", TITLE_WIDTH, title, "Description");
-    print_enc(frame.description, -1, frame.encoding);
-    printf("\n");
+    fprintf(fp, "%*s: %s - ", TITLE_WIDTH, title, "Description");
+    print_enc(fp, frame.description, -1, frame.encoding);
+    fprintf(fp, "\n");
 
     if (extract) {
-        picfile = write_tmpfile(frame.picture, frame.picture_len);
+        if (fheader->data_offset != -1) {
+            offset = fheader->data_offset + (frame.picture - fheader->data);
+        }
+        picfile = extract_object(extract, mime_ext(frame.mime_type),
+                frame.picture, frame.picture_len, offset);
         if (picfile == NULL) {
             return;
         }
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Saved To", picfile);
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Saved To", picfile);
         free(picfile);
     } else {
-        printf("%*s: %s\n", TITLE_WIDTH, title, "Use -e to extract picture");
+        fprintf(fp, "%*s: %s\n", TITLE_WIDTH, title,
+                "Use -e to extract picture");
     }
 }
 
 // Print a COMM frame
-static void print_COMM_frame(struct id3v2_frame_header *fheader,
+static void print_COMM_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     struct id3v2_frame_COMM frame;
     const char *title;
 
-    parse_COMM_frame(fheader, &frame);
+    if (!parse_COMM_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     title = frame_title(fheader);
 
     if (verbosity > 0) {
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
                 encoding_str(frame.encoding));
     }
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Language", frame.language);
-    printf("%*s: %s - ", TITLE_WIDTH, title, "Description");
-    print_enc(frame.content_descriptor, -1, frame.encoding);
-    printf("\n");
-    printf("%*s: %s - ", TITLE_WIDTH, title, "Comment");
-    print_enc(frame.comment, frame.comment_len, frame.encoding);
-    printf("\n");
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Language",
+            frame.language);
+    fprintf(fp, "%*s: %s - ", TITLE_WIDTH, title, "Description");
+    print_enc(fp, frame.content_descriptor, -1, frame.encoding);
+    fprintf(fp, "\n");
+    fprintf(fp, "%*s: %s - ", TITLE_WIDTH, title, "Comment");
+    print_enc(fp, frame.comment, frame.comment_len, frame.encoding);
+    fprintf(fp, "\n");
 }
 
 // Print a PRIV frame
-static void print_PRIV_frame(struct id3v2_frame_header *fheader,
+static void print_PRIV_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     const char *title;
     size_t len;
 
     title = frame_title(fheader);
 
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", fheader->data);
-    printf("%*s: ", TITLE_WIDTH, title);
-    len = strlen((char *)fheader->data) + 1;
-    print_bin(fheader->data + len, fheader->data_len - len);
-    printf("\n");
+    len = strnlen_enc((char *)fheader->data, fheader->data_len,
+            ID3V2_ENCODING_ISO_8859_1);
+    if (len == 0) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", fheader->data);
+    fprintf(fp, "%*s: ", TITLE_WIDTH, title);
+    print_bin(fp, fheader->data + len, fheader->data_len - len);
+    fprintf(fp, "\n");
 }
 
 // Print a UFID frame
-static void print_UFID_frame(struct id3v2_frame_header *fheader,
+static void print_UFID_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     struct id3v2_frame_UFID frame;
     const char *title;
 
-    parse_UFID_frame(fheader->data, &frame);
+    if (!parse_UFID_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     title = frame_title(fheader);
-    printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", frame.owner);
-    printf("%*s: ", TITLE_WIDTH, title);
-    print_bin(frame.id, fheader->data_len - strlen(frame.owner) - 1);
-    printf("\n");
+    fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Owner", frame.owner);
+    fprintf(fp, "%*s: ", TITLE_WIDTH, title);
+    print_bin(fp, frame.id, frame.id_len);
+    fprintf(fp, "\n");
 }
 
 // Print any text frame except TXXX
-static void print_text_frame(struct id3v2_frame_header *fheader,
+static void print_text_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     const char *title = frame_title(fheader);
     struct id3v2_frame_text frame;
 
-    parse_text_frame(fheader->data, &frame);
+    if (!parse_text_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     if (verbosity > 0) {
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
                 encoding_str(frame.encoding));
     }
-    printf("%*s: ", TITLE_WIDTH, title);
-    print_enc(frame.text, fheader->data_len - 1, frame.encoding);
-    printf("\n");
+    fprintf(fp, "%*s: ", TITLE_WIDTH, title);
+    print_enc(fp, frame.text, frame.text_len, frame.encoding);
+    fprintf(fp, "\n");
 }
 
 // Print a TXXX frame
-static void print_TXXX_frame(struct id3v2_frame_header *fheader,
+static void print_TXXX_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     const char *title = frame_title(fheader);
     struct id3v2_frame_TXXX frame;
 
-    parse_TXXX_frame(fheader->data, &frame);
+    if (!parse_TXXX_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     if (verbosity > 0) {
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
                 encoding_str(frame.encoding));
     }
-    printf("%*s: ", TITLE_WIDTH, title);
-    print_enc(frame.description, -1, frame.encoding);
-    printf(" - ");
-    print_enc(frame.value,
-            fheader->data_len -
-                    strlen_enc(frame.description, frame.encoding) - 1,
-            frame.encoding);
-    printf("\n");
+    fprintf(fp, "%*s: ", TITLE_WIDTH, title);
+    print_enc(fp, frame.description, -1, frame.encoding);
+    fprintf(fp, " - ");
+    print_enc(fp, frame.value, frame.value_len, frame.encoding);
+    fprintf(fp, "\n");
 }
 
 // Print any URL frame except WXXX
-static void print_url_frame(struct id3v2_frame_header *fheader,
+static void print_url_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
-    printf("%*s: %.*s\n", TITLE_WIDTH, frame_title(fheader), fheader->data_len,
+    fprintf(fp, "%*s: %.*s\n", TITLE_WIDTH, frame_title(fheader),
+            fheader->data_len,
             (char *)fheader->data);
 }
 
 // Print a WXXX frame
-static void print_WXXX_frame(struct id3v2_frame_header *fheader,
+static void print_WXXX_frame(FILE *fp, struct id3v2_frame_header *fheader,
         int verbosity) {
     const char *title = frame_title(fheader);
     struct id3v2_frame_WXXX frame;
 
-    parse_WXXX_frame(fheader->data, &frame);
+    if (!parse_WXXX_frame(fheader, &frame)) {
+        print_malformed_frame(fp, fheader);
+        return;
+    }
     if (verbosity > 0) {
-        printf("%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
+        fprintf(fp, "%*s: %s - %s\n", TITLE_WIDTH, title, "Encoding",
                 encoding_str(frame.encoding));
     }
-    printf("%*s: %s - ", TITLE_WIDTH, title, "Description");
-    print_enc(frame.description, -1, frame.encoding);
-    printf("\n");
-    printf("%*s: %s - %.*s\n", TITLE_WIDTH, title, "URL",
-            (int)(fheader->data_len -
-                strlen_enc(frame.description, frame.encoding) - 1),
-            frame.url);
+    fprintf(fp, "%*s: %s - ", TITLE_WIDTH, title, "Description");
+    print_enc(fp, frame.description, -1, frame.encoding);
+    fprintf(fp, "\n");
+    fprintf(fp, "%*s: %s - %.*s\n", TITLE_WIDTH, title, "URL",
+            (int)frame.url_len, frame.url);
 }
 
 // Print an id3v2 frame
-void print_id3v2_frame(struct id3v2_frame_header *header,
-        int verbosity, int extract) {
+void print_id3v2_frame(FILE *fp, struct id3v2_frame_header *header,
+        int verbosity, struct extract_options *extract) {
     if (!strcmp(header->id, ID3V2_FRAME_ID_AENC)) {
-        print_AENC_frame(header, verbosity);
+        print_AENC_frame(fp, header, verbosity);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_APIC)) {
-        print_APIC_frame(header, verbosity, extract);
+        print_APIC_frame(fp, header, verbosity, extract);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_COMM)) {
-        print_COMM_frame(header, verbosity);
+        print_COMM_frame(fp, header, verbosity);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_PRIV)) {
-        print_PRIV_frame(header, verbosity);
+        print_PRIV_frame(fp, header, verbosity);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_UFID)) {
-        print_UFID_frame(header, verbosity);
+        print_UFID_frame(fp, header, verbosity);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_TXXX)) {
-        print_TXXX_frame(header, verbosity);
+        print_TXXX_frame(fp, header, verbosity);
     } else if (header->id[0] == 'T') {
-        print_text_frame(header, verbosity);
+        print_text_frame(fp, header, verbosity);
     } else if (!strcmp(header->id, ID3V2_FRAME_ID_WXXX)) {
-        print_WXXX_frame(header, verbosity);
+        print_WXXX_frame(fp, header, verbosity);
     } else if (header->id[0] == 'W') {
-        print_url_frame(header, verbosity);
+        print_url_frame(fp, header, verbosity);
     } else {
-        printf("Support for frame %.*s not implemented yet\n",
+        fprintf(fp, "Support for frame %.*s not implemented yet\n",
                 ID3V2_FRAME_ID_SIZE, header->id);
     }
     if (verbosity > 0) {
-        printf("\n");
+        fprintf(fp, "\n");
     }
 }
@@ -0,0 +1,68 @@
+// Implementation of thread pools sharing out a list of work
+// Copyright 2015 David Gloe.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// Get the threads to work through count items with: workers, or one per
+// CPU but at least min if it's 0, and no more than there are items
+unsigned int pool_size(unsigned int workers, unsigned int min, int count) {
+    long n;
+
+    if (workers == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > (long)min ? n : min;
+    }
+    if (count < 0 || workers > (unsigned int)count) {
+        workers = count > 0 ? count : 1;
+    }
+    return workers;
+}
+
+void init_work_queue(struct work_queue *queue, int count) {
+    queue->count = count;
+    atomic_init(&queue->next, 0);
+}
+
+// Take the next item from queue
+// Returns its index, or -1 once every item has been taken
+int next_work(struct work_queue *queue) {
+    int i = atomic_fetch_add(&queue->next, 1);
+
+    return i < queue->count ? i : -1;
+}
+
+// Run worker on nthreads threads, the ith passed args + i * size, and
+// wait for them all to finish
+// Returns the number of threads that ran, or 0 on failure
+unsigned int run_pool(void *(*worker)(void *), void *args, size_t size,
+        unsigned int nthreads) {
+    pthread_t *threads;
+    unsigned int started, i;
+
+    threads = calloc(nthreads ? nthreads : 1, sizeof(*threads));
+    if (threads == NULL) {
+        debug("calloc failed: %m");
+        return 0;
+    }
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, worker,
+                    (char *)args + started * size)) {
+            debug("pthread_create failed");
+            break;
+        }
+    }
+    // Without any thread, do the work here
+    if (started == 0) {
+        worker(args);
+        started = 1;
+    } else {
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+    return started;
+}
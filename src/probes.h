@@ -0,0 +1,48 @@
+// Static tracepoints for bpftrace, perf and SystemTap
+// Copyright 2015 David Gloe.
+//
+// Each probe is a single nop in the id3al provider until a tracer
+// attaches to it. Without <sys/sdt.h> the probes compile to nothing.
+//
+//   tag__open(fd, file size)
+//   tag__header(version, revision, tag size, flags), where flags has
+//       bit 0 unsynchronisation, 1 extended header, 2 experimental and
+//       3 footer
+//   frame__start(id, size in the tag, flags), where flags has bit 0
+//       compressed, 1 unsynchronised, 2 encrypted and 3 data length
+//   frame__end(id, decoded size, 1 on success or 0)
+//   frame__resync(id, size before, size after)
+//   frame__inflate(id, compressed size, inflated size, zlib status)
+//   output__flush(frames, padding), once a tag has been printed
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define ID3AL_HAVE_SDT
+#endif
+#endif
+
+#ifdef ID3AL_HAVE_SDT
+#include <sys/sdt.h>
+#define ID3AL_PROBE2(name, a, b) DTRACE_PROBE2(id3al, name, a, b)
+#define ID3AL_PROBE3(name, a, b, c) DTRACE_PROBE3(id3al, name, a, b, c)
+#define ID3AL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(id3al, name, a, b, c, d)
+#else
+#define ID3AL_PROBE2(name, a, b) do { } while (0)
+#define ID3AL_PROBE3(name, a, b, c) do { } while (0)
+#define ID3AL_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#define ID3AL_TAG_FLAGS(header) \
+    (((header)->unsynchronization != 0) | \
+     ((header)->extheader_present != 0) << 1 | \
+     ((header)->experimental != 0) << 2 | \
+     ((header)->footer_present != 0) << 3)
+#define ID3AL_FRAME_FLAGS(header) \
+    (((header)->compressed != 0) | ((header)->unsynchronized != 0) << 1 | \
+     ((header)->encrypted != 0) << 2 | \
+     ((header)->data_length_present != 0) << 3)
+
+#endif // _PROBES_H
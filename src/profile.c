@@ -0,0 +1,230 @@
+// Timing and counting of the stages of reading tags
+// Copyright 2015 David Gloe.
+
+#include <assert.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "id3v2.h"
+
+// One thread's totals, linked together so they can be summed at the end
+struct profile {
+    uint64_t ns[PROFILE_PHASES];
+    uint64_t calls[PROFILE_PHASES];
+    uint64_t counts[PROFILE_COUNTERS];
+    // Usable bytes of the thread's allocations still in use, and the most
+    // there have been at once
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    struct profile *next;
+};
+
+int profile_enabled;
+
+static __thread struct profile *thread_profile;
+static struct profile *profiles;
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[PROFILE_PHASES] = {
+    [PROFILE_OPEN] = "open",
+    [PROFILE_MAP] = "map",
+    [PROFILE_SCAN] = "scan",
+    [PROFILE_RESYNC] = "resync",
+    [PROFILE_INFLATE] = "inflate",
+    [PROFILE_TRANSCODE] = "transcode",
+    [PROFILE_OUTPUT] = "output",
+    [PROFILE_WRITE] = "write",
+};
+
+static const char *counter_names[PROFILE_COUNTERS] = {
+    [PROFILE_FILES] = "files",
+    [PROFILE_BYTES_MAPPED] = "bytes_mapped",
+    [PROFILE_BYTES_SCANNED] = "bytes_scanned",
+    [PROFILE_BYTES_DECODED] = "bytes_decoded",
+    [PROFILE_BYTES_TRANSCODED] = "bytes_transcoded",
+    [PROFILE_FRAMES] = "frames",
+    [PROFILE_FRAMES_SKIPPED] = "frames_skipped",
+    [PROFILE_ALLOCATIONS] = "allocations",
+    [PROFILE_BYTES_ALLOCATED] = "bytes_allocated",
+    [PROFILE_FREES] = "frees",
+    [PROFILE_BYTES_WRITTEN] = "bytes_written",
+    [PROFILE_BYTES_MOVED] = "bytes_moved",
+};
+
+// Start collecting, before any thread that should be counted starts
+void profile_enable(void) {
+    profile_enabled = 1;
+}
+
+uint64_t profile_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Get the calling thread's totals, or NULL if they can't be allocated
+static struct profile *get_thread_profile(void) {
+    if (thread_profile) {
+        return thread_profile;
+    }
+    thread_profile = calloc(1, sizeof(*thread_profile));
+    if (thread_profile == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&profiles_lock);
+    thread_profile->next = profiles;
+    profiles = thread_profile;
+    pthread_mutex_unlock(&profiles_lock);
+    return thread_profile;
+}
+
+void profile_add_time(enum profile_phase phase, uint64_t start) {
+    struct profile *profile = get_thread_profile();
+
+    if (profile) {
+        profile->ns[phase] += profile_now() - start;
+        profile->calls[phase]++;
+    }
+}
+
+void profile_add_count(enum profile_counter counter, uint64_t count) {
+    struct profile *profile = get_thread_profile();
+
+    if (profile) {
+        profile->counts[counter] += count;
+    }
+}
+
+// Count an allocation of size bytes, with usable bytes behind it
+static void add_allocation(size_t size, size_t usable) {
+    struct profile *profile = get_thread_profile();
+
+    if (profile) {
+        profile->counts[PROFILE_ALLOCATIONS]++;
+        profile->counts[PROFILE_BYTES_ALLOCATED] += size;
+        profile->live_bytes += usable;
+        if (profile->live_bytes > profile->peak_bytes) {
+            profile->peak_bytes = profile->live_bytes;
+        }
+    }
+}
+
+// Count the release of usable bytes. Memory may be freed by a thread
+// other than the one that allocated it, so live bytes stop at 0.
+static void remove_allocation(size_t usable) {
+    struct profile *profile = get_thread_profile();
+
+    if (profile) {
+        profile->counts[PROFILE_FREES]++;
+        profile->live_bytes -= usable < profile->live_bytes ?
+            usable : profile->live_bytes;
+    }
+}
+
+void *profile_malloc(size_t size) {
+    void *p = malloc(size);
+
+    if (p && profile_enabled) {
+        add_allocation(size, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *profile_realloc(void *ptr, size_t size) {
+    size_t old = ptr && profile_enabled ? malloc_usable_size(ptr) : 0;
+    void *p = realloc(ptr, size);
+
+    if (p && profile_enabled) {
+        if (ptr) {
+            remove_allocation(old);
+        }
+        add_allocation(size, malloc_usable_size(p));
+    }
+    return p;
+}
+
+void profile_free(void *ptr) {
+    if (ptr && profile_enabled) {
+        remove_allocation(malloc_usable_size(ptr));
+    }
+    free(ptr);
+}
+
+// Print the totals of every thread, as text or JSON. Threads still
+// running may not be counted in full.
+void print_profile(FILE *fp, int json) {
+    struct profile total = { 0 }, *profile;
+    struct rusage usage;
+    double files;
+    int i;
+
+    assert(fp);
+
+    pthread_mutex_lock(&profiles_lock);
+    for (profile = profiles; profile; profile = profile->next) {
+        for (i = 0; i < PROFILE_PHASES; i++) {
+            total.ns[i] += profile->ns[i];
+            total.calls[i] += profile->calls[i];
+        }
+        for (i = 0; i < PROFILE_COUNTERS; i++) {
+            total.counts[i] += profile->counts[i];
+        }
+        // The busiest thread sets the memory each worker needs
+        if (profile->peak_bytes > total.peak_bytes) {
+            total.peak_bytes = profile->peak_bytes;
+        }
+    }
+    pthread_mutex_unlock(&profiles_lock);
+    // Page faults show how much of the mapped files was actually read
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        usage.ru_minflt = usage.ru_majflt = usage.ru_maxrss = 0;
+    }
+    files = total.counts[PROFILE_FILES] ? total.counts[PROFILE_FILES] : 1;
+
+    if (json) {
+        fprintf(fp, "{\"phases\": {");
+        for (i = 0; i < PROFILE_PHASES; i++) {
+            fprintf(fp, "%s\"%s\": {\"calls\": %"PRIu64", \"ns\": %"PRIu64"}",
+                    i ? ", " : "", phase_names[i], total.calls[i],
+                    total.ns[i]);
+        }
+        fprintf(fp, "}, \"counters\": {");
+        for (i = 0; i < PROFILE_COUNTERS; i++) {
+            fprintf(fp, "%s\"%s\": %"PRIu64, i ? ", " : "",
+                    counter_names[i], total.counts[i]);
+        }
+        fprintf(fp, "}, \"allocations_per_file\": %.1f, "
+                "\"bytes_allocated_per_file\": %.1f, "
+                "\"peak_live_bytes\": %"PRIu64", \"max_rss_kb\": %ld, "
+                "\"minor_faults\": %ld, \"major_faults\": %ld}\n",
+                total.counts[PROFILE_ALLOCATIONS] / files,
+                total.counts[PROFILE_BYTES_ALLOCATED] / files,
+                total.peak_bytes, usage.ru_maxrss, usage.ru_minflt,
+                usage.ru_majflt);
+        return;
+    }
+
+    fprintf(fp, "%-18s %12s %14s %12s\n", "Phase", "Calls", "Total ms",
+            "Mean us");
+    for (i = 0; i < PROFILE_PHASES; i++) {
+        fprintf(fp, "%-18s %12"PRIu64" %14.3f %12.3f\n", phase_names[i],
+                total.calls[i], total.ns[i] / 1e6,
+                total.calls[i] ? total.ns[i] / 1e3 / total.calls[i] : 0.0);
+    }
+    for (i = 0; i < PROFILE_COUNTERS; i++) {
+        fprintf(fp, "%-18s %12"PRIu64"\n", counter_names[i],
+                total.counts[i]);
+    }
+    fprintf(fp, "%-18s %12.1f\n", "allocs_per_file",
+            total.counts[PROFILE_ALLOCATIONS] / files);
+    fprintf(fp, "%-18s %12.1f\n", "bytes_per_file",
+            total.counts[PROFILE_BYTES_ALLOCATED] / files);
+    fprintf(fp, "%-18s %12"PRIu64"\n", "peak_live_bytes", total.peak_bytes);
+    fprintf(fp, "%-18s %12ld\n", "max_rss_kb", usage.ru_maxrss);
+    fprintf(fp, "%-18s %12ld\n", "minor_faults", usage.ru_minflt);
+    fprintf(fp, "%-18s %12ld\n", "major_faults", usage.ru_majflt);
+}
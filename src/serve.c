@@ -0,0 +1,1085 @@
+// Implementation of the tag query daemon
+// Copyright 2015 David Gloe.
+//
+// Clients connect to a Unix domain socket and send requests, one JSON
+// object per line:
+//     {"id": 1, "path": "/music/a.mp3", "frames": ["TIT2", "TPE1"],
+//      "verbosity": 1}
+// Only path is required. Requests may be pipelined, and each gets one
+// line in reply carrying the same id. Replies may arrive out of order.
+//     {"id": 1, "path": "/music/a.mp3", "output": "..."}
+//     {"id": 1, "path": "/music/a.mp3", "error": "..."}
+//
+// There is no binary framing: requests are a path and a few frame IDs, so
+// parsing them costs little next to reading the tag.
+//
+// An epoll event loop owns the sockets and hands complete requests to a
+// pool of worker threads. Workers keep recently rendered tags in an LRU
+// cache shared between them, checked against the file's identity.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+#define SERVE_BACKLOG 128
+#define SERVE_MAX_EVENTS 64
+#define SERVE_READ_SIZE 65536
+#define SERVE_MAX_LINE (64 * 1024)
+// A connection isn't read from while this much work for it is queued
+#define SERVE_MAX_PENDING 256
+#define SERVE_MAX_OUTPUT (1024 * 1024)
+#define SERVE_LRU_ENTRIES 4096
+#define SERVE_LRU_BUCKETS (SERVE_LRU_ENTRIES * 2)
+
+struct request {
+    long long id;
+    int has_id;
+    char *path;
+    char *frames;       // Comma separated frame IDs, or NULL for all
+    int verbosity;
+};
+
+// A request line on its way to a worker, and its reply on the way back
+struct job {
+    struct job *next;
+    int fd;
+    unsigned int gen;
+    char *data;
+    size_t len;
+};
+
+struct job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *head;
+    struct job *tail;
+    int stop;
+};
+
+struct conn {
+    int fd;
+    unsigned int gen;   // Tells replies for a closed connection apart
+    uint32_t events;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    unsigned int pending;
+    int closing;
+};
+
+struct lru_entry {
+    struct lru_entry *prev;
+    struct lru_entry *next;
+    struct lru_entry *chain;
+    uint64_t hash;
+    char *key;
+    size_t key_len;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *output;       // Escaped JSON string, with quotes
+    size_t output_len;
+};
+
+struct lru {
+    pthread_mutex_t lock;
+    struct lru_entry *buckets[SERVE_LRU_BUCKETS];
+    struct lru_entry *head;
+    struct lru_entry *tail;
+    size_t count;
+};
+
+struct server {
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;
+    int signal_fd;
+    int verbosity;
+    struct conn **conns;
+    size_t conns_cap;
+    unsigned int next_gen;
+    struct job_queue requests;
+    struct job_queue replies;
+    struct lru lru;
+};
+
+static void queue_init(struct job_queue *queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->head = queue->tail = NULL;
+    queue->stop = 0;
+}
+
+static void queue_push(struct job_queue *queue, struct job *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take every job off a queue without waiting
+static struct job *queue_drain(struct job_queue *queue) {
+    struct job *jobs;
+
+    pthread_mutex_lock(&queue->lock);
+    jobs = queue->head;
+    queue->head = queue->tail = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return jobs;
+}
+
+// Wait for a job, returning NULL once the queue is stopped
+static struct job *queue_pop(struct job_queue *queue) {
+    struct job *job;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == NULL && !queue->stop) {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    job = queue->head;
+    if (job) {
+        queue->head = job->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+static void free_jobs(struct job *job) {
+    struct job *next;
+
+    for (; job; job = next) {
+        next = job->next;
+        free(job->data);
+        free(job);
+    }
+}
+
+// Write a JSON string literal
+static void write_json_string(FILE *fp, const char *str, size_t len) {
+    size_t i;
+    unsigned char c;
+
+    fputc('"', fp);
+    for (i = 0; i < len; i++) {
+        c = str[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c == '\n') {
+            fputs("\\n", fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static const char *skip_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+// Append a code point to a string as UTF-8
+static char *put_utf8(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = cp;
+    } else if (cp < 0x800) {
+        *out++ = 0xC0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3F);
+    } else if (cp < 0x10000) {
+        *out++ = 0xE0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    } else {
+        *out++ = 0xF0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3F);
+        *out++ = 0x80 | ((cp >> 6) & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    return out;
+}
+
+static int parse_hex4(const char *p, uint32_t *val) {
+    int i;
+
+    *val = 0;
+    for (i = 0; i < 4; i++) {
+        *val <<= 4;
+        if (p[i] >= '0' && p[i] <= '9') {
+            *val |= p[i] - '0';
+        } else if (p[i] >= 'a' && p[i] <= 'f') {
+            *val |= p[i] - 'a' + 10;
+        } else if (p[i] >= 'A' && p[i] <= 'F') {
+            *val |= p[i] - 'A' + 10;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parse a JSON string literal at *p into a new string
+// Returns the string, which must be freed, or NULL if it is invalid
+static char *parse_json_string(const char **p) {
+    const char *in = *p;
+    char *str, *out;
+    uint32_t cp, low;
+
+    if (*in++ != '"') {
+        return NULL;
+    }
+    // Escapes never expand, so the literal's length is enough
+    str = malloc(strlen(in) + 1);
+    if (str == NULL) {
+        return NULL;
+    }
+    out = str;
+    while (*in != '"') {
+        if (*in == 0 || (unsigned char)*in < 0x20) {
+            free(str);
+            return NULL;
+        } else if (*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+        in++;
+        switch (*in++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u':
+                // A NUL would cut the string short
+                if (!parse_hex4(in, &cp) || cp == 0) {
+                    free(str);
+                    return NULL;
+                }
+                in += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && in[0] == '\\' &&
+                        in[1] == 'u' && parse_hex4(in + 2, &low) &&
+                        low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    in += 6;
+                }
+                out = put_utf8(out, cp);
+                break;
+            default:
+                free(str);
+                return NULL;
+        }
+    }
+    *out = 0;
+    *p = in + 1;
+    return str;
+}
+
+// Parse a JSON integer at *p
+// Returns 1 on success, 0 otherwise
+static int parse_json_int(const char **p, long long *val) {
+    char *end;
+
+    errno = 0;
+    *val = strtoll(*p, &end, 10);
+    if (end == *p || errno) {
+        return 0;
+    }
+    *p = end;
+    return 1;
+}
+
+// Parse an array of frame IDs into a comma separated list
+// Returns the list, which must be freed, or NULL if it is invalid
+static char *parse_frame_list(const char **p) {
+    const char *in = *p;
+    char *frames, *id;
+    size_t len = 0;
+
+    if (*in++ != '[') {
+        return NULL;
+    }
+    frames = calloc(1, strlen(in) + 1);
+    if (frames == NULL) {
+        return NULL;
+    }
+    in = skip_space(in);
+    while (*in != ']') {
+        id = parse_json_string(&in);
+        if (id == NULL || strlen(id) != ID3V2_FRAME_ID_SIZE) {
+            free(id);
+            free(frames);
+            return NULL;
+        }
+        if (len) {
+            frames[len++] = ',';
+        }
+        memcpy(frames + len, id, ID3V2_FRAME_ID_SIZE);
+        len += ID3V2_FRAME_ID_SIZE;
+        free(id);
+        in = skip_space(in);
+        if (*in == ',') {
+            in = skip_space(in + 1);
+        } else if (*in != ']') {
+            free(frames);
+            return NULL;
+        }
+    }
+    *p = in + 1;
+    return frames;
+}
+
+static void free_request(struct request *req) {
+    free(req->path);
+    free(req->frames);
+}
+
+// Parse a request line
+// Returns 1 on success, 0 otherwise
+static int parse_request(const char *line, struct request *req) {
+    const char *p = skip_space(line);
+    char *key;
+    long long val;
+    int ok;
+
+    if (*p++ != '{') {
+        return 0;
+    }
+    p = skip_space(p);
+    while (*p != '}') {
+        key = parse_json_string(&p);
+        if (key == NULL) {
+            return 0;
+        }
+        p = skip_space(p);
+        if (*p++ != ':') {
+            free(key);
+            return 0;
+        }
+        p = skip_space(p);
+        if (!strcmp(key, "path")) {
+            free(req->path);
+            req->path = parse_json_string(&p);
+            ok = req->path != NULL;
+        } else if (!strcmp(key, "frames")) {
+            free(req->frames);
+            req->frames = parse_frame_list(&p);
+            ok = req->frames != NULL;
+        } else if (!strcmp(key, "id")) {
+            ok = req->has_id = parse_json_int(&p, &req->id);
+        } else if (!strcmp(key, "verbosity")) {
+            ok = parse_json_int(&p, &val) && val >= 0 && val < 16;
+            req->verbosity = val;
+        } else {
+            ok = 0;
+        }
+        free(key);
+        if (!ok) {
+            return 0;
+        }
+        p = skip_space(p);
+        if (*p == ',') {
+            p = skip_space(p + 1);
+        } else if (*p != '}') {
+            return 0;
+        }
+    }
+    return req->path != NULL && *skip_space(p + 1) == 0;
+}
+
+// Build the LRU key for a request
+static char *lru_key(struct request *req, size_t *len) {
+    char *key;
+    int count;
+
+    count = asprintf(&key, "%s%c%s%c%d", req->path, 0,
+            req->frames ? req->frames : "", 0, req->verbosity);
+    if (count == -1) {
+        return NULL;
+    }
+    *len = count;
+    return key;
+}
+
+static void lru_unlink(struct lru *lru, struct lru_entry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        lru->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru->tail = entry->prev;
+    }
+}
+
+static void lru_push_front(struct lru *lru, struct lru_entry *entry) {
+    entry->prev = NULL;
+    entry->next = lru->head;
+    if (lru->head) {
+        lru->head->prev = entry;
+    } else {
+        lru->tail = entry;
+    }
+    lru->head = entry;
+}
+
+// Find the chain link pointing at the entry for key
+static struct lru_entry **lru_find(struct lru *lru, const char *key,
+        size_t key_len, uint64_t hash) {
+    struct lru_entry **link;
+
+    link = &lru->buckets[hash % SERVE_LRU_BUCKETS];
+    while (*link && ((*link)->hash != hash || (*link)->key_len != key_len ||
+                memcmp((*link)->key, key, key_len))) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void lru_free_entry(struct lru_entry *entry) {
+    free(entry->key);
+    free(entry->output);
+    free(entry);
+}
+
+// Copy the output cached for key if the file is unchanged
+// Returns the output, which must be freed, or NULL if not cached
+static char *lru_get(struct lru *lru, const char *key, size_t key_len,
+        const struct stat *st, size_t *len) {
+    struct lru_entry *entry;
+    uint64_t hash = hash64(key, key_len, 0);
+    char *output = NULL;
+
+    pthread_mutex_lock(&lru->lock);
+    entry = *lru_find(lru, key, key_len, hash);
+    if (entry && entry->dev == st->st_dev && entry->ino == st->st_ino &&
+            entry->size == st->st_size &&
+            entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        output = malloc(entry->output_len);
+        if (output) {
+            memcpy(output, entry->output, entry->output_len);
+            *len = entry->output_len;
+        }
+        lru_unlink(lru, entry);
+        lru_push_front(lru, entry);
+    }
+    pthread_mutex_unlock(&lru->lock);
+    return output;
+}
+
+// Cache the output for key, evicting the least recently used entry if
+// the cache is full. Takes ownership of key and output.
+static void lru_put(struct lru *lru, char *key, size_t key_len,
+        const struct stat *st, char *output, size_t len) {
+    struct lru_entry *entry, **link, *replaced, *evicted = NULL;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        free(key);
+        free(output);
+        return;
+    }
+    entry->hash = hash64(key, key_len, 0);
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->output = output;
+    entry->output_len = len;
+
+    pthread_mutex_lock(&lru->lock);
+    link = lru_find(lru, key, key_len, entry->hash);
+    replaced = *link;
+    if (replaced) {
+        // Replace an outdated entry
+        entry->chain = replaced->chain;
+        lru_unlink(lru, replaced);
+        lru->count--;
+    }
+    *link = entry;
+    lru_push_front(lru, entry);
+    lru->count++;
+    if (lru->count > SERVE_LRU_ENTRIES) {
+        evicted = lru->tail;
+        lru_unlink(lru, evicted);
+        link = lru_find(lru, evicted->key, evicted->key_len, evicted->hash);
+        *link = evicted->chain;
+        lru->count--;
+    }
+    pthread_mutex_unlock(&lru->lock);
+    if (replaced) {
+        lru_free_entry(replaced);
+    }
+    if (evicted) {
+        lru_free_entry(evicted);
+    }
+}
+
+static void lru_free(struct lru *lru) {
+    struct lru_entry *entry, *next;
+
+    for (entry = lru->head; entry; entry = next) {
+        next = entry->next;
+        lru_free_entry(entry);
+    }
+}
+
+// Render the output for a request as an escaped JSON string
+// Returns the string, which must be freed, or NULL with error set
+static char *render_tag(struct request *req, size_t *len,
+        const char **error) {
+    struct id3v2_header header;
+    char *buf, *output;
+    size_t buf_len;
+    FILE *fp;
+    int fd;
+
+    fd = open(req->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    if (!get_id3v2_tag(fd, &header)) {
+        close(fd);
+        *error = "No valid ID3v2 tag";
+        return NULL;
+    }
+    fp = open_memstream(&buf, &buf_len);
+    if (fp) {
+        print_id3v2_tag(fp, &header, req->verbosity, NULL, req->frames);
+        fclose(fp);
+    }
+    free_id3v2_tag(&header);
+    close(fd);
+    if (fp == NULL) {
+        *error = "Out of memory";
+        return NULL;
+    }
+
+    fp = open_memstream(&output, len);
+    if (fp == NULL) {
+        *error = "Out of memory";
+        free(buf);
+        return NULL;
+    }
+    write_json_string(fp, buf, buf_len);
+    fclose(fp);
+    free(buf);
+    return output;
+}
+
+// Answer a request line, replacing it with the reply line
+static void handle_job(struct server *server, struct job *job) {
+    struct request req;
+    struct stat st;
+    char *key = NULL, *output = NULL, *copy;
+    const char *error = "Out of memory";
+    size_t key_len, output_len;
+    char *reply;
+    size_t reply_len;
+    FILE *fp;
+
+    memset(&req, 0, sizeof(req));
+    req.verbosity = server->verbosity;
+    if (!parse_request(job->data, &req)) {
+        error = "Invalid request";
+    } else if (stat(req.path, &st)) {
+        error = strerror(errno);
+    } else {
+        key = lru_key(&req, &key_len);
+        if (key) {
+            output = lru_get(&server->lru, key, key_len, &st, &output_len);
+        }
+        if (output == NULL) {
+            output = render_tag(&req, &output_len, &error);
+            copy = output && key ? malloc(output_len) : NULL;
+            if (copy) {
+                memcpy(copy, output, output_len);
+                lru_put(&server->lru, key, key_len, &st, copy, output_len);
+                key = NULL;
+            }
+        }
+    }
+
+    fp = open_memstream(&reply, &reply_len);
+    if (fp == NULL) {
+        reply = NULL;
+        reply_len = 0;
+    } else {
+        fputc('{', fp);
+        if (req.has_id) {
+            fprintf(fp, "\"id\": %lld, ", req.id);
+        }
+        if (req.path) {
+            fputs("\"path\": ", fp);
+            write_json_string(fp, req.path, strlen(req.path));
+            fputs(", ", fp);
+        }
+        if (output) {
+            fputs("\"output\": ", fp);
+            fwrite(output, 1, output_len, fp);
+        } else {
+            fputs("\"error\": ", fp);
+            write_json_string(fp, error, strlen(error));
+        }
+        fputs("}\n", fp);
+        fclose(fp);
+    }
+    free(key);
+    free(output);
+    free_request(&req);
+    free(job->data);
+    job->data = reply;
+    job->len = reply_len;
+}
+
+static void *worker_main(void *arg) {
+    struct server *server = arg;
+    struct job *job;
+    uint64_t one = 1;
+
+    while ((job = queue_pop(&server->requests))) {
+        handle_job(server, job);
+        queue_push(&server->replies, job);
+        if (write(server->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            debug("eventfd write failed: %m");
+        }
+    }
+    return NULL;
+}
+
+// Update the events a connection is polled for. Connections with too
+// much work outstanding aren't read from until it drains.
+static void update_events(struct server *server, struct conn *conn) {
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (!conn->closing && conn->pending < SERVE_MAX_PENDING &&
+            conn->out_len - conn->out_off < SERVE_MAX_OUTPUT) {
+        events |= EPOLLIN;
+    }
+    if (conn->out_off < conn->out_len) {
+        events |= EPOLLOUT;
+    }
+    if (events != conn->events) {
+        ev.events = events;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev)) {
+            debug("epoll_ctl failed: %m");
+        }
+        conn->events = events;
+    }
+}
+
+static void close_conn(struct server *server, struct conn *conn) {
+    server->conns[conn->fd] = NULL;
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void accept_conns(struct server *server) {
+    struct epoll_event ev;
+    struct conn *conn, **conns;
+    size_t cap;
+    int fd;
+
+    while ((fd = accept4(server->listen_fd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (fd >= server->conns_cap) {
+            cap = server->conns_cap ? server->conns_cap : 64;
+            while (cap <= fd) {
+                cap *= 2;
+            }
+            conns = realloc(server->conns, cap * sizeof(*conns));
+            if (conns == NULL) {
+                debug("realloc failed: %m");
+                close(fd);
+                continue;
+            }
+            memset(conns + server->conns_cap, 0,
+                    (cap - server->conns_cap) * sizeof(*conns));
+            server->conns = conns;
+            server->conns_cap = cap;
+        }
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            debug("calloc failed: %m");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->gen = ++server->next_gen;
+        conn->events = EPOLLIN;
+        ev.events = conn->events;
+        ev.data.fd = fd;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            debug("epoll_ctl failed: %m");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        server->conns[fd] = conn;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        debug("accept failed: %m");
+    }
+}
+
+// Queue every complete line received on a connection
+// Returns 1 on success, 0 if the connection should be closed
+static int submit_lines(struct server *server, struct conn *conn) {
+    struct job *job;
+    char *start = conn->in, *nl;
+    size_t left = conn->in_len;
+
+    while ((nl = memchr(start, '\n', left))) {
+        if (nl > start) {
+            job = malloc(sizeof(*job));
+            if (job == NULL) {
+                return 0;
+            }
+            job->fd = conn->fd;
+            job->gen = conn->gen;
+            job->data = strndup(start, nl - start);
+            if (job->data == NULL) {
+                free(job);
+                return 0;
+            }
+            conn->pending++;
+            queue_push(&server->requests, job);
+        }
+        left -= nl + 1 - start;
+        start = nl + 1;
+    }
+    memmove(conn->in, start, left);
+    conn->in_len = left;
+    return left < SERVE_MAX_LINE;
+}
+
+// Read what is available on a connection
+// Returns 1 on success, 0 if the connection should be closed
+static int read_conn(struct server *server, struct conn *conn) {
+    ssize_t count;
+    char *in;
+
+    if (conn->in_cap - conn->in_len < SERVE_READ_SIZE) {
+        in = realloc(conn->in, conn->in_len + SERVE_READ_SIZE);
+        if (in == NULL) {
+            return 0;
+        }
+        conn->in = in;
+        conn->in_cap = conn->in_len + SERVE_READ_SIZE;
+    }
+    count = read(conn->fd, conn->in + conn->in_len,
+            conn->in_cap - conn->in_len);
+    if (count == -1) {
+        return errno == EAGAIN || errno == EINTR;
+    } else if (count == 0) {
+        // Answer what was asked before the client stopped sending
+        conn->closing = 1;
+        return 1;
+    }
+    conn->in_len += count;
+    return submit_lines(server, conn);
+}
+
+// Write as much pending output as the socket takes
+// Returns 1 on success, 0 if the connection should be closed
+static int flush_conn(struct conn *conn) {
+    ssize_t count;
+
+    while (conn->out_off < conn->out_len) {
+        count = send(conn->fd, conn->out + conn->out_off,
+                conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (count == -1) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        conn->out_off += count;
+    }
+    conn->out_off = conn->out_len = 0;
+    return 1;
+}
+
+// Append a reply to a connection's output
+// Returns 1 on success, 0 otherwise
+static int append_reply(struct conn *conn, struct job *job) {
+    size_t cap;
+    char *out;
+
+    if (conn->out_off && conn->out_len + job->len > conn->out_cap) {
+        memmove(conn->out, conn->out + conn->out_off,
+                conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if (conn->out_len + job->len > conn->out_cap) {
+        cap = conn->out_cap ? conn->out_cap : SERVE_READ_SIZE;
+        while (cap < conn->out_len + job->len) {
+            cap *= 2;
+        }
+        out = realloc(conn->out, cap);
+        if (out == NULL) {
+            return 0;
+        }
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, job->data, job->len);
+    conn->out_len += job->len;
+    return 1;
+}
+
+// Send replies from the workers to their connections
+static void deliver_replies(struct server *server) {
+    struct job *job, *next;
+    struct conn *conn;
+    uint64_t count;
+
+    // The count only matters for waking the loop
+    if (read(server->event_fd, &count, sizeof(count)) == -1 &&
+            errno != EAGAIN) {
+        debug("eventfd read failed: %m");
+    }
+    for (job = queue_drain(&server->replies); job; job = next) {
+        next = job->next;
+        conn = job->fd < server->conns_cap ? server->conns[job->fd] : NULL;
+        if (conn && conn->gen == job->gen) {
+            conn->pending--;
+            if (job->data == NULL || !append_reply(conn, job) ||
+                    !flush_conn(conn)) {
+                close_conn(server, conn);
+            } else if (conn->closing && conn->pending == 0 &&
+                    conn->out_len == 0) {
+                close_conn(server, conn);
+            } else {
+                update_events(server, conn);
+            }
+        }
+        job->next = NULL;
+        free_jobs(job);
+    }
+}
+
+static void handle_conn(struct server *server, struct conn *conn,
+        uint32_t events) {
+    int ok = 1;
+
+    if (events & EPOLLIN) {
+        ok = read_conn(server, conn);
+    }
+    if (ok && (events & EPOLLOUT)) {
+        ok = flush_conn(conn);
+    }
+    // Replies can't be delivered once the peer has gone entirely
+    if (ok && (events & (EPOLLERR | EPOLLHUP))) {
+        ok = 0;
+    }
+    if (!ok || (conn->closing && conn->pending == 0 && conn->out_len == 0)) {
+        close_conn(server, conn);
+    } else {
+        update_events(server, conn);
+    }
+}
+
+// Create the listening socket, replacing a stale one left at path
+// Returns the socket, or -1 on failure
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd, ok;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        debug("Socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        debug("socket failed: %m");
+        return -1;
+    }
+    // Only the user running the server may connect, as requests can name
+    // any file it can read. No other thread is running yet to be affected
+    // by the umask
+    mask = umask(0177);
+    ok = !bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (!ok || listen(fd, SERVE_BACKLOG)) {
+        debug("Listening on %s failed: %m", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int add_poll(int epoll_fd, int fd) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        debug("epoll_ctl failed: %m");
+        return 0;
+    }
+    return 1;
+}
+
+// Serve tag queries on a Unix domain socket at path until interrupted
+// Uses workers threads, or one per CPU if workers is 0.
+// Returns 1 after a clean shutdown, 0 on failure
+int run_server(const char *path, unsigned int workers, int verbosity) {
+    struct server server;
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    pthread_t *threads;
+    sigset_t sigs;
+    size_t i;
+    int count, n, fd, ret = 0, running = 1;
+    unsigned int started = 0;
+
+    assert(path);
+
+    memset(&server, 0, sizeof(server));
+    server.verbosity = verbosity;
+    server.event_fd = server.signal_fd = server.epoll_fd = -1;
+    queue_init(&server.requests);
+    queue_init(&server.replies);
+    pthread_mutex_init(&server.lru.lock, NULL);
+    if (workers == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > 0 ? n : 1;
+    }
+
+    // Workers inherit the blocked signals, leaving them to the event loop
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    server.listen_fd = listen_socket(path);
+    if (server.listen_fd == -1) {
+        return 0;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    threads = calloc(workers, sizeof(*threads));
+    if (server.epoll_fd == -1 || server.event_fd == -1 ||
+            server.signal_fd == -1 || threads == NULL) {
+        debug("Creating server failed: %m");
+        goto out;
+    }
+    if (!add_poll(server.epoll_fd, server.listen_fd) ||
+            !add_poll(server.epoll_fd, server.event_fd) ||
+            !add_poll(server.epoll_fd, server.signal_fd)) {
+        goto out;
+    }
+    for (started = 0; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, &server)) {
+            debug("pthread_create failed");
+            goto out;
+        }
+    }
+
+    while (running) {
+        count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("epoll_wait failed: %m");
+            goto out;
+        }
+        for (n = 0; n < count; n++) {
+            fd = events[n].data.fd;
+            if (fd == server.listen_fd) {
+                accept_conns(&server);
+            } else if (fd == server.event_fd) {
+                deliver_replies(&server);
+            } else if (fd == server.signal_fd) {
+                running = 0;
+            } else if (fd < server.conns_cap && server.conns[fd]) {
+                handle_conn(&server, server.conns[fd], events[n].events);
+            }
+        }
+    }
+    ret = 1;
+
+out:
+    pthread_mutex_lock(&server.requests.lock);
+    server.requests.stop = 1;
+    pthread_cond_broadcast(&server.requests.cond);
+    pthread_mutex_unlock(&server.requests.lock);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    free(threads);
+    free_jobs(queue_drain(&server.requests));
+    free_jobs(queue_drain(&server.replies));
+    for (i = 0; i < server.conns_cap; i++) {
+        if (server.conns[i]) {
+            close_conn(&server, server.conns[i]);
+        }
+    }
+    free(server.conns);
+    lru_free(&server.lru);
+    close(server.listen_fd);
+    unlink(path);
+    if (server.epoll_fd != -1) {
+        close(server.epoll_fd);
+    }
+    if (server.event_fd != -1) {
+        close(server.event_fd);
+    }
+    if (server.signal_fd != -1) {
+        close(server.signal_fd);
+    }
+    return ret;
+}
@@ -0,0 +1,536 @@
+// Aggregate statistics over many tags, read from their headers alone
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// The first read of each file holds the headers of most whole tags
+#define WALK_WINDOW 4096
+// A frame header with all its flag data, and the first byte of data
+#define WALK_FRAME_PEEK (ID3V2_FRAME_HEADER_SIZE + 5 + 1)
+// Sizes are counted in power of two buckets up to 4 GiB
+#define STATS_BUCKETS 33
+// Frame IDs beyond this many distinct ones are counted together
+#define STATS_MAX_IDS 1024
+#define STATS_ENCODINGS (ID3V2_ENCODING_UTF_8 + 2)
+#define TITLE_WIDTH 24
+
+// A tag being read a frame header at a time, through a small window
+struct tag_walk {
+    int fd;
+    struct id3v2_header header;
+    off_t frames_offset; // File offset of the frame data
+    off_t window_offset; // File offset of window
+    size_t window_len;
+    uint8_t window[WALK_WINDOW];
+};
+
+struct frame_count {
+    uint32_t id;
+    uint64_t count;
+};
+
+struct tag_stats {
+    uint64_t files;
+    uint64_t untagged;
+    uint64_t unreadable;
+    uint64_t bad_frames;
+    uint64_t versions[ID3V2_SUPPORTED_VERSION + 1];
+    uint64_t tag_sizes[STATS_BUCKETS];
+    uint64_t tag_bytes;
+    uint64_t paddings[STATS_BUCKETS];
+    uint64_t padding_bytes;
+    uint64_t unsynchronized_tags;
+    uint64_t frames;
+    uint64_t compressed;
+    uint64_t unsynchronized;
+    uint64_t encrypted;
+    uint64_t encodings[STATS_ENCODINGS];
+    uint64_t apic_frames;
+    uint64_t apic_bytes;
+    struct frame_count ids[STATS_MAX_IDS];
+    unsigned int nids;
+    uint64_t other_ids;
+};
+
+// Where the bytes of one file's tag go
+struct survey_entry {
+    uint64_t tag;     // Whole tag, with its header and footer
+    uint64_t padding; // Padding after the last frame
+    int status;       // As from walk_open, or -1 for a bad frame
+};
+
+struct stats_scan {
+    char * const *files;
+    struct work_queue queue;
+    struct survey_entry *survey; // Entry for each file when surveying
+};
+
+struct stats_worker {
+    struct stats_scan *scan;
+    struct tag_stats stats;
+};
+
+// Start reading the tag at the start of fd
+// Return 1 if there is a tag, 0 if not, or -1 on failure
+static int walk_open(struct tag_walk *walk, int fd) {
+    ssize_t count;
+
+    walk->fd = fd;
+    count = pread(fd, walk->window, sizeof(walk->window), 0);
+    if (count == -1) {
+        debug("pread failed: %m");
+        return -1;
+    }
+    walk->window_offset = 0;
+    walk->window_len = count;
+    if (!parse_id3v2_tag_header(walk->window, count, &walk->header)) {
+        return 0;
+    }
+    walk->header.fd = fd;
+    walk->frames_offset = walk->header.frame_data_offset;
+    walk->header.i = 0;
+    return 1;
+}
+
+// Read the next frame header. first is set to the first byte of the
+// frame's data, or -1 if it has none.
+// Return 1 if a frame was read, 0 at padding or the end of the tag,
+// or -1 on failure
+static int walk_next(struct tag_walk *walk, struct id3v2_frame_header *fheader,
+        int *first) {
+    struct id3v2_header *header = &walk->header;
+    const uint8_t *p;
+    size_t want, len;
+    ssize_t count;
+    off_t offset;
+
+    if (header->i + ID3V2_FRAME_HEADER_SIZE > header->frame_data_len) {
+        header->padding = header->frame_data_len - header->i;
+        return 0;
+    }
+    want = header->frame_data_len - header->i;
+    if (want > WALK_FRAME_PEEK) {
+        want = WALK_FRAME_PEEK;
+    }
+
+    // Move the window up to this frame if it isn't all there already
+    offset = walk->frames_offset + header->i;
+    if (offset < walk->window_offset ||
+            offset + want > walk->window_offset + walk->window_len) {
+        len = header->frame_data_len - header->i;
+        if (len > sizeof(walk->window)) {
+            len = sizeof(walk->window);
+        }
+        count = pread(walk->fd, walk->window, len, offset);
+        if (count < (ssize_t)want) {
+            debug("Unexpected eof or error in frame header: %m");
+            return -1;
+        }
+        walk->window_offset = offset;
+        walk->window_len = count;
+    }
+    p = walk->window + (offset - walk->window_offset);
+    if (p[0] == 0) {
+        header->padding = header->frame_data_len - header->i;
+        return 0;
+    }
+
+    len = parse_id3v2_frame_header(p, want, header->version, fheader);
+    if (len == 0) {
+        return -1;
+    } else if (header->i + ID3V2_FRAME_HEADER_SIZE + fheader->size >
+            header->frame_data_len) {
+        debug("Frame %s size %"PRIu32" overflows tag", fheader->id,
+                fheader->size);
+        return -1;
+    }
+    *first = len < want && fheader->raw_len ? p[len] : -1;
+    fheader->data = NULL;
+    fheader->data_offset = walk->frames_offset + header->i + len;
+    header->i += len + fheader->raw_len;
+    header->frames++;
+    return 1;
+}
+
+// Get the bucket counting size, which is its number of bits
+static unsigned int size_bucket(uint64_t size) {
+    unsigned int bucket = 0;
+
+    for (; size && bucket < STATS_BUCKETS - 1; size >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Add count occurrences of a frame ID
+static void count_id(struct tag_stats *stats, uint32_t id, uint64_t count) {
+    size_t i;
+
+    i = (id * 0x9E3779B1U) % STATS_MAX_IDS;
+    while (stats->ids[i].count && stats->ids[i].id != id) {
+        i = (i + 1) % STATS_MAX_IDS;
+    }
+    if (stats->ids[i].count == 0) {
+        // Keep the table sparse enough to probe quickly
+        if (stats->nids >= STATS_MAX_IDS / 4 * 3) {
+            stats->other_ids += count;
+            return;
+        }
+        stats->ids[i].id = id;
+        stats->nids++;
+    }
+    stats->ids[i].count += count;
+}
+
+static void count_frame(struct tag_stats *stats,
+        struct id3v2_frame_header *fheader, int first) {
+    uint32_t id;
+
+    memcpy(&id, fheader->id, sizeof(id));
+    count_id(stats, id, 1);
+    stats->frames++;
+    stats->compressed += fheader->compressed != 0;
+    stats->unsynchronized += fheader->unsynchronized != 0;
+    stats->encrypted += fheader->encrypted != 0;
+    if (!strcmp(fheader->id, ID3V2_FRAME_ID_APIC)) {
+        stats->apic_frames++;
+        stats->apic_bytes += fheader->size;
+    }
+    // Transformed data doesn't start with the encoding
+    if (first != -1 && !fheader->compressed && !fheader->encrypted &&
+            frame_has_encoding(fheader->id)) {
+        stats->encodings[first < STATS_ENCODINGS - 1 ? first :
+                STATS_ENCODINGS - 1]++;
+    }
+}
+
+static void count_file(struct tag_stats *stats, const char *path,
+        struct tag_walk *walk) {
+    struct id3v2_frame_header fheader;
+    int fd, ret, first;
+
+    stats->files++;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        debug("open %s failed: %m", path);
+        stats->unreadable++;
+        return;
+    }
+    ret = walk_open(walk, fd);
+    if (ret != 1) {
+        if (ret == 0) {
+            stats->untagged++;
+        } else {
+            stats->unreadable++;
+        }
+        close(fd);
+        return;
+    }
+
+    stats->versions[walk->header.version]++;
+    stats->tag_sizes[size_bucket(walk->header.tag_size)]++;
+    stats->tag_bytes += walk->header.tag_size;
+    stats->unsynchronized_tags += walk->header.unsynchronization != 0;
+    while ((ret = walk_next(walk, &fheader, &first)) == 1) {
+        count_frame(stats, &fheader, first);
+    }
+    if (ret == -1) {
+        stats->bad_frames++;
+    } else {
+        stats->paddings[size_bucket(walk->header.padding)]++;
+        stats->padding_bytes += walk->header.padding;
+    }
+    close(fd);
+}
+
+// Measure the tag and its padding by walking the frame headers
+static void survey_file(struct survey_entry *entry, const char *path,
+        struct tag_walk *walk) {
+    struct id3v2_frame_header fheader;
+    int fd, first;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        debug("open %s failed: %m", path);
+        entry->status = -1;
+        return;
+    }
+    entry->status = walk_open(walk, fd);
+    if (entry->status == 1) {
+        while ((entry->status = walk_next(walk, &fheader, &first)) == 1);
+        if (entry->status == 0) {
+            entry->status = 1;
+            entry->tag = ID3V2_HEADER_SIZE + walk->header.tag_size +
+                    (walk->header.footer_present ? ID3V2_FOOTER_SIZE : 0);
+            entry->padding = walk->header.padding;
+        }
+    }
+    close(fd);
+}
+
+static void *stats_worker(void *arg) {
+    struct stats_worker *worker = arg;
+    struct stats_scan *scan = worker->scan;
+    struct tag_walk *walk;
+    int i;
+
+    walk = malloc(sizeof(*walk));
+    if (walk == NULL) {
+        debug("malloc %zu failed: %m", sizeof(*walk));
+        return NULL;
+    }
+    while ((i = next_work(&scan->queue)) >= 0) {
+        if (scan->survey) {
+            survey_file(&scan->survey[i], scan->files[i], walk);
+        } else {
+            count_file(&worker->stats, scan->files[i], walk);
+        }
+    }
+    free(walk);
+    return NULL;
+}
+
+static void merge_stats(struct tag_stats *into, const struct tag_stats *from) {
+    size_t i;
+
+    into->files += from->files;
+    into->untagged += from->untagged;
+    into->unreadable += from->unreadable;
+    into->bad_frames += from->bad_frames;
+    for (i = 0; i <= ID3V2_SUPPORTED_VERSION; i++) {
+        into->versions[i] += from->versions[i];
+    }
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        into->tag_sizes[i] += from->tag_sizes[i];
+        into->paddings[i] += from->paddings[i];
+    }
+    into->tag_bytes += from->tag_bytes;
+    into->padding_bytes += from->padding_bytes;
+    into->unsynchronized_tags += from->unsynchronized_tags;
+    into->frames += from->frames;
+    into->compressed += from->compressed;
+    into->unsynchronized += from->unsynchronized;
+    into->encrypted += from->encrypted;
+    for (i = 0; i < STATS_ENCODINGS; i++) {
+        into->encodings[i] += from->encodings[i];
+    }
+    into->apic_frames += from->apic_frames;
+    into->apic_bytes += from->apic_bytes;
+    for (i = 0; i < STATS_MAX_IDS; i++) {
+        if (from->ids[i].count) {
+            count_id(into, from->ids[i].id, from->ids[i].count);
+        }
+    }
+    into->other_ids += from->other_ids;
+}
+
+// Write a power of two number of bytes with the largest whole unit
+static void format_size(char *buf, size_t len, uint64_t size) {
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int unit = 0;
+
+    while (size >= 1024 && size % 1024 == 0 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+    snprintf(buf, len, "%"PRIu64" %s", size, units[unit]);
+}
+
+static void print_histogram(FILE *fp, const char *title,
+        const uint64_t buckets[STATS_BUCKETS]) {
+    char low[16], high[16], range[40];
+    unsigned int i;
+
+    fprintf(fp, "%s:\n", title);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        } else if (i == 0) {
+            snprintf(range, sizeof(range), "0 B");
+        } else {
+            format_size(low, sizeof(low), 1ULL << (i - 1));
+            format_size(high, sizeof(high), 1ULL << i);
+            snprintf(range, sizeof(range), "%s - %s", low, high);
+        }
+        fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, range, buckets[i]);
+    }
+}
+
+// Most frequent first
+static int compare_counts(const void *a, const void *b) {
+    const struct frame_count *x = a, *y = b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return memcmp(&x->id, &y->id, sizeof(x->id));
+}
+
+static void print_stats(FILE *fp, struct tag_stats *stats) {
+    char id[ID3V2_FRAME_ID_SIZE + 1];
+    unsigned int i;
+
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Files", stats->files);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Untagged",
+            stats->untagged);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Unreadable",
+            stats->unreadable);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Bad Frames",
+            stats->bad_frames);
+    for (i = 0; i <= ID3V2_SUPPORTED_VERSION; i++) {
+        if (stats->versions[i]) {
+            snprintf(id, sizeof(id), "2.%u", i);
+            fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, id,
+                    stats->versions[i]);
+        }
+    }
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Unsynchronized Tags",
+            stats->unsynchronized_tags);
+    fprintf(fp, "%*s: %"PRIu64" bytes\n", TITLE_WIDTH, "Tag Size",
+            stats->tag_bytes);
+    fprintf(fp, "%*s: %"PRIu64" bytes\n", TITLE_WIDTH, "Padding",
+            stats->padding_bytes);
+    print_histogram(fp, "Tag Sizes", stats->tag_sizes);
+    print_histogram(fp, "Padding Sizes", stats->paddings);
+
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Frames", stats->frames);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Compressed",
+            stats->compressed);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Unsynchronized",
+            stats->unsynchronized);
+    fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Encrypted",
+            stats->encrypted);
+    fprintf(fp, "%*s: %"PRIu64" frames, %"PRIu64" bytes\n", TITLE_WIDTH,
+            "Pictures", stats->apic_frames, stats->apic_bytes);
+    fprintf(fp, "Encodings:\n");
+    for (i = 0; i < STATS_ENCODINGS; i++) {
+        if (stats->encodings[i]) {
+            fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, encoding_str(i),
+                    stats->encodings[i]);
+        }
+    }
+
+    // Compact the table to sort it
+    fprintf(fp, "Frame IDs:\n");
+    for (i = 0, stats->nids = 0; i < STATS_MAX_IDS; i++) {
+        if (stats->ids[i].count) {
+            stats->ids[stats->nids++] = stats->ids[i];
+        }
+    }
+    qsort(stats->ids, stats->nids, sizeof(*stats->ids), compare_counts);
+    for (i = 0; i < stats->nids; i++) {
+        memcpy(id, &stats->ids[i].id, ID3V2_FRAME_ID_SIZE);
+        id[ID3V2_FRAME_ID_SIZE] = 0;
+        fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, id,
+                stats->ids[i].count);
+    }
+    if (stats->other_ids) {
+        fprintf(fp, "%*s: %"PRIu64"\n", TITLE_WIDTH, "Others",
+                stats->other_ids);
+    }
+}
+
+// Share out the files of scan between workers threads, or one per CPU if
+// workers is 0, and wait for them to finish. Each thread keeps its own
+// counts, which the caller adds up.
+// Returns the started threads' workers, or NULL on failure
+static struct stats_worker *run_scan(struct stats_scan *scan,
+        unsigned int workers, unsigned int *started) {
+    struct stats_worker *pool;
+    unsigned int i;
+
+    workers = pool_size(workers, 1, scan->queue.count);
+    pool = calloc(workers, sizeof(*pool));
+    if (pool == NULL) {
+        debug("calloc failed: %m");
+        return NULL;
+    }
+    for (i = 0; i < workers; i++) {
+        pool[i].scan = scan;
+    }
+    *started = run_pool(stats_worker, pool, sizeof(*pool), workers);
+    if (*started == 0) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int print_tag_stats(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp) {
+    struct stats_scan scan;
+    struct stats_worker *pool;
+    unsigned int started, i;
+
+    assert(files);
+    assert(fp);
+
+    scan.files = files;
+    init_work_queue(&scan.queue, nfiles);
+    scan.survey = NULL;
+    pool = run_scan(&scan, workers, &started);
+    if (pool == NULL) {
+        return 0;
+    }
+    for (i = 1; i < started; i++) {
+        merge_stats(&pool[0].stats, &pool[i].stats);
+    }
+    print_stats(fp, &pool[0].stats);
+    free(pool);
+    return 1;
+}
+
+// Print the tag size, bytes used by the headers and frames, and padding
+// of each file in order, then the totals
+int print_tag_survey(char * const files[], int nfiles, unsigned int workers,
+        FILE *fp) {
+    struct stats_scan scan;
+    struct stats_worker *pool;
+    struct survey_entry *entry, total;
+    unsigned int started;
+    int i, ret = 1;
+
+    assert(files);
+    assert(fp);
+
+    scan.files = files;
+    init_work_queue(&scan.queue, nfiles);
+    scan.survey = calloc(nfiles ? nfiles : 1, sizeof(*scan.survey));
+    if (scan.survey == NULL) {
+        debug("calloc failed: %m");
+        return 0;
+    }
+    pool = run_scan(&scan, workers, &started);
+    if (pool == NULL) {
+        free(scan.survey);
+        return 0;
+    }
+    free(pool);
+
+    memset(&total, 0, sizeof(total));
+    fprintf(fp, "%12s %12s %12s %s\n", "Tag", "Used", "Padding", "File");
+    for (i = 0; i < nfiles; i++) {
+        entry = &scan.survey[i];
+        if (entry->status == -1) {
+            fprintf(stderr, "Couldn't read the tag of %s\n", files[i]);
+            ret = 0;
+            continue;
+        }
+        fprintf(fp, "%12"PRIu64" %12"PRIu64" %12"PRIu64" %s\n", entry->tag,
+                entry->tag - entry->padding, entry->padding, files[i]);
+        total.tag += entry->tag;
+        total.padding += entry->padding;
+    }
+    fprintf(fp, "%12"PRIu64" %12"PRIu64" %12"PRIu64" %s\n", total.tag,
+            total.tag - total.padding, total.padding, "Total");
+    free(scan.survey);
+    return ret;
+}
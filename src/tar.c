@@ -0,0 +1,288 @@
+// Implementation of a streaming tar archive writer
+// Copyright 2015 David Gloe.
+//
+// Archives use the POSIX ustar format, with GNU long name entries for
+// names that don't fit.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_SIZE 155
+#define TAR_LONGNAME "././@LongLink"
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_LONGNAME 'L'
+
+// Entries are gathered into large writes
+#define TAR_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct tar_header {
+    char name[TAR_NAME_SIZE];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[TAR_PREFIX_SIZE];
+    char pad[12];
+};
+
+struct tar_writer {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+};
+
+// Write out everything buffered
+// Returns 1 on success, 0 otherwise
+static int tar_flush(struct tar_writer *tar) {
+    if (!write_all(tar->fd, tar->buf, tar->len)) {
+        return 0;
+    }
+    tar->len = 0;
+    return 1;
+}
+
+// Append data to the archive, padded to a whole number of blocks
+// Returns 1 on success, 0 otherwise
+static int tar_append(struct tar_writer *tar, const void *data, size_t len) {
+    size_t padded = (len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE *
+        TAR_BLOCK_SIZE;
+    size_t avail, count;
+
+    while (len > 0) {
+        if (tar->len == TAR_BUFFER_SIZE && !tar_flush(tar)) {
+            return 0;
+        }
+        avail = TAR_BUFFER_SIZE - tar->len;
+        count = len < avail ? len : avail;
+        memcpy(tar->buf + tar->len, data, count);
+        tar->len += count;
+        data = (const uint8_t *)data + count;
+        len -= count;
+        padded -= count;
+    }
+    while (padded > 0) {
+        if (tar->len == TAR_BUFFER_SIZE && !tar_flush(tar)) {
+            return 0;
+        }
+        avail = TAR_BUFFER_SIZE - tar->len;
+        count = padded < avail ? padded : avail;
+        memset(tar->buf + tar->len, 0, count);
+        tar->len += count;
+        padded -= count;
+    }
+    return 1;
+}
+
+// Fill in and append a header block
+// Returns 1 on success, 0 otherwise
+static int tar_append_header(struct tar_writer *tar, const char *name,
+        const char *prefix, char type, size_t size, time_t mtime) {
+    struct tar_header header;
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name));
+    if (prefix) {
+        strncpy(header.prefix, prefix, sizeof(header.prefix));
+    }
+    snprintf(header.mode, sizeof(header.mode), "%07o", 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011zo", size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011llo",
+            (unsigned long long)mtime);
+    header.typeflag = type;
+    memcpy(header.magic, "ustar", sizeof(header.magic));
+    memcpy(header.version, "00", sizeof(header.version));
+
+    // The checksum is computed with its own field set to spaces
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    for (i = 0; i < sizeof(header); i++) {
+        sum += ((uint8_t *)&header)[i];
+    }
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    return tar_append(tar, &header, sizeof(header));
+}
+
+// Open a tar archive for writing at path, or on stdout if path is "-"
+// Returns the writer, or NULL on failure
+struct tar_writer *tar_open(const char *path) {
+    struct tar_writer *tar;
+
+    assert(path);
+
+    tar = calloc(1, sizeof(*tar));
+    if (tar == NULL) {
+        debug("calloc %zu failed: %m", sizeof(*tar));
+        return NULL;
+    }
+    tar->buf = malloc(TAR_BUFFER_SIZE);
+    if (tar->buf == NULL) {
+        debug("malloc %d failed: %m", TAR_BUFFER_SIZE);
+        free(tar);
+        return NULL;
+    }
+    // stdout is duplicated so the caller may redirect it afterwards
+    if (!strcmp(path, "-")) {
+        tar->fd = dup(STDOUT_FILENO);
+    } else {
+        tar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (tar->fd == -1) {
+        debug("Opening %s failed: %m", path);
+        free(tar->buf);
+        free(tar);
+        return NULL;
+    }
+    return tar;
+}
+
+// Add a file entry named name to the archive
+// Returns 1 on success, 0 otherwise
+static int tar_add_entry(struct tar_writer *tar, const char *name,
+        const uint8_t *data, size_t len, time_t mtime) {
+    const char *split = NULL, *p;
+    char prefix[TAR_PREFIX_SIZE + 1];
+    size_t namelen, direct;
+
+    namelen = strlen(name);
+
+    // Long names are split between the prefix and name fields if
+    // possible, and otherwise written in an entry of their own
+    if (namelen > TAR_NAME_SIZE) {
+        for (p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+            if (p - name <= TAR_PREFIX_SIZE &&
+                    namelen - (p - name) - 1 <= TAR_NAME_SIZE) {
+                split = p;
+                break;
+            }
+        }
+        if (split) {
+            memcpy(prefix, name, split - name);
+            prefix[split - name] = 0;
+            if (!tar_append_header(tar, split + 1, prefix, TAR_TYPE_FILE,
+                        len, mtime)) {
+                return 0;
+            }
+        } else if (!tar_append_header(tar, TAR_LONGNAME, NULL,
+                    TAR_TYPE_LONGNAME, namelen + 1, 0) ||
+                !tar_append(tar, name, namelen + 1) ||
+                !tar_append_header(tar, name, NULL, TAR_TYPE_FILE, len,
+                    mtime)) {
+            return 0;
+        }
+    } else if (!tar_append_header(tar, name, NULL, TAR_TYPE_FILE, len,
+                mtime)) {
+        return 0;
+    }
+
+    // The whole blocks of objects bigger than the buffer are written
+    // directly rather than copied through it
+    if (len >= TAR_BUFFER_SIZE) {
+        direct = len / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        if (!tar_flush(tar) || !write_all(tar->fd, data, direct)) {
+            return 0;
+        }
+        data += direct;
+        len -= direct;
+    }
+    return tar_append(tar, data, len);
+}
+
+// Copy name without empty, "." and ".." components, so that extracting
+// the archive can't write outside the directory it's extracted into
+// Returns the copy, which must be freed, or NULL on failure
+static char *clean_name(const char *name) {
+    const char *p = name;
+    char *clean;
+    size_t len, out = 0;
+
+    clean = malloc(strlen(name) + 1);
+    if (clean == NULL) {
+        debug("malloc failed: %m");
+        return NULL;
+    }
+    while (*p) {
+        len = strcspn(p, "/");
+        if (len && !(len == 1 && p[0] == '.') &&
+                !(len == 2 && p[0] == '.' && p[1] == '.')) {
+            if (out) {
+                clean[out++] = '/';
+            }
+            memcpy(clean + out, p, len);
+            out += len;
+        }
+        p += len;
+        if (*p == '/') {
+            p++;
+        }
+    }
+    clean[out] = 0;
+    if (out == 0) {
+        debug("No entry name left of %s", name);
+        free(clean);
+        return NULL;
+    }
+    return clean;
+}
+
+// Add a file entry to the archive. Leading slashes and "." and ".."
+// components are dropped from name.
+// Returns 1 on success, 0 otherwise
+int tar_add(struct tar_writer *tar, const char *name, const uint8_t *data,
+        size_t len, time_t mtime) {
+    char *clean;
+    int ret;
+
+    assert(tar);
+    assert(name);
+
+    clean = clean_name(name);
+    if (clean == NULL) {
+        return 0;
+    }
+    ret = tar_add_entry(tar, clean, data, len, mtime);
+    free(clean);
+    return ret;
+}
+
+// Finish the archive and free the writer
+// Returns 1 if everything was written successfully, 0 otherwise
+int tar_close(struct tar_writer *tar) {
+    uint8_t end[2 * TAR_BLOCK_SIZE];
+    int ret;
+
+    if (tar == NULL) {
+        return 1;
+    }
+    memset(end, 0, sizeof(end));
+    ret = tar_append(tar, end, sizeof(end)) && tar_flush(tar);
+    if (close(tar->fd)) {
+        debug("close failed: %m");
+        ret = 0;
+    }
+    free(tar->buf);
+    free(tar);
+    return ret;
+}
@@ -2,11 +2,36 @@
 // Copyright 2015 David Gloe.
 
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "zlib.h"
 #include "../id3v2.h"
 
+#define TEMP_FILE_TEMPLATE "/tmp/id3test-file-XXXXXX"
+
+// Write len bytes of data to a new temporary file, putting its name in
+// path, which must have room for TEMP_FILE_TEMPLATE
+// Returns the file, open for reading and writing after the data
+static int write_temp_file(const void *data, size_t len, char *path) {
+    int fd;
+
+    strcpy(path, TEMP_FILE_TEMPLATE);
+    fd = mkstemp(path);
+    assert(fd != -1);
+    assert(write(fd, data, len) == len);
+    return fd;
+}
+
 static void check_synchsafe(void) {
     assert(to_synchsafe(0x0FFFFFFF) == 0x7F7F7F7F);
     assert(from_synchsafe(0x7F7F7F7F) == 0x0FFFFFFF);
@@ -141,7 +166,7 @@ static void check_verify(void) {
     assert(!verify_id3v2_header(&header));
     header.footer.footer_present = 1;
 
-    strncpy(fheader.id, ID3V2_FRAME_ID_AENC, ID3V2_FRAME_ID_SIZE);
+    strncpy(fheader.id, ID3V2_FRAME_ID_AENC, sizeof(fheader.id));
     fheader.size = 0x7f7f7f7f;
     fheader.compressed = 1;
     fheader.data_length_present = 1;
@@ -157,6 +182,21 @@ static void check_verify(void) {
     fheader.data_length_present = 0;
 }
 
+static void check_find_header(void) {
+    struct id3v2_header header;
+    // A stray ID3 with a size that isn't synchsafe, then a real header
+    static const uint8_t data[] = {
+        'x', 'I', 'D', '3', 4, 0, 0, 0x80, 0, 0, 0,
+        'I', 'D', '3', 3, 0, 0, 0, 0, 1, 0,
+    };
+
+    assert(find_id3v2_header(data, sizeof(data), &header) == sizeof(data));
+    assert(!strcmp(header.id, ID3V2_FILE_IDENTIFIER));
+    assert(header.version == 3);
+    assert(header.tag_size == 128);
+    assert(find_id3v2_header(data, sizeof(data) - 1, &header) == 0);
+}
+
 static void check_conversion(void) {
     assert(get_tag_size_restriction(0xFF) == ID3V2_RESTRICTION_TAG_SIZE_4KB);
     assert(get_tag_size_restriction(0xBF) == ID3V2_RESTRICTION_TAG_SIZE_40KB);
@@ -188,12 +228,1325 @@ static void check_conversion(void) {
             ID3V2_RESTRICTION_IMAGE_SIZE_64_STRICT);
 }
 
+static void check_hash(void) {
+    const char *text = "Nobody inspects the spammish repetition";
+    struct hash64_state state;
+    struct hashset *set;
+    uint8_t data[200];
+    uint64_t i;
+    size_t split;
+
+    assert(hash64("", 0, 0) == 0xEF46DB3751D8E999ULL);
+    assert(hash64("abc", 3, 0) == 0x44BC2CF5AD770999ULL);
+    assert(hash64(text, strlen(text), 0) == 0xFBCEA83C8A378BF1ULL);
+
+    // Hashing in pieces matches hashing all at once
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = i * 7;
+    }
+    for (split = 0; split <= sizeof(data); split += 13) {
+        hash64_init(&state, 5);
+        hash64_update(&state, data, split / 3);
+        hash64_update(&state, data + split / 3, split - split / 3);
+        hash64_update(&state, data + split, sizeof(data) - split);
+        assert(hash64_final(&state) == hash64(data, sizeof(data), 5));
+        hash64_init(&state, 5);
+        hash64_update(&state, data, split);
+        assert(hash64_final(&state) == hash64(data, split, 5));
+    }
+
+    set = hashset_create(100);
+    assert(set);
+    assert(hashset_insert(set, 0) == 1);
+    assert(hashset_insert(set, 0) == 0);
+    for (i = 1; i <= 100; i++) {
+        assert(hashset_insert(set, i << 32) == 1);
+    }
+    assert(hashset_insert(set, 5ULL << 32) == 0);
+    assert(hashset_contains(set, 100ULL << 32));
+    assert(!hashset_contains(set, 101ULL << 32));
+    assert(hashset_count(set) == 101);
+
+    // Removed keys can be added again
+    assert(hashset_remove(set, 5ULL << 32) == 1);
+    assert(hashset_remove(set, 5ULL << 32) == 0);
+    assert(!hashset_contains(set, 5ULL << 32));
+    assert(hashset_contains(set, 100ULL << 32));
+    assert(hashset_count(set) == 100);
+    assert(hashset_insert(set, 5ULL << 32) == 1);
+    assert(hashset_contains(set, 5ULL << 32));
+    hashset_free(set);
+}
+
+static void check_cache(void) {
+    char path[] = "/tmp/id3test-cache-XXXXXX";
+    struct metadata_cache *cache, *other;
+    struct stat st, fst, pst;
+    const uint8_t *data;
+    size_t len;
+    int fd;
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    memset(&st, 0, sizeof(st));
+    st.st_dev = 1;
+    st.st_ino = 2;
+    st.st_size = 3;
+    st.st_mtim.tv_sec = 4;
+
+    cache = open_metadata_cache(path, 0);
+    assert(cache);
+    assert(!metadata_cache_lookup(cache, &st, &data, &len));
+    assert(metadata_cache_store(cache, &st, (uint8_t *)"old", 3));
+    assert(metadata_cache_store(cache, &st, (uint8_t *)"output", 6));
+    close_metadata_cache(cache);
+
+    cache = open_metadata_cache(path, 0);
+    assert(cache);
+    assert(metadata_cache_lookup(cache, &st, &data, &len));
+    assert(len == 6 && !memcmp(data, "output", 6));
+    st.st_mtim.tv_nsec = 1;
+    assert(!metadata_cache_lookup(cache, &st, &data, &len));
+    close_metadata_cache(cache);
+
+    // Entries are only returned for the options they were made with
+    st.st_mtim.tv_nsec = 0;
+    cache = open_metadata_cache(path, 1);
+    assert(cache);
+    assert(!metadata_cache_lookup(cache, &st, &data, &len));
+    close_metadata_cache(cache);
+
+    // Several openers share the cache at once
+    cache = open_metadata_cache(path, 0);
+    other = open_metadata_cache(path, 0);
+    assert(cache && other);
+    st.st_ino = 5;
+    assert(metadata_cache_store(other, &st, (uint8_t *)"other", 5));
+    // An incomplete record may still be being appended while the cache
+    // is open elsewhere, so it's left alone
+    fd = open(path, O_WRONLY | O_APPEND);
+    assert(fd != -1);
+    assert(write(fd, "partial", 7) == 7);
+    close(fd);
+    assert(stat(path, &fst) == 0);
+    close_metadata_cache(other);
+    other = open_metadata_cache(path, 0);
+    assert(other);
+    assert(metadata_cache_lookup(other, &st, &data, &len));
+    assert(len == 5 && !memcmp(data, "other", 5));
+    close_metadata_cache(other);
+    close_metadata_cache(cache);
+    assert(stat(path, &pst) == 0 && pst.st_size == fst.st_size);
+
+    // and cut off by the next opener with the cache to itself
+    cache = open_metadata_cache(path, 0);
+    assert(cache);
+    assert(stat(path, &pst) == 0 && pst.st_size == fst.st_size - 7);
+    assert(metadata_cache_lookup(cache, &st, &data, &len));
+    close_metadata_cache(cache);
+    unlink(path);
+}
+
+static void check_index(void) {
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    char index[] = "/tmp/id3test-index-XXXXXX";
+    char *files[] = { file }, *terms[2], *out;
+    uint64_t bad_offset = UINT64_MAX - 4;
+    size_t len;
+    FILE *fp;
+    int fd;
+    // A tag holding TPE1 "The Artist" and TDRC "1999"
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x24,
+        'T', 'P', 'E', '1', 0, 0, 0, 11, 0, 0,
+        0, 'T', 'h', 'e', ' ', 'A', 'r', 't', 'i', 's', 't',
+        'T', 'D', 'R', 'C', 0, 0, 0, 5, 0, 0, 0, '1', '9', '9', '9'
+    };
+
+    fd = write_temp_file(tag, sizeof(tag), file);
+    close(fd);
+    fd = mkstemp(index);
+    assert(fd != -1);
+    close(fd);
+    assert(build_index(index, files, 1));
+
+    terms[0] = "tpe1=THE ARTIST";
+    terms[1] = "TDRC<2000";
+    fp = open_memstream(&out, &len);
+    assert(query_index(index, terms, 2, fp));
+    fclose(fp);
+    assert(len == strlen(file) + 1 && !strncmp(out, file, strlen(file)));
+    free(out);
+
+    terms[1] = "TDRC>1999";
+    fp = open_memstream(&out, &len);
+    assert(query_index(index, terms, 2, fp));
+    fclose(fp);
+    assert(len == 0);
+    free(out);
+
+    terms[0] = "TPE1";
+    fp = open_memstream(&out, &len);
+    assert(!query_index(index, terms, 1, fp));
+    fclose(fp);
+    free(out);
+
+    // A key past the end of the index is refused, not read: the first
+    // term follows the 64 byte header and the one path offset
+    terms[0] = "TDRC=1999";
+    fd = open(index, O_WRONLY);
+    assert(fd != -1);
+    assert(pwrite(fd, &bad_offset, sizeof(bad_offset), 72) ==
+            sizeof(bad_offset));
+    close(fd);
+    fp = open_memstream(&out, &len);
+    assert(!query_index(index, terms, 1, fp));
+    fclose(fp);
+    free(out);
+    unlink(file);
+    unlink(index);
+}
+
+static void check_tar(void) {
+    char path[] = "/tmp/id3test-tar-XXXXXX";
+    struct tar_writer *tar;
+    char name[100];
+    int fd;
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    tar = tar_open(path);
+    assert(tar);
+    // Names can't lead outside the directory the archive is extracted in
+    assert(tar_add(tar, "/../music/./a.mp3/0.jpg", (uint8_t *)"jpg", 3, 0));
+    assert(!tar_add(tar, "../..", (uint8_t *)"jpg", 3, 0));
+    assert(tar_close(tar));
+    fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, name, sizeof(name)) == sizeof(name));
+    assert(!strcmp(name, "music/a.mp3/0.jpg"));
+    close(fd);
+    unlink(path);
+}
+
+// Check that the file at path holds exactly len bytes of data
+static void check_file_data(const char *path, const void *data, size_t len) {
+    char buf[256];
+    int fd;
+
+    assert(len < sizeof(buf));
+    fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, buf, sizeof(buf)) == len);
+    assert(!memcmp(buf, data, len));
+    close(fd);
+}
+
+static void check_extract_names(void) {
+    char dir[] = "/tmp/id3test-extract-XXXXXX", expected[64];
+    struct extract_options ex;
+    const char *data = "picture";
+    char *path, *other;
+
+    assert(mkdtemp(dir));
+    memset(&ex, 0, sizeof(ex));
+    ex.dir = dir;
+    ex.source = "/music/album/My Song.mp3";
+    ex.fd = -1;
+    ex.index = 3;
+
+    // The source name loses its directories and extension
+    ex.name = "%f-%i.%e%%";
+    path = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    assert(path);
+    snprintf(expected, sizeof(expected), "%s/My Song-3.jpg%%", dir);
+    assert(!strcmp(path, expected));
+    check_file_data(path, data, strlen(data));
+    // Without a template an existing file is never overwritten
+    assert(!extract_object(&ex, "jpg", (uint8_t *)"other", 5, -1));
+    check_file_data(path, data, strlen(data));
+    unlink(path);
+    free(path);
+
+    // A trailing template is made unique, even before the extension
+    ex.name = "%f-XXXXXX.%e";
+    path = extract_object(&ex, "png", (uint8_t *)data, strlen(data), -1);
+    other = extract_object(&ex, "png", (uint8_t *)data, strlen(data), -1);
+    assert(path && other && strcmp(path, other));
+    snprintf(expected, sizeof(expected), "%s/My Song-", dir);
+    assert(!strncmp(path, expected, strlen(expected)));
+    assert(strlen(path) == strlen(expected) + strlen("XXXXXX.png"));
+    assert(!strcmp(path + strlen(path) - 4, ".png"));
+    check_file_data(other, data, strlen(data));
+    unlink(path);
+    unlink(other);
+    free(path);
+    free(other);
+
+    // A source without an extension keeps its whole name
+    ex.source = "plain";
+    ex.name = "%f.%e";
+    path = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    snprintf(expected, sizeof(expected), "%s/plain.jpg", dir);
+    assert(path && !strcmp(path, expected));
+    unlink(path);
+    free(path);
+
+    ex.name = "%q";
+    assert(!extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1));
+    assert(rmdir(dir) == 0);
+}
+
+static void check_extract_store(void) {
+    char dir[] = "/tmp/id3test-store-XXXXXX", index[64];
+    struct extract_options ex;
+    struct extract_store *store;
+    const char *data = "cover art";
+    char *path, *same, *other;
+    struct stat st;
+    off_t indexed;
+
+    assert(mkdtemp(dir));
+    snprintf(index, sizeof(index), "%s/index", dir);
+    store = open_extract_store(dir);
+    assert(store);
+    memset(&ex, 0, sizeof(ex));
+    ex.fd = -1;
+    ex.store = store;
+
+    // Identical bytes from different frames are stored once, by hash
+    ex.source = "a.mp3";
+    path = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    ex.source = "b.mp3";
+    ex.index = 1;
+    same = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    assert(path && same && !strcmp(path, same));
+    assert(!strncmp(path, dir, strlen(dir)));
+    assert(strlen(path) == strlen(dir) + strlen("/0123456789abcdef.jpg"));
+    check_file_data(path, data, strlen(data));
+    assert(stat(path, &st) == 0 && (st.st_mode & 0777) == 0644);
+    free(same);
+
+    // Another type or other bytes are another object
+    other = extract_object(&ex, "png", (uint8_t *)data, strlen(data), -1);
+    assert(other && strcmp(path, other));
+    unlink(other);
+    free(other);
+    other = extract_object(&ex, "jpg", (uint8_t *)"other", 5, -1);
+    assert(other && strcmp(path, other));
+    unlink(other);
+    free(other);
+    close_extract_store(store);
+
+    // The index remembers stored objects across runs, so nothing is added
+    assert(stat(index, &st) == 0);
+    indexed = st.st_size;
+    store = open_extract_store(dir);
+    assert(store);
+    ex.store = store;
+    same = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    assert(same && !strcmp(path, same));
+    free(same);
+    assert(stat(index, &st) == 0 && st.st_size == indexed);
+    // An indexed object that was deleted is written again
+    unlink(path);
+    same = extract_object(&ex, "jpg", (uint8_t *)data, strlen(data), -1);
+    assert(same && !strcmp(path, same));
+    check_file_data(path, data, strlen(data));
+    free(same);
+    close_extract_store(store);
+
+    unlink(path);
+    free(path);
+    unlink(index);
+    assert(rmdir(dir) == 0);
+}
+
+// Append a 2.4 frame with the given format flags to the tag in buf
+static size_t put_frame24(uint8_t *buf, size_t len, const char *id,
+        uint8_t flags, const uint8_t *data, size_t data_len) {
+    uint32_t size = byte_swap_32(to_synchsafe(data_len));
+
+    memcpy(buf + len, id, ID3V2_FRAME_ID_SIZE);
+    memcpy(buf + len + 4, &size, sizeof(size));
+    buf[len + 8] = 0;
+    buf[len + 9] = flags;
+    memcpy(buf + len + ID3V2_FRAME_HEADER_SIZE, data, data_len);
+    return len + ID3V2_FRAME_HEADER_SIZE + data_len;
+}
+
+static void check_dump_frame(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char file[sizeof(TEMP_FILE_TEMPLATE)], out[sizeof(TEMP_FILE_TEMPLATE)];
+    const char *text = "\x03" "a title that squeezes, squeezes, squeezes";
+    // Unsynchronised 0xFF 0xE0, after its data length
+    const uint8_t unsynced[] = { 0, 0, 0, 2, 0xFF, 0, 0xE0 };
+    uint8_t tag[256], data[128];
+    uLongf zlen = sizeof(data) - 4;
+    uint32_t size;
+    size_t len = ID3V2_HEADER_SIZE;
+    int fd, outfd;
+
+    // Stored verbatim, unsynchronised, and compressed with a data length
+    len = put_frame24(tag, len, "PRIV", 0, (uint8_t *)"o\0blob", 6);
+    len = put_frame24(tag, len, "PRIV", 0x03, unsynced, sizeof(unsynced));
+    assert(compress2(data + 4, &zlen, (uint8_t *)text, strlen(text),
+                Z_BEST_COMPRESSION) == Z_OK);
+    size = byte_swap_32(to_synchsafe(strlen(text)));
+    memcpy(data, &size, sizeof(size));
+    len = put_frame24(tag, len, "TIT2", 0x09, data, zlen + 4);
+    memcpy(tag, "ID3\x04\x00\x00", 6);
+    size = byte_swap_32(to_synchsafe(len - ID3V2_HEADER_SIZE));
+    memcpy(tag + 6, &size, sizeof(size));
+
+    fd = write_temp_file(tag, len, file);
+    outfd = write_temp_file("", 0, out);
+    assert(get_id3v2_tag(fd, &header));
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(fheader.data_offset != -1);
+    assert(dump_frame(&header, &fheader, outfd));
+    check_file_data(out, "o\0blob", 6);
+
+    // Only the frame's decoded data is written, however it was stored
+    assert(ftruncate(outfd, 0) == 0 && lseek(outfd, 0, SEEK_SET) == 0);
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(fheader.data_offset == -1);
+    assert(dump_frame(&header, &fheader, outfd));
+    check_file_data(out, "\xFF\xE0", 2);
+
+    assert(ftruncate(outfd, 0) == 0 && lseek(outfd, 0, SEEK_SET) == 0);
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(dump_frame(&header, &fheader, outfd));
+    check_file_data(out, text, strlen(text));
+    assert(!get_id3v2_frame_header(&header, &fheader));
+
+    free_id3v2_tag(&header);
+    close(outfd);
+    close(fd);
+    unlink(out);
+    unlink(file);
+}
+
+// Write a whole file at path, closing it so watchers see it written
+static void write_file(const char *path, const void *data, size_t len) {
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, data, len) == len);
+    assert(close(fd) == 0);
+}
+
+// Read what's written to fd into buf until ms pass without any
+// Returns the new length of buf
+static size_t read_until_quiet(int fd, char *buf, size_t len, size_t size,
+        int ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ssize_t count;
+
+    while (len < size - 1 && poll(&pfd, 1, ms) == 1) {
+        count = read(fd, buf + len, size - 1 - len);
+        if (count <= 0) {
+            break;
+        }
+        len += count;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// Count the listings of path in the output of run_watch
+static int count_listings(const char *out, const char *dir,
+        const char *name) {
+    char line[128];
+    int count = 0;
+
+    snprintf(line, sizeof(line), "%s/%s:\n", dir, name);
+    while ((out = strstr(out, line))) {
+        count++;
+        out += strlen(line);
+    }
+    return count;
+}
+
+static void check_watch(void) {
+    char dir[] = "/tmp/id3test-watch-XXXXXX", path[64], out[16384] = "";
+    char moved[sizeof(TEMP_FILE_TEMPLATE)];
+    static const char *names[] = { "ready.mp3", "burst.mp3", "moved.mp3",
+        "sub/deep.mp3", "plain.txt", "sub" };
+    size_t len = 0;
+    pid_t pid;
+    int pipefd[2], status, tries, i;
+    // A tag holding TPE1 "The Artist"
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x15,
+        'T', 'P', 'E', '1', 0, 0, 0, 11, 0, 0,
+        0, 'T', 'h', 'e', ' ', 'A', 'r', 't', 'i', 's', 't'
+    };
+
+    assert(mkdtemp(dir));
+    assert(pipe(pipefd) == 0);
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        _exit(run_watch(dir, 2, 0, NULL) ? 0 : 1);
+    }
+    close(pipefd[1]);
+
+    // Nothing says when the watch is in place, so write a file until it
+    // is seen
+    snprintf(path, sizeof(path), "%s/ready.mp3", dir);
+    for (tries = 0; !count_listings(out, dir, "ready.mp3"); tries++) {
+        assert(tries < 20);
+        write_file(path, tag, sizeof(tag));
+        len = read_until_quiet(pipefd[0], out, len, sizeof(out), 500);
+    }
+    assert(strstr(out, "The Artist"));
+    len = 0;
+    out[0] = '\0';
+
+    // A burst of writes to one file is read once it settles
+    snprintf(path, sizeof(path), "%s/burst.mp3", dir);
+    for (i = 0; i < 5; i++) {
+        write_file(path, tag, sizeof(tag));
+    }
+    // Files moved in are read, as are files in new directories
+    close(write_temp_file(tag, sizeof(tag), moved));
+    snprintf(path, sizeof(path), "%s/moved.mp3", dir);
+    assert(rename(moved, path) == 0);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    assert(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/sub/deep.mp3", dir);
+    write_file(path, tag, sizeof(tag));
+    // Files without a tag aren't listed
+    snprintf(path, sizeof(path), "%s/plain.txt", dir);
+    write_file(path, "text", 4);
+    len = read_until_quiet(pipefd[0], out, len, sizeof(out), 1000);
+
+    assert(count_listings(out, dir, "burst.mp3") == 1);
+    assert(count_listings(out, dir, "moved.mp3") == 1);
+    assert(count_listings(out, dir, "sub/deep.mp3") >= 1);
+    assert(count_listings(out, dir, "plain.txt") == 0);
+
+    assert(kill(pid, SIGTERM) == 0);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(pipefd[0]);
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        assert(remove(path) == 0);
+    }
+    assert(rmdir(dir) == 0);
+}
+
+// Check that the listed files form one group of hash_audio output, with
+// the same hash and in the order given
+static void check_audio_group(const char *out, char * const files[],
+        int nfiles) {
+    const char *first, *p, *prev;
+    int i;
+
+    first = prev = strstr(out, files[0]);
+    assert(first && first - out >= 17);
+    for (i = 1; i < nfiles; i++) {
+        p = strstr(out, files[i]);
+        assert(p && p > prev);
+        assert(!memcmp(p - 17, first - 17, 17));
+        prev = p;
+    }
+    // No group ends in between
+    for (p = first; p < prev; p++) {
+        assert(p[0] != '\n' || p[1] != '\n');
+    }
+}
+
+static void check_hash_audio(void) {
+    char paths[6][sizeof(TEMP_FILE_TEMPLATE)], *out, line[64];
+    char *files[7], *same[3], *other[2];
+    const char *audio = "\xFF\xFB audio frames", *audio2 = "\xFF\xFB other";
+    uint8_t v1[128] = "TAG";
+    size_t len;
+    FILE *fp;
+    int fd, i;
+    // Tags of different sizes, one with padding
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x15,
+        'T', 'P', 'E', '1', 0, 0, 0, 11, 0, 0,
+        0, 'T', 'h', 'e', ' ', 'A', 'r', 't', 'i', 's', 't'
+    };
+    static const uint8_t padded[] = {
+        'I', 'D', '3', 3, 0, 0, 0, 0, 0, 0x13,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        0, 0, 0, 0
+    };
+
+    // The same audio with one tag, another tag and an ID3v1 tag, and none
+    fd = write_temp_file(tag, sizeof(tag), paths[0]);
+    assert(write(fd, audio, strlen(audio)) == strlen(audio));
+    close(fd);
+    fd = write_temp_file(padded, sizeof(padded), paths[1]);
+    assert(write(fd, audio, strlen(audio)) == strlen(audio));
+    assert(write(fd, v1, sizeof(v1)) == sizeof(v1));
+    close(fd);
+    close(write_temp_file(audio, strlen(audio), paths[2]));
+    // Other audio, tagged and not
+    fd = write_temp_file(tag, sizeof(tag), paths[3]);
+    assert(write(fd, audio2, strlen(audio2)) == strlen(audio2));
+    close(fd);
+    close(write_temp_file(audio2, strlen(audio2), paths[4]));
+    // Audio nothing else has
+    close(write_temp_file("\xFF\xFB unique", 9, paths[5]));
+
+    for (i = 0; i < 6; i++) {
+        files[i] = paths[i];
+    }
+    same[0] = paths[0];
+    same[1] = paths[1];
+    same[2] = paths[2];
+    other[0] = paths[3];
+    other[1] = paths[4];
+
+    fp = open_memstream(&out, &len);
+    assert(hash_audio(files, 6, 3, 0, fp));
+    fclose(fp);
+    check_audio_group(out, same, 3);
+    check_audio_group(out, other, 2);
+    assert(!strstr(out, paths[5]));
+    // Two groups, with a blank line between them
+    assert(len == 2 * (17 + strlen(paths[0]) + 1) + 1 +
+            3 * (17 + strlen(paths[0]) + 1));
+    free(out);
+
+    // Verbosely every file's hash and audio length comes first, and a
+    // file that can't be read fails the run but not the others
+    files[6] = "/nonexistent/id3test";
+    fp = open_memstream(&out, &len);
+    assert(!hash_audio(files, 7, 0, 1, fp));
+    fclose(fp);
+    snprintf(line, sizeof(line), " %12zu %s\n", strlen(audio), paths[1]);
+    assert(strstr(out, line));
+    check_audio_group(strstr(out, "\n\n"), same, 3);
+    free(out);
+
+    for (i = 0; i < 6; i++) {
+        unlink(paths[i]);
+    }
+}
+
+static void check_serve(void) {
+    struct sockaddr_un addr;
+    char file[sizeof(TEMP_FILE_TEMPLATE)], requests[256], replies[512];
+    size_t len = 0;
+    ssize_t count;
+    pid_t pid;
+    int fd, status, tries, lines = 0;
+    // A tag holding TPE1 "The Artist"
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x15,
+        'T', 'P', 'E', '1', 0, 0, 0, 11, 0, 0,
+        0, 'T', 'h', 'e', ' ', 'A', 'r', 't', 'i', 's', 't'
+    };
+
+    fd = write_temp_file(tag, sizeof(tag), file);
+    close(fd);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.sock", file);
+
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        _exit(run_server(addr.sun_path, 1, 0) ? 0 : 1);
+    }
+
+    // Wait for the server to listen
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd != -1);
+    for (tries = 0; connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+            tries++) {
+        assert(tries < 500);
+        usleep(10000);
+    }
+
+    // Pipelined requests each get a reply line, in any order
+    snprintf(requests, sizeof(requests),
+            "{\"id\": 1, \"path\": \"%s\", \"frames\": [\"TPE1\"]}\n"
+            "{\"id\": 2, \"path\": \"%s.none\"}\n"
+            "not json\n", file, file);
+    assert(write(fd, requests, strlen(requests)) == strlen(requests));
+    while (lines < 3) {
+        count = read(fd, replies + len, sizeof(replies) - len - 1);
+        assert(count > 0);
+        while (count-- > 0) {
+            lines += replies[len++] == '\n';
+        }
+    }
+    replies[len] = '\0';
+    assert(strstr(replies, "{\"id\": 1, \"path\": \"/tmp/id3test-file-"));
+    assert(strstr(replies, "The Artist"));
+    assert(strstr(replies, "{\"id\": 2, \"path\": \"/tmp/id3test-file-"));
+    assert(strstr(replies, "\"error\": \"No such file or directory\"}\n"));
+    assert(strstr(replies, "{\"error\": \"Invalid request\"}\n"));
+    close(fd);
+
+    // The server shuts down cleanly, removing its socket
+    assert(kill(pid, SIGTERM) == 0);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(access(addr.sun_path, F_OK) == -1);
+    unlink(file);
+}
+
+static void check_frame_limits(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    struct id3v2_frame_TXXX txxx;
+    struct id3v2_frame_WXXX wxxx;
+    struct id3v2_frame_COMM comm;
+    struct id3v2_frame_APIC apic;
+    size_t big_len = ID3V2_COPY_THRESHOLD + 1000, map_len, page, len;
+    uint8_t *map, *big;
+    uint32_t size;
+    char *out;
+    FILE *fp;
+    // A 4 byte TIT2 frame, then a compressed TXXX claiming 256 MB
+    uint8_t frames[] = {
+        'T', 'I', 'T', '2', 0, 0, 0, 4, 0, 0, 0, 'A', 'B', 'C',
+        'T', 'X', 'X', 'X', 0, 0, 0, 7, 0, 0x09, 0x7F, 0x7F, 0x7F, 0x7F,
+        0x78, 0x9C, 0x03
+    };
+
+    memset(&header, 0, sizeof(header));
+    header.version = 4;
+    header.frame_data = frames;
+    header.frame_data_len = sizeof(frames);
+    header.budget = 3;
+
+    // Data over the budget isn't decoded
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(!get_id3v2_frame_data(&header, &fheader));
+    assert(header.budget == 3);
+    header.budget = 4;
+    header.i = 0;
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(get_id3v2_frame_data(&header, &fheader));
+    assert(header.budget == 0);
+    assert(fheader.data_len == 4 && !memcmp(fheader.data, "\0ABC", 4));
+    free_id3v2_frame_data(&header, &fheader);
+    assert(header.budget == 4);
+
+    // Nor is data claiming to expand more than zlib can
+    header.budget = ID3V2_DEFAULT_BUDGET * 8;
+    assert(get_id3v2_frame_header(&header, &fheader));
+    assert(fheader.compressed);
+    assert(!get_id3v2_frame_data(&header, &fheader));
+    assert(header.budget == ID3V2_DEFAULT_BUDGET * 8);
+
+    // A large frame read in place has no terminator after it, so its
+    // strings are only looked for within it. Put it right before an
+    // unreadable page to catch any read past its end.
+    page = sysconf(_SC_PAGESIZE);
+    map_len = (ID3V2_FRAME_HEADER_SIZE + big_len + page - 1) / page * page;
+    map = mmap(NULL, map_len + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(map != MAP_FAILED);
+    assert(!mprotect(map + map_len, page, PROT_NONE));
+    big = map + map_len - ID3V2_FRAME_HEADER_SIZE - big_len;
+    size = to_synchsafe(big_len);
+    memcpy(big, "TXXX", ID3V2_FRAME_ID_SIZE);
+    big[4] = size >> 24;
+    big[5] = size >> 16;
+    big[6] = size >> 8;
+    big[7] = size;
+    big[8] = big[9] = 0;
+    big[ID3V2_FRAME_HEADER_SIZE] = ID3V2_ENCODING_ISO_8859_1;
+    memset(big + ID3V2_FRAME_HEADER_SIZE + 1, 'x', big_len - 1);
+    header.frame_data = big;
+    header.frame_data_len = ID3V2_FRAME_HEADER_SIZE + big_len;
+    header.i = 0;
+    assert(get_id3v2_frame(&header, &fheader));
+    assert(fheader.data == big + ID3V2_FRAME_HEADER_SIZE);
+    assert(!parse_TXXX_frame(&fheader, &txxx));
+    assert(!parse_WXXX_frame(&fheader, &wxxx));
+    assert(!parse_COMM_frame(&fheader, &comm));
+    assert(!parse_APIC_frame(&fheader, &apic));
+    fp = open_memstream(&out, &len);
+    print_id3v2_frame(fp, &fheader, 0, NULL);
+    fclose(fp);
+    assert(strstr(out, "Malformed frame"));
+    free(out);
+
+    // Terminated, the last field runs to the end of the frame
+    big[ID3V2_FRAME_HEADER_SIZE + 3] = 0;
+    assert(parse_TXXX_frame(&fheader, &txxx));
+    assert(txxx.value == (char *)big + ID3V2_FRAME_HEADER_SIZE + 4);
+    assert(txxx.value_len == big_len - 4);
+    free_id3v2_frame_data(&header, &fheader);
+    munmap(map, map_len + page);
+}
+
+static void check_stats(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    char *files[] = { file, file }, *out;
+    size_t len;
+    FILE *fp;
+    int fd;
+    // A tag holding TPE1 "The Artist" and 8 bytes of padding
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x1D,
+        'T', 'P', 'E', '1', 0, 0, 0, 11, 0, 0,
+        0, 'T', 'h', 'e', ' ', 'A', 'r', 't', 'i', 's', 't',
+        0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    fd = write_temp_file(tag, sizeof(tag), file);
+    close(fd);
+
+    fp = open_memstream(&out, &len);
+    assert(print_tag_stats(files, 2, 2, fp));
+    fclose(fp);
+    assert(strstr(out, "Files: 2\n"));
+    assert(strstr(out, "2.4: 2\n"));
+    assert(strstr(out, "Padding: 16 bytes\n"));
+    assert(strstr(out, "8 B - 16 B: 2\n"));
+    assert(strstr(out, "ISO 8859-1: 2\n"));
+    assert(strstr(out, "TPE1: 2\n"));
+    free(out);
+
+    fp = open_memstream(&out, &len);
+    assert(print_tag_survey(files, 1, 1, fp));
+    fclose(fp);
+    assert(strstr(out, "          39           31            8 /tmp/"));
+    free(out);
+
+    // The full reader finds the same padding
+    fd = open(file, O_RDONLY);
+    assert(fd != -1);
+    assert(get_id3v2_tag(fd, &header));
+    while (get_id3v2_frame_header(&header, &fheader));
+    assert(header.padding == 8);
+    free_id3v2_tag(&header);
+    close(fd);
+    unlink(file);
+}
+
+static void check_profile(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char file[sizeof(TEMP_FILE_TEMPLATE)], *out, *p;
+    size_t len, peak;
+    FILE *fp;
+    int fd;
+    // A tag holding TIT2 "Song" then TPE1 "Band"
+    static const uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0, 0, 0, 0, 0x1E,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        'T', 'P', 'E', '1', 0, 0, 0, 5, 0, 0, 0, 'B', 'a', 'n', 'd'
+    };
+
+    fd = write_temp_file(tag, sizeof(tag), file);
+
+    profile_enable();
+    assert(get_id3v2_tag(fd, &header));
+    while (get_id3v2_frame_header(&header, &fheader)) {
+        assert(get_id3v2_frame_data(&header, &fheader));
+        free_id3v2_frame_data(&header, &fheader);
+    }
+    free_id3v2_tag(&header);
+    close(fd);
+    unlink(file);
+
+    fp = open_memstream(&out, &len);
+    print_profile(fp, 1);
+    fclose(fp);
+    assert(strstr(out, "\"map\": {\"calls\": 1,"));
+    assert(strstr(out, "\"files\": 1,"));
+    assert(strstr(out, "\"bytes_mapped\": 40,"));
+    assert(strstr(out, "\"bytes_decoded\": 10,"));
+    assert(strstr(out, "\"frames\": 2,"));
+    assert(strstr(out, "\"allocations\": 2,"));
+    assert(strstr(out, "\"frees\": 2,"));
+    assert(strstr(out, "\"allocations_per_file\": 2.0,"));
+    // Each frame is freed before the next is read
+    p = strstr(out, "\"peak_live_bytes\": ");
+    assert(p && sscanf(p, "\"peak_live_bytes\": %zu", &peak) == 1);
+    assert(peak >= 5 + ID3V2_DATA_TERMINATOR_SIZE && peak < 64);
+    free(out);
+}
+
+// Read a tag, checking its CRC, and return whether it matched
+static int read_crc_tag(const uint8_t *tag, size_t len, int frames) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    int fd, ret;
+
+    fd = write_temp_file(tag, len, file);
+    assert(get_id3v2_tag(fd, &header));
+    header.verify_crc = 1;
+    // Frames left unread are read by the check
+    while (frames-- && get_id3v2_frame_header(&header, &fheader)) {
+    }
+    ret = verify_id3v2_crc(&header);
+    free_id3v2_tag(&header);
+    close(fd);
+    unlink(file);
+    return ret;
+}
+
+static void check_crc(void) {
+    // A 2.4 tag with a CRC extended header, TIT2 "Song" and padding
+    uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0x40, 0, 0, 0, 0x20,
+        0, 0, 0, 12, 1, 0x20, 5, 0, 0, 0, 0, 0,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        0, 0, 0, 0, 0
+    };
+    // The 2.3 extended header has 2 flag bytes, a padding size and a CRC
+    uint8_t tag23[] = {
+        'I', 'D', '3', 3, 0, 0x40, 0, 0, 0, 0x22,
+        0, 0, 0, 10, 0x80, 0, 0, 0, 0, 5, 0, 0, 0, 0,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        0, 0, 0, 0, 0
+    };
+    // The extended header, TIT2 "\xFF\xE0\xFF\0x" and padding of a 2.3
+    // tag, before unsynchronisation
+    uint8_t body23[] = {
+        0, 0, 0, 10, 0x80, 0, 0, 0, 0, 4, 0, 0, 0, 0,
+        'T', 'I', 'T', '2', 0, 0, 0, 6, 0, 0, 0, 0xFF, 0xE0, 0xFF, 0, 'x',
+        0, 0, 0, 0
+    };
+    uint8_t *unsynced;
+    uint32_t crc, size;
+    size_t len;
+    int i;
+
+    // The CRC covers the frames and padding, as 35 synchsafe bits
+    crc = crc32(crc32(0L, Z_NULL, 0), tag + 22, sizeof(tag) - 22);
+    for (i = 0; i < 5; i++) {
+        tag[17 + i] = (crc >> (28 - 7 * i)) & 0x7F;
+    }
+    assert(read_crc_tag(tag, sizeof(tag), -1));
+    assert(read_crc_tag(tag, sizeof(tag), 0));
+
+    // Damage in a frame or in the padding is caught
+    tag[34] ^= 1;
+    assert(!read_crc_tag(tag, sizeof(tag), -1));
+    tag[34] ^= 1;
+    tag[sizeof(tag) - 1] = 1;
+    assert(!read_crc_tag(tag, sizeof(tag), -1));
+
+    // The 2.3 CRC is plain and covers the frames only
+    crc = crc32(crc32(0L, Z_NULL, 0), tag23 + 24, 15);
+    for (i = 0; i < 4; i++) {
+        tag23[20 + i] = crc >> (24 - 8 * i);
+    }
+    assert(read_crc_tag(tag23, sizeof(tag23), -1));
+    tag23[36] ^= 1;
+    assert(!read_crc_tag(tag23, sizeof(tag23), -1));
+
+    // 2.3 unsynchronisation covers the whole tag after its header, and
+    // the CRC is of the frames before it was applied
+    crc = crc32(crc32(0L, Z_NULL, 0), body23 + 14, 16);
+    for (i = 0; i < 4; i++) {
+        body23[10 + i] = crc >> (24 - 8 * i);
+    }
+    len = unsync_len(body23, sizeof(body23));
+    assert(len > sizeof(body23));
+    unsynced = malloc(ID3V2_HEADER_SIZE + len);
+    assert(unsynced);
+    memcpy(unsynced, "ID3\x03\x00\xC0", 6);
+    size = byte_swap_32(to_synchsafe(len));
+    memcpy(unsynced + 6, &size, sizeof(size));
+    unsynchronize(body23, sizeof(body23), unsynced + ID3V2_HEADER_SIZE);
+    assert(read_crc_tag(unsynced, ID3V2_HEADER_SIZE + len, -1));
+    assert(read_crc_tag(unsynced, ID3V2_HEADER_SIZE + len, 0));
+    unsynced[ID3V2_HEADER_SIZE + len - 5] ^= 1;
+    assert(!read_crc_tag(unsynced, ID3V2_HEADER_SIZE + len, -1));
+    free(unsynced);
+}
+
+// Write a file and check it
+static enum id3v2_check_status check_data(const uint8_t *data, size_t len) {
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    enum id3v2_check_status status;
+    int fd;
+
+    fd = write_temp_file(data, len, file);
+    close(fd);
+    status = check_id3v2_file(file);
+    unlink(file);
+    return status;
+}
+
+static void check_check(void) {
+    // A 2.4 tag restricting text to 30 characters, with a 30 character
+    // TIT2 and padding
+    uint8_t tag[] = {
+        'I', 'D', '3', 4, 0, 0x40, 0, 0, 0, 0x38,
+        0, 0, 0, 8, 1, 0x10, 1, 0x18,
+        'T', 'I', 'T', '2', 0, 0, 0, 31, 0, 0, 0,
+        'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+        'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+        'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
+        0, 0, 0, 0, 0, 0, 0
+    };
+    uint8_t tag23[] = {
+        'I', 'D', '3', 3, 0, 0x40, 0, 0, 0, 0x1E,
+        0, 0, 0, 6, 0, 0, 0, 0, 0, 5,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        0, 0, 0, 0, 0
+    };
+    char *files[] = { "/nonexistent/id3test" };
+
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_OK);
+    assert(check_data(tag + 10, sizeof(tag) - 10) == ID3V2_CHECK_NO_TAG);
+
+    // One character too many
+    tag[28] = ID3V2_ENCODING_UTF_8;
+    tag[sizeof(tag) - 7] = 'k';
+    tag[25] = 32;
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_RESTRICTED);
+    // Unless it's only a UTF-8 continuation byte
+    tag[sizeof(tag) - 7] = 0x80;
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_OK);
+
+    // Padding that isn't zero, and a frame that overflows the tag
+    tag[sizeof(tag) - 1] = 1;
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_BAD_FRAME);
+    tag[sizeof(tag) - 1] = 0;
+    tag[25] = 0x7F;
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_BAD_FRAME);
+    tag[25] = 32;
+
+    // A tag size that isn't synchsafe
+    tag[9] = 0x80;
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_BAD_HEADER);
+    // but the same in the audio of a file without a tag is no header
+    memmove(tag + 4, tag, sizeof(tag) - 4);
+    memcpy(tag, "\xFF\xFB\x90\x64", 4);
+    assert(check_data(tag, sizeof(tag)) == ID3V2_CHECK_NO_TAG);
+
+    // A 2.3 extended header, in its own layout
+    assert(check_data(tag23, sizeof(tag23)) == ID3V2_CHECK_OK);
+
+    assert(check_files(files, 1, 1, stderr) == ID3V2_CHECK_UNREADABLE);
+}
+
+// Write a tag to a file and read its frames back, comparing them
+static void check_tag_round_trip(struct id3v2_header *in,
+        struct id3v2_frame_header *frames, size_t nframes, size_t padding) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    uint8_t *tag;
+    size_t len, i = 0;
+    int fd;
+
+    tag = serialize_id3v2_tag(in, frames, nframes, padding, &len);
+    assert(tag);
+    assert(len == ID3V2_HEADER_SIZE + in->tag_size +
+            (in->footer_present ? ID3V2_FOOTER_SIZE : 0));
+    fd = write_temp_file(tag, len, file);
+    free(tag);
+
+    assert(get_id3v2_tag(fd, &header));
+    assert(header.tag_size == in->tag_size);
+    assert(!header.footer_present == !in->footer_present);
+    header.verify_crc = 1;
+    while (get_id3v2_frame(&header, &fheader)) {
+        assert(i < nframes);
+        assert(!strcmp(fheader.id, frames[i].id));
+        assert(fheader.data_len == frames[i].data_len);
+        assert(!memcmp(fheader.data, frames[i].data, fheader.data_len));
+        // Flags are read as their bits
+        assert(!fheader.unsynchronized == !frames[i].unsynchronized);
+        assert(!fheader.group_id_present == !frames[i].group_id_present);
+        assert(!fheader.read_only == !frames[i].read_only);
+        free_id3v2_frame_data(&header, &fheader);
+        i++;
+    }
+    assert(i == nframes);
+    assert(header.padding == padding);
+    assert(verify_id3v2_crc(&header));
+    free_id3v2_tag(&header);
+    close(fd);
+    assert(check_id3v2_file(file) == ID3V2_CHECK_OK);
+    unlink(file);
+}
+
+static void check_encode(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header frames[3];
+    uint8_t title[] = "\x03Song", picture[] = {
+        0, 'i', 'm', 'a', 'g', 'e', '/', 'p', 'n', 'g', 0, 3, 0,
+        0xFF, 0xE0, 0xFF, 0x00, 0xFF, 0xFF
+    };
+
+    memset(&header, 0, sizeof(header));
+    memset(frames, 0, sizeof(frames));
+    header.version = 4;
+    strcpy(frames[0].id, "TIT2");
+    frames[0].data = title;
+    frames[0].data_len = sizeof(title) - 1;
+    frames[0].read_only = 1;
+    // False syncs, so only this frame is unsynchronised
+    strcpy(frames[1].id, "APIC");
+    frames[1].data = picture;
+    frames[1].data_len = sizeof(picture);
+    frames[1].group_id_present = 1;
+    frames[1].group_id = 0x80;
+    strcpy(frames[2].id, "PCNT");
+
+    check_tag_round_trip(&header, frames, 3, 100);
+    assert(!frames[0].unsynchronized && frames[1].unsynchronized);
+    // Three false syncs, and a $00 after the final $FF
+    assert(frames[1].raw_len == sizeof(picture) + 4);
+
+    header.extheader_present = 1;
+    header.extheader.crc_present = 1;
+    header.extheader.restrictions = 1;
+    header.extheader.text_size_restrict = ID3V2_RESTRICTION_TEXT_SIZE_30;
+    header.extheader.img_enc_restrict =
+        ID3V2_RESTRICTION_IMAGE_ENCODING_COMPRESSED;
+    check_tag_round_trip(&header, frames, 3, 0);
+
+    header.footer_present = 1;
+    check_tag_round_trip(&header, frames, 2, 0);
+    assert(size_id3v2_tag(&header, frames, 2, 1) == 0);
+
+    frames[0].compressed = 1;
+    header.footer_present = 0;
+    assert(size_id3v2_tag(&header, frames, 1, 0) == 0);
+}
+
+// Check the text frames of the tag in a file, given as ID=TEXT, and that
+// the audio after the tag is intact
+static void check_updated_file(const char *file, char * const frames[],
+        size_t nframes, const char *audio) {
+    struct id3v2_header header;
+    struct id3v2_frame_header fheader;
+    char buf[64];
+    size_t i = 0, len = strlen(audio);
+    off_t end;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    assert(fd != -1);
+    assert(get_id3v2_tag(fd, &header));
+    assert(header.version == 4);
+    while (get_id3v2_frame(&header, &fheader)) {
+        assert(i < nframes);
+        assert(!strncmp(fheader.id, frames[i], ID3V2_FRAME_ID_SIZE));
+        assert(fheader.data[0] == ID3V2_ENCODING_UTF_8);
+        assert(fheader.data_len - 1 == strlen(frames[i] + 5));
+        assert(!memcmp(fheader.data + 1, frames[i] + 5, fheader.data_len - 1));
+        free_id3v2_frame_data(&header, &fheader);
+        i++;
+    }
+    assert(i == nframes);
+    assert(header.i + header.padding == header.frame_data_len);
+    end = header.frame_data_offset + header.frame_data_len;
+    free_id3v2_tag(&header);
+    assert(pread(fd, buf, sizeof(buf), end) == len);
+    assert(!memcmp(buf, audio, len));
+    close(fd);
+}
+
+static void check_update(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header frame;
+    struct id3v2_padding_policy policy = { 10, 0, 100, 512 };
+    char file[sizeof(TEMP_FILE_TEMPLATE)], long_title[305] = "TIT2=";
+    char *sets[] = { "TIT2=New title", "TPE1=Artist" };
+    char *grown[] = { long_title, "TPE1=" };
+    char *cleared[] = { "TIT2=", "TPE1=", "TALB=" };
+    const char *audio = "\xFF\xFB audio frames";
+    const char *stray = "\xFF\xFB" "ID3\x04\x00\x80\x80\x80\x80\x80 frames";
+    uint8_t title[] = "\x03Song", *tag, buf[16];
+    // A 2.3 tag with TIT2 "Song"
+    uint8_t tag23[] = {
+        'I', 'D', '3', 3, 0, 0, 0, 0, 0, 15,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g'
+    };
+    // Audio holding what reads as a valid tag of only padding
+    uint8_t valid_stray[16] = {
+        0xFF, 0xFB, 'I', 'D', '3', 4, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0
+    };
+    struct stat st;
+    size_t len;
+    int fd;
+
+    assert(grow_id3v2_padding(NULL, 100) == ID3V2_DEFAULT_PADDING_MIN);
+    assert(grow_id3v2_padding(NULL, 100000) == 10000);
+    assert(grow_id3v2_padding(&policy, 1000) == 24);
+
+    memset(&header, 0, sizeof(header));
+    memset(&frame, 0, sizeof(frame));
+    header.version = 4;
+    strcpy(frame.id, "TIT2");
+    frame.data = title;
+    frame.data_len = sizeof(title) - 1;
+    tag = serialize_id3v2_tag(&header, &frame, 1, 100, &len);
+    assert(tag);
+    fd = write_temp_file(tag, len, file);
+    assert(write(fd, audio, strlen(audio)) == strlen(audio));
+    close(fd);
+    free(tag);
+
+    // The new frames fit in the padding
+    assert(set_id3v2_text_frames(file, sets, 2, NULL, ID3V2_UPDATE_SYNC));
+    assert(stat(file, &st) == 0 && st.st_size == len + strlen(audio));
+    check_updated_file(file, sets, 2, audio);
+
+    // Growing moves the audio, and the tag is padded up to 512 bytes
+    memset(long_title + 5, 'x', sizeof(long_title) - 6);
+    assert(set_id3v2_text_frames(file, grown, 2, &policy, 0));
+    assert(stat(file, &st) == 0 && st.st_size == 512 + strlen(audio));
+    check_updated_file(file, grown, 1, audio);
+
+    // Removing every frame leaves only padding in place
+    assert(set_id3v2_text_frames(file, cleared, 3, &policy, 0));
+    assert(stat(file, &st) == 0 && st.st_size == 512 + strlen(audio));
+    check_updated_file(file, NULL, 0, audio);
+
+    // Stray "ID3" bytes in the audio of an untagged file are no tag
+    unlink(file);
+    close(write_temp_file(stray, strlen(stray), file));
+    assert(set_id3v2_text_frames(file, sets, 2, NULL, 0));
+    check_updated_file(file, sets, 2, stray);
+
+    // Even a valid tag is only the file's own at its start, so a new tag
+    // goes in front and the audio is left alone
+    unlink(file);
+    close(write_temp_file(valid_stray, sizeof(valid_stray), file));
+    assert(set_id3v2_text_frames(file, sets, 2, NULL, 0));
+    assert(stat(file, &st) == 0 && st.st_size > sizeof(valid_stray));
+    fd = open(file, O_RDONLY);
+    assert(fd != -1);
+    assert(pread(fd, buf, sizeof(buf), st.st_size - sizeof(buf)) ==
+            sizeof(buf));
+    assert(!memcmp(buf, valid_stray, sizeof(buf)));
+    assert(pread(fd, buf, ID3V2_HEADER_ID_SIZE, 0) == ID3V2_HEADER_ID_SIZE);
+    assert(!memcmp(buf, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE));
+    close(fd);
+
+    // Version 3 tags are refused and left alone
+    unlink(file);
+    close(write_temp_file(tag23, sizeof(tag23), file));
+    assert(!set_id3v2_text_frames(file, sets, 2, NULL, 0));
+    assert(stat(file, &st) == 0 && st.st_size == sizeof(tag23));
+    unlink(file);
+}
+
+static void check_shrink(void) {
+    struct id3v2_header header;
+    struct id3v2_frame_header frames[2];
+    struct id3v2_padding_policy policy = { 0, 0, 0, 0 };
+    char file[sizeof(TEMP_FILE_TEMPLATE)];
+    char *kept[] = { "TIT2=Song" }, *ids[] = { "PRIV" };
+    const char *audio = "\xFF\xFB audio frames";
+    const char *stray = "\xFF\xFB" "ID3\x04\x00\x80\x80\x80\x80\x80 frames";
+    uint8_t title[] = "\x03Song", private[5000], *tag;
+    // A 2.3 tag with TIT2 "Song" and PRIV "p"
+    uint8_t tag23[] = {
+        'I', 'D', '3', 3, 0, 0, 0, 0, 0, 26,
+        'T', 'I', 'T', '2', 0, 0, 0, 5, 0, 0, 0, 'S', 'o', 'n', 'g',
+        'P', 'R', 'I', 'V', 0, 0, 0, 1, 0, 0, 'p'
+    };
+    off_t reclaimed, most;
+    struct stat st;
+    size_t len;
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    memset(frames, 0, sizeof(frames));
+    memset(private, 'p', sizeof(private));
+    header.version = 4;
+    strcpy(frames[0].id, "TIT2");
+    frames[0].data = title;
+    frames[0].data_len = sizeof(title) - 1;
+    strcpy(frames[1].id, "PRIV");
+    frames[1].data = private;
+    frames[1].data_len = sizeof(private);
+    tag = serialize_id3v2_tag(&header, frames, 2, 9000, &len);
+    assert(tag);
+    fd = write_temp_file(tag, len, file);
+    assert(write(fd, audio, strlen(audio)) == strlen(audio));
+    close(fd);
+    free(tag);
+
+    // A dry run leaves the file alone, and gives the whole blocks freed
+    assert(shrink_id3v2_file(file, ids, 1, &policy, ID3V2_UPDATE_DRY_RUN,
+                &most));
+    assert(stat(file, &st) == 0 && st.st_size == len + strlen(audio));
+    assert(most > 0 && most % st.st_blksize == 0);
+    assert(most <= len - (ID3V2_HEADER_SIZE + ID3V2_FRAME_HEADER_SIZE +
+                sizeof(title) - 1));
+
+    // whether they're collapsed or copied
+    assert(shrink_id3v2_file(file, ids, 1, &policy, 0, &reclaimed));
+    assert(reclaimed == most);
+    assert(stat(file, &st) == 0 &&
+            st.st_size == len + strlen(audio) - reclaimed);
+    check_updated_file(file, kept, 1, audio);
+
+    // Less than a block left over stays as padding, without copying
+    most = st.st_size;
+    assert(shrink_id3v2_file(file, ids, 1, &policy, ID3V2_UPDATE_DRY_RUN,
+                &reclaimed));
+    assert(reclaimed == 0);
+    assert(shrink_id3v2_file(file, ids, 1, &policy, 0, &reclaimed));
+    assert(reclaimed == 0);
+    assert(stat(file, &st) == 0 && st.st_size == most);
+    check_updated_file(file, kept, 1, audio);
+
+    // Stray "ID3" bytes in the audio are no tag, and 2.3 tags are refused
+    unlink(file);
+    close(write_temp_file(stray, strlen(stray), file));
+    assert(shrink_id3v2_file(file, ids, 1, &policy, 0, &reclaimed));
+    assert(reclaimed == 0);
+    assert(stat(file, &st) == 0 && st.st_size == strlen(stray));
+    unlink(file);
+    close(write_temp_file(tag23, sizeof(tag23), file));
+    assert(!shrink_id3v2_file(file, ids, 1, &policy, 0, &reclaimed));
+    assert(stat(file, &st) == 0 && st.st_size == sizeof(tag23));
+    unlink(file);
+}
+
 int main() {
     check_synchsafe();
     check_byte_swap();
     check_synchronize();
     check_verify();
+    check_find_header();
     check_conversion();
+    check_hash();
+    check_cache();
+    check_index();
+    check_tar();
+    check_extract_names();
+    check_extract_store();
+    check_dump_frame();
+    check_serve();
+    check_watch();
+    check_hash_audio();
+    check_frame_limits();
+    check_stats();
+    check_profile();
+    check_crc();
+    check_check();
+    check_encode();
+    check_update();
+    check_shrink();
 
     printf("Passed!\n");
     return 0;
@@ -0,0 +1,667 @@
+// Rewriting the tags of files, in place where the old tag leaves room
+// Copyright 2015 David Gloe.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// Audio is copied through a buffer of at most this much
+#define MOVE_CHUNK_SIZE (1 << 20)
+
+// Write all of len bytes at offset
+// Return 1 on success, 0 otherwise
+static int write_at(int fd, const uint8_t *buf, size_t len, off_t offset) {
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret == -1) {
+            debug("pwrite %zu bytes at %jd failed: %m", len, (intmax_t)offset);
+            return 0;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+        PROFILE_COUNT(PROFILE_BYTES_WRITTEN, ret);
+    }
+    return 1;
+}
+
+// Append len bytes at offset in the file in to out, within the kernel
+// where it can, otherwise through a buffer
+// Return 1 on success, 0 otherwise
+static int append_range(int in, off_t offset, int out, off_t len) {
+    uint8_t *buf;
+    size_t chunk, copied;
+    ssize_t ret;
+
+    copied = copy_range(in, offset, out, len);
+    PROFILE_COUNT(PROFILE_BYTES_MOVED, copied);
+    if (copied == len) {
+        return 1;
+    }
+    offset += copied;
+    len -= copied;
+    buf = malloc(MOVE_CHUNK_SIZE);
+    if (buf == NULL) {
+        debug("malloc %d failed: %m", MOVE_CHUNK_SIZE);
+        return 0;
+    }
+    while (len > 0) {
+        chunk = len < MOVE_CHUNK_SIZE ? len : MOVE_CHUNK_SIZE;
+        ret = pread(in, buf, chunk, offset);
+        if (ret != (ssize_t)chunk) {
+            debug("pread %zu bytes at %jd failed: %m", chunk,
+                    (intmax_t)offset);
+            free(buf);
+            return 0;
+        }
+        if (!write_all(out, buf, chunk)) {
+            free(buf);
+            return 0;
+        }
+        offset += chunk;
+        len -= chunk;
+        PROFILE_COUNT(PROFILE_BYTES_MOVED, chunk);
+    }
+    free(buf);
+    return 1;
+}
+
+// Flush the directory holding the file at path, so a rename into it
+// lasts
+// Return 1 on success, 0 otherwise
+static int sync_dir(const char *path) {
+    char *dir;
+    int fd, ret;
+
+    dir = strdup(path);
+    if (dir == NULL) {
+        debug("strdup failed: %m");
+        return 0;
+    }
+    // path is absolute
+    *(strrchr(dir, '/') + 1) = 0;
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ret = fd != -1 && !fsync(fd);
+    if (!ret) {
+        debug("Flushing %s failed: %m", dir);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(dir);
+    return ret;
+}
+
+// Replace the file at path, open as fd, with a copy in which the len
+// bytes of buf take the place of those from start up to resume. The copy
+// is built in a temporary file next to it and renamed over it, so the
+// file is left whole if anything fails part way.
+// Return 1 on success, 0 otherwise
+static int replace_file(const char *path, int fd, off_t start,
+        const uint8_t *buf, size_t len, off_t resume, int flags) {
+    struct stat st;
+    char *real, *tmp_path;
+    int tmp_fd, ret;
+
+    if (fstat(fd, &st) == -1) {
+        debug("fstat failed: %m");
+        return 0;
+    }
+    // Replace the file a symbolic link points to, not the link
+    real = realpath(path, NULL);
+    if (real == NULL) {
+        debug("realpath %s failed: %m", path);
+        return 0;
+    }
+    if (asprintf(&tmp_path, "%s.XXXXXX", real) == -1) {
+        free(real);
+        return 0;
+    }
+    tmp_fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (tmp_fd == -1) {
+        debug("Creating %s failed: %m", tmp_path);
+        free(tmp_path);
+        free(real);
+        return 0;
+    }
+    ret = append_range(fd, 0, tmp_fd, start) &&
+        write_all(tmp_fd, buf, len) &&
+        append_range(fd, resume, tmp_fd, st.st_size - resume);
+    if (ret) {
+        PROFILE_COUNT(PROFILE_BYTES_WRITTEN, len);
+    }
+    // Keeping the owner needs privileges, but not the group
+    if (ret && fchown(tmp_fd, st.st_uid, st.st_gid) &&
+            fchown(tmp_fd, -1, st.st_gid)) {
+        debug("fchown %s failed: %m", tmp_path);
+    }
+    if (ret && fchmod(tmp_fd, st.st_mode & 07777)) {
+        debug("fchmod %s failed: %m", tmp_path);
+        ret = 0;
+    }
+    if (ret && (flags & ID3V2_UPDATE_SYNC) && fsync(tmp_fd)) {
+        debug("fsync %s failed: %m", tmp_path);
+        ret = 0;
+    }
+    if (close(tmp_fd) && ret) {
+        debug("close %s failed: %m", tmp_path);
+        ret = 0;
+    }
+    if (ret && rename(tmp_path, real)) {
+        debug("Renaming %s to %s failed: %m", tmp_path, real);
+        ret = 0;
+    }
+    if (!ret) {
+        unlink(tmp_path);
+    } else if (flags & ID3V2_UPDATE_SYNC) {
+        ret = sync_dir(real);
+    }
+    free(tmp_path);
+    free(real);
+    return ret;
+}
+
+// Get the padding to give a rebuilt tag of len bytes without any
+size_t grow_id3v2_padding(const struct id3v2_padding_policy *policy,
+        size_t len) {
+    struct id3v2_padding_policy defaults = {
+        .min = ID3V2_DEFAULT_PADDING_MIN,
+        .percent = ID3V2_DEFAULT_PADDING_PERCENT,
+        .max = ID3V2_DEFAULT_PADDING_MAX,
+        .align = 0
+    };
+    size_t padding;
+
+    if (policy == NULL) {
+        policy = &defaults;
+    }
+    padding = (uint64_t)len * policy->percent / 100;
+    if (padding < policy->min) {
+        padding = policy->min;
+    }
+    if (padding > policy->max) {
+        padding = policy->max;
+    }
+    if (policy->align) {
+        padding += (policy->align - (len + padding) % policy->align) %
+            policy->align;
+    }
+    // Give up on the padding before the size can't be written
+    if (len - ID3V2_HEADER_SIZE + padding > ID3V2_MAX_SIZE) {
+        padding = len - ID3V2_HEADER_SIZE > ID3V2_MAX_SIZE ? 0 :
+            ID3V2_MAX_SIZE - (len - ID3V2_HEADER_SIZE);
+    }
+    return padding;
+}
+
+// Get where the tag old starts in its file, and the bytes it takes there
+static void get_tag_place(const struct id3v2_header *old, off_t *start,
+        off_t *extent) {
+    *start = old->offset;
+    *extent = ID3V2_HEADER_SIZE + old->tag_size +
+        (old->footer_present ? ID3V2_FOOTER_SIZE : 0);
+}
+
+// Encode a tag laid out by size_id3v2_tag without padding, len bytes
+// long, with padding bytes of padding
+// Return the tag, to be freed, or NULL on failure
+static uint8_t *encode_padded_tag(struct id3v2_header *header,
+        const struct id3v2_frame_header *frames, size_t nframes, size_t len,
+        size_t padding) {
+    uint8_t *buf;
+
+    // Padding only adds to the tag size, so the frames aren't laid out
+    // again
+    header->tag_size += padding;
+    len += padding;
+    buf = malloc(len);
+    if (buf == NULL) {
+        debug("malloc %zu failed: %m", len);
+        return NULL;
+    }
+    encode_id3v2_tag(header, frames, nframes, buf, len);
+    return buf;
+}
+
+// Replace the tag of a file with a new one. See id3v2.h.
+int update_id3v2_tag(const char *path, int fd, struct id3v2_header *old,
+        struct id3v2_header *header, struct id3v2_frame_header *frames,
+        size_t nframes, const struct id3v2_padding_policy *policy,
+        int flags) {
+    uint8_t *buf;
+    off_t start = 0, extent = 0;
+    size_t len, padding;
+    uint64_t timer;
+    int in_place, ret;
+
+    assert(path);
+    assert(header);
+
+    if (old) {
+        get_tag_place(old, &start, &extent);
+    }
+    len = size_id3v2_tag(header, frames, nframes, 0);
+    if (len == 0) {
+        return 0;
+    }
+    // Tags with footers have no padding to take up the slack
+    in_place = header->footer_present ? len == extent : len <= extent;
+    if (in_place) {
+        padding = extent - len;
+    } else {
+        padding = header->footer_present ? 0 :
+            grow_id3v2_padding(policy, len);
+    }
+    // Frames may be read in place from the old tag, so they're all
+    // encoded before anything is written
+    buf = encode_padded_tag(header, frames, nframes, len, padding);
+    if (buf == NULL) {
+        return 0;
+    }
+    len += padding;
+
+    timer = PROFILE_START();
+    if (in_place) {
+        ret = write_at(fd, buf, len, start);
+        if (ret && (flags & ID3V2_UPDATE_SYNC) && fdatasync(fd)) {
+            debug("fdatasync failed: %m");
+            ret = 0;
+        }
+    } else {
+        // Moving the audio in place would leave the file damaged if it
+        // stopped part way
+        ret = replace_file(path, fd, start, buf, len, start + extent, flags);
+    }
+    free(buf);
+    PROFILE_END(PROFILE_WRITE, timer);
+    return ret;
+}
+
+// Check whether a frame is one of the count IDs given, alone or as
+// ID=TEXT
+static int is_set_frame(const char *id, char * const sets[], int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!strncmp(sets[i], id, ID3V2_FRAME_ID_SIZE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read the frames of a tag to be written again, skipping those in sets,
+// which are IDs alone or as ID=TEXT.
+// frames is grown as needed, and each frame's data must be released
+// with free_id3v2_frame_data.
+// Return 1 on success, 0 if any frame couldn't be read or rewritten
+static int read_kept_frames(struct id3v2_header *header,
+        char * const sets[], int count, struct id3v2_frame_header **frames,
+        size_t *nframes, size_t *alloc) {
+    struct id3v2_frame_header fheader, *grown;
+
+    while (get_id3v2_frame_header(header, &fheader)) {
+        if (is_set_frame(fheader.id, sets, count)) {
+            PROFILE_COUNT(PROFILE_FRAMES_SKIPPED, 1);
+            continue;
+        }
+        if (fheader.encrypted) {
+            debug("Frame %s is encrypted", fheader.id);
+            return 0;
+        }
+        if (*nframes == *alloc) {
+            *alloc = *alloc ? *alloc * 2 : 16;
+            grown = realloc(*frames, *alloc * sizeof(**frames));
+            if (grown == NULL) {
+                debug("realloc failed: %m");
+                return 0;
+            }
+            *frames = grown;
+        }
+        if (!get_id3v2_frame_data(header, &fheader)) {
+            return 0;
+        }
+        // The data is written back uncompressed
+        fheader.compressed = 0;
+        (*frames)[(*nframes)++] = fheader;
+    }
+    // A frame that couldn't be parsed ends the walk early, and would be
+    // lost with everything after it
+    if (header->i + header->padding != header->frame_data_len) {
+        debug("Frames end at %zu of %zu", header->i, header->frame_data_len);
+        return 0;
+    }
+    return 1;
+}
+
+// Read the tag of the file at path into old, setting tagged if it has
+// one. Only a tag starting the file is its tag: one found further in is
+// "ID3" bytes that happen to be in the audio, and a new tag is added in
+// front instead. Only version 4 tags can be rewritten, since earlier ones
+// lay out their frame flags and extended header differently and have
+// frames 2.4 lacks. A file starting with a damaged tag is refused too.
+// Return 1 on success, 0 otherwise
+static int read_old_tag(int fd, const char *path, struct id3v2_header *old,
+        int *tagged) {
+    char id[ID3V2_HEADER_ID_SIZE];
+    off_t start, extent;
+
+    *tagged = get_id3v2_tag(fd, old);
+    if (*tagged) {
+        get_tag_place(old, &start, &extent);
+        if (start != 0) {
+            free_id3v2_tag(old);
+            *tagged = 0;
+        }
+    }
+    if (*tagged && old->version != ID3V2_SUPPORTED_VERSION) {
+        debug("%s has a version %"PRIu8" tag, only version %d is written",
+                path, old->version, ID3V2_SUPPORTED_VERSION);
+        free_id3v2_tag(old);
+        *tagged = 0;
+        return 0;
+    } else if (!*tagged && pread(fd, id, ID3V2_HEADER_ID_SIZE, 0) ==
+                ID3V2_HEADER_ID_SIZE &&
+            !memcmp(id, ID3V2_FILE_IDENTIFIER, ID3V2_HEADER_ID_SIZE)) {
+        debug("%s has a bad tag", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Set up the header of a tag to replace old, or of a new tag if old is
+// NULL
+static void init_tag_header(const struct id3v2_header *old,
+        struct id3v2_header *header) {
+    memset(header, 0, sizeof(*header));
+    if (old) {
+        header->experimental = old->experimental;
+        header->extheader_present = old->extheader_present;
+        header->extheader = old->extheader;
+        header->footer_present = old->footer_present;
+    }
+    header->version = ID3V2_SUPPORTED_VERSION;
+}
+
+// Release frames, of which the first nkept were read from the tag old
+// and the rest allocated
+static void free_frames(struct id3v2_header *old,
+        struct id3v2_frame_header *frames, size_t nkept, size_t nframes) {
+    size_t i;
+
+    for (i = 0; i < nframes; i++) {
+        if (i < nkept) {
+            free_id3v2_frame_data(old, &frames[i]);
+        } else {
+            free(frames[i].data);
+        }
+    }
+    free(frames);
+}
+
+// Set text frames of a file, given as ID=TEXT, replacing any frames with
+// the same ID. An empty TEXT removes the frame. The file's tag must be a
+// version 4 tag, and is added if it has none.
+// Return 1 on success, 0 otherwise
+int set_id3v2_text_frames(const char *path, char * const sets[], int count,
+        const struct id3v2_padding_policy *policy, int flags) {
+    struct id3v2_header old, header;
+    struct id3v2_frame_header *frames = NULL, *grown;
+    size_t nframes = 0, nkept, alloc = 0;
+    const char *text;
+    uint64_t timer;
+    int fd, tagged, ret = 0, j;
+
+    assert(path);
+    assert(sets || count == 0);
+
+    timer = PROFILE_START();
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    PROFILE_END(PROFILE_OPEN, timer);
+    if (fd == -1) {
+        debug("open %s failed: %m", path);
+        return 0;
+    }
+    if (!read_old_tag(fd, path, &old, &tagged)) {
+        close(fd);
+        return 0;
+    }
+
+    init_tag_header(tagged ? &old : NULL, &header);
+    ret = !tagged || read_kept_frames(&old, sets, count, &frames, &nframes,
+            &alloc);
+    nkept = nframes;
+    if (!ret) {
+        goto out;
+    }
+    ret = 0;
+    grown = realloc(frames, (nframes + count + 1) * sizeof(*frames));
+    if (grown == NULL) {
+        debug("realloc failed: %m");
+        goto out;
+    }
+    frames = grown;
+    for (j = 0; j < count; j++) {
+        text = sets[j] + ID3V2_FRAME_ID_SIZE + 1;
+        if (*text == 0) {
+            continue;
+        }
+        memset(&frames[nframes], 0, sizeof(*frames));
+        memcpy(frames[nframes].id, sets[j], ID3V2_FRAME_ID_SIZE);
+        frames[nframes].data_len = 1 + strlen(text);
+        frames[nframes].data = malloc(frames[nframes].data_len);
+        if (frames[nframes].data == NULL) {
+            debug("malloc failed: %m");
+            goto out;
+        }
+        frames[nframes].data[0] = ID3V2_ENCODING_UTF_8;
+        memcpy(frames[nframes].data + 1, text, strlen(text));
+        nframes++;
+    }
+    ret = update_id3v2_tag(path, fd, tagged ? &old : NULL, &header,
+            frames, nframes, policy, flags);
+
+out:
+    free_frames(&old, frames, nkept, nframes);
+    if (tagged) {
+        free_id3v2_tag(&old);
+    }
+    close(fd);
+    return ret;
+}
+
+// Get the bytes to cut from the space between a tag at start and the
+// audio at start + extent to leave at least target: the whole blocks of
+// size bs within the tag, or for a footer that can't have padding after
+// it, exactly the space beyond target
+static off_t get_cut(off_t start, off_t extent, off_t target, off_t bs,
+        int footer) {
+    off_t offset, cut;
+
+    if (footer) {
+        return extent - target;
+    }
+    offset = (start + bs - 1) / bs * bs;
+    cut = extent - target;
+    if (start + extent - offset < cut) {
+        cut = start + extent - offset;
+    }
+    return cut > 0 ? cut / bs * bs : 0;
+}
+
+// Cut the space between a tag of len bytes at start and the audio at
+// start + extent of the file at path, open as fd, down to at least
+// target bytes, by get_cut. The blocks are collapsed out of the file
+// without moving the audio where the filesystem can, and otherwise the
+// file is rebuilt without them, so it ends up the same either way. What's
+// left stays as padding.
+// header and frames are encoded into the space left, and cut is set to
+// the bytes cut out.
+// Return 1 on success, 0 otherwise
+static int cut_tag_space(const char *path, int fd, off_t start,
+        off_t extent, off_t target, struct id3v2_header *header,
+        const struct id3v2_frame_header *frames, size_t nframes, size_t len,
+        int flags, off_t *cut) {
+    struct stat st;
+    uint8_t *buf;
+    off_t offset;
+    int ret, collapsed = 0;
+
+    if (fstat(fd, &st) == -1) {
+        debug("fstat failed: %m");
+        return 0;
+    }
+    *cut = get_cut(start, extent, target, st.st_blksize,
+            header->footer_present);
+    // The frames may be read in place from the file, so they're encoded
+    // before it changes
+    buf = encode_padded_tag(header, frames, nframes, len,
+            extent - *cut - len);
+    if (buf == NULL) {
+        return 0;
+    }
+    // Only whole blocks of the file can be collapsed, which a footer's
+    // cut may not be
+    offset = (start + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+    if (*cut > 0 && *cut % st.st_blksize == 0 &&
+            offset + *cut <= start + extent) {
+        collapsed = !fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, offset, *cut);
+        if (!collapsed) {
+            debug("fallocate collapse of %jd bytes at %jd failed: %m",
+                    (intmax_t)*cut, (intmax_t)offset);
+            if (errno != EOPNOTSUPP && errno != EINVAL) {
+                free(buf);
+                return 0;
+            }
+        }
+    }
+    if (*cut > 0 && !collapsed) {
+        ret = replace_file(path, fd, start, buf, extent - *cut,
+                start + extent, flags);
+    } else {
+        ret = write_at(fd, buf, extent - *cut, start);
+        if (ret && (flags & ID3V2_UPDATE_SYNC) && fdatasync(fd)) {
+            debug("fdatasync failed: %m");
+            ret = 0;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+// Drop frames from the tag of a file, and its padding beyond what policy
+// keeps. See id3v2.h.
+int shrink_id3v2_file(const char *path, char * const ids[], int count,
+        const struct id3v2_padding_policy *policy, int flags,
+        off_t *reclaimed) {
+    struct id3v2_header old, header;
+    struct id3v2_frame_header *frames = NULL;
+    size_t nframes = 0, alloc = 0, len;
+    off_t start, extent, target, cut;
+    struct stat st;
+    uint64_t timer;
+    int fd, tagged, ret = 0;
+
+    assert(path);
+    assert(ids || count == 0);
+    assert(reclaimed);
+
+    *reclaimed = 0;
+    timer = PROFILE_START();
+    fd = open(path, flags & ID3V2_UPDATE_DRY_RUN ? O_RDONLY | O_CLOEXEC :
+            O_RDWR | O_CLOEXEC);
+    PROFILE_END(PROFILE_OPEN, timer);
+    if (fd == -1) {
+        debug("open %s failed: %m", path);
+        return 0;
+    }
+    if (!read_old_tag(fd, path, &old, &tagged)) {
+        close(fd);
+        return 0;
+    } else if (!tagged) {
+        // A file without a tag has nothing to shrink
+        close(fd);
+        return 1;
+    }
+    init_tag_header(&old, &header);
+    if (!read_kept_frames(&old, ids, count, &frames, &nframes, &alloc)) {
+        goto out;
+    }
+    len = size_id3v2_tag(&header, frames, nframes, 0);
+    if (len == 0) {
+        goto out;
+    }
+    get_tag_place(&old, &start, &extent);
+    target = len;
+    if (!header.footer_present) {
+        target += policy ? policy->min : ID3V2_DEFAULT_PADDING_MIN;
+    }
+
+    if (flags & ID3V2_UPDATE_DRY_RUN) {
+        // Work the cut out just as shrinking would
+        ret = fstat(fd, &st) == 0;
+        if (!ret) {
+            debug("fstat failed: %m");
+        } else if (target < extent) {
+            *reclaimed = get_cut(start, extent, target, st.st_blksize,
+                    header.footer_present);
+        }
+    } else if (target >= extent) {
+        // Nothing to reclaim, but dropped frames are still cleared out
+        ret = nframes == old.frames || update_id3v2_tag(path, fd, &old,
+                &header, frames, nframes, policy, flags);
+    } else {
+        timer = PROFILE_START();
+        ret = cut_tag_space(path, fd, start, extent, target, &header,
+                frames, nframes, len, flags, &cut);
+        PROFILE_END(PROFILE_WRITE, timer);
+        if (ret) {
+            *reclaimed = cut;
+        }
+    }
+
+out:
+    free_frames(&old, frames, nframes, nframes);
+    free_id3v2_tag(&old);
+    close(fd);
+    return ret;
+}
+
+// Shrink files one by one, printing the bytes reclaimed from each that
+// has any and the total to fp
+// Return 1 if every file was shrunk, 0 otherwise
+int shrink_files(char * const files[], int nfiles, char * const ids[],
+        int count, const struct id3v2_padding_policy *policy, int flags,
+        FILE *fp) {
+    const char *verb;
+    off_t reclaimed, total = 0;
+    int i, ret = 1;
+
+    assert(files);
+    assert(fp);
+
+    verb = flags & ID3V2_UPDATE_DRY_RUN ? "would be reclaimed" : "reclaimed";
+    for (i = 0; i < nfiles; i++) {
+        if (!shrink_id3v2_file(files[i], ids, count, policy, flags,
+                    &reclaimed)) {
+            fprintf(stderr, "Couldn't shrink %s\n", files[i]);
+            ret = 0;
+        } else if (reclaimed) {
+            fprintf(fp, "%s: %jd bytes %s\n", files[i], (intmax_t)reclaimed,
+                    verb);
+            total += reclaimed;
+        }
+    }
+    fprintf(fp, "Total: %jd bytes %s\n", (intmax_t)total, verb);
+    return ret;
+}
@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include <string.h>
+#include <strings.h>
 #include "id3v2.h"
 
 int verify_id3v2_header(struct id3v2_header *header) {
@@ -26,7 +27,7 @@ int verify_id3v2_header(struct id3v2_header *header) {
         return 0;
     }
 
-    if (header->extheader_present &&
+    if (header->extheader_present && header->version >= 4 &&
             header->extheader.flag_size != ID3V2_EXTENDED_FLAG_SIZE) {
         debug("Extended header flag size %"PRIu8" should be %d",
                 header->extheader.flag_size, ID3V2_EXTENDED_FLAG_SIZE);
@@ -77,6 +78,31 @@ int verify_id3v2_header(struct id3v2_header *header) {
     return 1;
 }
 
+// Check the CRC in the extended header, once verify_crc has been set on
+// the tag before its frames were read. Any frames not yet read are read
+// first. Tags without a CRC pass.
+int verify_id3v2_crc(struct id3v2_header *header) {
+    struct id3v2_frame_header fheader;
+
+    if (!header->extheader_present || !header->extheader.crc_present) {
+        return 1;
+    } else if (!header->verify_crc) {
+        debug("Tag CRC verification not requested");
+        return 0;
+    }
+    while (get_id3v2_frame_header(header, &fheader)) {
+    }
+    if (!header->frames_crc_done) {
+        debug("Tag CRC not computed over unreadable frames");
+        return 0;
+    } else if (header->frames_crc != header->extheader.crc) {
+        debug("Tag CRC %08"PRIx32" should be %08"PRIx32,
+                header->frames_crc, header->extheader.crc);
+        return 0;
+    }
+    return 1;
+}
+
 int verify_id3v2_frame_header(struct id3v2_frame_header *fheader) {
     if (fheader->compressed && !fheader->data_length_present) {
         debug("Frame %s compression requires data length", fheader->id);
@@ -87,3 +113,145 @@ int verify_id3v2_frame_header(struct id3v2_frame_header *fheader) {
     }
     return 1;
 }
+
+// Frame IDs are made of capital letters and digits
+int verify_id3v2_frame_id(const char *id) {
+    int i;
+
+    for (i = 0; i < ID3V2_FRAME_ID_SIZE; i++) {
+        if ((id[i] < 'A' || id[i] > 'Z') && (id[i] < '0' || id[i] > '9')) {
+            debug("Frame ID %.4s not capital letters and digits", id);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check the frame count and size of a whole tag against its tag size
+// restriction, once all its frames have been read
+int verify_id3v2_tag_restrictions(struct id3v2_header *header) {
+    static const struct {
+        unsigned int frames;
+        size_t size;
+    } limits[] = {
+        [ID3V2_RESTRICTION_TAG_SIZE_1MB] = { 128, 1 << 20 },
+        [ID3V2_RESTRICTION_TAG_SIZE_128KB] = { 64, 128 << 10 },
+        [ID3V2_RESTRICTION_TAG_SIZE_40KB] = { 32, 40 << 10 },
+        [ID3V2_RESTRICTION_TAG_SIZE_4KB] = { 32, 4 << 10 },
+    };
+    enum id3v2_restriction_tag_size res = header->extheader.tag_size_restrict;
+    size_t size;
+
+    if (!header->extheader_present || !header->extheader.restrictions) {
+        return 1;
+    }
+    size = ID3V2_HEADER_SIZE + header->tag_size +
+        (header->footer_present ? ID3V2_FOOTER_SIZE : 0);
+    if (header->frames > limits[res].frames) {
+        debug("Tag has %u frames, over the %u allowed", header->frames,
+                limits[res].frames);
+        return 0;
+    } else if (size > limits[res].size) {
+        debug("Tag takes %zu bytes, over the %zu allowed", size,
+                limits[res].size);
+        return 0;
+    }
+    return 1;
+}
+
+// Get the length in characters of the longest terminated string in the
+// len bytes at data
+static size_t longest_string(const uint8_t *data, size_t len,
+        enum id3v2_encoding enc) {
+    size_t i, chars = 0, longest = 0, unit = 1;
+    int bigendian = enc == ID3V2_ENCODING_UTF_16BE, start = 1;
+    uint16_t u;
+
+    if (enc == ID3V2_ENCODING_UTF_16 || enc == ID3V2_ENCODING_UTF_16BE) {
+        unit = 2;
+    }
+    for (i = 0; i + unit <= len; i += unit) {
+        if (unit == 1) {
+            if (data[i] == 0) {
+                chars = 0;
+            // UTF-8 continuation bytes don't start characters
+            } else if (enc != ID3V2_ENCODING_UTF_8 ||
+                    (data[i] & 0xC0) != 0x80) {
+                chars++;
+            }
+        } else {
+            u = bigendian ? data[i] << 8 | data[i + 1] :
+                data[i] | data[i + 1] << 8;
+            if (u == 0) {
+                chars = 0;
+                start = 1;
+                continue;
+            }
+            // Each UTF-16 string has its own byte order mark
+            if (start && enc == ID3V2_ENCODING_UTF_16 &&
+                    (u == 0xFEFF || u == 0xFFFE)) {
+                bigendian = data[i] == 0xFE;
+                start = 0;
+                continue;
+            }
+            start = 0;
+            // Nor do trailing surrogates
+            if (u < 0xDC00 || u > 0xDFFF) {
+                chars++;
+            }
+        }
+        if (chars > longest) {
+            longest = chars;
+        }
+    }
+    return longest;
+}
+
+// Check a frame against the text encoding, text size and image encoding
+// restrictions of its tag. data holds the frame's len bytes of decoded
+// data.
+int verify_id3v2_frame_restrictions(struct id3v2_header *header,
+        struct id3v2_frame_header *fheader, const uint8_t *data, size_t len) {
+    static const size_t text_limits[] = {
+        [ID3V2_RESTRICTION_TEXT_SIZE_NONE] = 0,
+        [ID3V2_RESTRICTION_TEXT_SIZE_1024] = 1024,
+        [ID3V2_RESTRICTION_TEXT_SIZE_128] = 128,
+        [ID3V2_RESTRICTION_TEXT_SIZE_30] = 30,
+    };
+    struct id3v2_extended_header *ext = &header->extheader;
+    const char *mime;
+    size_t limit, longest, mime_len;
+
+    if (!header->extheader_present || !ext->restrictions || len == 0 ||
+            !frame_has_encoding(fheader->id)) {
+        return 1;
+    }
+    if (ext->text_enc_restrict == ID3V2_RESTRICTION_TEXT_ENCODING_BYTE &&
+            data[0] != ID3V2_ENCODING_ISO_8859_1 &&
+            data[0] != ID3V2_ENCODING_UTF_8) {
+        debug("Frame %s has encoding %s, not a byte encoding", fheader->id,
+                encoding_str(data[0]));
+        return 0;
+    }
+    limit = text_limits[ext->text_size_restrict];
+    if (limit && fheader->id[0] == 'T') {
+        longest = longest_string(data + 1, len - 1, data[0]);
+        if (longest > limit) {
+            debug("Frame %s has a string of %zu characters, over %zu",
+                    fheader->id, longest, limit);
+            return 0;
+        }
+    }
+    if (ext->img_enc_restrict &&
+            !strcmp(fheader->id, ID3V2_FRAME_ID_APIC)) {
+        mime = (const char *)data + 1;
+        mime_len = strnlen(mime, len - 1);
+        if (mime_len == len - 1 || (strcasecmp(mime, "image/png") &&
+                    strcasecmp(mime, "image/jpeg"))) {
+            debug("Frame %s image is %.*s, not PNG or JPEG", fheader->id,
+                    (int)mime_len, mime);
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,498 @@
+// Implementation of watch mode
+// Copyright 2015 David Gloe.
+//
+// Files under a directory are read when they are closed after writing or
+// moved in, as reported by inotify. A burst of events for one file is
+// coalesced by waiting until the file has been quiet for a while. Files
+// that have settled go through a bounded queue to worker threads; when
+// the queue or the set of settling files is full, inotify isn't read
+// until they drain, leaving events in the kernel's queue. Directories
+// that appear while watching are likewise read a little at a time as
+// there is room.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "id3v2.h"
+
+// How long a file must go without events before it is read
+#define WATCH_SETTLE_MS 200
+#define WATCH_MAX_PENDING 4096
+#define WATCH_QUEUE_SIZE 64
+// Small enough that one read never adds more files than there is room for
+#define WATCH_EVENT_BUFFER 16384
+#define WATCH_MAX_READ_EVENTS (WATCH_EVENT_BUFFER / \
+        sizeof(struct inotify_event))
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+struct pending_file {
+    char *path;
+    uint64_t hash;
+    long long deadline;
+};
+
+// Directory whose files are still to be read
+struct scan_dir {
+    char *path;
+    DIR *dp;
+    struct scan_dir *next;
+};
+
+// Bounded queue of settled files waiting for a worker
+struct watch_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    char *paths[WATCH_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int count;
+    int stop;
+};
+
+struct watcher {
+    int inotify_fd;
+    int signal_fd;
+    int verbosity;
+    char **dirs;        // Watched directory for each watch descriptor
+    int dirs_cap;
+    struct pending_file pending[WATCH_MAX_PENDING];
+    unsigned int npending;
+    struct scan_dir *scans;     // Oldest first
+    struct scan_dir **scans_tail;
+    struct watch_queue queue;
+    struct metadata_cache *cache;
+    pthread_mutex_t cache_lock;
+};
+
+static long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Add a path to the queue, waiting while it is full
+static void queue_put(struct watch_queue *queue, char *path) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == WATCH_QUEUE_SIZE) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->paths[(queue->head + queue->count++) % WATCH_QUEUE_SIZE] = path;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Wait for a path, returning NULL once the queue is stopped and empty
+static char *queue_get(struct watch_queue *queue) {
+    char *path = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->stop) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count) {
+        path = queue->paths[queue->head];
+        queue->head = (queue->head + 1) % WATCH_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return path;
+}
+
+// Read a file's tag and write its listing to stdout in one piece
+static void process_file(struct watcher *watcher, const char *path) {
+    struct id3v2_header header;
+    struct stat st;
+    char *buf;
+    size_t len;
+    FILE *fp;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        debug("Opening %s failed: %m", path);
+        return;
+    }
+    if (fstat(fd, &st) || !get_id3v2_tag(fd, &header)) {
+        close(fd);
+        return;
+    }
+    fp = open_memstream(&buf, &len);
+    if (fp == NULL) {
+        debug("open_memstream failed: %m");
+        free_id3v2_tag(&header);
+        close(fd);
+        return;
+    }
+    print_id3v2_tag(fp, &header, watcher->verbosity, NULL, NULL);
+    fclose(fp);
+    free_id3v2_tag(&header);
+    close(fd);
+
+    if (watcher->cache) {
+        pthread_mutex_lock(&watcher->cache_lock);
+        metadata_cache_store(watcher->cache, &st, (uint8_t *)buf, len);
+        pthread_mutex_unlock(&watcher->cache_lock);
+    }
+    flockfile(stdout);
+    printf("%s:\n", path);
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+    free(buf);
+}
+
+static void *worker_main(void *arg) {
+    struct watcher *watcher = arg;
+    char *path;
+
+    while ((path = queue_get(&watcher->queue))) {
+        process_file(watcher, path);
+        free(path);
+    }
+    return NULL;
+}
+
+// Note an event for a file, pushing back the time it will be read.
+// Takes ownership of path.
+// Returns 1 on success, 0 if too many files are waiting
+static int add_pending(struct watcher *watcher, char *path) {
+    uint64_t hash = hash64(path, strlen(path), 0);
+    unsigned int i;
+
+    for (i = 0; i < watcher->npending; i++) {
+        if (watcher->pending[i].hash == hash &&
+                !strcmp(watcher->pending[i].path, path)) {
+            watcher->pending[i].deadline = now_ms() + WATCH_SETTLE_MS;
+            free(path);
+            return 1;
+        }
+    }
+    if (watcher->npending == WATCH_MAX_PENDING) {
+        debug("Skipping %s with %u files waiting", path, WATCH_MAX_PENDING);
+        free(path);
+        return 0;
+    }
+    watcher->pending[i].path = path;
+    watcher->pending[i].hash = hash;
+    watcher->pending[i].deadline = now_ms() + WATCH_SETTLE_MS;
+    watcher->npending++;
+    return 1;
+}
+
+// Queue every file that has settled
+// Returns the time until the next one settles in ms, or -1 if none is
+// waiting
+static int queue_settled(struct watcher *watcher) {
+    long long now = now_ms(), wait = -1;
+    unsigned int i = 0;
+
+    while (i < watcher->npending) {
+        if (watcher->pending[i].deadline <= now) {
+            queue_put(&watcher->queue, watcher->pending[i].path);
+            watcher->pending[i] = watcher->pending[--watcher->npending];
+        } else {
+            if (wait == -1 || watcher->pending[i].deadline - now < wait) {
+                wait = watcher->pending[i].deadline - now;
+            }
+            i++;
+        }
+    }
+    return wait;
+}
+
+static void free_scan(struct scan_dir *scan) {
+    if (scan->dp) {
+        closedir(scan->dp);
+    }
+    free(scan->path);
+    free(scan);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    char *path;
+
+    if (asprintf(&path, "%s/%s", dir, name) == -1) {
+        debug("asprintf failed");
+        return NULL;
+    }
+    return path;
+}
+
+// Watch a directory and everything below it. With files set, regular
+// files already there are read too, for directories that appear while
+// watching, once there is room for them.
+// Returns 1 on success, 0 otherwise
+static int watch_tree(struct watcher *watcher, const char *dir, int files) {
+    struct scan_dir *scan;
+    struct dirent *ent;
+    char **dirs, *path;
+    DIR *dp;
+    int wd, cap;
+
+    wd = inotify_add_watch(watcher->inotify_fd, dir, WATCH_EVENTS);
+    if (wd == -1) {
+        debug("Watching %s failed: %m", dir);
+        return 0;
+    }
+    if (wd >= watcher->dirs_cap) {
+        cap = watcher->dirs_cap ? watcher->dirs_cap : 64;
+        while (cap <= wd) {
+            cap *= 2;
+        }
+        dirs = realloc(watcher->dirs, cap * sizeof(*dirs));
+        if (dirs == NULL) {
+            debug("realloc failed: %m");
+            return 0;
+        }
+        memset(dirs + watcher->dirs_cap, 0,
+                (cap - watcher->dirs_cap) * sizeof(*dirs));
+        watcher->dirs = dirs;
+        watcher->dirs_cap = cap;
+    }
+    free(watcher->dirs[wd]);
+    watcher->dirs[wd] = strdup(dir);
+    if (watcher->dirs[wd] == NULL) {
+        return 0;
+    }
+
+    dp = opendir(dir);
+    if (dp == NULL) {
+        debug("opendir %s failed: %m", dir);
+        return 0;
+    }
+    while ((ent = readdir(dp))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        if (ent->d_type == DT_DIR) {
+            path = join_path(dir, ent->d_name);
+            if (path) {
+                watch_tree(watcher, path, files);
+                free(path);
+            }
+        }
+    }
+    closedir(dp);
+
+    // Files are read later, once there's room; any written meanwhile
+    // also have events, which add_pending merges
+    if (files) {
+        scan = calloc(1, sizeof(*scan));
+        if (scan == NULL || (scan->path = strdup(dir)) == NULL) {
+            debug("Allocating scan of %s failed: %m", dir);
+            free(scan);
+            return 0;
+        }
+        *watcher->scans_tail = scan;
+        watcher->scans_tail = &scan->next;
+    }
+    return 1;
+}
+
+// Note files from directories waiting to be read while there is room,
+// leaving enough for a read of inotify events
+static void scan_files(struct watcher *watcher) {
+    struct scan_dir *scan;
+    struct dirent *ent;
+    char *path;
+
+    while ((scan = watcher->scans) && watcher->npending +
+            WATCH_MAX_READ_EVENTS < WATCH_MAX_PENDING) {
+        if (scan->dp == NULL) {
+            scan->dp = opendir(scan->path);
+            if (scan->dp == NULL) {
+                debug("opendir %s failed: %m", scan->path);
+            }
+        }
+        ent = scan->dp ? readdir(scan->dp) : NULL;
+        if (ent == NULL) {
+            watcher->scans = scan->next;
+            if (watcher->scans == NULL) {
+                watcher->scans_tail = &watcher->scans;
+            }
+            free_scan(scan);
+        } else if (ent->d_type == DT_REG) {
+            path = join_path(scan->path, ent->d_name);
+            if (path) {
+                add_pending(watcher, path);
+            }
+        }
+    }
+}
+
+// Handle the events available from inotify
+static void read_events(struct watcher *watcher) {
+    char buf[WATCH_EVENT_BUFFER]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p, *path;
+
+    len = read(watcher->inotify_fd, buf, sizeof(buf));
+    if (len == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            debug("read inotify failed: %m");
+        }
+        return;
+    }
+    for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+        ev = (const struct inotify_event *)p;
+        if (ev->mask & IN_Q_OVERFLOW) {
+            fprintf(stderr, "Too many changes at once, some were missed\n");
+            continue;
+        }
+        if (ev->wd < 0 || ev->wd >= watcher->dirs_cap ||
+                watcher->dirs[ev->wd] == NULL) {
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            free(watcher->dirs[ev->wd]);
+            watcher->dirs[ev->wd] = NULL;
+            continue;
+        }
+        if (ev->len == 0) {
+            continue;
+        }
+        path = join_path(watcher->dirs[ev->wd], ev->name);
+        if (path == NULL) {
+            continue;
+        }
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                watch_tree(watcher, path, 1);
+            }
+            free(path);
+        } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            add_pending(watcher, path);
+        } else {
+            free(path);
+        }
+    }
+}
+
+// Watch dir for new and changed files until interrupted, with workers
+// threads, or one per CPU if workers is 0. Listings are added to cache if
+// it isn't NULL, which only holds its lock shared, so other runs can use
+// it meanwhile.
+// Returns 1 after a clean shutdown, 0 on failure
+int run_watch(const char *dir, unsigned int workers, int verbosity,
+        struct metadata_cache *cache) {
+    struct watcher *watcher;
+    struct scan_dir *scan;
+    struct pollfd fds[2];
+    pthread_t *threads = NULL;
+    sigset_t sigs;
+    unsigned int started = 0;
+    int n, wait, ret = 0, running = 1;
+
+    assert(dir);
+
+    watcher = calloc(1, sizeof(*watcher));
+    if (watcher == NULL) {
+        debug("calloc %zu failed: %m", sizeof(*watcher));
+        return 0;
+    }
+    watcher->verbosity = verbosity;
+    watcher->inotify_fd = watcher->signal_fd = -1;
+    watcher->scans_tail = &watcher->scans;
+    watcher->cache = cache;
+    pthread_mutex_init(&watcher->cache_lock, NULL);
+    pthread_mutex_init(&watcher->queue.lock, NULL);
+    pthread_cond_init(&watcher->queue.not_empty, NULL);
+    pthread_cond_init(&watcher->queue.not_full, NULL);
+    if (workers == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > 0 ? n : 1;
+    }
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    watcher->signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    threads = calloc(workers, sizeof(*threads));
+    if (watcher->signal_fd == -1 || watcher->inotify_fd == -1 ||
+            threads == NULL) {
+        debug("Creating watcher failed: %m");
+        goto out;
+    }
+    if (!watch_tree(watcher, dir, 0)) {
+        goto out;
+    }
+    for (started = 0; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, worker_main, watcher)) {
+            debug("pthread_create failed");
+            goto out;
+        }
+    }
+
+    fds[0].fd = watcher->signal_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watcher->inotify_fd;
+    while (running) {
+        scan_files(watcher);
+        wait = queue_settled(watcher);
+        // Leave events in the kernel until the backlog drains
+        fds[1].events = watcher->npending + WATCH_MAX_READ_EVENTS <=
+            WATCH_MAX_PENDING ? POLLIN : 0;
+        n = poll(fds, 2, wait);
+        if (n == -1 && errno != EINTR) {
+            debug("poll failed: %m");
+            goto out;
+        }
+        if (n > 0 && fds[0].revents) {
+            running = 0;
+        }
+        if (n > 0 && (fds[1].revents & POLLIN)) {
+            read_events(watcher);
+        }
+    }
+    ret = 1;
+
+out:
+    pthread_mutex_lock(&watcher->queue.lock);
+    watcher->queue.stop = 1;
+    pthread_cond_broadcast(&watcher->queue.not_empty);
+    pthread_mutex_unlock(&watcher->queue.lock);
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    free(threads);
+    while (watcher->npending > 0) {
+        free(watcher->pending[--watcher->npending].path);
+    }
+    while (watcher->scans) {
+        scan = watcher->scans;
+        watcher->scans = scan->next;
+        free_scan(scan);
+    }
+    for (n = 0; n < watcher->dirs_cap; n++) {
+        free(watcher->dirs[n]);
+    }
+    free(watcher->dirs);
+    if (watcher->inotify_fd != -1) {
+        close(watcher->inotify_fd);
+    }
+    if (watcher->signal_fd != -1) {
+        close(watcher->signal_fd);
+    }
+    free(watcher);
+    return ret;
+}